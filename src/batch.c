@@ -0,0 +1,344 @@
+#include "batch.h"
+#include "connection.h"
+#include "database.h"
+#include "commit.h"
+#include "worker.h"
+#include "handler.h"
+#include "event.h"
+#include "logging.h"
+
+#include <string.h>
+#include <time.h>
+
+// the most a GET result takes
+#define BATCH_MAX_RESULT (2 + 8 + UINT16_MAX)
+
+// room for the results gathered between writes
+#define BATCH_OUT_SIZE (2 * BATCH_MAX_RESULT)
+
+#define GET_RECORD_LENGTH 4
+#define SET_RECORD_LENGTH 14
+#define DELETE_RECORD_LENGTH 4
+
+struct batch_s
+{
+    // the operation of the frame being executed, and how many
+    // of its records are left. remaining is 0 between frames.
+    uint8_t op;
+    uint32_t remaining;
+
+    // a result did not fit and the output buffer is still being sent
+    bool waiting;
+
+    // results gathered. Those before out_sent have been
+    // handed to the connection.
+    size_t out_length;
+    size_t out_sent;
+    uint8_t out[BATCH_OUT_SIZE];
+};
+
+static uint16_t read16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read64(const uint8_t *p)
+{
+    return (uint64_t)read32(p) | ((uint64_t)read32(p + 4) << 32);
+}
+
+static void write16(uint8_t *p, uint16_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+}
+
+static void write32(uint8_t *p, uint32_t value)
+{
+    write16(p, (uint16_t)value);
+    write16(p + 2, (uint16_t)(value >> 16));
+}
+
+static void write64(uint8_t *p, uint64_t value)
+{
+    write32(p, (uint32_t)value);
+    write32(p + 4, (uint32_t)(value >> 32));
+}
+
+bool batch_open(struct connection_s *conn)
+{
+    struct batch_s *batch = (struct batch_s *)malloc(sizeof(struct batch_s));
+    if (!batch)
+    {
+        warn("Could not allocate memory for batch connection");
+        return false;
+    }
+
+    batch->op = 0;
+    batch->remaining = 0;
+    batch->waiting = false;
+    batch->out_length = 0;
+    batch->out_sent = 0;
+    conn->batch = batch;
+    return true;
+}
+
+void batch_close(struct connection_s *conn)
+{
+    free(conn->batch);
+    conn->batch = NULL;
+}
+
+bool batch_can_process(const struct connection_s *conn)
+{
+    return !conn->batch->waiting || !conn->send_inflight;
+}
+
+bool batch_idle(const struct connection_s *conn)
+{
+    return conn->batch->remaining == 0;
+}
+
+// hand the results gathered so far to the connection
+static bool batch_send(struct connection_s *conn)
+{
+    struct batch_s *batch = conn->batch;
+    if (batch->out_sent == batch->out_length)
+    {
+        return true;
+    }
+    size_t start = batch->out_sent;
+    batch->out_sent = batch->out_length;
+    return connection_send(conn, batch->out + start, batch->out_length - start);
+}
+
+// space for a result. Results are sent straight out of the buffer, so
+// once it is full it is only reused after everything in it has been
+// written. Returns NULL and sets waiting if that has to wait for a send
+// to complete, or NULL if the connection failed.
+static uint8_t *batch_reserve(struct connection_s *conn, size_t length)
+{
+    struct batch_s *batch = conn->batch;
+    if (batch->out_length + length > BATCH_OUT_SIZE)
+    {
+        if (!batch_send(conn) || !conn->worker->backend->flush(conn))
+        {
+            return NULL;
+        }
+        if (conn->send_inflight)
+        {
+            batch->waiting = true;
+            return NULL;
+        }
+        batch->out_length = 0;
+        batch->out_sent = 0;
+    }
+    return batch->out + batch->out_length;
+}
+
+// the last record of a frame has been executed
+static void batch_frame_done(struct connection_s *conn)
+{
+    conn->stats.requests++;
+
+    // a draining worker lets the frame in progress finish, then closes
+    if (conn->worker->draining)
+    {
+        conn->close_after_write = true;
+    }
+}
+
+// execute the record at the front of data. used is left at 0 if the
+// record is incomplete or its result has to wait. Returns false if
+// the connection should be closed.
+static bool batch_record(struct connection_s *conn, const uint8_t *data, size_t length, size_t *used)
+{
+    struct batch_s *batch = conn->batch;
+    database db = conn->worker->db;
+    uint8_t *out;
+
+    *used = 0;
+    switch (batch->op)
+    {
+    case BATCH_GET:
+    {
+        if (length < GET_RECORD_LENGTH)
+        {
+            return true;
+        }
+
+        database_url url;
+        size_t url_length = 0;
+        uint64_t expires = 0;
+        // an expired link is gone, as it is over HTTP
+        if (database_get(db, read32(data), conn->worker->scratch, &url, &expires) &&
+            (expires == 0 || expires > (uint64_t)time(NULL)))
+        {
+            url_length = database_url_length(&url);
+        }
+        if (url_length == 0 || url_length > UINT16_MAX)
+        {
+            url_length = 0;
+            expires = 0;
+        }
+
+        out = batch_reserve(conn, 2 + 8 + url_length);
+        if (!out)
+        {
+            return batch->waiting;
+        }
+        write16(out, (uint16_t)url_length);
+        write64(out + 2, expires);
+        if (url_length)
+        {
+            if (url.prefix_length)
+            {
+                memcpy(out + 10, url.prefix, url.prefix_length);
+            }
+            memcpy(out + 10 + url.prefix_length, url.suffix, url.suffix_length);
+        }
+        batch->out_length += 10 + url_length;
+        *used = GET_RECORD_LENGTH;
+        return true;
+    }
+
+    case BATCH_SET:
+    {
+        if (length < SET_RECORD_LENGTH)
+        {
+            return true;
+        }
+        size_t url_length = read16(data + 12);
+        if (url_length == 0 || url_length > BATCH_MAX_URL)
+        {
+            debugf("batch SET with a url of %zu bytes", url_length);
+            return false;
+        }
+        if (length < SET_RECORD_LENGTH + url_length)
+        {
+            return true;
+        }
+
+        out = batch_reserve(conn, 1);
+        if (!out)
+        {
+            return batch->waiting;
+        }
+        char url[BATCH_MAX_URL + 1];
+        memcpy(url, data + SET_RECORD_LENGTH, url_length);
+        url[url_length] = '\0';
+        out[0] = 1;
+        if (handler_valid_url(url, url_length) && database_set(db, read32(data), url, read64(data + 4)))
+        {
+            out[0] = 0;
+            commit_add(conn);
+        }
+        batch->out_length++;
+        *used = SET_RECORD_LENGTH + url_length;
+        return true;
+    }
+
+    case BATCH_DELETE:
+    {
+        if (length < DELETE_RECORD_LENGTH)
+        {
+            return true;
+        }
+        out = batch_reserve(conn, 1);
+        if (!out)
+        {
+            return batch->waiting;
+        }
+        out[0] = 1;
+        if (database_delete(db, read32(data)))
+        {
+            out[0] = 0;
+            commit_add(conn);
+        }
+        batch->out_length++;
+        *used = DELETE_RECORD_LENGTH;
+        return true;
+    }
+    }
+
+    return false;
+}
+
+bool batch_process(struct connection_s *conn)
+{
+    struct batch_s *batch = conn->batch;
+    const uint8_t *buffer = (const uint8_t *)conn->buffer;
+    size_t pos = 0;
+    bool result = true;
+
+    // start the output buffer over if nothing is reading from it
+    batch->waiting = false;
+    if (conn->iovcnt == 0 && !conn->send_inflight && batch->out_sent == batch->out_length)
+    {
+        batch->out_length = 0;
+        batch->out_sent = 0;
+    }
+
+    while (result && connection_can_process(conn))
+    {
+        const uint8_t *data = buffer + pos;
+        size_t available = conn->length - pos;
+
+        if (!batch->remaining)
+        {
+            if (available < BATCH_FRAME_HEADER_LENGTH)
+            {
+                break;
+            }
+            uint8_t op = data[0];
+            if (op < BATCH_GET || op > BATCH_DELETE || data[1] || read16(data + 2))
+            {
+                debug("Malformed batch frame");
+                result = false;
+                break;
+            }
+
+            // the reply has the same header
+            uint8_t *out = batch_reserve(conn, BATCH_FRAME_HEADER_LENGTH);
+            if (!out)
+            {
+                result = batch->waiting;
+                break;
+            }
+            memcpy(out, data, BATCH_FRAME_HEADER_LENGTH);
+            batch->out_length += BATCH_FRAME_HEADER_LENGTH;
+            pos += BATCH_FRAME_HEADER_LENGTH;
+
+            batch->op = op;
+            batch->remaining = read32(data + 4);
+            if (!batch->remaining)
+            {
+                batch_frame_done(conn);
+            }
+            continue;
+        }
+
+        size_t used;
+        result = batch_record(conn, data, available, &used);
+        if (!used)
+        {
+            break;
+        }
+        pos += used;
+        if (--batch->remaining == 0)
+        {
+            batch_frame_done(conn);
+        }
+    }
+
+    // keep a partial record for the next read
+    conn->length -= pos;
+    memmove(conn->buffer, conn->buffer + pos, conn->length);
+
+    return result && batch_send(conn);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct connection_s;
+struct batch_s;
+
+// A binary protocol for internal services that look up and create links
+// in bulk, served on a Unix socket. There is no HTTP framing: a frame is a
+// header followed by a number of records, and the reply to each frame is a
+// frame with one result per record, in order. Frames may be pipelined.
+//
+// Records are executed as they arrive, so a frame may be much larger than
+// the read buffer; only a single record has to fit in it. Results are
+// copied into an output buffer that is written once per read, so
+// thousands of lookups cost a handful of system calls.
+//
+// All integers are little endian.
+//
+//   frame header   u8 op, u8 flags (0), u16 reserved (0), u32 count
+//
+//   GET record     u32 key
+//   GET result     u16 length, u64 expires, length bytes of url.
+//                  A length of 0 means there is no such link, or it
+//                  has expired.
+//
+//   SET record     u32 key, u64 expires, u16 length, length bytes of url.
+//                  A url with spaces or control characters is refused.
+//   DELETE record  u32 key
+//   SET and DELETE result
+//                  u8 status, 0 if done
+//
+// The reply's header is the same as the request's. Anything malformed
+// closes the connection.
+
+enum batch_op
+{
+    BATCH_GET = 1,
+    BATCH_SET = 2,
+    BATCH_DELETE = 3,
+};
+
+#define BATCH_FRAME_HEADER_LENGTH 8
+
+// the longest url a SET may carry. A record has to fit in the read buffer.
+#define BATCH_MAX_URL 2048
+
+// set a connection on the batch socket up
+bool batch_open(struct connection_s *conn);
+
+// free the batch state of a connection
+void batch_close(struct connection_s *conn);
+
+// execute all the complete records in the connection buffer. Returns
+// false if the connection should be closed right away.
+bool batch_process(struct connection_s *conn);
+
+// whether more records can be executed now. False while the output
+// buffer is full and still being sent.
+bool batch_can_process(const struct connection_s *conn);
+
+// whether the connection is between frames
+bool batch_idle(const struct connection_s *conn);
@@ -0,0 +1,217 @@
+#include "cache.h"
+#include "config.h"
+#include "logging.h"
+
+#include <string.h>
+
+static uint32_t cache_home(const struct cache_s *cache, uint32_t key)
+{
+    return (key * 0x9e3779b1u) >> (32 - cache->index_bits);
+}
+
+bool cache_open(struct cache_s *cache)
+{
+    const config_t *config = config_get();
+    *cache = (struct cache_s){0};
+    unsigned int slots = config->cache_size / CACHE_SLOT_SIZE;
+    if (!slots)
+    {
+        return true;
+    }
+
+    // at least twice as many index positions as slots keeps probes short
+    unsigned int bits = 1;
+    while (bits < 31 && (1u << bits) < 2 * (size_t)slots)
+    {
+        bits++;
+    }
+
+    cache->entries = (struct cache_entry_s *)calloc(slots, sizeof(struct cache_entry_s));
+    cache->responses = (char *)malloc((size_t)slots * CACHE_SLOT_SIZE);
+    cache->index = (uint32_t *)calloc((size_t)1 << bits, sizeof(uint32_t));
+    if (!cache->entries || !cache->responses || !cache->index)
+    {
+        critical_error("Could not allocate response cache");
+        cache_close(cache);
+        return false;
+    }
+    cache->slots = slots;
+    cache->index_bits = bits;
+    return true;
+}
+
+void cache_close(struct cache_s *cache)
+{
+    free(cache->entries);
+    free(cache->responses);
+    free(cache->index);
+    *cache = (struct cache_s){0};
+}
+
+// the index position of key, or -1
+static int64_t cache_find(const struct cache_s *cache, uint32_t key)
+{
+    uint32_t mask = (1u << cache->index_bits) - 1;
+    for (uint32_t position = cache_home(cache, key);; position = (position + 1) & mask)
+    {
+        uint32_t slot = cache->index[position];
+        if (!slot)
+        {
+            return -1;
+        }
+        if (cache->entries[slot - 1].key == key)
+        {
+            return position;
+        }
+    }
+}
+
+// take the entry at an index position out of the index. The entries
+// after it move back so that no probe runs into a gap.
+static void cache_unindex(struct cache_s *cache, uint32_t position)
+{
+    uint32_t mask = (1u << cache->index_bits) - 1;
+    cache->entries[cache->index[position] - 1].indexed = false;
+    for (;;)
+    {
+        cache->index[position] = 0;
+        uint32_t next = position;
+        for (;;)
+        {
+            next = (next + 1) & mask;
+            if (!cache->index[next])
+            {
+                return;
+            }
+            // an entry stays put if its home is between the gap and it
+            uint32_t home = cache_home(cache, cache->entries[cache->index[next] - 1].key);
+            bool stays = position <= next ? (position < home && home <= next)
+                                          : (position < home || home <= next);
+            if (!stays)
+            {
+                break;
+            }
+        }
+        cache->index[position] = cache->index[next];
+        position = next;
+    }
+}
+
+const char *cache_get(struct cache_s *cache, database db, uint32_t key, uint64_t now, size_t *length)
+{
+    if (!cache->entries)
+    {
+        return NULL;
+    }
+
+    int64_t position = cache_find(cache, key);
+    if (position < 0)
+    {
+        return NULL;
+    }
+
+    uint32_t slot = cache->index[position] - 1;
+    struct cache_entry_s *entry = &cache->entries[slot];
+    if (entry->version != database_version(db, key) || (entry->expires && entry->expires <= now))
+    {
+        // the slot is left for the hand to reuse
+        cache_unindex(cache, (uint32_t)position);
+        return NULL;
+    }
+
+    entry->referenced = true;
+    *length = entry->length;
+    return cache->responses + (size_t)slot * CACHE_SLOT_SIZE;
+}
+
+char *cache_reserve(struct cache_s *cache)
+{
+    if (!cache->entries)
+    {
+        return NULL;
+    }
+
+    // every slot gets at most two looks: one to clear its mark
+    // and one to take it
+    for (unsigned int i = 0; i < 2 * cache->slots; i++)
+    {
+        uint32_t slot = cache->hand;
+        struct cache_entry_s *entry = &cache->entries[slot];
+        cache->hand = cache->hand + 1 == cache->slots ? 0 : cache->hand + 1;
+
+        if (entry->holds)
+        {
+            continue;
+        }
+        if (entry->indexed)
+        {
+            if (entry->referenced)
+            {
+                entry->referenced = false;
+                continue;
+            }
+            cache_unindex(cache, (uint32_t)cache_find(cache, entry->key));
+        }
+        entry->length = 0;
+        return cache->responses + (size_t)slot * CACHE_SLOT_SIZE;
+    }
+    return NULL;
+}
+
+void cache_commit(struct cache_s *cache, char *slot, uint32_t key, uint32_t version,
+                  uint64_t expires, size_t length)
+{
+    // an older response for the key may still be indexed
+    int64_t position = cache_find(cache, key);
+    if (position >= 0)
+    {
+        cache_unindex(cache, (uint32_t)position);
+    }
+
+    uint32_t index = (uint32_t)((slot - cache->responses) / CACHE_SLOT_SIZE);
+    struct cache_entry_s *entry = &cache->entries[index];
+    entry->key = key;
+    entry->version = version;
+    entry->expires = expires;
+    entry->length = (uint16_t)length;
+    entry->referenced = false;
+    entry->indexed = true;
+
+    uint32_t mask = (1u << cache->index_bits) - 1;
+    uint32_t free_position = cache_home(cache, key);
+    while (cache->index[free_position])
+    {
+        free_position = (free_position + 1) & mask;
+    }
+    cache->index[free_position] = index + 1;
+}
+
+// the entry of the slot data points into, or NULL
+static struct cache_entry_s *cache_entry_of(struct cache_s *cache, const void *data)
+{
+    const char *p = (const char *)data;
+    if (!cache->entries || p < cache->responses ||
+        p >= cache->responses + (size_t)cache->slots * CACHE_SLOT_SIZE)
+    {
+        return NULL;
+    }
+    return &cache->entries[(size_t)(p - cache->responses) / CACHE_SLOT_SIZE];
+}
+
+void cache_hold(struct cache_s *cache, const void *data)
+{
+    struct cache_entry_s *entry = cache_entry_of(cache, data);
+    if (entry)
+    {
+        entry->holds++;
+    }
+}
+
+void cache_release(struct cache_s *cache, const void *data)
+{
+    struct cache_entry_s *entry = cache_entry_of(cache, data);
+    if (entry && entry->holds)
+    {
+        entry->holds--;
+    }
+}
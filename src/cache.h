@@ -0,0 +1,89 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "database.h"
+
+// A cache of complete HTTP/1.1 responses for the most requested links.
+// Each worker has its own, so a hit is a lookup and one piece of output
+// with no database access, no locks and nothing to assemble.
+//
+// Responses are kept in fixed size slots and evicted with CLOCK: a hit
+// marks its slot and the hand gives marked slots a second chance, so the
+// links that keep being requested stay while one-off requests cycle
+// through. Responses that do not fit in a slot are not cached.
+//
+// Every entry records the database's version of its key when it was
+// filled. database_set changes the version, so an entry for a link that
+// has been changed since is never served, whichever worker changed it.
+//
+// Output points straight into the slots, so a slot must not be reused
+// while something is still sending from it. Backends that send after the
+// request has been handled hold the slots they send from until the send
+// has completed, and the hand passes over slots that are held.
+
+// the most bytes of response a slot holds
+#define CACHE_SLOT_SIZE 512
+
+struct cache_entry_s
+{
+    uint32_t key;
+    // the database version of the key the response was made from
+    uint32_t version;
+    // when the link expires, 0 if never
+    uint64_t expires;
+    // the length of the response, 0 if the slot is unused
+    uint16_t length;
+    // sends in progress from the slot
+    uint16_t holds;
+    // hit since the hand last passed
+    bool referenced;
+    // the slot is in the index
+    bool indexed;
+};
+
+struct cache_s
+{
+    // NULL if the cache is off
+    struct cache_entry_s *entries;
+    char *responses;
+    unsigned int slots;
+    // the CLOCK hand
+    unsigned int hand;
+    // open addressing from key to slot + 1, 0 if empty. There are
+    // 1 << index_bits positions, at least twice the slots.
+    uint32_t *index;
+    unsigned int index_bits;
+};
+
+// allocate the cache as configured. The cache stays
+// off if LINKY_CACHE_SIZE is 0.
+bool cache_open(struct cache_s *cache);
+
+void cache_close(struct cache_s *cache);
+
+static inline bool cache_enabled(const struct cache_s *cache)
+{
+    return cache->entries != NULL;
+}
+
+// the response for key, or NULL if it is not cached, has expired
+// or the link has changed since. now is seconds since the epoch.
+const char *cache_get(struct cache_s *cache, database db, uint32_t key, uint64_t now, size_t *length);
+
+// make room for a response of up to CACHE_SLOT_SIZE bytes. The
+// response is written to the returned slot and added with
+// cache_commit. Returns NULL if every slot is being sent from.
+char *cache_reserve(struct cache_s *cache);
+
+// add the response written to slot. version is what database_version
+// returned before the link was read.
+void cache_commit(struct cache_s *cache, char *slot, uint32_t key, uint32_t version,
+                  uint64_t expires, size_t length);
+
+// stop the slot data points into, if any, from being reused until
+// it is released
+void cache_hold(struct cache_s *cache, const void *data);
+
+void cache_release(struct cache_s *cache, const void *data);
@@ -0,0 +1,98 @@
+#include "commit.h"
+#include "config.h"
+#include "connection.h"
+#include "database.h"
+#include "worker.h"
+#include "event.h"
+#include "logging.h"
+
+#include <time.h>
+
+static uint64_t commit_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+void commit_open(struct commit_s *commit)
+{
+    const config_t *config = config_get();
+    commit->waiting = NULL;
+    commit->started = 0;
+    commit->window = config->commit_window;
+}
+
+void commit_add(struct connection_s *conn)
+{
+    if (conn->commit_waiting)
+    {
+        return;
+    }
+
+    struct commit_s *commit = &conn->worker->commit;
+    if (!commit->waiting)
+    {
+        commit->started = commit_now();
+    }
+    conn->commit_waiting = true;
+    conn->commit_next = commit->waiting;
+    commit->waiting = conn;
+}
+
+void commit_remove(struct connection_s *conn)
+{
+    if (!conn->commit_waiting)
+    {
+        return;
+    }
+
+    struct connection_s **link = &conn->worker->commit.waiting;
+    while (*link && *link != conn)
+    {
+        link = &(*link)->commit_next;
+    }
+    if (*link)
+    {
+        *link = conn->commit_next;
+    }
+    conn->commit_waiting = false;
+    conn->commit_next = NULL;
+}
+
+uint64_t commit_delay(const struct commit_s *commit)
+{
+    if (!commit->waiting || !commit->window)
+    {
+        return 0;
+    }
+    uint64_t elapsed = commit_now() - commit->started;
+    return elapsed < commit->window ? commit->window - elapsed : 0;
+}
+
+void commit_run(struct worker_s *worker)
+{
+    struct commit_s *commit = &worker->commit;
+    if (!commit->waiting || commit_delay(commit))
+    {
+        return;
+    }
+
+    // one sync covers every change made so far
+    bool durable = database_sync(worker->db);
+    if (!durable)
+    {
+        error("Could not make changes to the database durable");
+    }
+
+    struct connection_s *conn = commit->waiting;
+    commit->waiting = NULL;
+    while (conn)
+    {
+        struct connection_s *next = conn->commit_next;
+        conn->commit_waiting = false;
+        conn->commit_next = NULL;
+        worker->backend->resume(conn, durable);
+        conn = next;
+    }
+}
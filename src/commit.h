@@ -0,0 +1,53 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct worker_s;
+struct connection_s;
+
+// Group commit. A change to the database is applied right away but only
+// acknowledged once it is durable. The connection that made it keeps its
+// output, the acknowledgement and anything after it, in its output queue
+// instead of sending it. Once per event loop iteration, or once the
+// configured window has passed since the first waiting change, the worker
+// syncs the database a single time for every change it made and lets the
+// waiting connections send. Creating links in bulk then costs one sync per
+// batch rather than one per link.
+
+struct commit_s
+{
+    // the connections waiting for a sync, linked through commit_next
+    struct connection_s *waiting;
+
+    // when the first of them started waiting, in microseconds
+    uint64_t started;
+
+    // microseconds a change may wait for others to share its sync.
+    // 0 syncs at the end of every event loop iteration.
+    uint64_t window;
+};
+
+// set the commit state of a worker up as configured
+void commit_open(struct commit_s *commit);
+
+// hold the output of a connection that just changed the database
+// until the change is durable
+void commit_add(struct connection_s *conn);
+
+// stop waiting for a connection that is being closed
+void commit_remove(struct connection_s *conn);
+
+// whether any connection is waiting for a sync
+static inline bool commit_pending(const struct commit_s *commit)
+{
+    return commit->waiting != NULL;
+}
+
+// microseconds until the waiting connections are due to be released.
+// 0 if they are due now.
+uint64_t commit_delay(const struct commit_s *commit);
+
+// sync the database and release the waiting connections if they are due.
+// Connections are closed without their output if the sync fails.
+void commit_run(struct worker_s *worker);
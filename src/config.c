@@ -19,6 +19,18 @@
 #define DEFAULT_CERT_CHAIN "/etc/linky/cert.pem"
 #define DEFAULT_CERT_KEY "/etc/linky/privkey.pem"
 #define DEFAULT_JWT_AUDIENCE "linky"
+#define DEFAULT_WORKERS 1
+#define DEFAULT_EVENT_BACKEND "epoll"
+#define MAX_WORKERS 256
+#define DEFAULT_LISTEN_BACKLOG 4096
+#define DEFAULT_IDLE_TIMEOUT 60
+#define DEFAULT_HEADER_TIMEOUT 10
+#define DEFAULT_WRITE_TIMEOUT 30
+#define DEFAULT_DRAIN_TIMEOUT 30
+#define DEFAULT_RATE_CLIENTS 65536
+#define DEFAULT_CACHE_SIZE 4194304
+#define DEFAULT_JWT_CACHE 1024
+#define DEFAULT_CHECKPOINT_INTERVAL 60
 
 static config_t *_config = NULL;
 
@@ -32,6 +44,13 @@ static const char *coalesce(const char *a, const char *b)
     return a ? a : b;
 }
 
+// an unsigned number from the environment or a default
+static unsigned int env_unsigned(const char *name, unsigned int def)
+{
+    const char *val = getenv(name);
+    return val && val[0] ? (unsigned int)strtoul(val, NULL, 10) : def;
+}
+
 static bool validate_config(const config_t *config)
 {
     bool result = true;
@@ -105,6 +124,7 @@ static void print_config(const config_t *config)
         debugf("listen port: %s", config->port);
         debugf("TLS listen port: %s", coalesce(config->secure_port, "<N/A>"));
         debugf("database file: %s", config->database);
+        debugf("database log: %s", coalesce(config->database_log, "<next to the database file>"));
         debugf("certificate chain file: %s", coalesce(config->certificate_chain_path, "<N/A>"));
         debugf("certificate key file: %s", coalesce(config->certificate_key_path, "<N/A>"));
         debugf("JWT audience: %s", coalesce(config->jwt_audience, "<N/A>"));
@@ -112,6 +132,27 @@ static void print_config(const config_t *config)
         debugf("JWT issuer key: %s", coalesce(config->jwt_issuer_key, "<N/A>"));
         debugf("setgid: %d", config->setgid);
         debugf("setuid: %d", config->setuid);
+        debugf("workers: %u", config->workers);
+        debugf("event backend: %s", config->event_backend);
+        debugf("listen backlog: %u", config->listen_backlog);
+        debugf("defer accept: %u", config->defer_accept);
+        debugf("fast open queue: %u", config->fastopen);
+        debugf("busy poll: %u", config->busy_poll);
+        debugf("idle timeout: %u", config->idle_timeout);
+        debugf("header timeout: %u", config->header_timeout);
+        debugf("write timeout: %u", config->write_timeout);
+        debugf("drain timeout: %u", config->drain_timeout);
+        debugf("rate limit: %u", config->rate_limit);
+        debugf("rate burst: %u", config->rate_burst);
+        debugf("rate clients: %u", config->rate_clients);
+        debugf("HTTP/2: %u", config->http2);
+        debugf("response cache size: %u", config->cache_size);
+        debugf("batch socket: %s", coalesce(config->batch_socket, "<N/A>"));
+        debugf("JWT cache: %u", config->jwt_cache);
+        debugf("commit window: %u", config->commit_window);
+        debugf("checkpoint interval: %u", config->checkpoint_interval);
+        debugf("scrub: %u", config->scrub);
+        debugf("compress threshold: %u", config->compress_threshold);
     }
 }
 
@@ -127,18 +168,39 @@ bool config_load()
 {
     if (!_config)
     {
-        config_t *newconfig = (config_t *)malloc(sizeof(config_t));
+        config_t *newconfig = (config_t *)calloc(1, sizeof(config_t));
 
         newconfig->logging = is_true(getenv("LINKY_LOGGING"));
 
         newconfig->port = coalesce(getenv("LINKY_PORT"), DEFAULT_PORT);
         newconfig->secure_port = coalesce(getenv("LINKY_SECURE_PORT"), DEFAULT_SECURE_PORT);
         newconfig->database = coalesce(getenv("LINKY_DATABASE"), DEFAULT_DATABASE);
+        newconfig->database_log = getenv("LINKY_DATABASE_LOG");
         newconfig->certificate_chain_path = coalesce(getenv("LINKY_CERT_CHAIN"), DEFAULT_CERT_CHAIN);
         newconfig->certificate_key_path = coalesce(getenv("LINKY_CERT_KEY"), DEFAULT_CERT_KEY);
         newconfig->jwt_audience = coalesce(getenv("LINKY_JWT_AUDIENCE"), DEFAULT_JWT_AUDIENCE);
         newconfig->jwt_issuer = getenv("LINKY_JWT_ISSUER");
         newconfig->jwt_issuer_key = getenv("LINKY_JWT_ISSUER_KEY");
+        newconfig->event_backend = coalesce(getenv("LINKY_EVENT_BACKEND"), DEFAULT_EVENT_BACKEND);
+        newconfig->listen_backlog = env_unsigned("LINKY_LISTEN_BACKLOG", DEFAULT_LISTEN_BACKLOG);
+        newconfig->defer_accept = env_unsigned("LINKY_DEFER_ACCEPT", 0);
+        newconfig->fastopen = env_unsigned("LINKY_FASTOPEN", 0);
+        newconfig->busy_poll = env_unsigned("LINKY_BUSY_POLL", 0);
+        newconfig->idle_timeout = env_unsigned("LINKY_IDLE_TIMEOUT", DEFAULT_IDLE_TIMEOUT);
+        newconfig->header_timeout = env_unsigned("LINKY_HEADER_TIMEOUT", DEFAULT_HEADER_TIMEOUT);
+        newconfig->write_timeout = env_unsigned("LINKY_WRITE_TIMEOUT", DEFAULT_WRITE_TIMEOUT);
+        newconfig->drain_timeout = env_unsigned("LINKY_DRAIN_TIMEOUT", DEFAULT_DRAIN_TIMEOUT);
+        newconfig->rate_limit = env_unsigned("LINKY_RATE_LIMIT", 0);
+        newconfig->rate_burst = env_unsigned("LINKY_RATE_BURST", 0);
+        newconfig->rate_clients = env_unsigned("LINKY_RATE_CLIENTS", DEFAULT_RATE_CLIENTS);
+        newconfig->http2 = env_unsigned("LINKY_HTTP2", 1);
+        newconfig->cache_size = env_unsigned("LINKY_CACHE_SIZE", DEFAULT_CACHE_SIZE);
+        newconfig->batch_socket = getenv("LINKY_BATCH_SOCKET");
+        newconfig->jwt_cache = env_unsigned("LINKY_JWT_CACHE", DEFAULT_JWT_CACHE);
+        newconfig->commit_window = env_unsigned("LINKY_COMMIT_WINDOW", 0);
+        newconfig->checkpoint_interval = env_unsigned("LINKY_CHECKPOINT_INTERVAL", DEFAULT_CHECKPOINT_INTERVAL);
+        newconfig->scrub = env_unsigned("LINKY_SCRUB", 0);
+        newconfig->compress_threshold = env_unsigned("LINKY_COMPRESS_THRESHOLD", 0);
 
         const char *setuidval = getenv("LINKY_UID");
         const char *setgidval = getenv("LINKY_UID");
@@ -161,6 +223,24 @@ bool config_load()
             }
         }
 
+        // parse the number of workers
+        const char *workersval = getenv("LINKY_WORKERS");
+        newconfig->workers = DEFAULT_WORKERS;
+        if (workersval && workersval[0])
+        {
+            newconfig->workers = strtoul(workersval, NULL, 10);
+            if (newconfig->workers == 0)
+            {
+                long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+                newconfig->workers = ncpu > 0 ? (unsigned int)ncpu : DEFAULT_WORKERS;
+            }
+            if (newconfig->workers > MAX_WORKERS)
+            {
+                warnf("Cannot start %u workers. Using %d", newconfig->workers, MAX_WORKERS);
+                newconfig->workers = MAX_WORKERS;
+            }
+        }
+
         // warn if only one of setgid or setuid is set
         if (newconfig->setgid ^ newconfig->setuid)
         {
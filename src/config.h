@@ -17,6 +17,12 @@ struct config_s {
     // the database file. From env LINKY_DATABASE. Default /var/lib/linky/linky.db
     const char* database;
 
+    // the write-ahead log of the database. From env LINKY_DATABASE_LOG.
+    // Default the database file with .wal added. Has to be set when the
+    // database file is on hugetlbfs, which cannot hold the log. The
+    // second log is next to it, with .2 added.
+    const char* database_log;
+
     // the certificate chain file. From env LINKY_CERT_CHAIN. Default /etc/linky/cert.pem
     const char* certificate_chain_path;
     
@@ -42,6 +48,107 @@ struct config_s {
     // If not specified the gid will not be changed. 0 is not a valid value.
     unsigned int setgid;
 
+    // The number of worker threads to run. From env LINKY_WORKERS. Default 1.
+    // Each worker has its own SO_REUSEPORT listen sockets and epoll instance.
+    // If 0, one worker is started per online CPU.
+    unsigned int workers;
+
+    // The event loop implementation. From env LINKY_EVENT_BACKEND. Either
+    // "epoll" or "io_uring". Default "epoll". If io_uring is not supported
+    // by the kernel epoll is used instead. io_uring does not serve HTTPS, so
+    // it refuses to start while LINKY_SECURE_PORT has a certificate to use.
+    const char* event_backend;
+
+    // The length of the queue of connections waiting to be accepted. From env
+    // LINKY_LISTEN_BACKLOG. Default 4096. The kernel caps it at net.core.somaxconn.
+    unsigned int listen_backlog;
+
+    // Seconds a new connection may wait for its first data before it is
+    // accepted (TCP_DEFER_ACCEPT). From env LINKY_DEFER_ACCEPT. Default 0 (off).
+    unsigned int defer_accept;
+
+    // The length of the TCP Fast Open queue. From env LINKY_FASTOPEN.
+    // Default 0 (off).
+    unsigned int fastopen;
+
+    // Microseconds to busy poll the device queue on blocking receives
+    // (SO_BUSY_POLL). From env LINKY_BUSY_POLL. Default 0 (off).
+    unsigned int busy_poll;
+
+    // Seconds a keep-alive connection may wait for its next request. From env
+    // LINKY_IDLE_TIMEOUT. Default 60. 0 disables it.
+    unsigned int idle_timeout;
+
+    // Seconds a client has to send a complete request once it has started,
+    // including the TLS handshake. From env LINKY_HEADER_TIMEOUT. Default 10.
+    // 0 disables it.
+    unsigned int header_timeout;
+
+    // Seconds a client may go without reading any of its pending responses.
+    // From env LINKY_WRITE_TIMEOUT. Default 30. 0 disables it.
+    unsigned int write_timeout;
+
+    // Seconds to let requests in progress finish when stopping or handing
+    // over to a new process. From env LINKY_DRAIN_TIMEOUT. Default 30.
+    // 0 waits for as long as the other timeouts allow.
+    unsigned int drain_timeout;
+
+    // Requests per second each client address may make. From env
+    // LINKY_RATE_LIMIT. Default 0 (off). Opening a connection counts as a
+    // request too.
+    unsigned int rate_limit;
+
+    // The most requests a client may make at once after being quiet. From
+    // env LINKY_RATE_BURST. Default 0, which is the same as the rate limit.
+    unsigned int rate_burst;
+
+    // The number of clients each worker keeps track of. From env
+    // LINKY_RATE_CLIENTS. Default 65536. The least recently seen client
+    // makes way for a new one.
+    unsigned int rate_clients;
+
+    // Whether HTTP/2 is offered to clients on the secure port. From env
+    // LINKY_HTTP2. Default 1. 0 turns it off.
+    unsigned int http2;
+
+    // Bytes of complete responses each worker keeps for the links requested
+    // most. From env LINKY_CACHE_SIZE. Default 4194304 (4 MiB). 0 turns the
+    // cache off.
+    unsigned int cache_size;
+
+    // The path of a Unix socket to serve the binary batch protocol on. From
+    // env LINKY_BATCH_SOCKET. No default. If not specified the batch
+    // protocol is not served.
+    const char* batch_socket;
+
+    // The number of verified bearer tokens each worker remembers until they
+    // expire. From env LINKY_JWT_CACHE. Default 1024. 0 verifies every
+    // token's signature.
+    unsigned int jwt_cache;
+
+    // Microseconds a change to the database may wait for others to share
+    // its sync. From env LINKY_COMMIT_WINDOW. Default 0, which syncs once
+    // per event loop iteration.
+    unsigned int commit_window;
+
+    // Seconds between checkpoints, which write the changes in the log to
+    // the database file and empty the log. From env
+    // LINKY_CHECKPOINT_INTERVAL. Default 60. 0 only checkpoints when
+    // stopping.
+    unsigned int checkpoint_interval;
+
+    // Whether to check every page of the database against its checksum in
+    // the background on startup, on all cores. From env LINKY_SCRUB.
+    // Default 0, which checks pages the first time they are read.
+    unsigned int scrub;
+
+    // Urls at least this long, not counting a prefix shared with others,
+    // are stored compressed with a dictionary trained on the first of
+    // them, where that makes them smaller. From env
+    // LINKY_COMPRESS_THRESHOLD. Default 0, which stores every url as it
+    // is.
+    unsigned int compress_threshold;
+
 };
 
 typedef struct config_s config_t;
@@ -0,0 +1,509 @@
+#include "connection.h"
+#include "response.h"
+#include "handler.h"
+#include "worker.h"
+#include "event.h"
+#include "tls.h"
+#include "http2.h"
+#include "batch.h"
+#include "commit.h"
+#include "config.h"
+#include "logging.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define OUTQ_MIN_CAPACITY 4096
+
+void connection_init(struct connection_s *conn, struct worker_s *worker, int fd, uint32_t address, char *buffer)
+{
+    // the record is shared by all workers. Taking it over with acquire
+    // ordering sees everything the last owner did before it let go.
+    (void)__atomic_exchange_n(&conn->worker, worker, __ATOMIC_ACQ_REL);
+    conn->fd = fd;
+    conn->generation++;
+    conn->address = address;
+    conn->prev = NULL;
+    conn->next = NULL;
+    memset(&conn->stats, 0, sizeof(conn->stats));
+    conn->timer = (struct timer_s){0};
+    conn->timeout = CONNECTION_TIMEOUT_NONE;
+    conn->timeout_mark = 0;
+    conn->tls = NULL;
+    conn->tls_ready = false;
+    conn->ktls_send = false;
+    conn->http2 = NULL;
+    conn->batch = NULL;
+    conn->commit_waiting = false;
+    conn->commit_next = NULL;
+    conn->length = 0;
+    http_parser_reset(&conn->parser, 0);
+    conn->close_after_write = false;
+    conn->iovcnt = 0;
+    conn->outq = NULL;
+    conn->outq_offset = 0;
+    conn->outq_length = 0;
+    conn->outq_capacity = 0;
+    conn->outq_pinned = NULL;
+    conn->outq_retired = NULL;
+    conn->recv_armed = false;
+    conn->send_inflight = false;
+    conn->closing = false;
+    conn->send_iovcnt = 0;
+    conn->send_length = 0;
+    conn->backlog = NULL;
+    conn->backlog_offset = 0;
+    conn->backlog_length = 0;
+    conn->backlog_eof = false;
+    conn->buffer = buffer;
+}
+
+void connection_release(struct connection_s *conn)
+{
+    debugf("connection closed after %llu requests (%llu bytes read, %llu written)",
+           (unsigned long long)conn->stats.requests,
+           (unsigned long long)conn->stats.bytes_read,
+           (unsigned long long)conn->stats.bytes_written);
+
+    timer_cancel(&conn->worker->timers, &conn->timer);
+    tls_close(conn);
+    http2_close(conn);
+    batch_close(conn);
+    commit_remove(conn);
+    if (conn->outq)
+    {
+        free(conn->outq);
+        conn->outq = NULL;
+    }
+    connection_unpin_queue(conn);
+    if (conn->backlog)
+    {
+        free(conn->backlog);
+        conn->backlog = NULL;
+    }
+    conn->backlog_offset = conn->backlog_length = 0;
+    conn->outq_offset = conn->outq_length = conn->outq_capacity = 0;
+    conn->iovcnt = 0;
+    conn->buffer = NULL;
+
+    // letting go of the record is the last thing written to it. Once
+    // the socket is closed another worker can take it for the same fd.
+    int fd = conn->fd;
+    conn->fd = -1;
+    __atomic_store_n(&conn->worker, NULL, __ATOMIC_RELEASE);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+bool connection_can_process(struct connection_s *conn)
+{
+    return !conn->close_after_write && conn->outq_length < CONNECTION_MAX_QUEUED &&
+           (!conn->batch || batch_can_process(conn));
+}
+
+bool connection_queue(struct connection_s *conn, const void *data, size_t length)
+{
+    if (conn->outq_length + length > conn->outq_capacity)
+    {
+        size_t capacity = conn->outq_capacity ? conn->outq_capacity : OUTQ_MIN_CAPACITY;
+        while (capacity < conn->outq_length + length)
+        {
+            capacity *= 2;
+        }
+
+        char *outq;
+        if (conn->outq && conn->outq == conn->outq_pinned)
+        {
+            // a send is reading the current buffer so it has to stay
+            outq = (char *)malloc(capacity);
+            if (outq)
+            {
+                memcpy(outq, conn->outq, conn->outq_length);
+                conn->outq_retired = conn->outq;
+            }
+        }
+        else
+        {
+            outq = (char *)realloc(conn->outq, capacity);
+        }
+        if (!outq)
+        {
+            warn("Could not allocate memory for output queue");
+            return false;
+        }
+        conn->outq = outq;
+        conn->outq_capacity = capacity;
+    }
+
+    memcpy(conn->outq + conn->outq_length, data, length);
+    conn->outq_length += length;
+    return true;
+}
+
+// respond to a request that could not be parsed and close the connection
+static bool handle_bad_request(struct connection_s *conn, int status)
+{
+    debugf("bad request (%d)", status);
+    conn->close_after_write = true;
+    return response_status(conn, status, false);
+}
+
+bool connection_idle(struct connection_s *conn)
+{
+    return conn->stats.requests && conn->length == 0 && conn->iovcnt == 0 &&
+           conn->outq_length == 0 && !conn->send_inflight && conn->backlog_length == 0 &&
+           (!conn->http2 || http2_idle(conn)) && (!conn->batch || batch_idle(conn));
+}
+
+void connection_unpin_queue(struct connection_s *conn)
+{
+    if (conn->outq_retired)
+    {
+        free(conn->outq_retired);
+        conn->outq_retired = NULL;
+    }
+    conn->outq_pinned = NULL;
+}
+
+bool connection_process(struct connection_s *conn)
+{
+    if (conn->http2)
+    {
+        return http2_process(conn);
+    }
+    if (conn->batch)
+    {
+        return batch_process(conn);
+    }
+
+    http_parser *parser = &conn->parser;
+    while (connection_can_process(conn))
+    {
+        http_parse_result presult = http_parse(parser, conn->buffer, conn->length);
+        if (presult == HTTP_PARSE_COMPLETE)
+        {
+            if (!handler_request(conn, &parser->request))
+            {
+                return false;
+            }
+            conn->stats.requests++;
+            http_parser_reset(parser, parser->request.end);
+        }
+        else if (presult == HTTP_PARSE_INCOMPLETE)
+        {
+            // a request body that will never fit. The request starts at
+            // request.end, where it will be moved to the front.
+            if (parser->state == HTTP_STATE_BODY &&
+                parser->line_start - parser->request.end + parser->request.content_length > CONNECTION_BUFFER_SIZE)
+            {
+                return handle_bad_request(conn, 413);
+            }
+
+            // move a partial request to the front of the buffer. If
+            // it was preceded by other requests it is parsed from the start
+            // again, otherwise the parser carries on where it stopped.
+            size_t start = parser->request.end;
+            if (start)
+            {
+                conn->length -= start;
+                memmove(conn->buffer, conn->buffer + start, conn->length);
+                http_parser_reset(parser, 0);
+            }
+            else if (conn->length == CONNECTION_BUFFER_SIZE)
+            {
+                return handle_bad_request(conn, 431);
+            }
+            break;
+        }
+        else
+        {
+            return handle_bad_request(conn, parser->error_status);
+        }
+    }
+
+    return true;
+}
+
+static ssize_t connection_recv(struct connection_s *conn, void *buffer, size_t length)
+{
+    return conn->tls ? tls_read(conn, buffer, length) : read(conn->fd, buffer, length);
+}
+
+static ssize_t connection_send_queued(struct connection_s *conn)
+{
+    const char *data = conn->outq + conn->outq_offset;
+    size_t length = conn->outq_length - conn->outq_offset;
+    return conn->tls && !conn->ktls_send
+               ? tls_write(conn, data, length)
+               : send(conn->fd, data, length, MSG_NOSIGNAL);
+}
+
+bool connection_read(struct connection_s *conn)
+{
+    // finish the TLS handshake before anything else
+    if (conn->tls && !conn->tls_ready)
+    {
+        if (!tls_handshake(conn))
+        {
+            return false;
+        }
+        if (!conn->tls_ready)
+        {
+            return true;
+        }
+        if (tls_selected_http2(conn) && !http2_open(conn))
+        {
+            return false;
+        }
+    }
+
+    // first handle anything that was held back
+    bool result = connection_process(conn);
+
+    while (result && connection_can_process(conn))
+    {
+        ssize_t amt = connection_recv(conn, conn->buffer + conn->length, CONNECTION_BUFFER_SIZE - conn->length);
+        if (amt > 0)
+        {
+            conn->length += amt;
+            conn->stats.bytes_read += amt;
+            result = connection_process(conn);
+        }
+        else if (amt == 0)
+        {
+            // remote will not send anything more
+            conn->close_after_write = true;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            break;
+        }
+        else if (errno != EINTR)
+        {
+            debug("Socket read error");
+            result = false;
+        }
+    }
+
+    // send all the responses in one go
+    if (result)
+    {
+        result = connection_flush(conn);
+    }
+
+    // close once everything has been sent
+    if (result && conn->close_after_write && conn->outq_length == 0)
+    {
+        result = false;
+    }
+
+    return result;
+}
+
+// write as much of the output queue as the socket takes. Sets
+// drained if everything was written.
+static bool connection_drain(struct connection_s *conn, bool *drained)
+{
+    *drained = false;
+    while (conn->outq_offset < conn->outq_length)
+    {
+        ssize_t amt = connection_send_queued(conn);
+        if (amt >= 0)
+        {
+            conn->outq_offset += amt;
+            conn->stats.bytes_written += amt;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return true;
+        }
+        else if (errno != EINTR)
+        {
+            debug("Socket write error");
+            return false;
+        }
+    }
+
+    conn->outq_offset = 0;
+    conn->outq_length = 0;
+    *drained = true;
+    return true;
+}
+
+bool connection_write(struct connection_s *conn)
+{
+    // a TLS handshake may be waiting to write
+    if (conn->tls && !conn->tls_ready)
+    {
+        return connection_read(conn);
+    }
+
+    // held output waits for the commit
+    if (conn->outq_length == 0 || conn->commit_waiting)
+    {
+        return true;
+    }
+
+    bool drained;
+    if (!connection_drain(conn, &drained))
+    {
+        return false;
+    }
+    if (!drained)
+    {
+        return true;
+    }
+
+    if (conn->close_after_write)
+    {
+        return false;
+    }
+
+    // the client has caught up so carry on with
+    // whatever was held back while it was behind
+    return connection_read(conn);
+}
+
+void connection_update_timeout(struct connection_s *conn)
+{
+    const config_t *config = config_get();
+    enum connection_timeout timeout;
+    unsigned int seconds;
+    uint64_t mark;
+    if (conn->outq_length || conn->send_inflight)
+    {
+        // restarts whenever the client reads something
+        timeout = CONNECTION_TIMEOUT_WRITE;
+        seconds = config->write_timeout;
+        mark = conn->stats.bytes_written;
+    }
+    else if (conn->length || conn->stats.requests == 0)
+    {
+        // a request (and on a new connection the TLS handshake) has to
+        // be completed in time no matter how slowly its bytes trickle in
+        timeout = CONNECTION_TIMEOUT_HEADER;
+        seconds = config->header_timeout;
+        mark = conn->stats.requests;
+    }
+    else
+    {
+        timeout = CONNECTION_TIMEOUT_IDLE;
+        seconds = config->idle_timeout;
+        mark = conn->stats.bytes_read;
+    }
+
+    if (timeout == conn->timeout && mark == conn->timeout_mark)
+    {
+        return;
+    }
+    conn->timeout = timeout;
+    conn->timeout_mark = mark;
+
+    struct timer_wheel_s *timers = &conn->worker->timers;
+    if (seconds)
+    {
+        timer_arm(timers, &conn->timer, (uint64_t)seconds * 1000);
+    }
+    else
+    {
+        timer_cancel(timers, &conn->timer);
+    }
+}
+
+bool connection_send(struct connection_s *conn, const void *data, size_t length)
+{
+    if (conn->iovcnt == CONNECTION_MAX_IOV && !conn->worker->backend->flush(conn))
+    {
+        return false;
+    }
+
+    conn->iov[conn->iovcnt].iov_base = (void *)data;
+    conn->iov[conn->iovcnt].iov_len = length;
+    conn->iovcnt++;
+    return true;
+}
+
+bool connection_hold(struct connection_s *conn)
+{
+    bool result = true;
+    for (int i = 0; result && i < conn->iovcnt; i++)
+    {
+        result = connection_queue(conn, conn->iov[i].iov_base, conn->iov[i].iov_len);
+    }
+    conn->iovcnt = 0;
+    return result;
+}
+
+bool connection_flush(struct connection_s *conn)
+{
+    if (conn->iovcnt == 0)
+    {
+        return true;
+    }
+
+    // nothing goes out until the connection's changes are durable
+    if (conn->commit_waiting)
+    {
+        return connection_hold(conn);
+    }
+
+    // TLS encrypts from one contiguous buffer, so the responses are
+    // gathered in the output queue and written from there
+    if (conn->tls && !conn->ktls_send)
+    {
+        bool drained;
+        return connection_hold(conn) && connection_drain(conn, &drained);
+    }
+
+    // if output is already queued everything goes behind it
+    size_t sent = 0;
+    if (conn->outq_length == 0)
+    {
+        struct msghdr msg = {
+            .msg_iov = conn->iov,
+            .msg_iovlen = conn->iovcnt,
+        };
+
+        ssize_t amt;
+        do
+        {
+            amt = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        } while (amt == -1 && errno == EINTR);
+
+        if (amt >= 0)
+        {
+            sent = amt;
+            conn->stats.bytes_written += amt;
+        }
+        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            debug("Socket write error");
+            conn->iovcnt = 0;
+            return false;
+        }
+    }
+
+    // park whatever was not written until the socket is writable
+    bool result = true;
+    for (int i = 0; result && i < conn->iovcnt; i++)
+    {
+        size_t len = conn->iov[i].iov_len;
+        if (sent >= len)
+        {
+            sent -= len;
+        }
+        else
+        {
+            result = connection_queue(conn, (const char *)conn->iov[i].iov_base + sent, len - sent);
+            sent = 0;
+        }
+    }
+    conn->iovcnt = 0;
+
+    return result;
+}
@@ -0,0 +1,200 @@
+#pragma once
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "http.h"
+#include "timer.h"
+
+struct worker_s;
+struct ssl_st;
+struct http2_s;
+struct batch_s;
+
+// the size of the per-connection read buffer. A request
+// (headers and body) must fit in here
+#define CONNECTION_BUFFER_SIZE 4096
+
+// the maximum number of pieces of response gathered before they
+// are written. Responses are flushed once per read, or sooner if
+// this fills up.
+#define CONNECTION_MAX_IOV 64
+
+// once this much output is queued no more requests are
+// processed until the client has read some of it
+#define CONNECTION_MAX_QUEUED 65536
+
+// connection records are aligned to cache lines so
+// neighbouring records never share one
+#define CONNECTION_ALIGN 64
+
+// what a connection is waiting for
+enum connection_timeout
+{
+    CONNECTION_TIMEOUT_NONE,
+    // the next request on a keep-alive connection
+    CONNECTION_TIMEOUT_IDLE,
+    // the first or the rest of a request, or the TLS handshake
+    CONNECTION_TIMEOUT_HEADER,
+    // the client to read its responses
+    CONNECTION_TIMEOUT_WRITE,
+};
+
+// counters kept for each connection
+struct connection_stats_s
+{
+    uint64_t requests;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+};
+
+// state kept for each client connection. The records live in a table
+// indexed by fd and the read buffer comes from a free list, so
+// connections are opened and closed without allocating.
+struct connection_s
+{
+    // the worker that owns the connection. NULL if the record is free.
+    // Other workers may look at this while they drop stale events, so
+    // it is taken and given back with atomics.
+    _Alignas(CONNECTION_ALIGN) struct worker_s *worker;
+    int fd;
+
+    // bumped every time the record is used for a new socket, so events
+    // for one that was closed can be told from events for its successor
+    uint32_t generation;
+
+    // the client's IPv4 address in network order. 0 for
+    // connections on the batch socket.
+    uint32_t address;
+
+    // the live connections of a worker
+    struct connection_s *prev;
+    struct connection_s *next;
+
+    struct connection_stats_s stats;
+
+    // the deadline for whatever the connection is waiting on. The
+    // mark is the counter that restarts it when it moves.
+    struct timer_s timer;
+    enum connection_timeout timeout;
+    uint64_t timeout_mark;
+
+    // TLS state for connections on the secure port. NULL for plain
+    // connections. Once the kernel encrypts (ktls_send) responses are
+    // written to the socket directly.
+    struct ssl_st *tls;
+    bool tls_ready;
+    bool ktls_send;
+
+    // HTTP/2 state if the client negotiated it. NULL for HTTP/1.1.
+    struct http2_s *http2;
+
+    // state for connections on the batch socket, which
+    // speak the binary batch protocol. NULL otherwise.
+    struct batch_s *batch;
+
+    // number of bytes in buffer
+    size_t length;
+    http_parser parser;
+
+    // the client asked for the connection to be closed
+    // or will not send anything more
+    bool close_after_write;
+
+    // a change this connection made to the database is not durable
+    // yet. Output is held in the output queue until it is.
+    bool commit_waiting;
+    struct connection_s *commit_next;
+
+    // responses gathered since the last flush. These point to
+    // memory that stays valid at least until the flush.
+    struct iovec iov[CONNECTION_MAX_IOV];
+    int iovcnt;
+
+    // output that could not be written yet. Written when
+    // the socket becomes writable again.
+    char *outq;
+    size_t outq_offset;
+    size_t outq_length;
+    size_t outq_capacity;
+
+    // set while a send reads straight from outq. The buffer is not
+    // moved while pinned; a grown copy replaces it and the pinned one
+    // is kept as outq_retired until the send completes.
+    char *outq_pinned;
+    char *outq_retired;
+
+    // completion based backends keep track of what is in flight
+    bool recv_armed;
+    bool send_inflight;
+    bool closing;
+    struct msghdr send_msg;
+    struct iovec send_iov[CONNECTION_MAX_IOV];
+    int send_iovcnt;
+    size_t send_length;
+    // received data held back until the client reads its responses
+    char *backlog;
+    size_t backlog_offset;
+    size_t backlog_length;
+    // the remote closed its end behind the held back data
+    bool backlog_eof;
+
+    // CONNECTION_BUFFER_SIZE bytes of received data
+    char *buffer;
+};
+
+// the connection a timer belongs to
+#define connection_from_timer(t) \
+    ((struct connection_s *)((char *)(t) - offsetof(struct connection_s, timer)))
+
+// initialize a connection for a newly accepted socket
+void connection_init(struct connection_s *conn, struct worker_s *worker, int fd, uint32_t address, char *buffer);
+
+// release everything held by the connection and close the socket. The
+// socket is closed last, after which the record may be reused.
+void connection_release(struct connection_s *conn);
+
+// read and handle everything available on the socket. Returns
+// false if the connection should be closed.
+bool connection_read(struct connection_s *conn);
+
+// write queued output. Returns false if the connection should be closed.
+bool connection_write(struct connection_s *conn);
+
+// whether more requests can be handled right now. False while the
+// client is not reading its responses or the connection is closing.
+bool connection_can_process(struct connection_s *conn);
+
+// whether a keep-alive connection is between requests, with nothing
+// received or to send. A new connection is not idle: its first
+// request may not have been read yet.
+bool connection_idle(struct connection_s *conn);
+
+// parse and handle all the complete requests in the connection buffer
+bool connection_process(struct connection_s *conn);
+
+// copy data to the end of the output queue
+bool connection_queue(struct connection_s *conn, const void *data, size_t length);
+
+// the output queue is no longer being sent from
+void connection_unpin_queue(struct connection_s *conn);
+
+// arm the timeout for whatever the connection is waiting on now.
+// Called by the backends once they are done with an event.
+void connection_update_timeout(struct connection_s *conn);
+
+// add a piece of response to be sent on the next flush. The memory
+// must stay valid until then.
+bool connection_send(struct connection_s *conn, const void *data, size_t length);
+
+// write everything gathered with connection_send in one go, queueing
+// whatever the socket does not accept. Returns false on error.
+bool connection_flush(struct connection_s *conn);
+
+// copy everything gathered with connection_send to the output
+// queue without writing it
+bool connection_hold(struct connection_s *conn);
@@ -1,18 +1,35 @@
+#define _GNU_SOURCE
 #include "database.h"
 #include "logging.h"
+#include "hashtable.h"
+#include "wal.h"
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <assert.h>
 #include <string.h>
 #include <memory.h>
 
 #include <zlib.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 
 #include <sys/file.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/mman.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include <linux/magic.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define HUGE_PAGE_SIZE 2097152
 #ifndef MAP_HUGE_2MB
@@ -47,180 +64,3029 @@ struct mm_index_page
 _Static_assert(sizeof(union mm_extent) == 64, "extent must be 64 bytes");
 _Static_assert(sizeof(union mm_page) == HUGE_PAGE_SIZE, "page must be 2Mb");
 
+// keys are spread over 1 << DATABASE_VERSION_BITS version counters
+#define DATABASE_VERSION_BITS 14
+#define DATABASE_VERSIONS (1u << DATABASE_VERSION_BITS)
+
+#define MM_EXTENT_SIZE sizeof(union mm_extent)
+#define MM_PAGE_EXTENTS (sizeof(union mm_page) / sizeof(union mm_extent))
+#define MM_BITMAP_WORDS (sizeof(((struct mm_index_record *)0)->bitmap) / sizeof(uint32_t))
+#define MM_INDEX_RECORDS (sizeof(struct mm_index_page) / sizeof(struct mm_index_record))
+
+_Static_assert(MM_BITMAP_WORDS * 32 == MM_PAGE_EXTENTS, "a bitmap must cover a page");
+
+// The file is a sequence of 2MB pages. Page 0 starts with the header and
+// the hashtable root. Everything else lives in extents handed out by the
+// allocator: the hashtable buckets, the urls they point to and the url
+// prefixes they share.
+//
+// Each page has an index record with a bitmap of the extents in use. The
+// records for a group of MM_INDEX_RECORDS pages fill an index page, which
+// is page 1 for the first group and the first page of every later one.
+// Pages that are not made of extents, like the index pages, are marked
+// full so the allocator never looks at them.
+//
+// Most values are a few extents long, so blocks of up to
+// MM_SIZE_CLASSES extents are not given back to the bitmap when they are
+// freed. They stay marked in use and go on a free list for their size,
+// linked through their first word, and the next allocation of that size
+// pops one. The heads of the lists are in the header so they survive a
+// restart.
+//
+// Each page's index record also has a CRC32C of the page, computed when
+// a checkpoint writes it. An index page has its own record, which counts
+// as 0 in its checksum. A page is checked the first time a value in it
+// is read after opening, against the file rather than the mapping: the
+// file has the page as of the last checkpoint, like the checksum, while
+// the mapping may have changed since. A checksum of 0 is never checked,
+// it is what pages written before checksums were kept have.
+//
+// The file is mapped privately, so changes stay in memory until a
+// checkpoint writes the pages they touched, and the write-ahead log keeps
+// them durable in between. See wal.h.
+
+// blocks of 1 to MM_SIZE_CLASSES extents have free lists
+#define MM_SIZE_CLASSES 8
+
+// runs of extents are searched for among the pages that may have room
+// for a run of their class: class 0 is a run of 1, and class c > 0 the
+// runs longer than 1 << (c - 1) and no longer than 1 << c
+#define MM_RUN_CLASSES 16
+
+_Static_assert(1u << (MM_RUN_CLASSES - 1) == MM_PAGE_EXTENTS, "the last run class must end at a whole page");
+
+// Readers take no locks. Writers still take turns, and each one makes
+// the version counter of the key it changes odd while it works, and
+// even again when it is done. A reader reads the counter, looks the key
+// up and copies the value, then reads the counter again, and starts over
+// if a write was in progress or finished in between. All the keys in a
+// hashtable bucket share a counter, since growing the bucket for one of
+// them moves the others.
+//
+// That leaves memory a reader may still be looking at after a writer
+// is done with it: the bucket that was replaced by a bigger one, or the
+// url of a value that was overwritten. Such blocks are retired instead
+// of freed. Each reader has a slot where it records the writers' epoch
+// when it enters, and clears it when it leaves, which workers do around
+// waiting for events. Writers bump the epoch after every change, and a
+// block retired in an epoch is only freed once every reader inside
+// entered in a later one.
+
+#define DATABASE_MAGIC 0x3142445942424e4cull
+#define DATABASE_FORMAT 3
+
+// the number of hashtable buckets. The root takes 4 bytes for each.
+#define DATABASE_BUCKETS (1u << 18)
+
+_Static_assert(DATABASE_BUCKETS % DATABASE_VERSIONS == 0, "the keys of a bucket must share a counter");
+
+// the address space reserved for the file to grow into. Buckets are
+// found by 32 bit offsets in 16 byte units from the root, which reach
+// this far.
+#define DATABASE_MAX_SIZE (32ull << 30)
+
+// the pages the file grows by at a time
+#define DATABASE_GROWTH 16
+
+struct mm_header
+{
+    uint64_t magic;
+    uint32_t format;
+    uint32_t buckets;
+    // the first free block of each size class, by extent number. 0
+    // (the header itself) ends a list.
+    uint32_t free_lists[MM_SIZE_CLASSES];
+    // the prefix table by extent number, 0 until there is one, the
+    // prefixes in it and how many it has room for
+    uint32_t prefixes;
+    uint32_t prefix_count;
+    uint32_t prefix_capacity;
+    // the dictionary compressed values are deflated with by extent
+    // number, 0 until there is one
+    uint32_t dictionary;
+};
+
+struct mm_root_page
+{
+    struct mm_header header;
+    int32_t buckets[DATABASE_BUCKETS];
+};
+
+_Static_assert(sizeof(struct mm_header) % MM_EXTENT_SIZE == 0, "the root must stay aligned");
+_Static_assert(sizeof(struct mm_root_page) <= sizeof(union mm_page), "the root must fit in page 0");
+
+// what the hashtable keeps for each key. The url is stored in
+// extents of its own, from extent onwards. Values follow a 4 byte
+// key in the buckets so they are only 4 byte aligned.
+struct __attribute__((packed, aligned(4))) database_value
+{
+    uint64_t expires;
+    uint32_t extent;
+    uint32_t length;
+};
+
+// Most urls share their scheme, host and path with many others, so each
+// of those prefixes is stored once, in a table in the file, and the urls
+// that start with it store a 2 byte id and the rest. The length of such a
+// value has DATABASE_INTERNED set. A prefix goes in the table the second
+// time it is seen, since one that is never seen again would take more
+// room than it saves. Prefixes are never removed, and the table is only
+// ever replaced by a bigger copy, so readers can use any they find.
+#define DATABASE_INTERNED (1u << 31)
+
+// ids are 2 bytes
+#define DATABASE_MAX_PREFIXES 65535
+
+// shorter prefixes are not worth an id
+#define DATABASE_MIN_PREFIX 16
+
+// positions in the index from prefix to id, at least twice the prefixes
+#define DATABASE_PREFIX_INDEX (1u << 17)
+
+// the prefixes seen once that the next sighting will add
+#define DATABASE_PREFIX_SEEN (1u << 14)
+
+struct database_prefix
+{
+    uint32_t extent;
+    uint32_t length;
+};
+
+// Long urls, like ones carrying tracking parameters, are mostly made of
+// the same few dozen strings. With compression on, the first of them are
+// sampled to train a dictionary of those strings, which is stored once
+// and never changes, and from then on the rest of a long url after its
+// prefix is deflated against it. Such a block holds the prefix id if
+// there is one, the 4 byte length of the rest and the deflated rest, and
+// its length has DATABASE_COMPRESSED set. A url is only stored that way
+// if it takes fewer extents. Readers inflate it into scratch of their
+// own, so the short urls most links have are read as before.
+#define DATABASE_COMPRESSED (1u << 30)
+
+#define DATABASE_LENGTH_FLAGS (DATABASE_INTERNED | DATABASE_COMPRESSED)
+
+// the longest dictionary
+#define DATABASE_DICTIONARY_SIZE (8u << 10)
+
+// the bytes of long urls sampled to train it on
+#define DATABASE_DICTIONARY_SAMPLES (256u << 10)
+
+// the strings counted while training, a power of 2
+#define DATABASE_DICTIONARY_STRINGS (1u << 16)
+
+// a string in the samples and how often it came up
+struct database_string
+{
+    uint32_t hash;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t count;
+};
+
+// where a reader inflates compressed values
+struct database_scratch_s
+{
+    z_stream inflater;
+    char *buffer;
+    size_t capacity;
+};
+
+// a reader's slot, a cache line each. epoch is 0 while the reader is
+// outside.
+struct database_reader_s
+{
+    uint64_t epoch;
+    uint8_t padding[56];
+};
+
+// How the file is mapped. A database page is 2MB so that it can be one
+// huge page, which takes one TLB entry where 4KB pages take 512 and a
+// lookup is less likely to miss. On hugetlbfs every page of the file is a
+// huge page. Elsewhere the kernel is asked for transparent huge pages,
+// which it gives where the file system and free memory allow. Pages that
+// changed since the last checkpoint are private copies and are only huge
+// on hugetlbfs.
+enum mm_huge
+{
+    MM_HUGE_NONE,
+    MM_HUGE_TLBFS,
+    MM_HUGE_THP,
+};
+
+// a block waiting for the readers that may see it to leave
+struct mm_retired
+{
+    uint64_t epoch;
+    uint32_t extent;
+    uint32_t size;
+};
+
 struct database_s
 {
     int fd;
     const char *file;
     union mm_page *data;
     uint64_t size;
+    // the address space data is at the start of, and
+    // which the file is mapped further into as it grows
+    void *reservation;
+    size_t reservation_size;
+    uint64_t reserved;
+    // the number of pages in the file
+    uint32_t pages;
+    enum mm_huge huge;
+    // for each page, the shortest run of extents known not to fit in
+    // it since something in it was last freed. Saves searching pages
+    // that are too fragmented again and again.
+    uint32_t *no_fit;
+    uint32_t no_fit_pages;
+    // for each run class, a bit for each page that may have room for a
+    // run of the class, going by no_fit and the extents it has free.
+    // The words before first_candidate[class] are 0.
+    uint64_t *candidates[MM_RUN_CLASSES];
+    uint32_t first_candidate[MM_RUN_CLASSES];
+    // a bit for each page changed since the last checkpoint, covering
+    // as many pages as no_fit
+    uint64_t *dirty;
+    // changes are logged in logs[log]. A checkpoint moves them to the
+    // other log, which it empties once the file has what is in it.
+    struct wal_s logs[2];
+    unsigned int log;
+    // set from when a checkpoint moves the changes to the other log
+    // until it has synced the changes left in the one before
+    bool log_unsynced;
+    // changes are not logged while the log is replayed
+    bool replaying;
+    // set once the file has been handed to another process, which
+    // makes the changes from then on
+    bool frozen;
+    // set once the log has been replayed. Until then a checkpoint
+    // would lose what is left in it.
+    bool recovered;
+    // the thread that checkpoints every checkpoint_interval seconds
+    pthread_t checkpointer;
+    bool checkpointer_running;
+    bool stopping;
+    unsigned int checkpoint_interval;
+    pthread_mutex_t checkpoint_lock;
+    pthread_cond_t checkpoint_wake;
+    // held for the whole of a checkpoint, which the write lock is not
+    pthread_mutex_t checkpointing;
+    // odd while a checkpoint writes pages and checksums, bumped again
+    // when it is done
+    uint32_t checkpoints;
+    // a bit for each page that has been checked against its checksum,
+    // covering the whole reservation so readers never see it move
+    uint64_t *verified;
+    // a bit for each page a reader has asked to be checked, and the
+    // thread that checks them, woken through checkpoint_lock
+    uint64_t *requested;
+    pthread_t verifier;
+    bool verifier_running;
+    bool verify_pending;
+    pthread_cond_t verify_wake;
+    // the thread that checks every page when scrubbing, the page the
+    // threads it starts check next, and how many were corrupt
+    pthread_t scrubber;
+    bool scrubber_running;
+    uint32_t scrub_next;
+    uint32_t scrub_corrupt;
+    hashtable table;
+    // open addressing from the hash of a prefix to its id + 1, 0 if
+    // empty, and the hashes of prefixes seen once. Writers only.
+    uint32_t *prefix_index;
+    uint32_t *prefix_seen;
+    // urls at least this long after their prefix are compressed, with
+    // deflater into deflated. Until there is a dictionary they are
+    // sampled instead, separated by 0. Writers only.
+    unsigned int compress_threshold;
+    z_stream deflater;
+    bool deflating;
+    uint8_t *deflated;
+    size_t deflated_capacity;
+    char *samples;
+    size_t samples_length;
+    // writers take turns
+    pthread_mutex_t write_lock;
+    // odd while a key is being changed. Read by every worker.
+    uint32_t versions[DATABASE_VERSIONS];
+    // blocks that readers may still be looking at, oldest first
+    struct mm_retired *retired;
+    size_t retired_count;
+    size_t retired_capacity;
+    // bumped by writers after every change
+    uint64_t epoch;
+    // one more than the highest reader that has entered
+    unsigned int readers;
+    struct database_reader_s reader_slots[DATABASE_MAX_READERS];
 };
 
-// open or create the database file
-bool mm_open(database db)
-{
-    return false;
-}
+// the first index from start whose word is not skip, or end if
+// there is none. Bitmaps are scanned for words that have a free
+// extent (skip all ones) or an allocated one (skip 0).
+typedef size_t (*mm_scan_fn)(const uint32_t *words, size_t start, size_t end, uint32_t skip);
 
-// increase the size of the database file by 2MB
-bool mm_sbrk(database db)
+static size_t mm_scan_scalar(const uint32_t *words, size_t start, size_t end, uint32_t skip)
 {
-    return false;
+    size_t i = start;
+    while (i < end && words[i] == skip)
+    {
+        i++;
+    }
+    return i;
 }
 
-void *mm_allocate(database db, size_t size)
+#if defined(__x86_64__)
+static size_t mm_scan_sse2(const uint32_t *words, size_t start, size_t end, uint32_t skip)
 {
-    return NULL;
+    __m128i skips = _mm_set1_epi32((int)skip);
+    size_t i = start;
+    for (; i + 4 <= end; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(words + i));
+        unsigned int same = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi32(v, skips));
+        if (same != 0xffff)
+        {
+            return i + (size_t)__builtin_ctz(~same) / 4;
+        }
+    }
+    return mm_scan_scalar(words, i, end, skip);
 }
 
-void *mm_reallocate(database db, void *ptr, size_t orig_size, size_t new_size)
+__attribute__((target("avx2"))) static size_t mm_scan_avx2(const uint32_t *words, size_t start, size_t end, uint32_t skip)
 {
-    return NULL;
+    __m256i skips = _mm256_set1_epi32((int)skip);
+    size_t i = start;
+    for (; i + 8 <= end; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(words + i));
+        unsigned int same = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, skips));
+        if (same != 0xffffffff)
+        {
+            return i + (size_t)__builtin_ctz(~same) / 4;
+        }
+    }
+    return mm_scan_scalar(words, i, end, skip);
 }
+#endif
 
-void mm_free(database db, void *ptr, size_t orig_size)
+static mm_scan_fn mm_scan = mm_scan_scalar;
+
+// pages are checksummed with CRC32C, which SSE4.2 has an instruction for
+#define MM_CRC32C_POLY 0x82f63b78u
+
+typedef uint32_t (*mm_crc_fn)(uint32_t crc, const uint8_t *data, size_t length);
+
+static uint32_t mm_crc_table[256];
+
+static uint32_t mm_crc32c_table(uint32_t crc, const uint8_t *data, size_t length)
 {
+    for (size_t i = 0; i < length; i++)
+    {
+        crc = mm_crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
 }
 
-database database_open(const char *file, bool create, gid_t gid, uid_t uid)
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t mm_crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length)
 {
-    int fperm = S_IRUSR | S_IWUSR;
-
-    // open the file
-    int fd = open(file, O_CREAT, fperm);
-    if (fd == -1)
+    uint64_t c = crc;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8)
     {
-        errorf("Could not open file %s", file);
-        errorp();
-        close(fd);
-        return NULL;
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        c = _mm_crc32_u64(c, word);
     }
-
-    // lock the file
-    if (flock(fd, LOCK_EX) == -1)
+    for (; i < length; i++)
     {
-        errorf("Could not lock file %s", file);
-        errorp();
-        close(fd);
-        return NULL;
+        c = _mm_crc32_u8((uint32_t)c, data[i]);
     }
+    return (uint32_t)c;
+}
+#endif
 
-    // check file size, owner and mode
-    struct stat fst;
-    if (fstat(fd, &fst) == -1)
+static mm_crc_fn mm_crc32c = mm_crc32c_table;
+
+// pick the widest scan and the fastest checksum the cpu has
+static void mm_cpu_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
     {
-        errorf("Could not open file %s", file);
-        errorp();
-        close(fd);
-        return NULL;
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (MM_CRC32C_POLY & (0u - (crc & 1)));
+        }
+        mm_crc_table[i] = crc;
     }
 
-    // make sure the file size is a multiple of page size
-    if ((fst.st_size % HUGE_PAGE_SIZE) != 0)
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    mm_scan = __builtin_cpu_supports("avx2") ? mm_scan_avx2 : mm_scan_sse2;
+    debugf("extent bitmaps are scanned with %s", mm_scan == mm_scan_avx2 ? "AVX2" : "SSE2");
+    if (__builtin_cpu_supports("sse4.2"))
     {
-        errorf("The database file %s has an incorrect size (%lld). The size must be a multiple of %d bytes",
-               file,
-               (int64_t)fst.st_size,
-               HUGE_PAGE_SIZE);
-        close(fd);
-        return NULL;
+        mm_crc32c = mm_crc32c_sse42;
     }
+#endif
+    debugf("pages are checksummed with %s", mm_crc32c == mm_crc32c_table ? "a table" : "SSE4.2");
+}
 
-    // fix file owner if needed
-    if (fst.st_gid != gid || fst.st_uid != uid)
+// the first run of count free extents in a page. Returns -1 if there is none.
+static int32_t mm_find_run(const uint32_t *bitmap, uint32_t count)
+{
+    uint32_t pos = 0;
+    while (pos + count <= MM_PAGE_EXTENTS)
     {
-        warnf("changing file %s ownership from %d:%d to %d:%d", file, fst.st_uid, fst.st_gid, uid, gid);
-        if (fchown(fd, uid, gid) == -1)
+        // skip to the next free extent. Whole words in use are skipped
+        // a vector at a time.
+        size_t w = pos / 32;
+        uint32_t used = bitmap[w] | ((1u << (pos % 32)) - 1);
+        if (used == UINT32_MAX)
         {
-            errorf("Could not change file %s owner", file);
-            errorp();
-            close(fd);
-            return NULL;
+            w = mm_scan(bitmap, w + 1, MM_BITMAP_WORDS, UINT32_MAX);
+            if (w == MM_BITMAP_WORDS)
+            {
+                return -1;
+            }
+            used = bitmap[w];
+        }
+        pos = (uint32_t)w * 32 + (uint32_t)__builtin_ctz(~used);
+        if (pos + count > MM_PAGE_EXTENTS)
+        {
+            return -1;
+        }
+
+        // measure the run. Whole free words are skipped the same way.
+        uint32_t end;
+        uint32_t limit = pos + count;
+        uint32_t taken = bitmap[w] & ~((1u << (pos % 32)) - 1);
+        if (taken)
+        {
+            end = (uint32_t)w * 32 + (uint32_t)__builtin_ctz(taken);
+        }
+        else
+        {
+            size_t last = (limit + 31) / 32;
+            size_t next = mm_scan(bitmap, w + 1, last, 0);
+            end = next == last ? limit : (uint32_t)next * 32 + (uint32_t)__builtin_ctz(bitmap[next]);
+        }
+        if (end >= limit)
+        {
+            return (int32_t)pos;
         }
+        pos = end;
     }
+    return -1;
+}
 
-    // fix mode if needed. Only owner has permission to read or write
-    if (fst.st_mode & (S_IRWXG | S_IRWXO))
+// the bits from pos up to count of them, within the word pos is in
+static uint32_t mm_mask(uint32_t pos, uint32_t count, uint32_t *n)
+{
+    uint32_t bit = pos % 32;
+    *n = 32 - bit < count ? 32 - bit : count;
+    return (*n == 32 ? UINT32_MAX : ((1u << *n) - 1)) << bit;
+}
+
+// whether count extents from pos are free
+static bool mm_run_free(const uint32_t *bitmap, uint32_t pos, uint32_t count)
+{
+    while (count)
     {
-        warnf("changing file %s mode from %04o to %04o", file, fst.st_mode, fperm);
-        if (fchmod(fd, fperm) == -1)
+        uint32_t n;
+        if (bitmap[pos / 32] & mm_mask(pos, count, &n))
         {
-            errorf("Could not change file %s mode", file);
-            errorp();
-            close(fd);
-            return NULL;
+            return false;
         }
+        pos += n;
+        count -= n;
     }
+    return true;
+}
 
-    // allocate at least four pages.
-    size_t filesize = fst.st_size;
-    if (filesize < HUGE_PAGE_SIZE * 4)
+// set or clear count bits from pos
+static void mm_mark(uint32_t *bitmap, uint32_t pos, uint32_t count, bool used)
+{
+    while (count)
     {
-        if (ftruncate(fd, HUGE_PAGE_SIZE * 4) == -1)
+        uint32_t n;
+        uint32_t mask = mm_mask(pos, count, &n);
+        if (used)
         {
-            errorf("Could not increase file %s size to %d Mb", file, (HUGE_PAGE_SIZE * 4) / 1024 / 1024);
-            errorp();
-            close(fd);
-            return NULL;
+            bitmap[pos / 32] |= mask;
         }
-        filesize = HUGE_PAGE_SIZE * 4;
+        else
+        {
+            bitmap[pos / 32] &= ~mask;
+        }
+        pos += n;
+        count -= n;
     }
+}
+
+static uint32_t mm_extents(size_t size)
+{
+    return (uint32_t)((size + MM_EXTENT_SIZE - 1) / MM_EXTENT_SIZE);
+}
+
+// the page that holds the index records of a page
+static uint32_t mm_index_page_number(uint32_t page)
+{
+    uint32_t group = page / MM_INDEX_RECORDS;
+    return group ? group * MM_INDEX_RECORDS : 1;
+}
+
+static struct mm_index_record *mm_record(database db, uint32_t page)
+{
+    struct mm_index_page *index = (struct mm_index_page *)&db->data[mm_index_page_number(page)];
+    return &index->indices[page % MM_INDEX_RECORDS];
+}
+
+// note that a page has changed since the last checkpoint
+static void mm_touch(database db, uint32_t page)
+{
+    db->dirty[page / 64] |= 1ull << (page % 64);
+}
 
-    // map the file
-    void *filemem = mmap(
-        NULL, // address hint
-        filesize,
-        PROT_READ | PROT_WRITE,
-        MAP_HUGE_2MB | MAP_SHARED,
-        fd,
-        0); // offset
+// the class of runs of count extents
+static unsigned int mm_run_class(uint32_t count)
+{
+    return count == 1 ? 0 : 32 - (unsigned int)__builtin_clz(count - 1);
+}
 
-    if (!filemem)
+// the longest run of extents that may fit in a page
+static uint32_t mm_room(database db, uint32_t page)
+{
+    struct mm_index_record *record = mm_record(db, page);
+    if (record->full)
     {
-        errorf("Could not map file %s", file);
-        errorp();
-        close(fd);
-        return NULL;
+        return 0;
     }
+    uint32_t room = MM_PAGE_EXTENTS - record->extents_allocated;
+    return db->no_fit[page] <= room ? db->no_fit[page] - 1 : room;
+}
 
-    database db = (database)malloc(sizeof(struct database_s));
-    memset(db, 0, sizeof(struct database_s));
-    db->data = filemem;
-    db->fd = fd;
-    size_t fnlen = strlen(file) + 1;
-    char* filenamemem = (char*) malloc(fnlen);
-    memcpy(filenamemem, file, fnlen);
-    db->file = filenamemem;
-    db->size = filesize;
+// put a page among the candidates of the run classes it may have room
+// for, and take it out of the others. Called whenever its record or its
+// no_fit hint changes.
+static void mm_update_candidates(database db, uint32_t page)
+{
+    uint32_t room = mm_room(db, page);
+    uint32_t word = page / 64;
+    uint64_t bit = 1ull << (page % 64);
+    for (unsigned int c = 0; c < MM_RUN_CLASSES; c++)
+    {
+        // the shortest run of the class
+        uint32_t shortest = c == 0 ? 1 : (1u << (c - 1)) + 1;
+        if (room >= shortest)
+        {
+            db->candidates[c][word] |= bit;
+            if (word < db->first_candidate[c])
+            {
+                db->first_candidate[c] = word;
+            }
+        }
+        else
+        {
+            db->candidates[c][word] &= ~bit;
+        }
+    }
+}
 
-    return db;
+// mark the first count extents of a page as in use
+static void mm_reserve(database db, uint32_t page, uint32_t count)
+{
+    struct mm_index_record *record = mm_record(db, page);
+    mm_mark(record->bitmap, 0, count, true);
+    record->extents_allocated = count;
+    record->full = count == MM_PAGE_EXTENTS;
+    mm_touch(db, mm_index_page_number(page));
+    mm_update_candidates(db, page);
 }
 
-bool database_get(database db, uint32_t key, const char **value, uint64_t *expires)
+static uint32_t mm_extent_number(database db, const void *ptr)
 {
-    return false;
+    return (uint32_t)(((const uint8_t *)ptr - db->data->data) / MM_EXTENT_SIZE);
 }
 
-bool database_set(database db, uint32_t key, const char *value, uint64_t expires)
+static void *mm_extent_ptr(database db, uint32_t extent)
 {
-    return false;
+    return db->data->data + (size_t)extent * MM_EXTENT_SIZE;
 }
 
-void database_close(database db)
+// note that the page ptr is in has changed
+static void mm_touch_ptr(database db, const void *ptr)
 {
-    if (db)
+    mm_touch(db, mm_extent_number(db, ptr) / MM_PAGE_EXTENTS);
+}
+
+// where an index page keeps its own checksum. SIZE_MAX for other pages.
+static size_t mm_checksum_offset(uint32_t page)
+{
+    if (mm_index_page_number(page) != page)
     {
-        if (db->fd > 0)
+        return SIZE_MAX;
+    }
+    return offsetof(struct mm_index_page, indices) +
+           (page % MM_INDEX_RECORDS) * sizeof(struct mm_index_record) +
+           offsetof(struct mm_index_record, checksum);
+}
+
+// a checksum is never 0, which means there is none
+static uint32_t mm_checksum_final(uint32_t crc)
+{
+    crc = ~crc;
+    return crc ? crc : 1;
+}
+
+// store the checksum of a page as it is in memory. Index pages go after
+// the pages they have the checksums of.
+static void mm_checksum(database db, uint32_t page)
+{
+    uint32_t *checksum = &mm_record(db, page)->checksum;
+    if (mm_checksum_offset(page) != SIZE_MAX)
+    {
+        *checksum = 0;
+    }
+    *checksum = mm_checksum_final(mm_crc32c(~0u, db->data[page].data, sizeof(union mm_page)));
+}
+
+enum mm_verdict
+{
+    // a checkpoint got in the way, try again
+    MM_UNCHECKED,
+    MM_GOOD,
+    MM_CORRUPT,
+};
+
+// the checksum of a page as it is in the file. Returns false if it
+// could not be read.
+static bool mm_file_checksum(database db, uint32_t page, uint32_t *checksum)
+{
+    uint8_t buffer[65536];
+    size_t zero = mm_checksum_offset(page);
+    uint32_t crc = ~0u;
+    for (size_t offset = 0; offset < sizeof(union mm_page); offset += sizeof(buffer))
+    {
+        if (pread(db->fd, buffer, sizeof(buffer), (off_t)page * HUGE_PAGE_SIZE + (off_t)offset) != (ssize_t)sizeof(buffer))
         {
-            close(db->fd);
-            db->fd = -1;
+            errorf("Could not read page %u of database file %s", page, db->file);
+            errorp();
+            return false;
         }
-        if (db->file)
+        if (zero >= offset && zero < offset + sizeof(buffer))
         {
-            free((char*)db->file);
-            db->file = NULL;
+            memset(buffer + (zero - offset), 0, sizeof(uint32_t));
         }
-        db->size = 0;
-        db->data = NULL;
-        free(db);
+        crc = mm_crc32c(crc, buffer, sizeof(buffer));
+    }
+    *checksum = mm_checksum_final(crc);
+    return true;
+}
+
+// check a page in the file against its checksum
+static enum mm_verdict mm_verify(database db, uint32_t page)
+{
+    uint32_t checkpoints = __atomic_load_n(&db->checkpoints, __ATOMIC_ACQUIRE);
+    if (checkpoints & 1)
+    {
+        return MM_UNCHECKED;
+    }
+
+    enum mm_verdict verdict = MM_GOOD;
+    uint32_t expected = __atomic_load_n(&mm_record(db, page)->checksum, __ATOMIC_RELAXED);
+    uint32_t checksum;
+    if (expected && (!mm_file_checksum(db, page, &checksum) || checksum != expected))
+    {
+        verdict = MM_CORRUPT;
     }
-}
\ No newline at end of file
+
+    // the page or its checksum may have been rewritten while reading
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&db->checkpoints, __ATOMIC_RELAXED) != checkpoints)
+    {
+        return MM_UNCHECKED;
+    }
+    if (verdict == MM_CORRUPT)
+    {
+        errorf("Page %u of database file %s does not match its checksum", page, db->file);
+    }
+    __atomic_or_fetch(&db->verified[page / 64], 1ull << (page % 64), __ATOMIC_RELAXED);
+    return verdict;
+}
+
+// whether a page has been checked since opening
+static bool mm_verified(database db, uint32_t page)
+{
+    return __atomic_load_n(&db->verified[page / 64], __ATOMIC_RELAXED) & (1ull << (page % 64));
+}
+
+// have a page checked the first time it is used. Reading it from the
+// file is left to the verifier, so the reader does not wait for it.
+static void mm_check(database db, uint32_t page)
+{
+    uint64_t *requested = &db->requested[page / 64];
+    uint64_t bit = 1ull << (page % 64);
+    if (mm_verified(db, page) || (__atomic_load_n(requested, __ATOMIC_RELAXED) & bit))
+    {
+        return;
+    }
+    if (!db->verifier_running)
+    {
+        mm_verify(db, page);
+    }
+    else if (!(__atomic_fetch_or(requested, bit, __ATOMIC_RELAXED) & bit))
+    {
+        pthread_mutex_lock(&db->checkpoint_lock);
+        db->verify_pending = true;
+        pthread_cond_signal(&db->verify_wake);
+        pthread_mutex_unlock(&db->checkpoint_lock);
+    }
+}
+
+// check the pages readers asked for. Returns false if a checkpoint got
+// in the way of some of them.
+static bool mm_verify_requested(database db)
+{
+    bool done = true;
+    uint32_t pages = (uint32_t)(__atomic_load_n(&db->size, __ATOMIC_ACQUIRE) / HUGE_PAGE_SIZE);
+    for (uint32_t w = 0; w < (pages + 63) / 64 && !__atomic_load_n(&db->stopping, __ATOMIC_RELAXED); w++)
+    {
+        uint64_t requested = __atomic_load_n(&db->requested[w], __ATOMIC_RELAXED);
+        for (uint64_t bits = requested & ~__atomic_load_n(&db->verified[w], __ATOMIC_RELAXED); bits; bits &= bits - 1)
+        {
+            if (mm_verify(db, w * 64 + (uint32_t)__builtin_ctzll(bits)) == MM_UNCHECKED)
+            {
+                done = false;
+            }
+        }
+    }
+    return done;
+}
+
+static void *mm_verifier(void *arg)
+{
+    database db = (database)arg;
+    pthread_mutex_lock(&db->checkpoint_lock);
+    while (!db->stopping)
+    {
+        if (!db->verify_pending)
+        {
+            pthread_cond_wait(&db->verify_wake, &db->checkpoint_lock);
+            continue;
+        }
+        db->verify_pending = false;
+        pthread_mutex_unlock(&db->checkpoint_lock);
+        bool done = mm_verify_requested(db);
+        if (!done)
+        {
+            // try again once the checkpoint is over
+            struct timespec pause = {.tv_nsec = 1000000};
+            nanosleep(&pause, NULL);
+        }
+        pthread_mutex_lock(&db->checkpoint_lock);
+        db->verify_pending = db->verify_pending || !done;
+    }
+    pthread_mutex_unlock(&db->checkpoint_lock);
+    return NULL;
+}
+
+// grow the page hints to cover pages
+static bool mm_track_pages(database db, uint32_t pages)
+{
+    if (pages <= db->no_fit_pages)
+    {
+        return true;
+    }
+    uint32_t capacity = db->no_fit_pages ? db->no_fit_pages : 64;
+    while (capacity < pages)
+    {
+        capacity *= 2;
+    }
+    uint32_t *no_fit = (uint32_t *)realloc(db->no_fit, capacity * sizeof(uint32_t));
+    if (no_fit)
+    {
+        db->no_fit = no_fit;
+    }
+    uint64_t *dirty = (uint64_t *)realloc(db->dirty, capacity / 64 * sizeof(uint64_t));
+    if (dirty)
+    {
+        db->dirty = dirty;
+    }
+    bool candidates = true;
+    for (unsigned int c = 0; c < MM_RUN_CLASSES; c++)
+    {
+        uint64_t *words = (uint64_t *)realloc(db->candidates[c], capacity / 64 * sizeof(uint64_t));
+        if (words)
+        {
+            db->candidates[c] = words;
+        }
+        candidates = candidates && words;
+    }
+    if (!no_fit || !dirty || !candidates)
+    {
+        error("Could not allocate memory for database page hints");
+        return false;
+    }
+    for (uint32_t i = db->no_fit_pages; i < capacity; i++)
+    {
+        no_fit[i] = MM_PAGE_EXTENTS + 1;
+    }
+    memset(dirty + db->no_fit_pages / 64, 0, (capacity - db->no_fit_pages) / 64 * sizeof(uint64_t));
+    for (unsigned int c = 0; c < MM_RUN_CLASSES; c++)
+    {
+        memset(db->candidates[c] + db->no_fit_pages / 64, 0,
+               (capacity - db->no_fit_pages) / 64 * sizeof(uint64_t));
+    }
+    db->no_fit_pages = capacity;
+    return true;
+}
+
+static const char *mm_huge_name(enum mm_huge huge)
+{
+    switch (huge)
+    {
+    case MM_HUGE_TLBFS:
+        return "from hugetlbfs with 2 MB pages";
+    case MM_HUGE_THP:
+        return "asking for transparent huge pages";
+    default:
+        return "with 4 KB pages as transparent huge pages are off";
+    }
+}
+
+// work out how the file can be mapped. Returns false if it cannot be.
+static bool mm_huge_detect(int fd, const char *file, enum mm_huge *huge)
+{
+    struct statfs fs;
+    if (fstatfs(fd, &fs) == -1)
+    {
+        errorf("Could not find out what file system file %s is on", file);
+        errorp();
+        return false;
+    }
+    if (fs.f_type == HUGETLBFS_MAGIC)
+    {
+        // a database page has to be a whole file page
+        if (fs.f_bsize != HUGE_PAGE_SIZE)
+        {
+            errorf("The database file %s is on hugetlbfs with %ld KB pages. It needs %d KB pages",
+                   file, (long)fs.f_bsize / 1024, HUGE_PAGE_SIZE / 1024);
+            return false;
+        }
+        *huge = MM_HUGE_TLBFS;
+        return true;
+    }
+
+    // madvise takes MADV_HUGEPAGE even when transparent huge pages are off
+    *huge = MM_HUGE_THP;
+    FILE *f = fopen(fs.f_type == TMPFS_MAGIC ? "/sys/kernel/mm/transparent_hugepage/shmem_enabled"
+                                             : "/sys/kernel/mm/transparent_hugepage/enabled",
+                    "r");
+    if (f)
+    {
+        char line[128];
+        if (fgets(line, sizeof(line), f) && (strstr(line, "[never]") || strstr(line, "[deny]")))
+        {
+            *huge = MM_HUGE_NONE;
+        }
+        fclose(f);
+    }
+    return true;
+}
+
+// map length bytes of the file from offset at addr, inside the reservation
+static void *mm_map(int fd, enum mm_huge *huge, void *addr, size_t length, off_t offset)
+{
+    int flags = MAP_PRIVATE | MAP_FIXED;
+    if (*huge == MM_HUGE_TLBFS)
+    {
+        flags |= MAP_HUGETLB | MAP_HUGE_2MB;
+    }
+    void *data = mmap(addr, length, PROT_READ | PROT_WRITE, flags, fd, offset);
+    if (data != MAP_FAILED && *huge == MM_HUGE_THP && madvise(data, length, MADV_HUGEPAGE) == -1)
+    {
+        // a kernel without transparent huge pages
+        *huge = MM_HUGE_NONE;
+    }
+    return data;
+}
+
+// write length bytes over the file at offset. Files on hugetlbfs cannot be
+// written to, only mapped, so those are copied through a shared mapping.
+static bool mm_file_write(int fd, enum mm_huge huge, const void *data, size_t length, off_t offset)
+{
+    if (huge == MM_HUGE_TLBFS)
+    {
+        // the page may be past the end of the file, or a hole
+        if (fallocate(fd, 0, offset, (off_t)length) == -1)
+        {
+            return false;
+        }
+        void *file = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+        if (file == MAP_FAILED)
+        {
+            return false;
+        }
+        memcpy(file, data, length);
+        munmap(file, length);
+        return true;
+    }
+
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t amt = pwrite(fd, (const uint8_t *)data + written, length - written, offset + (off_t)written);
+        if (amt == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (amt <= 0)
+        {
+            return false;
+        }
+        written += (size_t)amt;
+    }
+    return true;
+}
+
+// how many KB of the file are in memory, and how many of those are in
+// huge pages, whatever the kernel made of the way it was mapped
+static bool mm_huge_usage(database db, unsigned long long *resident, unsigned long long *huge)
+{
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f)
+    {
+        return false;
+    }
+    unsigned long start = (unsigned long)db->data;
+    unsigned long end = start + (unsigned long)__atomic_load_n(&db->size, __ATOMIC_ACQUIRE);
+    bool inside = false;
+    *resident = *huge = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        unsigned long from, to;
+        char name[64];
+        unsigned long long kb;
+        if (sscanf(line, "%lx-%lx ", &from, &to) == 2)
+        {
+            inside = from >= start && to <= end;
+        }
+        else if (inside && sscanf(line, "%63s %llu kB", name, &kb) == 2)
+        {
+            // hugetlbfs pages are not counted in Rss
+            if (strcmp(name, "Rss:") == 0)
+            {
+                *resident += kb;
+            }
+            else if (strcmp(name, "Private_Hugetlb:") == 0 || strcmp(name, "Shared_Hugetlb:") == 0)
+            {
+                *resident += kb;
+                *huge += kb;
+            }
+            else if (strcmp(name, "AnonHugePages:") == 0 || strcmp(name, "FilePmdMapped:") == 0 ||
+                     strcmp(name, "ShmemPmdMapped:") == 0)
+            {
+                *huge += kb;
+            }
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+// increase the size of the database file by DATABASE_GROWTH pages. The
+// new pages are mapped right after the old ones, inside the range reserved
+// when the file was opened, so nothing that points into the file moves and
+// readers carry on while the file grows.
+bool mm_sbrk(database db)
+{
+    uint64_t size = db->size + DATABASE_GROWTH * sizeof(union mm_page);
+    if (size > db->reserved)
+    {
+        size = db->reserved;
+    }
+    if (size == db->size)
+    {
+        errorf("The database file %s cannot grow beyond %llu bytes", db->file, (unsigned long long)db->reserved);
+        return false;
+    }
+    uint64_t growth = size - db->size;
+
+    // fallocate gets the blocks without writing them. ftruncate
+    // does for file systems that cannot.
+    if (fallocate(db->fd, 0, (off_t)db->size, (off_t)growth) == -1 &&
+        (errno != EOPNOTSUPP || ftruncate(db->fd, (off_t)size) == -1))
+    {
+        errorf("Could not grow database file %s", db->file);
+        errorp();
+        // give back what fallocate got before it ran out, which on
+        // hugetlbfs are pages the private mapping needs to change
+        if (ftruncate(db->fd, (off_t)db->size) == -1)
+        {
+            errorp();
+        }
+        return false;
+    }
+
+    void *data = mm_map(db->fd, &db->huge, (uint8_t *)db->data + db->size, growth, (off_t)db->size);
+    if (data == MAP_FAILED)
+    {
+        errorf("Could not map more of database file %s", db->file);
+        errorp();
+        return false;
+    }
+
+    uint32_t pages = (uint32_t)(size / sizeof(union mm_page));
+    if (!mm_track_pages(db, pages))
+    {
+        return false;
+    }
+
+    // the first page of a group holds the index records of the group
+    for (uint32_t page = db->pages; page < pages; page++)
+    {
+        if (mm_index_page_number(page) == page)
+        {
+            mm_reserve(db, page, MM_PAGE_EXTENTS);
+        }
+        else
+        {
+            mm_update_candidates(db, page);
+        }
+    }
+
+    // only now may other threads see the new pages
+    __atomic_store_n(&db->size, size, __ATOMIC_RELEASE);
+    db->pages = pages;
+    return true;
+}
+
+void *mm_allocate(database db, size_t size)
+{
+    uint32_t count = mm_extents(size);
+    if (count == 0 || count > MM_PAGE_EXTENTS)
+    {
+        return NULL;
+    }
+
+    // a freed block of the same size
+    if (count <= MM_SIZE_CLASSES)
+    {
+        uint32_t *head = &((struct mm_root_page *)db->data)->header.free_lists[count - 1];
+        if (*head)
+        {
+            uint32_t *block = (uint32_t *)mm_extent_ptr(db, *head);
+            *head = block[0];
+            memset(block, 0, (size_t)count * MM_EXTENT_SIZE);
+            mm_touch(db, 0);
+            mm_touch_ptr(db, block);
+            return block;
+        }
+    }
+
+    // the lowest page that may have room, of the pages that may have
+    // room for a run of the class
+    unsigned int c = mm_run_class(count);
+    for (;;)
+    {
+        uint32_t words = (db->pages + 63) / 64;
+        for (uint32_t w = db->first_candidate[c]; w < words; w++)
+        {
+            uint64_t bits = db->candidates[c][w];
+            if (!bits && w == db->first_candidate[c])
+            {
+                db->first_candidate[c]++;
+                continue;
+            }
+            for (; bits; bits &= bits - 1)
+            {
+                uint32_t page = w * 64 + (uint32_t)__builtin_ctzll(bits);
+                if (mm_room(db, page) < count)
+                {
+                    continue;
+                }
+
+                struct mm_index_record *record = mm_record(db, page);
+                int32_t first = mm_find_run(record->bitmap, count);
+                if (first < 0)
+                {
+                    db->no_fit[page] = count;
+                    mm_update_candidates(db, page);
+                    continue;
+                }
+                mm_mark(record->bitmap, (uint32_t)first, count, true);
+                record->extents_allocated += count;
+                record->full = record->extents_allocated == MM_PAGE_EXTENTS;
+                mm_update_candidates(db, page);
+
+                void *ptr = db->data[page].extents + first;
+                memset(ptr, 0, (size_t)count * MM_EXTENT_SIZE);
+                mm_touch(db, mm_index_page_number(page));
+                mm_touch(db, page);
+                return ptr;
+            }
+        }
+
+        if (!mm_sbrk(db))
+        {
+            return NULL;
+        }
+    }
+}
+
+void mm_free(database db, void *ptr, size_t orig_size)
+{
+    uint32_t count = mm_extents(orig_size);
+    if (!ptr || !count)
+    {
+        return;
+    }
+    uint32_t extent = mm_extent_number(db, ptr);
+    uint32_t page = extent / MM_PAGE_EXTENTS;
+    struct mm_index_record *record = mm_record(db, page);
+
+    // small blocks are kept for the next allocation of their size
+    if (count <= MM_SIZE_CLASSES)
+    {
+        uint32_t *head = &((struct mm_root_page *)db->data)->header.free_lists[count - 1];
+        *(uint32_t *)ptr = *head;
+        *head = extent;
+        mm_touch(db, 0);
+        mm_touch(db, page);
+        return;
+    }
+
+    mm_mark(record->bitmap, extent % MM_PAGE_EXTENTS, count, false);
+    mm_touch(db, mm_index_page_number(page));
+    record->extents_allocated -= count;
+    record->full = false;
+    db->no_fit[page] = MM_PAGE_EXTENTS + 1;
+    mm_update_candidates(db, page);
+}
+
+// free a block once no reader can be looking at it any more
+static void mm_retire(database db, void *ptr, size_t orig_size)
+{
+    if (!ptr || !orig_size)
+    {
+        return;
+    }
+    if (db->retired_count == db->retired_capacity)
+    {
+        size_t capacity = db->retired_capacity ? db->retired_capacity * 2 : 256;
+        struct mm_retired *retired = (struct mm_retired *)realloc(db->retired, capacity * sizeof(struct mm_retired));
+        if (!retired)
+        {
+            // better lost than handed out while it is being read
+            error("Could not allocate memory for retired database blocks");
+            return;
+        }
+        db->retired = retired;
+        db->retired_capacity = capacity;
+    }
+    db->retired[db->retired_count++] = (struct mm_retired){
+        .epoch = db->epoch,
+        .extent = mm_extent_number(db, ptr),
+        .size = (uint32_t)orig_size,
+    };
+}
+
+// free the retired blocks that no reader inside can have seen
+static void mm_reclaim(database db)
+{
+    if (db->retired_count == 0)
+    {
+        return;
+    }
+
+    uint64_t oldest = UINT64_MAX;
+    unsigned int readers = __atomic_load_n(&db->readers, __ATOMIC_ACQUIRE);
+    for (unsigned int i = 0; i < readers; i++)
+    {
+        uint64_t epoch = __atomic_load_n(&db->reader_slots[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < oldest)
+        {
+            oldest = epoch;
+        }
+    }
+
+    size_t done = 0;
+    while (done < db->retired_count && db->retired[done].epoch < oldest)
+    {
+        mm_free(db, mm_extent_ptr(db, db->retired[done].extent), db->retired[done].size);
+        done++;
+    }
+    db->retired_count -= done;
+    memmove(db->retired, db->retired + done, db->retired_count * sizeof(struct mm_retired));
+}
+
+void *mm_reallocate(database db, void *ptr, size_t orig_size, size_t new_size)
+{
+    if (!ptr)
+    {
+        return mm_allocate(db, new_size);
+    }
+
+    uint32_t have = mm_extents(orig_size);
+    uint32_t want = mm_extents(new_size);
+    uint32_t extent = mm_extent_number(db, ptr);
+    uint32_t page = extent / MM_PAGE_EXTENTS;
+    uint32_t first = extent % MM_PAGE_EXTENTS;
+    struct mm_index_record *record = mm_record(db, page);
+
+    if (want <= have)
+    {
+        mm_retire(db, (uint8_t *)ptr + (size_t)want * MM_EXTENT_SIZE, (size_t)(have - want) * MM_EXTENT_SIZE);
+        return ptr;
+    }
+
+    // grow in place if the extents after it are free
+    uint32_t extra = want - have;
+    uint32_t next = first + have;
+    if (next + extra <= MM_PAGE_EXTENTS && mm_run_free(record->bitmap, next, extra))
+    {
+        mm_mark(record->bitmap, next, extra, true);
+        record->extents_allocated += extra;
+        record->full = record->extents_allocated == MM_PAGE_EXTENTS;
+        mm_update_candidates(db, page);
+        memset((uint8_t *)ptr + (size_t)have * MM_EXTENT_SIZE, 0, (size_t)extra * MM_EXTENT_SIZE);
+        mm_touch(db, mm_index_page_number(page));
+        mm_touch(db, page);
+        return ptr;
+    }
+
+    void *moved = mm_allocate(db, new_size);
+    if (!moved)
+    {
+        return NULL;
+    }
+    memcpy(moved, ptr, (size_t)have * MM_EXTENT_SIZE);
+    mm_retire(db, ptr, orig_size);
+    return moved;
+}
+
+// the hashtable keeps its buckets in extents
+static void *table_allocate(void *state, size_t size)
+{
+    return mm_allocate((database)state, size);
+}
+
+static void *table_reallocate(void *state, void *ptr, size_t orig_size, size_t new_size)
+{
+    return mm_reallocate((database)state, ptr, orig_size, new_size);
+}
+
+static void table_free(void *state, void *ptr, size_t orig_size)
+{
+    mm_retire((database)state, ptr, orig_size);
+}
+
+// the prefix table, or NULL if nothing has been interned yet
+static struct database_prefix *database_prefixes(database db)
+{
+    uint32_t extent = __atomic_load_n(&((struct mm_root_page *)db->data)->header.prefixes, __ATOMIC_ACQUIRE);
+    return extent ? (struct database_prefix *)mm_extent_ptr(db, extent) : NULL;
+}
+
+// how much of url is shared with others: up to the last / before the
+// query, like https://example.com/some/path/. 0 if that is too short.
+static size_t database_prefix_length(const char *url, size_t length)
+{
+    size_t end = 0;
+    for (size_t i = 0; i < length && url[i] != '?' && url[i] != '#'; i++)
+    {
+        if (url[i] == '/')
+        {
+            end = i + 1;
+        }
+    }
+    return end >= DATABASE_MIN_PREFIX ? end : 0;
+}
+
+static uint32_t database_prefix_hash(const char *prefix, size_t length)
+{
+    uint32_t hash = mm_crc32c(0, (const uint8_t *)prefix, length);
+    return hash ? hash : 1;
+}
+
+// the id of a prefix, or -1 if it has none. Sets slot to where it is in
+// the index, or would go.
+static int32_t database_prefix_find(database db, const char *prefix, size_t length, uint32_t hash, uint32_t *slot)
+{
+    const struct database_prefix *table = database_prefixes(db);
+    for (uint32_t i = hash & (DATABASE_PREFIX_INDEX - 1);; i = (i + 1) & (DATABASE_PREFIX_INDEX - 1))
+    {
+        uint32_t id = db->prefix_index[i];
+        *slot = i;
+        if (id == 0)
+        {
+            return -1;
+        }
+        const struct database_prefix *entry = &table[id - 1];
+        if (entry->length == length && memcmp(mm_extent_ptr(db, entry->extent), prefix, length) == 0)
+        {
+            return (int32_t)(id - 1);
+        }
+    }
+}
+
+// find the prefix of url in the table, or add it if it has been seen
+// before. Returns its length and sets id, or returns 0 if the url is to
+// be stored in full.
+static size_t database_intern(database db, const char *url, size_t length, uint16_t *id)
+{
+    size_t prefix_length = database_prefix_length(url, length);
+    if (prefix_length == 0)
+    {
+        return 0;
+    }
+    uint32_t hash = database_prefix_hash(url, prefix_length);
+    uint32_t slot;
+    int32_t found = database_prefix_find(db, url, prefix_length, hash, &slot);
+    if (found >= 0)
+    {
+        *id = (uint16_t)found;
+        return prefix_length;
+    }
+
+    struct mm_header *header = &((struct mm_root_page *)db->data)->header;
+    uint32_t *seen = &db->prefix_seen[hash & (DATABASE_PREFIX_SEEN - 1)];
+    if (*seen != hash || header->prefix_count == DATABASE_MAX_PREFIXES)
+    {
+        *seen = hash;
+        return 0;
+    }
+
+    // a bigger table replaces the old one whole, which readers may still
+    // be looking at
+    struct database_prefix *table = database_prefixes(db);
+    if (header->prefix_count == header->prefix_capacity)
+    {
+        uint32_t capacity = header->prefix_capacity ? header->prefix_capacity * 2 : 64;
+        if (capacity > DATABASE_MAX_PREFIXES)
+        {
+            capacity = DATABASE_MAX_PREFIXES;
+        }
+        struct database_prefix *grown = (struct database_prefix *)mm_allocate(db, capacity * sizeof(*grown));
+        if (!grown)
+        {
+            return 0;
+        }
+        if (table)
+        {
+            memcpy(grown, table, header->prefix_count * sizeof(*grown));
+            mm_retire(db, table, header->prefix_capacity * sizeof(*table));
+        }
+        header->prefix_capacity = capacity;
+        __atomic_store_n(&header->prefixes, mm_extent_number(db, grown), __ATOMIC_RELEASE);
+        table = grown;
+    }
+
+    void *prefix = mm_allocate(db, prefix_length);
+    if (!prefix)
+    {
+        return 0;
+    }
+    memcpy(prefix, url, prefix_length);
+    struct database_prefix *entry = &table[header->prefix_count];
+    entry->extent = mm_extent_number(db, prefix);
+    entry->length = (uint32_t)prefix_length;
+    mm_touch_ptr(db, entry);
+    *id = (uint16_t)header->prefix_count++;
+    mm_touch(db, 0);
+    db->prefix_index[slot] = *id + 1u;
+    return prefix_length;
+}
+
+// index the prefixes in the table
+static bool database_prefixes_open(database db)
+{
+    db->prefix_index = (uint32_t *)calloc(DATABASE_PREFIX_INDEX, sizeof(uint32_t));
+    db->prefix_seen = (uint32_t *)calloc(DATABASE_PREFIX_SEEN, sizeof(uint32_t));
+    if (!db->prefix_index || !db->prefix_seen)
+    {
+        error("Could not allocate memory for the prefix index");
+        return false;
+    }
+
+    const struct mm_header *header = &((struct mm_root_page *)db->data)->header;
+    const struct database_prefix *table = database_prefixes(db);
+    if (header->prefix_count > header->prefix_capacity || header->prefix_capacity > DATABASE_MAX_PREFIXES ||
+        (header->prefix_count && !table))
+    {
+        errorf("The prefix table of database file %s is corrupt", db->file);
+        return false;
+    }
+    for (uint32_t id = 0; id < header->prefix_count; id++)
+    {
+        const char *prefix = (const char *)mm_extent_ptr(db, table[id].extent);
+        uint32_t slot;
+        if (database_prefix_find(db, prefix, table[id].length, database_prefix_hash(prefix, table[id].length), &slot) < 0)
+        {
+            db->prefix_index[slot] = id + 1;
+        }
+    }
+    return true;
+}
+
+// the dictionary compressed values are deflated with, or NULL if there
+// is none yet
+static const uint8_t *database_dictionary(database db, uint32_t *length)
+{
+    uint32_t extent = __atomic_load_n(&((struct mm_root_page *)db->data)->header.dictionary, __ATOMIC_ACQUIRE);
+    if (!extent)
+    {
+        return NULL;
+    }
+    mm_check(db, extent / MM_PAGE_EXTENTS);
+    const uint8_t *block = (const uint8_t *)mm_extent_ptr(db, extent);
+    memcpy(length, block, sizeof(*length));
+    return block + sizeof(*length);
+}
+
+// count a string in the samples, unless it is too short to be worth it
+// or the table is too full to take new ones
+static void database_count(struct database_string *strings, uint32_t *used, const char *samples,
+                           size_t offset, size_t length)
+{
+    if (length < 4)
+    {
+        return;
+    }
+    uint32_t hash = mm_crc32c(0, (const uint8_t *)samples + offset, length);
+    for (uint32_t i = hash & (DATABASE_DICTIONARY_STRINGS - 1);; i = (i + 1) & (DATABASE_DICTIONARY_STRINGS - 1))
+    {
+        struct database_string *string = &strings[i];
+        if (string->count == 0)
+        {
+            if (*used < DATABASE_DICTIONARY_STRINGS / 4 * 3)
+            {
+                *string = (struct database_string){hash, (uint32_t)offset, (uint32_t)length, 1};
+                (*used)++;
+            }
+            return;
+        }
+        if (string->hash == hash && string->length == length &&
+            memcmp(samples + string->offset, samples + offset, length) == 0)
+        {
+            string->count++;
+            return;
+        }
+    }
+}
+
+// the bytes a string would save if it came up as often again
+static uint64_t database_string_score(const struct database_string *string)
+{
+    return (uint64_t)(string->count - 1) * string->length;
+}
+
+static int database_string_order(const void *a, const void *b)
+{
+    uint64_t score_a = database_string_score((const struct database_string *)a);
+    uint64_t score_b = database_string_score((const struct database_string *)b);
+    return score_a < score_b ? 1 : score_a > score_b ? -1 : 0;
+}
+
+// Make a dictionary of the strings that come up most in the samples:
+// every piece of a url from one of / ? & # ; to the next, and the name of
+// every parameter. Deflate finds the end of the dictionary in fewer bits,
+// so the best go last. Returns false if there is none, when nothing came
+// up twice.
+static bool database_train(database db)
+{
+    struct database_string *strings =
+        (struct database_string *)calloc(DATABASE_DICTIONARY_STRINGS, sizeof(*strings));
+    if (!strings)
+    {
+        error("Could not allocate memory to train the dictionary");
+        return false;
+    }
+
+    const char *samples = db->samples;
+    uint32_t used = 0;
+    size_t start = 0;
+    for (size_t i = 1; i < db->samples_length; i++)
+    {
+        if (samples[i] && !strchr("/?&#;", samples[i]))
+        {
+            continue;
+        }
+        const char *equals = (const char *)memchr(samples + start, '=', i - start);
+        database_count(strings, &used, samples, start, i - start);
+        if (equals)
+        {
+            database_count(strings, &used, samples, start, (size_t)(equals + 1 - (samples + start)));
+        }
+        start = samples[i] ? i : i + 1;
+    }
+
+    size_t count = 0;
+    for (uint32_t i = 0; i < DATABASE_DICTIONARY_STRINGS; i++)
+    {
+        if (strings[i].count > 1)
+        {
+            strings[count++] = strings[i];
+        }
+    }
+    qsort(strings, count, sizeof(*strings), database_string_order);
+
+    // filled from the end, leaving out strings that are in it already
+    char dictionary[DATABASE_DICTIONARY_SIZE];
+    size_t free_length = sizeof(dictionary);
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *string = samples + strings[i].offset;
+        size_t length = strings[i].length;
+        if (length <= free_length &&
+            !memmem(dictionary + free_length, sizeof(dictionary) - free_length, string, length))
+        {
+            free_length -= length;
+            memcpy(dictionary + free_length, string, length);
+        }
+    }
+    free(strings);
+
+    uint32_t length = (uint32_t)(sizeof(dictionary) - free_length);
+    uint8_t *block = length ? (uint8_t *)mm_allocate(db, sizeof(length) + length) : NULL;
+    if (!block)
+    {
+        return false;
+    }
+    memcpy(block, &length, sizeof(length));
+    memcpy(block + sizeof(length), dictionary + free_length, length);
+    mm_touch_ptr(db, block);
+    __atomic_store_n(&((struct mm_root_page *)db->data)->header.dictionary, mm_extent_number(db, block), __ATOMIC_RELEASE);
+    mm_touch(db, 0);
+    debugf("Trained a dictionary of %u bytes on %zu bytes of urls in database file %s",
+           length, db->samples_length, db->file);
+
+    free(db->samples);
+    db->samples = NULL;
+    db->samples_length = 0;
+    return true;
+}
+
+// keep the rest of a long url to train the dictionary on, and train it
+// once the samples are full
+static void database_sample(database db, const char *value, size_t length)
+{
+    if (!db->samples)
+    {
+        return;
+    }
+    if (length + 1 > DATABASE_DICTIONARY_SAMPLES - db->samples_length)
+    {
+        // sampling starts over if nothing came up twice
+        if (!database_train(db))
+        {
+            db->samples_length = 0;
+        }
+        return;
+    }
+    memcpy(db->samples + db->samples_length, value, length);
+    db->samples[db->samples_length + length] = '\0';
+    db->samples_length += length + 1;
+}
+
+// deflate the rest of a url after head bytes of prefix id into deflated,
+// if it is long enough. Returns its deflated length, or 0 if it is to be
+// stored as it is because that would not take more extents.
+static size_t database_deflate(database db, const char *value, size_t length, size_t head)
+{
+    if (db->compress_threshold == 0 || length < db->compress_threshold)
+    {
+        return 0;
+    }
+    uint32_t dictionary_length;
+    const uint8_t *dictionary = database_dictionary(db, &dictionary_length);
+    if (!dictionary)
+    {
+        database_sample(db, value, length);
+        return 0;
+    }
+
+    // what fits in one extent less, after the length
+    size_t limit = (size_t)(mm_extents(head + length) - 1) * MM_EXTENT_SIZE;
+    if (limit <= head + sizeof(uint32_t))
+    {
+        return 0;
+    }
+    limit -= head + sizeof(uint32_t);
+    if (limit > db->deflated_capacity)
+    {
+        uint8_t *deflated = (uint8_t *)realloc(db->deflated, limit);
+        if (!deflated)
+        {
+            return 0;
+        }
+        db->deflated = deflated;
+        db->deflated_capacity = limit;
+    }
+
+    z_stream *stream = &db->deflater;
+    if (deflateReset(stream) != Z_OK || deflateSetDictionary(stream, dictionary, dictionary_length) != Z_OK)
+    {
+        return 0;
+    }
+    stream->next_in = (Bytef *)value;
+    stream->avail_in = (uInt)length;
+    stream->next_out = db->deflated;
+    stream->avail_out = (uInt)limit;
+    return deflate(stream, Z_FINISH) == Z_STREAM_END ? limit - stream->avail_out : 0;
+}
+
+// inflate the rest of a compressed url into scratch
+static bool database_inflate(database db, database_scratch scratch, const uint8_t *data, size_t length,
+                             database_url *url)
+{
+    uint32_t dictionary_length;
+    const uint8_t *dictionary = database_dictionary(db, &dictionary_length);
+    uint32_t inflated;
+    if (!scratch || !dictionary || length < sizeof(inflated))
+    {
+        return false;
+    }
+    memcpy(&inflated, data, sizeof(inflated));
+    if (inflated == 0 || inflated > sizeof(union mm_page))
+    {
+        return false;
+    }
+    if (inflated > scratch->capacity)
+    {
+        char *buffer = (char *)realloc(scratch->buffer, inflated);
+        if (!buffer)
+        {
+            return false;
+        }
+        scratch->buffer = buffer;
+        scratch->capacity = inflated;
+    }
+
+    z_stream *stream = &scratch->inflater;
+    if (inflateReset(stream) != Z_OK || inflateSetDictionary(stream, dictionary, dictionary_length) != Z_OK)
+    {
+        return false;
+    }
+    stream->next_in = (Bytef *)data + sizeof(inflated);
+    stream->avail_in = (uInt)(length - sizeof(inflated));
+    stream->next_out = (Bytef *)scratch->buffer;
+    stream->avail_out = inflated;
+    if (inflate(stream, Z_FINISH) != Z_STREAM_END || stream->avail_out)
+    {
+        return false;
+    }
+    url->suffix = scratch->buffer;
+    url->suffix_length = inflated;
+    return true;
+}
+
+// lay out a new file, or check that an existing one is ours
+bool mm_open(database db)
+{
+    if (!mm_track_pages(db, db->pages))
+    {
+        return false;
+    }
+
+    struct mm_root_page *root = (struct mm_root_page *)db->data;
+    if (root->header.magic == 0)
+    {
+        root->header.magic = DATABASE_MAGIC;
+        root->header.format = DATABASE_FORMAT;
+        root->header.buckets = DATABASE_BUCKETS;
+        mm_touch(db, 0);
+        mm_reserve(db, 0, mm_extents(sizeof(struct mm_root_page)));
+        mm_reserve(db, 1, MM_PAGE_EXTENTS);
+    }
+    else if (root->header.magic != DATABASE_MAGIC ||
+             root->header.format == 0 || root->header.format > DATABASE_FORMAT ||
+             root->header.buckets != DATABASE_BUCKETS)
+    {
+        errorf("The database file %s is not a linky database or has an unknown format", db->file);
+        return false;
+    }
+    else if (root->header.format != DATABASE_FORMAT)
+    {
+        // earlier formats had no prefixes or no dictionary, and their
+        // values are all stored in full or interned
+        root->header.format = DATABASE_FORMAT;
+        mm_touch(db, 0);
+    }
+
+    // the file may have grown before a crash without a checkpoint
+    // writing the index pages of the new groups
+    for (uint32_t page = MM_INDEX_RECORDS; page < db->pages; page += MM_INDEX_RECORDS)
+    {
+        if (!mm_record(db, page)->full)
+        {
+            mm_reserve(db, page, MM_PAGE_EXTENTS);
+        }
+    }
+    for (uint32_t page = 0; page < db->pages; page++)
+    {
+        mm_update_candidates(db, page);
+    }
+
+    hashtable_options_t options = {
+        .allocate = table_allocate,
+        .reallocate = table_reallocate,
+        .free = table_free,
+        .num_buckets = DATABASE_BUCKETS,
+        .value_size = sizeof(struct database_value),
+        .state = db,
+    };
+    db->table = hashtable_create(&options, root->buckets, sizeof(root->buckets));
+    return db->table && database_prefixes_open(db);
+}
+
+static bool database_replay(database db, uint64_t from);
+
+// open both logs and find the one changes went to last
+static bool database_logs_open(struct wal_s *logs, unsigned int *current, const char *file, const char *log)
+{
+    memset(logs, 0, 2 * sizeof(*logs));
+    logs[1].fd = -1;
+    if (!wal_open(&logs[0], file, log))
+    {
+        return false;
+    }
+    size_t length = strlen(logs[0].file);
+    char *second = (char *)malloc(length + 3);
+    if (!second)
+    {
+        error("Could not allocate memory for the log");
+        return false;
+    }
+    memcpy(second, logs[0].file, length);
+    memcpy(second + length, ".2", 3);
+    bool result = wal_open(&logs[1], file, second);
+    free(second);
+    *current = logs[1].generation > logs[0].generation ? 1 : 0;
+    return result;
+}
+
+static void database_logs_close(struct wal_s *logs)
+{
+    wal_close(&logs[0]);
+    wal_close(&logs[1]);
+}
+
+// a replay of both logs, with the offsets of the later one
+// running on from the end of the earlier one
+struct database_logs_s
+{
+    wal_replay_fn fn;
+    void *state;
+    uint64_t base;
+};
+
+static bool database_logs_record(void *state, const struct wal_record *record, const void *data, uint64_t offset)
+{
+    struct database_logs_s *logs = (struct database_logs_s *)state;
+    return logs->fn(logs->state, record, data, logs->base + offset);
+}
+
+// call fn for every record that checks out in both logs, in the order
+// they were written
+static bool database_logs_replay(struct wal_s *logs, unsigned int current, wal_replay_fn fn, void *state)
+{
+    struct database_logs_s replay = {.fn = fn, .state = state};
+    struct wal_s *earlier = &logs[current ^ 1];
+    if (!wal_replay(earlier, database_logs_record, &replay))
+    {
+        return false;
+    }
+    replay.base = earlier->size;
+    return wal_replay(&logs[current], database_logs_record, &replay);
+}
+
+// where the page images of the last complete checkpoint in the log are
+struct database_redo_s
+{
+    int fd;
+    enum mm_huge huge;
+    // the run of page images being read
+    uint64_t images;
+    bool in_images;
+    // the last run that a checkpoint record followed, and
+    // the end of that record
+    uint64_t start;
+    uint64_t end;
+};
+
+static bool database_find_checkpoint(void *state, const struct wal_record *record, const void *data, uint64_t offset)
+{
+    struct database_redo_s *redo = (struct database_redo_s *)state;
+    if (record->type == WAL_PAGE)
+    {
+        if (!redo->in_images)
+        {
+            redo->images = offset;
+            redo->in_images = true;
+        }
+        return true;
+    }
+    if (record->type == WAL_CHECKPOINT && redo->in_images)
+    {
+        redo->start = redo->images;
+        redo->end = offset + sizeof(*record) + record->length;
+    }
+    redo->in_images = false;
+    return true;
+}
+
+static bool database_redo_page(void *state, const struct wal_record *record, const void *data, uint64_t offset)
+{
+    struct database_redo_s *redo = (struct database_redo_s *)state;
+    if (record->type != WAL_PAGE || offset < redo->start || offset >= redo->end)
+    {
+        return true;
+    }
+
+    if (!mm_file_write(redo->fd, redo->huge, data, record->length, (off_t)record->key * HUGE_PAGE_SIZE))
+    {
+        errorp();
+        return false;
+    }
+    return true;
+}
+
+// write the pages of the last complete checkpoint in the logs over the
+// file. They may be there already. replay_from is set to where the
+// changes made after that checkpoint start in the logs.
+static bool database_redo(int fd, enum mm_huge huge, struct wal_s *logs, unsigned int current, uint64_t *replay_from)
+{
+    struct database_redo_s redo = {.fd = fd, .huge = huge};
+    if (!database_logs_replay(logs, current, database_find_checkpoint, &redo))
+    {
+        return false;
+    }
+    if (redo.end)
+    {
+        infof("Writing the pages of an unfinished checkpoint from %s", logs[0].file);
+        if (!database_logs_replay(logs, current, database_redo_page, &redo) || fdatasync(fd) == -1)
+        {
+            return false;
+        }
+    }
+    *replay_from = redo.end;
+    return true;
+}
+
+database database_open(const char *file, const char *log, bool create, gid_t gid, uid_t uid)
+{
+    int fperm = S_IRUSR | S_IWUSR;
+
+    // open the file
+    int fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, fperm);
+    if (fd == -1)
+    {
+        errorf("Could not open file %s", file);
+        errorp();
+        close(fd);
+        return NULL;
+    }
+
+    // lock the file
+    if (flock(fd, LOCK_EX) == -1)
+    {
+        errorf("Could not lock file %s", file);
+        errorp();
+        close(fd);
+        return NULL;
+    }
+
+    return database_adopt(fd, file, log, gid, uid);
+}
+
+database database_adopt(int fd, const char *file, const char *log, gid_t gid, uid_t uid)
+{
+    int fperm = S_IRUSR | S_IWUSR;
+
+    // check file size, owner and mode
+    struct stat fst;
+    if (fstat(fd, &fst) == -1)
+    {
+        errorf("Could not open file %s", file);
+        errorp();
+        close(fd);
+        return NULL;
+    }
+
+    // make sure the file size is a multiple of page size
+    if ((fst.st_size % HUGE_PAGE_SIZE) != 0)
+    {
+        errorf("The database file %s has an incorrect size (%lld). The size must be a multiple of %d bytes",
+               file,
+               (int64_t)fst.st_size,
+               HUGE_PAGE_SIZE);
+        close(fd);
+        return NULL;
+    }
+
+    // fix file owner if needed
+    if (fst.st_gid != gid || fst.st_uid != uid)
+    {
+        warnf("changing file %s ownership from %d:%d to %d:%d", file, fst.st_uid, fst.st_gid, uid, gid);
+        if (fchown(fd, uid, gid) == -1)
+        {
+            errorf("Could not change file %s owner", file);
+            errorp();
+            close(fd);
+            return NULL;
+        }
+    }
+
+    // fix mode if needed. Only owner has permission to read or write
+    if (fst.st_mode & (S_IRWXG | S_IRWXO))
+    {
+        warnf("changing file %s mode from %04o to %04o", file, fst.st_mode, fperm);
+        if (fchmod(fd, fperm) == -1)
+        {
+            errorf("Could not change file %s mode", file);
+            errorp();
+            close(fd);
+            return NULL;
+        }
+    }
+
+    enum mm_huge huge;
+    if (!mm_huge_detect(fd, file, &huge))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // put back the pages a checkpoint was writing over the file
+    // when it stopped, which may make the file longer
+    struct wal_s logs[2];
+    unsigned int current;
+    uint64_t replay_from = 0;
+    if (!database_logs_open(logs, &current, file, log) ||
+        !database_redo(fd, huge, logs, current, &replay_from) || fstat(fd, &fst) == -1)
+    {
+        errorf("Could not recover file %s", file);
+        database_logs_close(logs);
+        close(fd);
+        return NULL;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (fchown(logs[i].fd, uid, gid) == -1)
+        {
+            warnf("Could not change file %s owner", logs[i].file);
+        }
+    }
+
+    // allocate at least four pages. On hugetlbfs a hole would take a
+    // huge page only when a checkpoint first writes it, when there may
+    // be none left.
+    size_t filesize = fst.st_size;
+    if (filesize < HUGE_PAGE_SIZE * 4)
+    {
+        if (fallocate(fd, 0, 0, HUGE_PAGE_SIZE * 4) == -1 &&
+            (errno != EOPNOTSUPP || ftruncate(fd, HUGE_PAGE_SIZE * 4) == -1))
+        {
+            errorf("Could not increase file %s size to %d Mb", file, (HUGE_PAGE_SIZE * 4) / 1024 / 1024);
+            errorp();
+            database_logs_close(logs);
+            close(fd);
+            return NULL;
+        }
+        filesize = HUGE_PAGE_SIZE * 4;
+    }
+
+    // reserve address space for the file to grow into, aligned to a
+    // page. Nothing is committed until the file is mapped over it.
+    size_t reserved = filesize > DATABASE_MAX_SIZE ? filesize : DATABASE_MAX_SIZE;
+    size_t reservation_size = reserved + HUGE_PAGE_SIZE;
+    void *reservation = mmap(NULL, reservation_size, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reservation == MAP_FAILED)
+    {
+        errorf("Could not reserve address space for file %s", file);
+        errorp();
+        database_logs_close(logs);
+        close(fd);
+        return NULL;
+    }
+    void *start = (void *)(((uintptr_t)reservation + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+
+    // map the file. Changes stay private until a checkpoint.
+    void *filemem = mm_map(fd, &huge, start, filesize, 0);
+    if (filemem == MAP_FAILED)
+    {
+        errorf("Could not map file %s", file);
+        errorp();
+        if (huge == MM_HUGE_TLBFS)
+        {
+            // a private mapping reserves a huge page for every page that may change
+            errorf("The huge page pool needs %llu free pages for file %s", (unsigned long long)(filesize / HUGE_PAGE_SIZE), file);
+        }
+        munmap(reservation, reservation_size);
+        database_logs_close(logs);
+        close(fd);
+        return NULL;
+    }
+
+    // the reader slots are a cache line each
+    database db = (database)aligned_alloc(64, (sizeof(struct database_s) + 63) & ~(size_t)63);
+    memset(db, 0, sizeof(struct database_s));
+    db->data = filemem;
+    db->fd = fd;
+    db->logs[0] = logs[0];
+    db->logs[1] = logs[1];
+    db->log = current;
+    size_t fnlen = strlen(file) + 1;
+    char* filenamemem = (char*) malloc(fnlen);
+    memcpy(filenamemem, file, fnlen);
+    db->file = filenamemem;
+    db->size = filesize;
+    db->reservation = reservation;
+    db->reservation_size = reservation_size;
+    db->reserved = reserved;
+    db->pages = (uint32_t)(filesize / HUGE_PAGE_SIZE);
+    db->huge = huge;
+    db->epoch = 1;
+    pthread_mutex_init(&db->write_lock, NULL);
+    pthread_mutex_init(&db->checkpoint_lock, NULL);
+    pthread_cond_init(&db->checkpoint_wake, NULL);
+    pthread_mutex_init(&db->checkpointing, NULL);
+    pthread_cond_init(&db->verify_wake, NULL);
+    db->verified = (uint64_t *)calloc(reserved / HUGE_PAGE_SIZE / 64 + 1, sizeof(uint64_t));
+    db->requested = (uint64_t *)calloc(reserved / HUGE_PAGE_SIZE / 64 + 1, sizeof(uint64_t));
+    if (!db->verified || !db->requested)
+    {
+        error("Could not allocate memory for database page checks");
+        database_close(db);
+        return NULL;
+    }
+
+    // redo the changes made since the last checkpoint, and start
+    // the next one from here
+    mm_cpu_init();
+    if (!mm_open(db) || !database_replay(db, replay_from) || !database_checkpoint(db))
+    {
+        database_close(db);
+        return NULL;
+    }
+
+    // pages are checked in the background from here on. Signals are for
+    // the listener.
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    db->verifier_running = pthread_create(&db->verifier, NULL, mm_verifier, db) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!db->verifier_running)
+    {
+        warnf("Could not start checking database file %s in the background", db->file);
+    }
+
+    unsigned long long resident = 0;
+    unsigned long long in_huge = 0;
+    mm_huge_usage(db, &resident, &in_huge);
+    infof("Mapped database file %s %s. %llu of %llu KB in memory are in huge pages",
+          file, mm_huge_name(db->huge), in_huge, resident);
+    return db;
+}
+
+int database_fd(database db)
+{
+    return db->fd;
+}
+
+static uint32_t *database_version_counter(database db, uint32_t key)
+{
+    // the same as the bucket, folded
+    return &db->versions[key % DATABASE_VERSIONS];
+}
+
+void database_reader_enter(database db, unsigned int reader)
+{
+    assert(reader < DATABASE_MAX_READERS);
+
+    // let writers know about a new reader
+    unsigned int readers = __atomic_load_n(&db->readers, __ATOMIC_ACQUIRE);
+    while (reader >= readers &&
+           !__atomic_compare_exchange_n(&db->readers, &readers, reader + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE))
+    {
+    }
+
+    // the slot must be set before anything is read
+    __atomic_store_n(&db->reader_slots[reader].epoch, __atomic_load_n(&db->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void database_reader_leave(database db, unsigned int reader)
+{
+    assert(reader < DATABASE_MAX_READERS);
+    __atomic_store_n(&db->reader_slots[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+bool database_contains(database db, const void *ptr)
+{
+    const uint8_t *p = (const uint8_t *)ptr;
+    return p >= db->data->data && p < db->data->data + db->reserved;
+}
+
+database_scratch database_scratch_create(void)
+{
+    database_scratch scratch = (database_scratch)calloc(1, sizeof(struct database_scratch_s));
+    if (!scratch || inflateInit2(&scratch->inflater, -MAX_WBITS) != Z_OK)
+    {
+        error("Could not allocate memory to inflate values");
+        free(scratch);
+        return NULL;
+    }
+    return scratch;
+}
+
+void database_scratch_free(database_scratch scratch)
+{
+    if (scratch)
+    {
+        inflateEnd(&scratch->inflater);
+        free(scratch->buffer);
+        free(scratch);
+    }
+}
+
+bool database_scratch_contains(database_scratch scratch, const void *ptr)
+{
+    const char *p = (const char *)ptr;
+    return scratch && scratch->buffer && p >= scratch->buffer && p < scratch->buffer + scratch->capacity;
+}
+
+bool database_get(database db, uint32_t key, database_scratch scratch, database_url *url, uint64_t *expires)
+{
+    const uint32_t *counter = database_version_counter(db, key);
+    for (;;)
+    {
+        uint32_t version = __atomic_load_n(counter, __ATOMIC_ACQUIRE);
+        if (version & 1)
+        {
+            // a writer is changing the bucket
+#if defined(__x86_64__)
+            _mm_pause();
+#endif
+            continue;
+        }
+
+        struct database_value *stored;
+        struct database_value copy;
+        bool found = hashtable_get(db->table, key, (void **)&stored, false);
+        if (found)
+        {
+            memcpy(&copy, stored, sizeof(copy));
+        }
+
+        // only what was read while nothing changed is any good
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(counter, __ATOMIC_RELAXED) != version)
+        {
+            continue;
+        }
+        if (found)
+        {
+            mm_check(db, mm_extent_number(db, stored) / MM_PAGE_EXTENTS);
+            mm_check(db, copy.extent / MM_PAGE_EXTENTS);
+            const char *value = (const char *)mm_extent_ptr(db, copy.extent);
+            size_t length = copy.length & ~DATABASE_LENGTH_FLAGS;
+            url->prefix = NULL;
+            url->prefix_length = 0;
+            if (copy.length & DATABASE_INTERNED)
+            {
+                uint16_t id;
+                memcpy(&id, value, sizeof(id));
+                const struct database_prefix *prefix = &database_prefixes(db)[id];
+                mm_check(db, mm_extent_number(db, prefix) / MM_PAGE_EXTENTS);
+                mm_check(db, prefix->extent / MM_PAGE_EXTENTS);
+                url->prefix = (const char *)mm_extent_ptr(db, prefix->extent);
+                url->prefix_length = prefix->length;
+                value += sizeof(id);
+                length -= sizeof(id);
+            }
+            url->suffix = value;
+            url->suffix_length = length;
+            *expires = copy.expires;
+            if ((copy.length & DATABASE_COMPRESSED) &&
+                !database_inflate(db, scratch, (const uint8_t *)value, length, url))
+            {
+                errorf("Could not inflate the value of key %u in database file %s", key, db->file);
+                found = false;
+            }
+        }
+        return found;
+    }
+}
+
+uint32_t database_version(database db, uint32_t key)
+{
+    return __atomic_load_n(database_version_counter(db, key), __ATOMIC_ACQUIRE);
+}
+
+// start changing the bucket of key. Readers of its keys wait or retry,
+// so only the publishing goes between this and database_write_end.
+static uint32_t database_write_begin(database db, uint32_t key)
+{
+    uint32_t *counter = database_version_counter(db, key);
+    uint32_t version = *counter;
+    __atomic_store_n(counter, version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return version;
+}
+
+// finish changing the bucket of key. Once the new value is in place,
+// copies of the old one are stale, and what was retired on the way can
+// go once the readers that may have seen it leave.
+static void database_write_end(database db, uint32_t key, uint32_t version)
+{
+    __atomic_store_n(database_version_counter(db, key), version + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&db->epoch, db->epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+// store a url in extents of its own, which no reader can see until a
+// value points to them. Returns NULL if there is no room, or sets the
+// size and flags for its value.
+static uint8_t *database_store_url(database db, const char *value, size_t length, size_t *size, uint32_t *flags)
+{
+    uint16_t id;
+    size_t prefix_length = database_intern(db, value, length, &id);
+    size_t head = prefix_length ? sizeof(id) : 0;
+    const char *rest = value + prefix_length;
+    size_t rest_length = length - prefix_length;
+    size_t deflated = database_deflate(db, rest, rest_length, head);
+    *size = head + (deflated ? sizeof(uint32_t) + deflated : rest_length);
+    uint8_t *url = (uint8_t *)mm_allocate(db, *size);
+    if (!url)
+    {
+        return NULL;
+    }
+
+    if (prefix_length)
+    {
+        memcpy(url, &id, sizeof(id));
+    }
+    if (deflated)
+    {
+        uint32_t inflated = (uint32_t)rest_length;
+        memcpy(url + head, &inflated, sizeof(inflated));
+        memcpy(url + head + sizeof(inflated), db->deflated, deflated);
+    }
+    else
+    {
+        memcpy(url + head, rest, rest_length);
+    }
+    *flags = (prefix_length ? DATABASE_INTERNED : 0) | (deflated ? DATABASE_COMPRESSED : 0);
+    return url;
+}
+
+// the changes to make for a key. Called with the write lock held and
+// the log appended to first. A value of NULL deletes the key, and a
+// length of 0 only changes when it expires.
+static bool database_change(database db, uint32_t key, const char *value, size_t length, uint64_t expires)
+{
+    // the url goes in first, so a value never points to nothing. It is
+    // stored before the bucket is locked, so readers of the key do not
+    // wait for it to be compressed or for the file to grow.
+    mm_reclaim(db);
+    uint8_t *url = NULL;
+    size_t size = 0;
+    uint32_t flags = 0;
+    if (value && length)
+    {
+        url = database_store_url(db, value, length, &size, &flags);
+        if (!url)
+        {
+            return false;
+        }
+    }
+
+    uint32_t version = database_write_begin(db, key);
+    bool result = false;
+    struct database_value *stored;
+    if (!value)
+    {
+        result = hashtable_get(db->table, key, (void **)&stored, false);
+        if (result)
+        {
+            mm_touch_ptr(db, stored);
+            mm_retire(db, mm_extent_ptr(db, stored->extent), stored->length & ~DATABASE_LENGTH_FLAGS);
+            hashtable_delete(db->table, key);
+        }
+    }
+    else if (length == 0)
+    {
+        result = hashtable_get(db->table, key, (void **)&stored, false);
+        if (result)
+        {
+            mm_touch_ptr(db, stored);
+            stored->expires = expires;
+        }
+    }
+    else if (hashtable_get(db->table, key, (void **)&stored, true))
+    {
+        if (stored->length)
+        {
+            mm_retire(db, mm_extent_ptr(db, stored->extent), stored->length & ~DATABASE_LENGTH_FLAGS);
+        }
+        mm_touch_ptr(db, stored);
+        stored->expires = expires;
+        stored->extent = mm_extent_number(db, url);
+        stored->length = (uint32_t)size | flags;
+        result = true;
+    }
+
+    // the root may point to a bucket that moved
+    mm_touch(db, 0);
+    database_write_end(db, key, version);
+
+    if (url && !result)
+    {
+        // no reader has seen it
+        mm_free(db, url, size);
+    }
+    return result;
+}
+
+// the log changes go in
+static struct wal_s *database_log(database db)
+{
+    return &db->logs[db->log];
+}
+
+// log a change and make it
+static bool database_write(database db, enum wal_type type, uint32_t key, const char *value, size_t length, uint64_t expires)
+{
+    pthread_mutex_lock(&db->write_lock);
+    bool result = false;
+    if (db->frozen)
+    {
+        errorf("The database file %s has been handed over and cannot be changed", db->file);
+    }
+    else if (db->replaying || wal_append(database_log(db), type, key, expires, value, (uint32_t)length))
+    {
+        result = database_change(db, key, type == WAL_DELETE ? NULL : value ? value : "", length, expires);
+    }
+    pthread_mutex_unlock(&db->write_lock);
+    return result;
+}
+
+bool database_set(database db, uint32_t key, const char *value, uint64_t expires)
+{
+    size_t length = strlen(value);
+    if (length == 0 || length > sizeof(union mm_page))
+    {
+        return false;
+    }
+    return database_write(db, WAL_SET, key, value, length, expires);
+}
+
+bool database_expire(database db, uint32_t key, uint64_t expires)
+{
+    return database_write(db, WAL_EXPIRE, key, NULL, 0, expires);
+}
+
+bool database_delete(database db, uint32_t key)
+{
+    return database_write(db, WAL_DELETE, key, NULL, 0, 0);
+}
+
+// where to start replaying the log
+struct database_replay_s
+{
+    database db;
+    // the records before this are in the file already
+    uint64_t from;
+};
+
+static bool database_replay_record(void *state, const struct wal_record *record, const void *data, uint64_t offset)
+{
+    struct database_replay_s *replay = (struct database_replay_s *)state;
+    if (offset < replay->from)
+    {
+        return true;
+    }
+
+    // a change that failed is logged all the same, and fails again
+    switch (record->type)
+    {
+    case WAL_SET:
+        database_write(replay->db, WAL_SET, record->key, (const char *)data, record->length, record->expires);
+        break;
+    case WAL_EXPIRE:
+        database_write(replay->db, WAL_EXPIRE, record->key, NULL, 0, record->expires);
+        break;
+    case WAL_DELETE:
+        database_write(replay->db, WAL_DELETE, record->key, NULL, 0, 0);
+        break;
+    }
+    return true;
+}
+
+static bool database_replay(database db, uint64_t from)
+{
+    struct database_replay_s replay = {.db = db, .from = from};
+    db->replaying = true;
+    bool result = database_logs_replay(db->logs, db->log, database_replay_record, &replay);
+    db->replaying = false;
+    db->recovered = result;
+    return result;
+}
+
+bool database_sync(database db)
+{
+    // writers wait while the log is written, but not while it is synced.
+    // Changes logged before a checkpoint moved to this log may be in the
+    // other one still.
+    pthread_mutex_lock(&db->write_lock);
+    struct wal_s *log = database_log(db);
+    struct wal_s *before = __atomic_load_n(&db->log_unsynced, __ATOMIC_ACQUIRE) ? &db->logs[db->log ^ 1] : NULL;
+    bool result = wal_write(log);
+    pthread_mutex_unlock(&db->write_lock);
+    return result && wal_sync(log) && (!before || wal_sync(before));
+}
+
+// the pages a checkpoint writes, as they were when it started
+struct mm_snapshot
+{
+    // a bit for each page
+    uint64_t *dirty;
+    uint32_t words;
+    uint32_t count;
+    // the pages in order, or NULL if they are written from the mapping
+    // with the write lock held
+    uint8_t *images;
+    // for each page, the checksum the file has for it if nobody has
+    // checked it since opening, otherwise 0
+    uint32_t *expected;
+    // the log the pages go in
+    struct wal_s *log;
+    enum mm_huge huge;
+};
+
+// the image of page, the i-th of a snapshot
+static const void *mm_snapshot_image(database db, const struct mm_snapshot *snapshot, uint32_t i, uint32_t page)
+{
+    if (snapshot->images)
+    {
+        return snapshot->images + (size_t)i * sizeof(union mm_page);
+    }
+    return &db->data[page];
+}
+
+// take the pages that changed since the last checkpoint, with their
+// checksums. Called with the write lock held. If copy is set and the
+// pages can be copied, changes from here on go in the other log, and
+// the lock can be let go while the copies are written.
+static bool mm_snapshot(database db, struct mm_snapshot *snapshot, bool copy)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->log = database_log(db);
+    snapshot->huge = db->huge;
+
+    // the changes go in the log before the pages that have them
+    if (!wal_write(snapshot->log))
+    {
+        return false;
+    }
+
+    // the checksums of the pages change the index pages too
+    uint32_t words = (db->pages + 63) / 64;
+    for (uint32_t w = 0; w < words; w++)
+    {
+        for (uint64_t bits = db->dirty[w]; bits; bits &= bits - 1)
+        {
+            mm_touch(db, mm_index_page_number(w * 64 + (uint32_t)__builtin_ctzll(bits)));
+        }
+    }
+    uint32_t count = 0;
+    for (uint32_t w = 0; w < words; w++)
+    {
+        count += (uint32_t)__builtin_popcountll(db->dirty[w]);
+    }
+
+    snapshot->words = words;
+    snapshot->count = count;
+    snapshot->dirty = (uint64_t *)malloc(words * sizeof(uint64_t));
+    snapshot->expected = (uint32_t *)calloc(count + 1, sizeof(uint32_t));
+    if (!snapshot->dirty || !snapshot->expected)
+    {
+        error("Could not allocate memory to checkpoint");
+        free(snapshot->dirty);
+        free(snapshot->expected);
+        return false;
+    }
+    memcpy(snapshot->dirty, db->dirty, words * sizeof(uint64_t));
+
+    // pages nobody has read since opening are checked before the file
+    // has them no more, against the checksums they had
+    uint32_t i = 0;
+    for (uint32_t w = 0; w < words; w++)
+    {
+        uint64_t verified = __atomic_load_n(&db->verified[w], __ATOMIC_RELAXED);
+        for (uint64_t bits = snapshot->dirty[w]; bits; bits &= bits - 1, i++)
+        {
+            uint32_t page = w * 64 + (uint32_t)__builtin_ctzll(bits);
+            if (!(verified & (1ull << (page % 64))))
+            {
+                snapshot->expected[i] = mm_record(db, page)->checksum;
+            }
+        }
+    }
+
+    // from here on the checksums are for what the file is going to have
+    __atomic_store_n(&db->checkpoints, db->checkpoints + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (uint32_t w = 0; w < words; w++)
+    {
+        for (uint64_t bits = db->dirty[w]; bits; bits &= bits - 1)
+        {
+            uint32_t page = w * 64 + (uint32_t)__builtin_ctzll(bits);
+            if (mm_checksum_offset(page) == SIZE_MAX)
+            {
+                mm_checksum(db, page);
+            }
+        }
+    }
+    for (uint32_t w = 0; w < words; w++)
+    {
+        for (uint64_t bits = db->dirty[w]; bits; bits &= bits - 1)
+        {
+            uint32_t page = w * 64 + (uint32_t)__builtin_ctzll(bits);
+            if (mm_checksum_offset(page) != SIZE_MAX)
+            {
+                mm_checksum(db, page);
+            }
+        }
+    }
+
+    // the other log is only free once the last checkpoint emptied it
+    struct wal_s *next = &db->logs[db->log ^ 1];
+    if (copy && count && next->size == 0 && next->length == 0)
+    {
+        size_t size = (size_t)count * sizeof(union mm_page);
+        void *images = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (images != MAP_FAILED && wal_start(next, snapshot->log->generation + 1))
+        {
+            snapshot->images = (uint8_t *)images;
+            i = 0;
+            for (uint32_t w = 0; w < words; w++)
+            {
+                for (uint64_t bits = snapshot->dirty[w]; bits; bits &= bits - 1, i++)
+                {
+                    uint32_t page = w * 64 + (uint32_t)__builtin_ctzll(bits);
+                    memcpy(snapshot->images + (size_t)i * sizeof(union mm_page), &db->data[page], sizeof(union mm_page));
+                }
+            }
+            db->log ^= 1;
+            __atomic_store_n(&db->log_unsynced, true, __ATOMIC_RELEASE);
+        }
+        else if (images != MAP_FAILED)
+        {
+            munmap(images, size);
+        }
+    }
+
+    // what changes from here on is for the next checkpoint
+    memset(db->dirty, 0, words * sizeof(uint64_t));
+    return true;
+}
+
+// write the pages of a snapshot over the file, copying them into its log
+// first so that the file can be put right if writing over it stops
+// halfway, then empty the log
+static bool mm_write_snapshot(database db, struct mm_snapshot *snapshot)
+{
+    uint32_t i = 0;
+    for (uint32_t w = 0; w < snapshot->words; w++)
+    {
+        for (uint64_t bits = snapshot->dirty[w]; bits; bits &= bits - 1, i++)
+        {
+            uint32_t page = w * 64 + (uint32_t)__builtin_ctzll(bits);
+            uint32_t checksum;
+            if (snapshot->expected[i] && mm_file_checksum(db, page, &checksum) && checksum != snapshot->expected[i])
+            {
+                errorf("Page %u of database file %s does not match its checksum", page, db->file);
+            }
+        }
+    }
+
+    // the changes left in the log are durable before anything else
+    struct wal_s *log = snapshot->log;
+    if (snapshot->images)
+    {
+        if (!wal_sync(log))
+        {
+            return false;
+        }
+        __atomic_store_n(&db->log_unsynced, false, __ATOMIC_RELEASE);
+    }
+
+    if (snapshot->count)
+    {
+        i = 0;
+        for (uint32_t w = 0; w < snapshot->words; w++)
+        {
+            for (uint64_t bits = snapshot->dirty[w]; bits; bits &= bits - 1, i++)
+            {
+                uint32_t page = w * 64 + (uint32_t)__builtin_ctzll(bits);
+                const void *image = mm_snapshot_image(db, snapshot, i, page);
+                if (!wal_write_page(log, page, image, sizeof(union mm_page)))
+                {
+                    return false;
+                }
+            }
+        }
+        if (!wal_append(log, WAL_CHECKPOINT, 0, 0, NULL, 0) || !wal_write(log) || !wal_sync(log))
+        {
+            return false;
+        }
+
+        i = 0;
+        for (uint32_t w = 0; w < snapshot->words; w++)
+        {
+            for (uint64_t bits = snapshot->dirty[w]; bits; bits &= bits - 1, i++)
+            {
+                uint32_t page = w * 64 + (uint32_t)__builtin_ctzll(bits);
+                const void *image = mm_snapshot_image(db, snapshot, i, page);
+                if (!mm_file_write(db->fd, snapshot->huge, image, sizeof(union mm_page), (off_t)page * HUGE_PAGE_SIZE))
+                {
+                    errorf("Could not write database file %s", db->file);
+                    errorp();
+                    return false;
+                }
+            }
+        }
+        if (fdatasync(db->fd) == -1)
+        {
+            errorf("Could not sync database file %s", db->file);
+            errorp();
+            return false;
+        }
+    }
+    return log->size == 0 || wal_truncate(log);
+}
+
+// finish a checkpoint. Called with the write lock held.
+static void mm_snapshot_done(database db, struct mm_snapshot *snapshot, bool written)
+{
+    for (uint32_t w = 0; w < snapshot->words; w++)
+    {
+        if (!written)
+        {
+            // they are still to be written
+            db->dirty[w] |= snapshot->dirty[w];
+            continue;
+        }
+
+        // the private copies of the pages that did not change again are
+        // the same as the file now. Dropping them maps the file's pages
+        // back in, and readers that get there first read the same thing
+        // from the file.
+        for (uint64_t bits = snapshot->dirty[w] & ~db->dirty[w]; bits; bits &= bits - 1)
+        {
+            uint32_t page = w * 64 + (uint32_t)__builtin_ctzll(bits);
+            madvise(&db->data[page], sizeof(union mm_page), MADV_DONTNEED);
+        }
+        // and the file matches their checksums
+        __atomic_or_fetch(&db->verified[w], snapshot->dirty[w], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&db->checkpoints, db->checkpoints + 1, __ATOMIC_RELEASE);
+
+    if (snapshot->images)
+    {
+        munmap(snapshot->images, (size_t)snapshot->count * sizeof(union mm_page));
+    }
+    free(snapshot->dirty);
+    free(snapshot->expected);
+}
+
+// write the pages changed since the last checkpoint over the file. Called
+// with the write lock held, which is let go while the pages are written
+// if unlock is set and they could be copied.
+static bool mm_checkpoint(database db, bool unlock)
+{
+    struct mm_snapshot snapshot;
+    if (!mm_snapshot(db, &snapshot, unlock))
+    {
+        return false;
+    }
+    if (snapshot.images)
+    {
+        pthread_mutex_unlock(&db->write_lock);
+    }
+    bool result = mm_write_snapshot(db, &snapshot);
+    if (snapshot.images)
+    {
+        pthread_mutex_lock(&db->write_lock);
+    }
+
+    // a checkpoint that kept the lock has every change, which leaves
+    // nothing for the other log either
+    struct wal_s *other = &db->logs[db->log ^ 1];
+    if (result && !snapshot.images && (other->size != 0 || other->length != 0))
+    {
+        result = wal_truncate(other);
+        if (result)
+        {
+            __atomic_store_n(&db->log_unsynced, false, __ATOMIC_RELEASE);
+        }
+    }
+    mm_snapshot_done(db, &snapshot, result);
+    return result;
+}
+
+bool database_checkpoint(database db)
+{
+    pthread_mutex_lock(&db->checkpointing);
+    pthread_mutex_lock(&db->write_lock);
+    bool result = db->frozen || mm_checkpoint(db, true);
+    pthread_mutex_unlock(&db->write_lock);
+    pthread_mutex_unlock(&db->checkpointing);
+    if (!result)
+    {
+        errorf("Could not checkpoint database file %s", db->file);
+    }
+    return result;
+}
+
+static void *database_checkpointer(void *arg)
+{
+    database db = (database)arg;
+    pthread_mutex_lock(&db->checkpoint_lock);
+    while (!db->stopping)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += db->checkpoint_interval;
+        pthread_cond_timedwait(&db->checkpoint_wake, &db->checkpoint_lock, &deadline);
+        if (!db->stopping)
+        {
+            pthread_mutex_unlock(&db->checkpoint_lock);
+            database_checkpoint(db);
+            unsigned long long resident;
+            unsigned long long huge;
+            if (logging_debug_enabled() && mm_huge_usage(db, &resident, &huge))
+            {
+                debugf("%llu of %llu KB of database file %s in memory are in huge pages", huge, resident, db->file);
+            }
+            pthread_mutex_lock(&db->checkpoint_lock);
+        }
+    }
+    pthread_mutex_unlock(&db->checkpoint_lock);
+    return NULL;
+}
+
+bool database_checkpoint_every(database db, unsigned int seconds)
+{
+    if (seconds == 0)
+    {
+        return true;
+    }
+    db->checkpoint_interval = seconds;
+
+    // signals are for the listener
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    db->checkpointer_running = pthread_create(&db->checkpointer, NULL, database_checkpointer, db) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!db->checkpointer_running)
+    {
+        errorf("Could not start checkpointing database file %s", db->file);
+    }
+    return db->checkpointer_running;
+}
+
+bool database_compress(database db, unsigned int threshold)
+{
+    if (threshold == 0)
+    {
+        return true;
+    }
+
+    pthread_mutex_lock(&db->write_lock);
+    uint32_t dictionary_length;
+    bool result = deflateInit2(&db->deflater, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    db->deflating = result;
+    // until there is a dictionary long urls are sampled to train one on
+    if (result && !database_dictionary(db, &dictionary_length))
+    {
+        db->samples = (char *)malloc(DATABASE_DICTIONARY_SAMPLES);
+        result = db->samples != NULL;
+    }
+    if (result)
+    {
+        db->compress_threshold = threshold;
+    }
+    pthread_mutex_unlock(&db->write_lock);
+    if (!result)
+    {
+        error("Could not allocate memory to compress values");
+    }
+    return result;
+}
+
+bool database_freeze(database db, bool frozen)
+{
+    // the other process starts from the file, which has to have every
+    // change made before this returns
+    pthread_mutex_lock(&db->checkpointing);
+    pthread_mutex_lock(&db->write_lock);
+    bool result = db->frozen || !frozen || mm_checkpoint(db, false);
+    if (result)
+    {
+        db->frozen = frozen;
+    }
+    pthread_mutex_unlock(&db->write_lock);
+    pthread_mutex_unlock(&db->checkpointing);
+    return result;
+}
+
+static void *database_scrub_pages(void *arg)
+{
+    database db = (database)arg;
+    uint32_t pages = (uint32_t)(__atomic_load_n(&db->size, __ATOMIC_ACQUIRE) / HUGE_PAGE_SIZE);
+    for (;;)
+    {
+        uint32_t page = __atomic_fetch_add(&db->scrub_next, 1, __ATOMIC_RELAXED);
+        if (page >= pages)
+        {
+            break;
+        }
+        while (!mm_verified(db, page) && !__atomic_load_n(&db->stopping, __ATOMIC_RELAXED))
+        {
+            enum mm_verdict verdict = mm_verify(db, page);
+            if (verdict == MM_CORRUPT)
+            {
+                __atomic_add_fetch(&db->scrub_corrupt, 1, __ATOMIC_RELAXED);
+            }
+            else if (verdict == MM_UNCHECKED)
+            {
+                // wait for the checkpoint
+                struct timespec pause = {.tv_nsec = 1000000};
+                nanosleep(&pause, NULL);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *database_scrubber(void *arg)
+{
+    database db = (database)arg;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int count = ncpu > 0 ? (unsigned int)ncpu : 1;
+    pthread_t *threads = (pthread_t *)calloc(count, sizeof(pthread_t));
+    unsigned int started = 0;
+    while (threads && started < count && pthread_create(&threads[started], NULL, database_scrub_pages, db) == 0)
+    {
+        started++;
+    }
+    if (started == 0)
+    {
+        database_scrub_pages(db);
+    }
+    for (unsigned int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    uint32_t corrupt = __atomic_load_n(&db->scrub_corrupt, __ATOMIC_RELAXED);
+    if (corrupt)
+    {
+        errorf("Scrubbed database file %s, %u page(s) do not match their checksums", db->file, corrupt);
+    }
+    else if (!__atomic_load_n(&db->stopping, __ATOMIC_RELAXED))
+    {
+        infof("Scrubbed database file %s, every page matches its checksum", db->file);
+    }
+    return NULL;
+}
+
+bool database_scrub(database db)
+{
+    // signals are for the listener
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    db->scrubber_running = pthread_create(&db->scrubber, NULL, database_scrubber, db) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!db->scrubber_running)
+    {
+        errorf("Could not start scrubbing database file %s", db->file);
+    }
+    return db->scrubber_running;
+}
+
+void database_close(database db)
+{
+    if (db)
+    {
+        if (db->checkpointer_running || db->scrubber_running || db->verifier_running)
+        {
+            pthread_mutex_lock(&db->checkpoint_lock);
+            __atomic_store_n(&db->stopping, true, __ATOMIC_RELAXED);
+            pthread_cond_signal(&db->checkpoint_wake);
+            pthread_cond_signal(&db->verify_wake);
+            pthread_mutex_unlock(&db->checkpoint_lock);
+        }
+        if (db->checkpointer_running)
+        {
+            pthread_join(db->checkpointer, NULL);
+            db->checkpointer_running = false;
+        }
+        if (db->scrubber_running)
+        {
+            pthread_join(db->scrubber, NULL);
+            db->scrubber_running = false;
+        }
+        if (db->verifier_running)
+        {
+            pthread_join(db->verifier, NULL);
+            db->verifier_running = false;
+        }
+
+        // nobody is reading any more
+        if (db->data)
+        {
+            db->readers = 0;
+            mm_reclaim(db);
+        }
+        free(db->retired);
+        db->retired = NULL;
+
+        // leave nothing to replay, unless the file is someone else's now
+        // or the log has not been replayed yet
+        if (db->recovered)
+        {
+            database_checkpoint(db);
+        }
+
+        // the table lives in the file, only the object goes
+        if (db->table)
+        {
+            hashtable_detach(db->table);
+            db->table = NULL;
+        }
+        if (db->reservation)
+        {
+            munmap(db->reservation, db->reservation_size);
+        }
+        free(db->no_fit);
+        db->no_fit = NULL;
+        free(db->dirty);
+        db->dirty = NULL;
+        for (unsigned int c = 0; c < MM_RUN_CLASSES; c++)
+        {
+            free(db->candidates[c]);
+            db->candidates[c] = NULL;
+        }
+        free(db->verified);
+        db->verified = NULL;
+        free(db->requested);
+        db->requested = NULL;
+        free(db->prefix_index);
+        db->prefix_index = NULL;
+        free(db->prefix_seen);
+        db->prefix_seen = NULL;
+        if (db->deflating)
+        {
+            deflateEnd(&db->deflater);
+            db->deflating = false;
+        }
+        free(db->deflated);
+        db->deflated = NULL;
+        free(db->samples);
+        db->samples = NULL;
+        database_logs_close(db->logs);
+        if (db->fd > 0)
+        {
+            close(db->fd);
+            db->fd = -1;
+        }
+        if (db->file)
+        {
+            free((char*)db->file);
+            db->file = NULL;
+        }
+        pthread_mutex_destroy(&db->checkpoint_lock);
+        pthread_cond_destroy(&db->checkpoint_wake);
+        pthread_mutex_destroy(&db->checkpointing);
+        pthread_cond_destroy(&db->verify_wake);
+        db->size = 0;
+        db->data = NULL;
+        free(db);
+    }
+}
@@ -1,19 +1,112 @@
 #pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
 
 #include <sys/types.h>
 
 typedef struct database_s* database;
 
-// open or create the database 
-database database_open(const char *file, bool create, gid_t gid, uid_t uid);
+// open or create the database, with its log at log or, if that is NULL,
+// next to it
+database database_open(const char *file, const char *log, bool create, gid_t gid, uid_t uid);
 
-// get a value from the database
-bool database_get(database db, uint32_t key, const char** value, uint64_t* expires);
+// use a database file that is already open and locked, like one
+// handed over by the process being upgraded. Takes ownership of fd.
+database database_adopt(int fd, const char *file, const char *log, gid_t gid, uid_t uid);
+
+// the fd of the open database file
+int database_fd(database db);
+
+// the most threads that may read the database at once
+#define DATABASE_MAX_READERS 256
+
+// Reading takes no locks, so a reader has to say when it may be holding
+// pointers into the database. Call database_reader_enter with a number
+// below DATABASE_MAX_READERS that no other thread uses before getting
+// values, and database_reader_leave once nothing got since is in use,
+// like before waiting for events. Memory that changes free is not reused
+// until every reader inside has left.
+void database_reader_enter(database db, unsigned int reader);
+void database_reader_leave(database db, unsigned int reader);
+
+// whether ptr points into the database, where it may be reused once
+// the reader leaves
+bool database_contains(database db, const void *ptr);
+
+// a value as it is stored: a prefix it shares with other values, which
+// may be empty, and the rest of it
+typedef struct
+{
+    const char *prefix;
+    size_t prefix_length;
+    const char *suffix;
+    size_t suffix_length;
+} database_url;
+
+static inline size_t database_url_length(const database_url *url)
+{
+    return url->prefix_length + url->suffix_length;
+}
+
+// room for a reader to inflate compressed values into. Each reader
+// thread needs its own.
+typedef struct database_scratch_s* database_scratch;
+
+database_scratch database_scratch_create(void);
+void database_scratch_free(database_scratch scratch);
+
+// whether ptr points into scratch, where it is overwritten by the next get
+bool database_scratch_contains(database_scratch scratch, const void *ptr);
+
+// get a value from the database. Both pieces of url point straight into
+// the database, unless the value is compressed, when the suffix is
+// inflated into scratch and good until the next get with it. Between
+// database_reader_enter and database_reader_leave only.
+bool database_get(database db, uint32_t key, database_scratch scratch, database_url *url, uint64_t* expires);
+
+// a number that changes whenever the value of key is set. Keys share
+// counters, so it may also change when another key is set. It is odd
+// while a change is in progress. Read it before getting the value to
+// tell later whether a copy is stale.
+uint32_t database_version(database db, uint32_t key);
 
 // set a value in the database
 bool database_set(database db, uint32_t key, const char* value, uint64_t expires);
 
+// change when the value of a key expires. Returns false if there is none.
+bool database_expire(database db, uint32_t key, uint64_t expires);
+
+// remove a value from the database
+bool database_delete(database db, uint32_t key);
+
+// make every change so far durable by writing and syncing the log. One
+// call covers any number of changes, so writers share it rather than
+// syncing each change.
+bool database_sync(database db);
+
+// write the pages changed since the last checkpoint to the file and
+// empty the log
+bool database_checkpoint(database db);
+
+// checkpoint every so many seconds in the background. 0 leaves
+// checkpoints to database_close.
+bool database_checkpoint_every(database db, unsigned int seconds);
+
+// store values at least threshold bytes long, not counting a shared
+// prefix, compressed where that makes them smaller. 0 stores them as
+// they are.
+bool database_compress(database db, unsigned int threshold);
+
+// check every page of the file against its checksum in the background,
+// on all cores. Pages are otherwise checked by a thread of their own
+// the first time they are read, without the reader waiting for it.
+bool database_scrub(database db);
+
+// checkpoint and stop changing the file, before another process takes
+// it over. Changes fail from then on. Unfreezing lets them through again
+// if the other process did not take over after all.
+bool database_freeze(database db, bool frozen);
+
 // close the database
 void database_close(database db);
\ No newline at end of file
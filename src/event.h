@@ -0,0 +1,41 @@
+#pragma once
+#include <stdbool.h>
+
+struct worker_s;
+struct connection_s;
+
+// An event backend drives a worker: it accepts connections on the
+// worker's listen sockets, feeds received data to the connections and
+// writes their responses. The backend is picked at startup.
+struct event_backend_s
+{
+    // the name used to select the backend in configuration
+    const char *name;
+
+    // set up the backend for a worker whose listen sockets are open.
+    // On failure everything that was set up is released again.
+    bool (*open)(struct worker_s *worker);
+
+    // run the event loop until the listener stops
+    bool (*run)(struct worker_s *worker);
+
+    // write the responses gathered on a connection
+    bool (*flush)(struct connection_s *conn);
+
+    // send the output a connection held while its changes to the
+    // database were made durable, and carry on. If keep is false they
+    // could not be, and the connection is closed without sending it.
+    void (*resume)(struct connection_s *conn, bool keep);
+
+    // release the backend
+    void (*close)(struct worker_s *worker);
+};
+
+// readiness based backend using epoll and nonblocking sockets
+extern const struct event_backend_s event_backend_epoll;
+
+// completion based backend using io_uring
+extern const struct event_backend_s event_backend_uring;
+
+// find a backend by name. Returns NULL if there is no such backend.
+const struct event_backend_s *event_backend_find(const char *name);
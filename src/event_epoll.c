@@ -0,0 +1,388 @@
+#define _GNU_SOURCE
+#include "event.h"
+#include "worker.h"
+#include "connection.h"
+#include "logging.h"
+#include "tls.h"
+#include "batch.h"
+#include "commit.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define MAX_EVENTS 128
+
+// fds are registered in the low 32 bits of the data, and client sockets
+// with the generation of their record above
+static uint64_t epoll_connection_data(const struct connection_s *conn)
+{
+    return (uint64_t)conn->generation << 32 | (uint32_t)conn->fd;
+}
+
+static int epoll_data_fd(epoll_data_t data)
+{
+    return (int)(uint32_t)data.u64;
+}
+
+static void epoll_close(struct worker_s *worker)
+{
+    // stop epolling
+    if (worker->epollfd != -1)
+    {
+        close(worker->epollfd);
+        worker->epollfd = -1;
+    }
+}
+
+static bool epoll_open(struct worker_s *worker)
+{
+    // create epoll structure
+    worker->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (worker->epollfd == -1)
+    {
+        error("Could not create epoll structure");
+        critical_errorp();
+        return false;
+    }
+
+    // attach the listening sockets to epoll
+    struct epoll_event evt = {
+        .events = EPOLLIN,
+        .data = {
+            .u64 = (uint32_t)worker->listen_socket_http,
+        }};
+    if (epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->listen_socket_http, &evt) == -1)
+    {
+        error("Could not register listening socket with epoll");
+        critical_errorp();
+        epoll_close(worker);
+        return false;
+    }
+    evt.data.u64 = (uint32_t)worker->timers.fd;
+    if (epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->timers.fd, &evt) == -1)
+    {
+        error("Could not register timer with epoll");
+        critical_errorp();
+        epoll_close(worker);
+        return false;
+    }
+    evt.data.u64 = (uint32_t)worker->wakefd;
+    if (epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->wakefd, &evt) == -1)
+    {
+        error("Could not register eventfd with epoll");
+        critical_errorp();
+        epoll_close(worker);
+        return false;
+    }
+    if (worker->listen_socket_https != -1)
+    {
+        evt.data.u64 = (uint32_t)worker->listen_socket_https;
+        if (epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->listen_socket_https, &evt) == -1)
+        {
+            error("Could not register listening socket with epoll");
+            critical_errorp();
+            epoll_close(worker);
+            return false;
+        }
+    }
+    if (worker->listen_socket_batch != -1)
+    {
+        // every worker polls the same socket, so only one is woken
+        evt.events = EPOLLIN | EPOLLEXCLUSIVE;
+        evt.data.u64 = (uint32_t)worker->listen_socket_batch;
+        if (epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->listen_socket_batch, &evt) == -1)
+        {
+            error("Could not register batch socket with epoll");
+            critical_errorp();
+            epoll_close(worker);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// poll for events for a client socket
+static bool epoll_add_connection(struct worker_s *worker, struct connection_s *conn)
+{
+    struct epoll_event evt = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR | EPOLLRDHUP | EPOLLPRI | EPOLLET,
+        .data = {
+            .u64 = epoll_connection_data(conn),
+        }};
+    return epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, conn->fd, &evt) != -1;
+}
+
+// accept every connection waiting on a listen socket. Accepted sockets
+// inherit TCP_NODELAY and the other options from the listen socket.
+static void epoll_accept(struct worker_s *worker, int listen_socket)
+{
+    bool secure = listen_socket == worker->listen_socket_https;
+    bool batch = listen_socket == worker->listen_socket_batch;
+    for (;;)
+    {
+        struct sockaddr_in address = {0};
+        socklen_t address_length = sizeof(address);
+        int connection = accept4(listen_socket, (struct sockaddr *)&address, &address_length,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connection == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                warn("could not accept incoming connection");
+                warnp();
+            }
+            return;
+        }
+
+        struct connection_s *conn = worker_connection_open(worker, connection,
+                                                           batch ? 0 : address.sin_addr.s_addr);
+        if (!conn)
+        {
+            close(connection);
+        }
+        else if ((secure && !tls_accept(conn)) || (batch && !batch_open(conn)))
+        {
+            worker_connection_close(worker, conn);
+        }
+        else if (epoll_add_connection(worker, conn))
+        {
+            // TODO: log connection info
+            debug("connection accepted");
+            connection_update_timeout(conn);
+        }
+        else
+        {
+            warn("Could not register new socket with epoll");
+            warnp();
+            worker_connection_close(worker, conn);
+        }
+    }
+}
+
+// stop accepting and close the connections that are not in the middle of anything
+static void epoll_drain(struct worker_s *worker)
+{
+    worker_drain(worker);
+    if (!worker->draining)
+    {
+        return;
+    }
+
+    // the process taking over has the same listen sockets open, and the
+    // other workers the same batch socket, which would keep them in this
+    // worker's set after they are closed here. The batch socket would
+    // still take its turn at the exclusive wakeups.
+    int listen_sockets[] = {worker->listen_socket_http, worker->listen_socket_https, worker->listen_socket_batch};
+    for (size_t i = 0; i < sizeof(listen_sockets) / sizeof(listen_sockets[0]); i++)
+    {
+        if (listen_sockets[i] != -1 && epoll_ctl(worker->epollfd, EPOLL_CTL_DEL, listen_sockets[i], NULL) == -1)
+        {
+            warn("Could not stop polling a listen socket");
+            warnp();
+        }
+    }
+    worker_close_listen_sockets(worker);
+
+    struct connection_s *next;
+    for (struct connection_s *conn = worker->live; conn; conn = next)
+    {
+        next = conn->next;
+        if (connection_idle(conn))
+        {
+            worker_connection_close(worker, conn);
+        }
+    }
+}
+
+static void epoll_expire(struct timer_s *timer, void *arg)
+{
+    struct worker_s *worker = (struct worker_s *)arg;
+    if (timer == &worker->drain_timer)
+    {
+        warn("Closing connections that did not finish in time");
+        while (worker->live)
+        {
+            worker_connection_close(worker, worker->live);
+        }
+        return;
+    }
+
+    struct connection_s *conn = connection_from_timer(timer);
+    debugf("connection timed out (%d)", conn->timeout);
+    worker_connection_close(worker, conn);
+}
+
+// send what a connection held for the commit
+static void epoll_resume(struct connection_s *conn, bool keep)
+{
+    if (keep)
+    {
+        keep = connection_write(conn);
+    }
+    if (keep)
+    {
+        connection_update_timeout(conn);
+    }
+    else
+    {
+        worker_connection_close(conn->worker, conn);
+    }
+}
+
+static bool epoll_run(struct worker_s *worker)
+{
+    int epollfd = worker->epollfd;
+
+    // "poll" for events
+    struct epoll_event events[MAX_EVENTS];
+    while (worker_running(worker))
+    {
+        // wake up in time for changes waiting on the commit window
+        struct timespec timeout;
+        bool waiting = commit_pending(&worker->commit);
+        if (waiting)
+        {
+            uint64_t delay = commit_delay(&worker->commit);
+            timeout.tv_sec = (time_t)(delay / 1000000);
+            timeout.tv_nsec = (long)(delay % 1000000) * 1000;
+        }
+        // nothing read from the database is in use while waiting
+        database_reader_leave(worker->db, worker->id);
+        int nfds = epoll_pwait2(epollfd, events, MAX_EVENTS, waiting ? &timeout : NULL, NULL);
+        database_reader_enter(worker->db, worker->id);
+        if (nfds == -1 && errno != EINTR)
+        {
+            error("Could not wait for events");
+            errorp();
+            return false;
+        }
+        debugf("got %d events", nfds);
+
+        for (int i = 0; i < nfds; i++)
+        {
+            struct epoll_event *evt = &events[i];
+            int fd = epoll_data_fd(evt->data);
+            // check if this is an accept. The listen sockets
+            // are closed once the worker starts draining.
+            if (fd == worker->listen_socket_http || fd == worker->listen_socket_https ||
+                fd == worker->listen_socket_batch)
+            {
+                epoll_accept(worker, fd);
+            }
+            else if (fd == worker->wakefd)
+            {
+                epoll_drain(worker);
+            }
+            else if (fd == worker->timers.fd)
+            {
+                // close the connections that have timed out
+                uint64_t expirations;
+                if (read(worker->timers.fd, &expirations, sizeof(expirations)) > 0)
+                {
+                    timer_wheel_advance(&worker->timers, epoll_expire, worker);
+                }
+            }
+            else
+            {
+                // otherwise this is data or something to do
+                // with a client connection. The record may have
+                // been closed earlier in this batch, and even
+                // reused for a socket accepted since, possibly by
+                // another worker that is writing it right now. Only
+                // the owner is read until it turns out to be us.
+                struct connection_s *conn = &worker->connections[fd];
+                if (__atomic_load_n(&conn->worker, __ATOMIC_ACQUIRE) != worker ||
+                    epoll_connection_data(conn) != evt->data.u64)
+                {
+                    continue;
+                }
+
+                bool keep = true;
+                if (evt->events & EPOLLIN)
+                {
+                    // data is ready to be read
+                    keep = connection_read(conn);
+                }
+                if (keep && (evt->events & EPOLLOUT))
+                {
+                    // the socket is ready for sending now
+                    keep = connection_write(conn);
+                }
+                if (keep && (evt->events & EPOLLRDHUP))
+                {
+                    // finish sending what is queued, then close
+                    debug("Socket remote hangup");
+                    conn->close_after_write = true;
+                    keep = conn->outq_length != 0;
+                }
+                if (keep && (evt->events & EPOLLHUP))
+                {
+                    debug("Socket hangup");
+                    keep = false;
+                }
+                if (keep && (evt->events & EPOLLERR))
+                {
+                    debug("Socket error");
+                    keep = false;
+                }
+                if (keep && (evt->events & EPOLLPRI))
+                {
+                    debug("Socket exceptional condition");
+                    keep = false;
+                }
+
+                if (keep)
+                {
+                    connection_update_timeout(conn);
+                }
+                else
+                {
+                    worker_connection_close(worker, conn);
+                }
+            }
+        }
+
+        // one sync for the changes made by this batch of events
+        commit_run(worker);
+    }
+
+    return true;
+}
+
+const struct event_backend_s event_backend_epoll = {
+    .name = "epoll",
+    .open = epoll_open,
+    .run = epoll_run,
+    .flush = connection_flush,
+    .resume = epoll_resume,
+    .close = epoll_close,
+};
+
+const struct event_backend_s *event_backend_find(const char *name)
+{
+    static const struct event_backend_s *const backends[] = {
+        &event_backend_epoll,
+        &event_backend_uring,
+    };
+
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+    {
+        if (strcmp(backends[i]->name, name) == 0)
+        {
+            return backends[i];
+        }
+    }
+    return NULL;
+}
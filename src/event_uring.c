@@ -0,0 +1,1146 @@
+#include "event.h"
+#include "worker.h"
+#include "connection.h"
+#include "logging.h"
+#include "batch.h"
+#include "commit.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+
+// The io_uring backend. Each worker gets its own ring. Listen sockets
+// use multishot accept and connections use multishot receive into a
+// ring of provided buffers, so a steady connection costs no syscalls
+// beyond the single io_uring_enter per loop iteration. A connection is
+// only closed once nothing in flight refers to it, so its fd (and with
+// it the connection record) cannot be reused early.
+
+#define URING_ENTRIES 1024
+
+// receive buffers shared by all the connections of a worker
+#define URING_BUFFERS 512
+#define URING_BUFFER_SIZE CONNECTION_BUFFER_SIZE
+#define URING_BUFFER_GROUP 0
+
+// the most received data held back for a client that does
+// not read its responses before it is disconnected
+#define URING_MAX_BACKLOG (1024 * 1024)
+
+// user_data is a connection pointer (or listen fd) with the
+// operation in the low bits
+enum uring_op
+{
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV = 2,
+    URING_OP_SEND = 3,
+    URING_OP_CANCEL = 4,
+    URING_OP_TIMER = 5,
+    URING_OP_WAKE = 6,
+    URING_OP_COMMIT = 7,
+};
+#define URING_OP_BITS 3
+#define URING_OP_MASK ((1 << URING_OP_BITS) - 1)
+
+_Static_assert(_Alignof(struct connection_s) >= (1 << URING_OP_BITS), "connections must be aligned to fit the op");
+
+struct uring_s
+{
+    int fd;
+
+    // submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    // entries filled in locally but not yet handed to the kernel
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+
+    // completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // mappings
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // provided receive buffers
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;
+    unsigned short buf_tail;
+
+    // a timeout that wakes the loop once the commit window has passed
+    struct __kernel_timespec commit_timeout;
+    bool commit_armed;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint64_t tag(const void *ptr, enum uring_op op)
+{
+    return (uint64_t)(uintptr_t)ptr | op;
+}
+
+// hand everything queued to the kernel and optionally wait for a completion
+static bool uring_submit(struct uring_s *ring, bool wait)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    int ret = sys_io_uring_enter(ring->fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+    if (ret == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+    {
+        error("Could not submit to io_uring");
+        errorp();
+        return false;
+    }
+    return true;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring_s *ring)
+{
+    // make room if the queue is full
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        uring_submit(ring, false);
+        if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+        {
+            warn("io_uring submission queue is full");
+            return NULL;
+        }
+    }
+
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+// give a receive buffer back to the kernel
+static void uring_return_buffer(struct uring_s *ring, int bid)
+{
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = (unsigned short)bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static bool uring_arm_accept(struct uring_s *ring, int listen_socket)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe)
+    {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = ((uint64_t)listen_socket << URING_OP_BITS) | URING_OP_ACCEPT;
+    return true;
+}
+
+static bool uring_arm_recv(struct uring_s *ring, struct connection_s *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe)
+    {
+        return false;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = tag(conn, URING_OP_RECV);
+    conn->recv_armed = true;
+    return true;
+}
+
+// wait for the timer or eventfd to become readable.
+// The poll keeps firing every time they do.
+static bool uring_arm_poll(struct uring_s *ring, int fd, enum uring_op op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe)
+    {
+        return false;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = tag(NULL, op);
+    return true;
+}
+
+static void uring_cancel(struct uring_s *ring, struct connection_s *conn, enum uring_op op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe)
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = tag(conn, op);
+        sqe->user_data = tag(NULL, URING_OP_CANCEL);
+    }
+}
+
+// close a connection once nothing in flight refers to it
+static void uring_release_if_done(struct connection_s *conn)
+{
+    if (conn->closing && !conn->recv_armed && !conn->send_inflight)
+    {
+        worker_connection_close(conn->worker, conn);
+    }
+}
+
+static void uring_close_connection(struct uring_s *ring, struct connection_s *conn)
+{
+    if (!conn->closing)
+    {
+        conn->closing = true;
+        timer_cancel(&conn->worker->timers, &conn->timer);
+        if (conn->recv_armed)
+        {
+            uring_cancel(ring, conn, URING_OP_RECV);
+        }
+        // a send to a client that stopped reading never finishes
+        if (conn->send_inflight)
+        {
+            uring_cancel(ring, conn, URING_OP_SEND);
+        }
+        uring_release_if_done(conn);
+    }
+}
+
+static bool uring_submit_send(struct uring_s *ring, struct connection_s *conn, size_t length)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe)
+    {
+        return false;
+    }
+
+    conn->send_msg = (struct msghdr){
+        .msg_iov = conn->send_iov,
+        .msg_iovlen = conn->send_iovcnt,
+    };
+    conn->send_length = length;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&conn->send_msg;
+    sqe->len = 1;
+    // the kernel keeps going until everything is sent
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = tag(conn, URING_OP_SEND);
+    conn->send_inflight = true;
+    return true;
+}
+
+// send whatever is queued on the connection
+static bool uring_send_queued(struct uring_s *ring, struct connection_s *conn)
+{
+    if (conn->send_inflight || conn->outq_offset == conn->outq_length)
+    {
+        return true;
+    }
+
+    // the buffer must not move while the kernel reads it
+    conn->outq_pinned = conn->outq;
+    conn->send_iov[0].iov_base = conn->outq + conn->outq_offset;
+    conn->send_iov[0].iov_len = conn->outq_length - conn->outq_offset;
+    conn->send_iovcnt = 1;
+    return uring_submit_send(ring, conn, conn->send_iov[0].iov_len);
+}
+
+static bool uring_flush(struct connection_s *conn)
+{
+    struct uring_s *ring = (struct uring_s *)conn->worker->backend_state;
+    if (conn->iovcnt == 0)
+    {
+        return true;
+    }
+
+    // if something is being sent, everything goes behind it. Nothing
+    // goes out until the connection's changes are durable.
+    if (conn->send_inflight || conn->outq_offset != conn->outq_length || conn->commit_waiting)
+    {
+        return connection_hold(conn);
+    }
+
+    // the kernel may still be reading after the worker leaves the
+    // database, when links in it may be reused, or inflates the next
+    // link over one, so those are copied
+    for (int i = 0; i < conn->iovcnt; i++)
+    {
+        if (database_contains(conn->worker->db, conn->iov[i].iov_base) ||
+            database_scratch_contains(conn->worker->scratch, conn->iov[i].iov_base))
+        {
+            return connection_hold(conn) && uring_send_queued(ring, conn);
+        }
+    }
+
+    size_t length = 0;
+    for (int i = 0; i < conn->iovcnt; i++)
+    {
+        conn->send_iov[i] = conn->iov[i];
+        length += conn->iov[i].iov_len;
+    }
+    conn->send_iovcnt = conn->iovcnt;
+    conn->iovcnt = 0;
+    if (!uring_submit_send(ring, conn, length))
+    {
+        return false;
+    }
+
+    // cached responses must not be replaced while the kernel reads them
+    for (int i = 0; i < conn->send_iovcnt; i++)
+    {
+        cache_hold(&conn->worker->cache, conn->send_iov[i].iov_base);
+    }
+    return true;
+}
+
+// feed received data to the connection, returning how much it took
+static bool uring_consume(struct connection_s *conn, const char *data, size_t length, size_t *used)
+{
+    size_t offset = 0;
+    bool result = true;
+    while (result && offset < length && connection_can_process(conn))
+    {
+        size_t amt = CONNECTION_BUFFER_SIZE - conn->length;
+        if (amt > length - offset)
+        {
+            amt = length - offset;
+        }
+        memcpy(conn->buffer + conn->length, data + offset, amt);
+        conn->length += amt;
+        offset += amt;
+        result = connection_process(conn);
+    }
+    *used = offset;
+    return result;
+}
+
+// flush responses and decide what happens to the connection next
+static void uring_settle(struct uring_s *ring, struct connection_s *conn, bool keep)
+{
+    if (keep)
+    {
+        keep = uring_flush(conn);
+    }
+    if (conn->closing)
+    {
+        return;
+    }
+    if (keep && conn->close_after_write && !conn->send_inflight && conn->outq_offset == conn->outq_length)
+    {
+        keep = false;
+    }
+    if (keep && !conn->recv_armed && conn->backlog_length == 0 && !conn->close_after_write)
+    {
+        keep = uring_arm_recv(ring, conn);
+    }
+    if (keep)
+    {
+        connection_update_timeout(conn);
+    }
+    else
+    {
+        uring_close_connection(ring, conn);
+    }
+}
+
+// hold on to received data the connection cannot take yet
+static bool uring_hold_back(struct connection_s *conn, const char *data, size_t length)
+{
+    if (conn->backlog_length + length > URING_MAX_BACKLOG)
+    {
+        debug("client is not reading its responses");
+        return false;
+    }
+
+    char *backlog = (char *)realloc(conn->backlog, conn->backlog_length + length);
+    if (!backlog)
+    {
+        warn("Could not allocate memory for received data");
+        return false;
+    }
+    memcpy(backlog + conn->backlog_length, data, length);
+    conn->backlog = backlog;
+    conn->backlog_length += length;
+    return true;
+}
+
+// carry on with received data that was held back
+static void uring_resume(struct uring_s *ring, struct connection_s *conn)
+{
+    bool keep = true;
+    if (conn->backlog_length)
+    {
+        size_t used;
+        keep = uring_consume(conn,
+                             conn->backlog + conn->backlog_offset,
+                             conn->backlog_length - conn->backlog_offset,
+                             &used);
+        conn->backlog_offset += used;
+        if (conn->backlog_offset == conn->backlog_length || conn->close_after_write)
+        {
+            free(conn->backlog);
+            conn->backlog = NULL;
+            conn->backlog_offset = conn->backlog_length = 0;
+            conn->close_after_write = conn->close_after_write || conn->backlog_eof;
+        }
+    }
+    else
+    {
+        keep = connection_process(conn);
+    }
+    uring_settle(ring, conn, keep);
+}
+
+static void uring_handle_accept(struct worker_s *worker, struct uring_s *ring, struct io_uring_cqe *cqe)
+{
+    int listen_socket = (int)(cqe->user_data >> URING_OP_BITS);
+    if (cqe->res >= 0)
+    {
+        // TCP_NODELAY is inherited from the listen socket. Multishot
+        // accept has nowhere to put each address, so it is only looked
+        // up when it is needed.
+        int fd = cqe->res;
+        bool batch = listen_socket == worker->listen_socket_batch;
+        struct sockaddr_in address = {0};
+        if (ratelimit_enabled(&worker->ratelimit) && !batch)
+        {
+            socklen_t address_length = sizeof(address);
+            getpeername(fd, (struct sockaddr *)&address, &address_length);
+        }
+        struct connection_s *conn = worker_connection_open(worker, fd, address.sin_addr.s_addr);
+        if (!conn)
+        {
+            close(fd);
+        }
+        else if ((batch && !batch_open(conn)) || !uring_arm_recv(ring, conn))
+        {
+            worker_connection_close(worker, conn);
+        }
+        else
+        {
+            debug("connection accepted");
+            connection_update_timeout(conn);
+        }
+    }
+    else if (cqe->res != -ECANCELED)
+    {
+        errno = -cqe->res;
+        warn("could not accept incoming connection");
+        warnp();
+    }
+
+    // the kernel stopped accepting for us
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !worker->draining)
+    {
+        uring_arm_accept(ring, listen_socket);
+    }
+}
+
+static void uring_handle_recv(struct uring_s *ring, struct connection_s *conn, struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        conn->recv_armed = false;
+    }
+    int bid = (cqe->flags & IORING_CQE_F_BUFFER) ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+
+    if (conn->closing)
+    {
+        if (bid != -1)
+        {
+            uring_return_buffer(ring, bid);
+        }
+        uring_release_if_done(conn);
+        return;
+    }
+
+    bool keep = true;
+    if (cqe->res > 0 && bid != -1)
+    {
+        const char *data = ring->buffers + (size_t)bid * URING_BUFFER_SIZE;
+        conn->stats.bytes_read += cqe->res;
+        if (conn->backlog_length)
+        {
+            // receiving was already stopped but this was on its way
+            keep = uring_hold_back(conn, data, cqe->res);
+        }
+        else
+        {
+            size_t used;
+            keep = uring_consume(conn, data, cqe->res, &used);
+            if (keep && used < (size_t)cqe->res && !conn->close_after_write)
+            {
+                // the client is not reading its responses. Hold on to the
+                // rest and stop receiving until it catches up.
+                keep = uring_hold_back(conn, data + used, cqe->res - used);
+                if (keep && conn->recv_armed)
+                {
+                    uring_cancel(ring, conn, URING_OP_RECV);
+                }
+            }
+        }
+        uring_return_buffer(ring, bid);
+    }
+    else if (cqe->res == 0)
+    {
+        // remote will not send anything more. If data is held
+        // back this takes effect once it has been handled.
+        if (conn->backlog_length)
+        {
+            conn->backlog_eof = true;
+        }
+        else
+        {
+            conn->close_after_write = true;
+        }
+    }
+    else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+    {
+        debug("Socket read error");
+        keep = false;
+    }
+
+    uring_settle(ring, conn, keep);
+}
+
+static void uring_handle_send(struct uring_s *ring, struct connection_s *conn, struct io_uring_cqe *cqe)
+{
+    conn->send_inflight = false;
+
+    // a send from the output queue is done with its buffer
+    bool from_outq = conn->outq_pinned != NULL;
+    if (from_outq)
+    {
+        connection_unpin_queue(conn);
+    }
+    else
+    {
+        for (int i = 0; i < conn->send_iovcnt; i++)
+        {
+            cache_release(&conn->worker->cache, conn->send_iov[i].iov_base);
+        }
+    }
+
+    if (conn->closing)
+    {
+        uring_release_if_done(conn);
+        return;
+    }
+
+    if (cqe->res < 0 || (size_t)cqe->res != conn->send_length)
+    {
+        debug("Socket write error");
+        uring_close_connection(ring, conn);
+        return;
+    }
+
+    conn->stats.bytes_written += cqe->res;
+    if (from_outq)
+    {
+        conn->outq_offset += cqe->res;
+        if (conn->outq_offset == conn->outq_length)
+        {
+            conn->outq_offset = conn->outq_length = 0;
+        }
+    }
+
+    // send anything that was queued in the mean time
+    // or pick up where reading stopped
+    if (conn->outq_offset != conn->outq_length)
+    {
+        if (conn->commit_waiting || uring_send_queued(ring, conn))
+        {
+            connection_update_timeout(conn);
+        }
+        else
+        {
+            uring_close_connection(ring, conn);
+        }
+    }
+    else if (conn->close_after_write && conn->iovcnt == 0)
+    {
+        uring_close_connection(ring, conn);
+    }
+    else
+    {
+        uring_resume(ring, conn);
+    }
+}
+
+// close every connection, or only those not in the middle of anything
+static void uring_close_all(struct worker_s *worker, struct uring_s *ring, bool idle_only)
+{
+    struct connection_s *next;
+    for (struct connection_s *conn = worker->live; conn; conn = next)
+    {
+        next = conn->next;
+        if (!idle_only || connection_idle(conn))
+        {
+            uring_close_connection(ring, conn);
+        }
+    }
+}
+
+static void uring_expire(struct timer_s *timer, void *arg)
+{
+    struct worker_s *worker = (struct worker_s *)arg;
+    struct uring_s *ring = (struct uring_s *)worker->backend_state;
+    if (timer == &worker->drain_timer)
+    {
+        warn("Closing connections that did not finish in time");
+        uring_close_all(worker, ring, false);
+        return;
+    }
+
+    struct connection_s *conn = connection_from_timer(timer);
+    debugf("connection timed out (%d)", conn->timeout);
+    uring_close_connection(ring, conn);
+}
+
+static void uring_handle_timer(struct worker_s *worker, struct uring_s *ring, struct io_uring_cqe *cqe)
+{
+    uint64_t expirations;
+    if (cqe->res >= 0 && read(worker->timers.fd, &expirations, sizeof(expirations)) > 0)
+    {
+        timer_wheel_advance(&worker->timers, uring_expire, worker);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        uring_arm_poll(ring, worker->timers.fd, URING_OP_TIMER);
+    }
+}
+
+// send what a connection held for the commit
+static void uring_resume_commit(struct connection_s *conn, bool keep)
+{
+    struct uring_s *ring = (struct uring_s *)conn->worker->backend_state;
+    if (conn->closing)
+    {
+        return;
+    }
+    if (keep && !uring_send_queued(ring, conn))
+    {
+        keep = false;
+    }
+    uring_settle(ring, conn, keep);
+}
+
+// wake up once the changes waiting for the commit are due
+static void uring_arm_commit(struct worker_s *worker, struct uring_s *ring)
+{
+    if (ring->commit_armed || !commit_pending(&worker->commit))
+    {
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe)
+    {
+        return;
+    }
+
+    uint64_t delay = commit_delay(&worker->commit);
+    ring->commit_timeout.tv_sec = (long long)(delay / 1000000);
+    ring->commit_timeout.tv_nsec = (long long)(delay % 1000000) * 1000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->commit_timeout;
+    sqe->len = 1;
+    sqe->user_data = tag(NULL, URING_OP_COMMIT);
+    ring->commit_armed = true;
+}
+
+// stop accepting and close the connections that are not in the middle of anything
+static void uring_handle_wake(struct worker_s *worker, struct uring_s *ring, struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        uring_arm_poll(ring, worker->wakefd, URING_OP_WAKE);
+    }
+
+    bool draining = worker->draining;
+    worker_drain(worker);
+    if (draining || !worker->draining)
+    {
+        return;
+    }
+
+    int listen_sockets[] = {worker->listen_socket_http, worker->listen_socket_https, worker->listen_socket_batch};
+    for (size_t i = 0; i < sizeof(listen_sockets) / sizeof(listen_sockets[0]); i++)
+    {
+        struct io_uring_sqe *sqe = listen_sockets[i] != -1 ? uring_get_sqe(ring) : NULL;
+        if (sqe)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = ((uint64_t)listen_sockets[i] << URING_OP_BITS) | URING_OP_ACCEPT;
+            sqe->user_data = tag(NULL, URING_OP_CANCEL);
+        }
+    }
+    worker_close_listen_sockets(worker);
+    uring_close_all(worker, ring, true);
+}
+
+static void uring_handle_cqe(struct worker_s *worker, struct uring_s *ring, struct io_uring_cqe *cqe)
+{
+    // records are only given up once nothing is in flight for them
+    // (uring_release_if_done), so a completion is never stale and the
+    // record still belongs to this worker
+    enum uring_op op = (enum uring_op)(cqe->user_data & URING_OP_MASK);
+    struct connection_s *conn = (struct connection_s *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+
+    switch (op)
+    {
+    case URING_OP_ACCEPT:
+        uring_handle_accept(worker, ring, cqe);
+        break;
+    case URING_OP_RECV:
+        uring_handle_recv(ring, conn, cqe);
+        break;
+    case URING_OP_SEND:
+        uring_handle_send(ring, conn, cqe);
+        break;
+    case URING_OP_TIMER:
+        uring_handle_timer(worker, ring, cqe);
+        break;
+    case URING_OP_WAKE:
+        uring_handle_wake(worker, ring, cqe);
+        break;
+    case URING_OP_COMMIT:
+        ring->commit_armed = false;
+        break;
+    default:
+        break;
+    }
+}
+
+// the operations the backend submits
+static const uint8_t uring_ops[] = {
+    IORING_OP_ACCEPT,
+    IORING_OP_RECV,
+    IORING_OP_SENDMSG,
+    IORING_OP_POLL_ADD,
+    IORING_OP_TIMEOUT,
+    IORING_OP_ASYNC_CANCEL,
+};
+
+// whether the kernel knows every operation the backend submits
+static bool uring_probe_ops(struct uring_s *ring)
+{
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, size);
+    if (!probe)
+    {
+        error("Could not allocate memory to probe io_uring");
+        return false;
+    }
+    bool result = sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) != -1;
+    if (!result)
+    {
+        warn("io_uring cannot be probed for the operations it supports");
+    }
+    for (size_t i = 0; result && i < sizeof(uring_ops); i++)
+    {
+        result = uring_ops[i] <= probe->last_op && (probe->ops[uring_ops[i]].flags & IO_URING_OP_SUPPORTED);
+        if (!result)
+        {
+            warnf("io_uring does not support operation %u", uring_ops[i]);
+        }
+    }
+    free(probe);
+    return result;
+}
+
+// Whether the kernel keeps a multishot operation armed after its first
+// completion. It is submitted with something for it to complete on at
+// once, followed by a cancel for it. A kernel that does not know the
+// flag refuses the operation, or completes it once and is done.
+static bool uring_probe_multishot(struct uring_s *ring, const struct io_uring_sqe *op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    struct io_uring_sqe *cancel = sqe ? uring_get_sqe(ring) : NULL;
+    if (!cancel)
+    {
+        return false;
+    }
+    *sqe = *op;
+    sqe->user_data = 0;
+    cancel->opcode = IORING_OP_ASYNC_CANCEL;
+    cancel->addr = 0;
+    cancel->user_data = tag(NULL, URING_OP_CANCEL);
+
+    bool more = false;
+    bool done = false;
+    bool cancelled = false;
+    while (!done || !cancelled)
+    {
+        if (!uring_submit(ring, true))
+        {
+            return false;
+        }
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data != 0)
+            {
+                cancelled = true;
+                continue;
+            }
+            more |= (cqe->flags & IORING_CQE_F_MORE) != 0;
+            done |= !(cqe->flags & IORING_CQE_F_MORE);
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+            {
+                uring_return_buffer(ring, (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+            }
+            if (op->opcode == IORING_OP_ACCEPT && cqe->res >= 0)
+            {
+                close(cqe->res);
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return more;
+}
+
+// accept a connection waiting on a unix socket
+static bool uring_probe_accept(struct uring_s *ring)
+{
+    bool result = false;
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int client = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    // binding no path picks an abstract address
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    socklen_t length = sizeof(address);
+    if (listener != -1 && client != -1 &&
+        bind(listener, (struct sockaddr *)&address, sizeof(sa_family_t)) == 0 && listen(listener, 1) == 0 &&
+        getsockname(listener, (struct sockaddr *)&address, &length) == 0 &&
+        connect(client, (struct sockaddr *)&address, length) == 0)
+    {
+        struct io_uring_sqe sqe = {
+            .opcode = IORING_OP_ACCEPT,
+            .fd = listener,
+            .ioprio = IORING_ACCEPT_MULTISHOT,
+            .accept_flags = SOCK_CLOEXEC,
+        };
+        result = uring_probe_multishot(ring, &sqe);
+    }
+    if (listener != -1)
+    {
+        close(listener);
+    }
+    if (client != -1)
+    {
+        close(client);
+    }
+    return result;
+}
+
+// receive a byte waiting on a socket pair into a provided buffer
+static bool uring_probe_recv(struct uring_s *ring)
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1)
+    {
+        return false;
+    }
+    bool result = false;
+    if (write(pair[1], "", 1) == 1)
+    {
+        struct io_uring_sqe sqe = {
+            .opcode = IORING_OP_RECV,
+            .fd = pair[0],
+            .ioprio = IORING_RECV_MULTISHOT,
+            .flags = IOSQE_BUFFER_SELECT,
+            .buf_group = URING_BUFFER_GROUP,
+        };
+        result = uring_probe_multishot(ring, &sqe);
+    }
+    close(pair[0]);
+    close(pair[1]);
+    return result;
+}
+
+static void uring_close(struct worker_s *worker)
+{
+    struct uring_s *ring = (struct uring_s *)worker->backend_state;
+    if (!ring)
+    {
+        return;
+    }
+
+    // closing the ring cancels everything in flight
+    if (ring->fd != -1)
+    {
+        close(ring->fd);
+    }
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->buf_ring && ring->buf_ring != MAP_FAILED)
+    {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    }
+    free(ring->buffers);
+    free(ring);
+    worker->backend_state = NULL;
+}
+
+static bool uring_open(struct worker_s *worker)
+{
+    // TLS needs the socket for kTLS, so it stays on epoll
+    if (worker->listen_socket_https != -1)
+    {
+        warn("The io_uring backend does not terminate TLS");
+        return false;
+    }
+
+    struct uring_s *ring = (struct uring_s *)calloc(1, sizeof(struct uring_s));
+    if (!ring)
+    {
+        error("Could not allocate memory for io_uring");
+        return false;
+    }
+    ring->fd = -1;
+    worker->backend_state = ring;
+
+    // create the ring
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+    ring->fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ring->fd == -1 && errno == EINVAL)
+    {
+        memset(&params, 0, sizeof(params));
+        ring->fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    }
+    if (ring->fd == -1)
+    {
+        error("Could not create io_uring");
+        errorp();
+        uring_close(worker);
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_NODROP))
+    {
+        error("io_uring does not support IORING_FEAT_NODROP");
+        uring_close(worker);
+        return false;
+    }
+
+    if (!uring_probe_ops(ring))
+    {
+        uring_close(worker);
+        return false;
+    }
+
+    // map the queues
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        error("Could not map io_uring submission queue");
+        errorp();
+        uring_close(worker);
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            error("Could not map io_uring completion queue");
+            errorp();
+            uring_close(worker);
+            return false;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        error("Could not map io_uring submission entries");
+        errorp();
+        uring_close(worker);
+        return false;
+    }
+
+    uint8_t *sq = (uint8_t *)ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    uint8_t *cq = (uint8_t *)ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // set up the provided buffer ring for receiving
+    ring->buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->buf_ring = (struct io_uring_buf_ring *)mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                                                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    ring->buffers = (char *)malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    if (ring->buf_ring == MAP_FAILED || !ring->buffers)
+    {
+        error("Could not allocate io_uring receive buffers");
+        uring_close(worker);
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        warn("io_uring does not support provided buffer rings");
+        warnp();
+        uring_close(worker);
+        return false;
+    }
+    for (int i = 0; i < URING_BUFFERS; i++)
+    {
+        uring_return_buffer(ring, i);
+    }
+
+    // kernels that have the flags but ignore them are not told apart by
+    // their version, so the multishot operations are tried out
+    if (!uring_probe_accept(ring))
+    {
+        warn("io_uring does not support multishot accept");
+        uring_close(worker);
+        return false;
+    }
+    if (!uring_probe_recv(ring))
+    {
+        warn("io_uring does not support multishot receive");
+        uring_close(worker);
+        return false;
+    }
+
+    // start accepting
+    if (!uring_arm_poll(ring, worker->timers.fd, URING_OP_TIMER) ||
+        !uring_arm_poll(ring, worker->wakefd, URING_OP_WAKE) ||
+        !uring_arm_accept(ring, worker->listen_socket_http) ||
+        (worker->listen_socket_https != -1 && !uring_arm_accept(ring, worker->listen_socket_https)) ||
+        (worker->listen_socket_batch != -1 && !uring_arm_accept(ring, worker->listen_socket_batch)))
+    {
+        uring_close(worker);
+        return false;
+    }
+
+    return true;
+}
+
+static bool uring_run(struct worker_s *worker)
+{
+    struct uring_s *ring = (struct uring_s *)worker->backend_state;
+
+    while (worker_running(worker))
+    {
+        // submit everything queued and wait for something to happen.
+        // Nothing read from the database is in use while waiting.
+        database_reader_leave(worker->db, worker->id);
+        bool submitted = uring_submit(ring, true);
+        database_reader_enter(worker->db, worker->id);
+        if (!submitted)
+        {
+            return false;
+        }
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            uring_handle_cqe(worker, ring, &ring->cqes[head & *ring->cq_mask]);
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        // one sync for the changes made by this batch of completions
+        commit_run(worker);
+        uring_arm_commit(worker, ring);
+    }
+
+    return true;
+}
+
+const struct event_backend_s event_backend_uring = {
+    .name = "io_uring",
+    .open = uring_open,
+    .run = uring_run,
+    .flush = uring_flush,
+    .resume = uring_resume_commit,
+    .close = uring_close,
+};
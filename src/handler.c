@@ -0,0 +1,309 @@
+#include "handler.h"
+#include "response.h"
+#include "worker.h"
+#include "event.h"
+#include "logging.h"
+
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+static int base62_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'A' && c <= 'Z')
+    {
+        return c - 'A' + 10;
+    }
+    if (c >= 'a' && c <= 'z')
+    {
+        return c - 'a' + 36;
+    }
+    return -1;
+}
+
+bool handler_decode_code(const char *code, size_t length, uint32_t *key)
+{
+    if (length == 0 || length > 6)
+    {
+        return false;
+    }
+
+    uint64_t value = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        int digit = base62_digit(code[i]);
+        if (digit < 0)
+        {
+            return false;
+        }
+        value = value * 62 + digit;
+    }
+
+    if (value > UINT32_MAX)
+    {
+        return false;
+    }
+
+    *key = (uint32_t)value;
+    return true;
+}
+
+bool handler_valid_url(const char *url, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = (unsigned char)url[i];
+        if (c < 0x21 || c == 0x7f)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the short code is the path without the leading / and any query string
+static bool request_key(const http_request *request, uint32_t *key)
+{
+    const char *target = request->target.data;
+    size_t length = request->target.length;
+    if (length < 2 || target[0] != '/')
+    {
+        return false;
+    }
+
+    size_t code_length = 1;
+    while (code_length < length && target[code_length] != '?')
+    {
+        code_length++;
+    }
+
+    return handler_decode_code(target + 1, code_length - 1, key);
+}
+
+// keep a copy of the complete response for the next request for the link
+static bool cache_redirect(struct connection_s *conn, uint32_t key, uint32_t version,
+                           uint64_t expires, const database_url *url)
+{
+    struct cache_s *cache = &conn->worker->cache;
+    char *slot = cache_reserve(cache);
+    if (!slot)
+    {
+        return false;
+    }
+    size_t length = response_format_redirect(slot, CACHE_SLOT_SIZE, url);
+    if (!length)
+    {
+        return false;
+    }
+    cache_commit(cache, slot, key, version, expires, length);
+    return connection_send(conn, slot, length);
+}
+
+static bool handle_get(struct connection_s *conn, const http_request *request, bool keep_alive)
+{
+    uint32_t key;
+    database_url url;
+    uint64_t expires;
+    uint64_t now = (uint64_t)time(NULL);
+    database db = conn->worker->db;
+
+    if (!request_key(request, &key))
+    {
+        return response_status(conn, 404, keep_alive);
+    }
+
+    // only the usual HTTP/1.1 keep-alive response is cached
+    bool cacheable = keep_alive && !conn->http2 && cache_enabled(&conn->worker->cache);
+    if (cacheable)
+    {
+        size_t length;
+        const char *response = cache_get(&conn->worker->cache, db, key, now, &length);
+        if (response)
+        {
+            return connection_send(conn, response, length);
+        }
+    }
+
+    uint32_t version = database_version(db, key);
+    if (database_get(db, key, conn->worker->scratch, &url, &expires) &&
+        (expires == 0 || expires > now))
+    {
+        if (cacheable)
+        {
+            // the slot the response goes in may be one that output
+            // gathered earlier still points to, so that goes out first
+            if (conn->iovcnt && !conn->worker->backend->flush(conn))
+            {
+                return false;
+            }
+            if (cache_redirect(conn, key, version, expires, &url))
+            {
+                return true;
+            }
+        }
+        // the url is sent straight out of the database. One that was
+        // inflated is overwritten by the next, so it goes out now.
+        return response_redirect(conn, &url, keep_alive) &&
+               (!database_scratch_contains(conn->worker->scratch, url.suffix) ||
+                conn->worker->backend->flush(conn));
+    }
+
+    return response_status(conn, 404, keep_alive);
+}
+
+// whether the request carries a bearer token from the issuer
+static bool request_authorized(struct connection_s *conn, const http_request *request, uint64_t now)
+{
+    http_slice authorization;
+    if (!http_request_header(request, "authorization", &authorization) ||
+        authorization.length <= 7 || strncasecmp(authorization.data, "Bearer ", 7) != 0)
+    {
+        return false;
+    }
+    return jwt_verify(&conn->worker->jwt, authorization.data + 7, authorization.length - 7, now);
+}
+
+// the expires parameter of the query string, in seconds since the
+// epoch. 0 if there is none, and given tells whether there was. Returns
+// false if it is malformed.
+static bool request_expires(const http_request *request, uint64_t *expires, bool *given)
+{
+    const char *query = memchr(request->target.data, '?', request->target.length);
+    *expires = 0;
+    *given = false;
+    if (!query)
+    {
+        return true;
+    }
+
+    const char *end = request->target.data + request->target.length;
+    for (const char *p = query + 1; p < end;)
+    {
+        const char *next = memchr(p, '&', (size_t)(end - p));
+        if (!next)
+        {
+            next = end;
+        }
+        if (next - p > 8 && memcmp(p, "expires=", 8) == 0)
+        {
+            uint64_t value = 0;
+            for (p += 8; p < next; p++)
+            {
+                if (*p < '0' || *p > '9' || value > UINT64_MAX / 10 - 1)
+                {
+                    return false;
+                }
+                value = value * 10 + (uint64_t)(*p - '0');
+            }
+            *expires = value;
+            *given = true;
+        }
+        p = next + 1;
+    }
+    return true;
+}
+
+// PUT /<code> with the url as the body creates or replaces a link. With
+// no body and an expires parameter it only changes when the link expires.
+static bool handle_put(struct connection_s *conn, const http_request *request, bool keep_alive)
+{
+    uint32_t key;
+    uint64_t expires;
+    bool given;
+    uint64_t now = (uint64_t)time(NULL);
+
+    if (!request_authorized(conn, request, now))
+    {
+        return response_status(conn, 401, keep_alive);
+    }
+    if (!request_key(request, &key))
+    {
+        return response_status(conn, 404, keep_alive);
+    }
+    if (!request_expires(request, &expires, &given) || (request->body.length == 0 && !given) ||
+        !handler_valid_url(request->body.data, request->body.length))
+    {
+        return response_status(conn, 400, keep_alive);
+    }
+    if (request->body.length == 0)
+    {
+        if (!database_expire(conn->worker->db, key, expires))
+        {
+            return response_status(conn, 404, keep_alive);
+        }
+        commit_add(conn);
+        return response_status(conn, 200, keep_alive);
+    }
+    if (request->body.length > HANDLER_MAX_URL)
+    {
+        return response_status(conn, 413, keep_alive);
+    }
+
+    char url[HANDLER_MAX_URL + 1];
+    memcpy(url, request->body.data, request->body.length);
+    url[request->body.length] = '\0';
+    if (!database_set(conn->worker->db, key, url, expires))
+    {
+        return response_status(conn, 500, keep_alive);
+    }
+    commit_add(conn);
+    return response_status(conn, 201, keep_alive);
+}
+
+// DELETE /<code> removes a link
+static bool handle_delete(struct connection_s *conn, const http_request *request, bool keep_alive)
+{
+    uint32_t key;
+    if (!request_authorized(conn, request, (uint64_t)time(NULL)))
+    {
+        return response_status(conn, 401, keep_alive);
+    }
+    if (!request_key(request, &key) || !database_delete(conn->worker->db, key))
+    {
+        return response_status(conn, 404, keep_alive);
+    }
+    commit_add(conn);
+    return response_status(conn, 200, keep_alive);
+}
+
+bool handler_request(struct connection_s *conn, const http_request *request)
+{
+    debugf("%.*s %.*s",
+           (int)request->method.length, request->method.data,
+           (int)request->target.length, request->target.data);
+
+    // only HTTP/1.1 connections are kept open, and none once the worker
+    // is draining. HTTP/2 connections are wound down with GOAWAY instead.
+    bool keep_alive = request->keep_alive && request->minor_version == 1 &&
+                      (conn->http2 || !conn->worker->draining);
+    if (!keep_alive)
+    {
+        conn->close_after_write = true;
+    }
+
+    if (!ratelimit_take(&conn->worker->ratelimit, conn->address))
+    {
+        return response_status(conn, 429, keep_alive);
+    }
+
+    if (http_slice_equals(request->method, "GET") || http_slice_equals(request->method, "HEAD"))
+    {
+        return handle_get(conn, request, keep_alive);
+    }
+    else if (http_slice_equals(request->method, "PUT"))
+    {
+        return handle_put(conn, request, keep_alive);
+    }
+    else if (http_slice_equals(request->method, "DELETE"))
+    {
+        return handle_delete(conn, request, keep_alive);
+    }
+    else
+    {
+        return response_status(conn, 405, keep_alive);
+    }
+}
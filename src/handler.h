@@ -0,0 +1,20 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "http.h"
+#include "connection.h"
+
+// the longest url a PUT may carry
+#define HANDLER_MAX_URL 2048
+
+// decode a short code into a database key. Codes are base62
+// ([0-9A-Za-z]) and must fit in 32 bits.
+bool handler_decode_code(const char *code, size_t length, uint32_t *key);
+
+// whether a url may go in a Location header as it is: no spaces,
+// control characters or DEL, which could end the header or the response
+bool handler_valid_url(const char *url, size_t length);
+
+// handle a complete request received on a connection
+bool handler_request(struct connection_s *conn, const http_request *request);
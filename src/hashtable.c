@@ -338,7 +338,7 @@ static uint32_t *hashtable_find_item_container(hashtable table, uint32_t key, ui
                 uint32_t bitmap = bucket[index];
                 for (uint32_t i = 0; i < 32 && !result; i++)
                 {
-                    if ((1 << i) & bitmap)
+                    if ((1u << i) & bitmap)
                     {
                         // there is something allocated in this slot
                         uint32_t item_offset = index + 1 + ((table_item_size(table) * i) / sizeof(uint32_t));
@@ -397,7 +397,7 @@ static uint32_t *hashtable_find_item_container(hashtable table, uint32_t key, ui
                         if (bucket)
                         {
                             // "allocate" the item
-                            bucket[index] |= 1 << freebit;
+                            bucket[index] |= 1u << freebit;
 
                             // assign the item
                             result = bucket + item_offset;
@@ -411,8 +411,9 @@ static uint32_t *hashtable_find_item_container(hashtable table, uint32_t key, ui
                         // move to the next bitmap
                         index += 1 + ((table_item_size(table) * 32) / sizeof(uint32_t));
 
-                        // increase the bucket size if needed
-                        while (bucket && index > bucketsize_words)
+                        // increase the bucket size if needed. The
+                        // bitmap itself has to be inside the bucket.
+                        while (bucket && index >= bucketsize_words)
                         {
                             bucket = increase_bucket_size(table, key);
                             if (bucket)
@@ -449,7 +450,7 @@ bool hashtable_delete(hashtable table, uint32_t key)
         // clear out the value container
         memset(val, 0, table_item_size(table));
         // clear the bit
-        *pbitmap &= ~(1 << index);
+        *pbitmap &= ~(1u << index);
         // TODO: shrink the bucket if needed
     }
     return !!val;
@@ -473,7 +474,7 @@ void hashtable_iterate(hashtable table, hashtable_iterate_fn iterator, void *sta
                     uint32_t bitmap = bucket[index];
                     for (uint32_t i = 0; i < 32; i++)
                     {
-                        if ((1 << i) & bitmap)
+                        if ((1u << i) & bitmap)
                         {
                             uint32_t item_offset = index + 1 + ((table_item_size(table) * i) / sizeof(uint32_t));
                             uint32_t item_end = item_offset + (table_item_size(table) / sizeof(uint32_t));
@@ -483,6 +484,7 @@ void hashtable_iterate(hashtable table, hashtable_iterate_fn iterator, void *sta
                             }
                         }
                     }
+                    index += 1 + ((table_item_size(table) * 32) / sizeof(uint32_t));
                 }
             }
         }
@@ -516,4 +518,9 @@ void hashtable_free(hashtable table)
         // free the whole table
         free(table);
     }
-}
\ No newline at end of file
+}
+
+void hashtable_detach(hashtable table)
+{
+    free(table);
+}
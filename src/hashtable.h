@@ -64,3 +64,7 @@ void hashtable_iterate(hashtable table, hashtable_iterate_fn iterator, void* sta
 // free a hashtable
 void hashtable_free(hashtable table);
 
+// free the hashtable object but leave the root and the buckets
+// alone, for tables kept in memory that outlives the process
+void hashtable_detach(hashtable table);
+
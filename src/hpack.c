@@ -0,0 +1,583 @@
+#include "hpack.h"
+
+#include <string.h>
+
+// the longest Huffman code, which is EOS
+#define HUFFMAN_MAX_BITS 30
+#define HUFFMAN_EOS 256
+
+#define STATIC_TABLE_COUNT 61
+
+// static table indices used by responses
+#define STATIC_STATUS 8
+#define STATIC_CACHE_CONTROL 24
+#define STATIC_CONTENT_LENGTH 28
+#define STATIC_LOCATION 46
+
+// representation prefixes
+#define REP_INDEXED 0x80
+#define REP_INCREMENTAL 0x40
+#define REP_SIZE_UPDATE 0x20
+#define REP_NEVER_INDEXED 0x10
+#define REP_WITHOUT_INDEXING 0x00
+#define STRING_HUFFMAN 0x80
+
+struct hpack_field_s
+{
+    const char *name;
+    const char *value;
+};
+
+#define FIELD(name, value) {name, value}
+
+static const struct hpack_field_s static_table[STATIC_TABLE_COUNT] = {
+    FIELD(":authority", ""),
+    FIELD(":method", "GET"),
+    FIELD(":method", "POST"),
+    FIELD(":path", "/"),
+    FIELD(":path", "/index.html"),
+    FIELD(":scheme", "http"),
+    FIELD(":scheme", "https"),
+    FIELD(":status", "200"),
+    FIELD(":status", "204"),
+    FIELD(":status", "206"),
+    FIELD(":status", "304"),
+    FIELD(":status", "400"),
+    FIELD(":status", "404"),
+    FIELD(":status", "500"),
+    FIELD("accept-charset", ""),
+    FIELD("accept-encoding", "gzip, deflate"),
+    FIELD("accept-language", ""),
+    FIELD("accept-ranges", ""),
+    FIELD("accept", ""),
+    FIELD("access-control-allow-origin", ""),
+    FIELD("age", ""),
+    FIELD("allow", ""),
+    FIELD("authorization", ""),
+    FIELD("cache-control", ""),
+    FIELD("content-disposition", ""),
+    FIELD("content-encoding", ""),
+    FIELD("content-language", ""),
+    FIELD("content-length", ""),
+    FIELD("content-location", ""),
+    FIELD("content-range", ""),
+    FIELD("content-type", ""),
+    FIELD("cookie", ""),
+    FIELD("date", ""),
+    FIELD("etag", ""),
+    FIELD("expect", ""),
+    FIELD("expires", ""),
+    FIELD("from", ""),
+    FIELD("host", ""),
+    FIELD("if-match", ""),
+    FIELD("if-modified-since", ""),
+    FIELD("if-none-match", ""),
+    FIELD("if-range", ""),
+    FIELD("if-unmodified-since", ""),
+    FIELD("last-modified", ""),
+    FIELD("link", ""),
+    FIELD("location", ""),
+    FIELD("max-forwards", ""),
+    FIELD("proxy-authenticate", ""),
+    FIELD("proxy-authorization", ""),
+    FIELD("range", ""),
+    FIELD("referer", ""),
+    FIELD("refresh", ""),
+    FIELD("retry-after", ""),
+    FIELD("server", ""),
+    FIELD("set-cookie", ""),
+    FIELD("strict-transport-security", ""),
+    FIELD("transfer-encoding", ""),
+    FIELD("user-agent", ""),
+    FIELD("vary", ""),
+    FIELD("via", ""),
+    FIELD("www-authenticate", ""),
+};
+
+// the response headers that are added to the client's table, with the
+// static entry for their names
+enum indexed_field
+{
+    INDEXED_STATUS_302,
+    INDEXED_CACHE_CONTROL,
+    INDEXED_CONTENT_LENGTH,
+};
+
+static const struct
+{
+    unsigned int name_index;
+    const char *value;
+    size_t size;
+} indexed_fields[HPACK_INDEXED_FIELDS] = {
+    [INDEXED_STATUS_302] = {STATIC_STATUS, "302", sizeof(":status") - 1 + 3 + HPACK_ENTRY_OVERHEAD},
+    [INDEXED_CACHE_CONTROL] = {STATIC_CACHE_CONTROL, "private, max-age=90",
+                               sizeof("cache-control") - 1 + sizeof("private, max-age=90") - 1 + HPACK_ENTRY_OVERHEAD},
+    [INDEXED_CONTENT_LENGTH] = {STATIC_CONTENT_LENGTH, "0", sizeof("content-length") - 1 + 1 + HPACK_ENTRY_OVERHEAD},
+};
+
+// the table has to hold all of them at once or none are indexed
+#define INDEXED_FIELDS_SIZE (indexed_fields[0].size + indexed_fields[1].size + indexed_fields[2].size)
+
+// The Huffman code of RFC 7541 appendix B is canonical, so it is decoded
+// from the number of codes of each length and the symbols in code order.
+static const uint8_t huffman_counts[HUFFMAN_MAX_BITS + 1] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+static const uint16_t huffman_symbols[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+    256,
+};
+
+// where decoded names and values are written
+struct hpack_space_s
+{
+    char *data;
+    size_t used;
+    size_t size;
+};
+
+void hpack_table_init(struct hpack_table_s *table)
+{
+    table->first = 0;
+    table->count = 0;
+    table->data_start = 0;
+    table->data_length = 0;
+    table->size = 0;
+    table->max_size = HPACK_TABLE_SIZE;
+}
+
+// drop the oldest entries until there is room for size more
+static void table_evict(struct hpack_table_s *table, size_t size)
+{
+    while (table->count && table->size + size > table->max_size)
+    {
+        const struct hpack_entry_s *oldest = &table->entries[table->first];
+        size_t length = (size_t)oldest->name_length + oldest->value_length;
+        table->data_start = (table->data_start + length) % HPACK_TABLE_SIZE;
+        table->data_length -= length;
+        table->size -= length + HPACK_ENTRY_OVERHEAD;
+        table->first = (table->first + 1) % HPACK_MAX_ENTRIES;
+        table->count--;
+    }
+}
+
+static void ring_write(struct hpack_table_s *table, size_t offset, const char *data, size_t length)
+{
+    size_t first = HPACK_TABLE_SIZE - offset < length ? HPACK_TABLE_SIZE - offset : length;
+    memcpy(table->data + offset, data, first);
+    memcpy(table->data, data + first, length - first);
+}
+
+static void ring_read(const struct hpack_table_s *table, size_t offset, char *data, size_t length)
+{
+    offset %= HPACK_TABLE_SIZE;
+    size_t first = HPACK_TABLE_SIZE - offset < length ? HPACK_TABLE_SIZE - offset : length;
+    memcpy(data, table->data + offset, first);
+    memcpy(data + first, table->data, length - first);
+}
+
+static void table_insert(struct hpack_table_s *table, http_slice name, http_slice value)
+{
+    size_t size = name.length + value.length + HPACK_ENTRY_OVERHEAD;
+    if (size > table->max_size)
+    {
+        // too big for the table, which is left empty
+        table_evict(table, table->max_size + 1);
+        return;
+    }
+    table_evict(table, size);
+
+    size_t offset = (table->data_start + table->data_length) % HPACK_TABLE_SIZE;
+    ring_write(table, offset, name.data, name.length);
+    ring_write(table, (offset + name.length) % HPACK_TABLE_SIZE, value.data, value.length);
+
+    struct hpack_entry_s *entry = &table->entries[(table->first + table->count) % HPACK_MAX_ENTRIES];
+    entry->offset = (uint16_t)offset;
+    entry->name_length = (uint16_t)name.length;
+    entry->value_length = (uint16_t)value.length;
+    table->count++;
+    table->data_length += name.length + value.length;
+    table->size += size;
+}
+
+static bool decode_integer(const uint8_t **p, const uint8_t *end, int bits, size_t *value)
+{
+    if (*p >= end)
+    {
+        return false;
+    }
+    size_t max = ((size_t)1 << bits) - 1;
+    size_t result = **p & max;
+    (*p)++;
+    if (result < max)
+    {
+        *value = result;
+        return true;
+    }
+
+    for (unsigned int shift = 0; *p < end && shift <= 28; shift += 7)
+    {
+        uint8_t byte = *(*p)++;
+        result += (size_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static enum hpack_result huffman_decode(const uint8_t *data, size_t length, struct hpack_space_s *space)
+{
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    int bits = 0;
+    bool ones = true;
+    for (size_t i = 0; i < length; i++)
+    {
+        for (int shift = 7; shift >= 0; shift--)
+        {
+            int bit = (data[i] >> shift) & 1;
+            code |= bit;
+            ones = ones && bit;
+            bits++;
+
+            int count = huffman_counts[bits];
+            if (code - count < first)
+            {
+                int symbol = huffman_symbols[index + (code - first)];
+                if (symbol == HUFFMAN_EOS)
+                {
+                    return HPACK_ERROR;
+                }
+                if (space->used == space->size)
+                {
+                    return HPACK_TOO_LARGE;
+                }
+                space->data[space->used++] = (char)symbol;
+                code = first = index = bits = 0;
+                ones = true;
+            }
+            else
+            {
+                if (bits == HUFFMAN_MAX_BITS)
+                {
+                    return HPACK_ERROR;
+                }
+                index += count;
+                first = (first + count) << 1;
+                code <<= 1;
+            }
+        }
+    }
+
+    // the string is padded with the start of EOS, which is all ones
+    return bits < 8 && ones ? HPACK_OK : HPACK_ERROR;
+}
+
+static enum hpack_result decode_string(const uint8_t **p, const uint8_t *end,
+                                       struct hpack_space_s *space, http_slice *slice)
+{
+    if (*p >= end)
+    {
+        return HPACK_ERROR;
+    }
+    bool huffman = **p & STRING_HUFFMAN;
+    size_t length;
+    if (!decode_integer(p, end, 7, &length) || length > (size_t)(end - *p))
+    {
+        return HPACK_ERROR;
+    }
+
+    char *start = space->data + space->used;
+    if (huffman)
+    {
+        enum hpack_result result = huffman_decode(*p, length, space);
+        if (result != HPACK_OK)
+        {
+            return result;
+        }
+    }
+    else
+    {
+        if (length > space->size - space->used)
+        {
+            return HPACK_TOO_LARGE;
+        }
+        memcpy(start, *p, length);
+        space->used += length;
+    }
+    *p += length;
+
+    slice->data = start;
+    slice->length = (size_t)(space->data + space->used - start);
+    return HPACK_OK;
+}
+
+// look up an entry in the static or dynamic table. Dynamic entries are
+// copied to space, static ones are used where they are.
+static enum hpack_result lookup(const struct hpack_table_s *table, size_t index, bool with_value,
+                                struct hpack_space_s *space, http_slice *name, http_slice *value)
+{
+    if (index == 0)
+    {
+        return HPACK_ERROR;
+    }
+    if (index <= STATIC_TABLE_COUNT)
+    {
+        const struct hpack_field_s *field = &static_table[index - 1];
+        *name = (http_slice){field->name, strlen(field->name)};
+        if (with_value)
+        {
+            *value = (http_slice){field->value, strlen(field->value)};
+        }
+        return HPACK_OK;
+    }
+
+    // 62 is the newest dynamic entry
+    size_t age = index - STATIC_TABLE_COUNT - 1;
+    if (age >= table->count)
+    {
+        return HPACK_ERROR;
+    }
+    const struct hpack_entry_s *entry =
+        &table->entries[(table->first + table->count - 1 - age) % HPACK_MAX_ENTRIES];
+    size_t length = entry->name_length + (with_value ? entry->value_length : 0);
+    if (length > space->size - space->used)
+    {
+        return HPACK_TOO_LARGE;
+    }
+
+    char *data = space->data + space->used;
+    ring_read(table, entry->offset, data, length);
+    space->used += length;
+    *name = (http_slice){data, entry->name_length};
+    if (with_value)
+    {
+        *value = (http_slice){data + entry->name_length, entry->value_length};
+    }
+    return HPACK_OK;
+}
+
+enum hpack_result hpack_decode(struct hpack_table_s *table, const uint8_t *block, size_t length,
+                               char *space_data, size_t space_size,
+                               http_header *headers, unsigned int max_headers, unsigned int *count)
+{
+    struct hpack_space_s space = {space_data, 0, space_size};
+    const uint8_t *p = block;
+    const uint8_t *end = block + length;
+    *count = 0;
+
+    while (p < end)
+    {
+        uint8_t first = *p;
+        http_header header;
+        enum hpack_result result;
+        size_t index;
+
+        if (first & REP_INDEXED)
+        {
+            if (!decode_integer(&p, end, 7, &index))
+            {
+                return HPACK_ERROR;
+            }
+            result = lookup(table, index, true, &space, &header.name, &header.value);
+        }
+        else if ((first & 0xe0) == REP_SIZE_UPDATE)
+        {
+            size_t size;
+            if (!decode_integer(&p, end, 5, &size) || size > HPACK_TABLE_SIZE)
+            {
+                return HPACK_ERROR;
+            }
+            table->max_size = size;
+            table_evict(table, 0);
+            continue;
+        }
+        else
+        {
+            // a literal, with a name that is either indexed or follows
+            bool incremental = first & REP_INCREMENTAL;
+            if (!decode_integer(&p, end, incremental ? 6 : 4, &index))
+            {
+                return HPACK_ERROR;
+            }
+            result = index ? lookup(table, index, false, &space, &header.name, NULL)
+                           : decode_string(&p, end, &space, &header.name);
+            if (result == HPACK_OK)
+            {
+                result = decode_string(&p, end, &space, &header.value);
+            }
+            if (result == HPACK_OK && incremental)
+            {
+                table_insert(table, header.name, header.value);
+            }
+        }
+
+        if (result != HPACK_OK)
+        {
+            return result;
+        }
+        if (*count < max_headers)
+        {
+            headers[(*count)++] = header;
+        }
+    }
+    return HPACK_OK;
+}
+
+void hpack_encoder_init(struct hpack_encoder_s *encoder)
+{
+    encoder->size = HPACK_TABLE_SIZE;
+    encoder->size_update = false;
+    encoder->indexed = 0;
+    for (int i = 0; i < HPACK_INDEXED_FIELDS; i++)
+    {
+        encoder->position[i] = -1;
+    }
+}
+
+void hpack_encoder_resize(struct hpack_encoder_s *encoder, size_t max_size)
+{
+    size_t size = max_size < HPACK_TABLE_SIZE ? max_size : HPACK_TABLE_SIZE;
+    if (size != encoder->size)
+    {
+        encoder->size = size;
+        encoder->size_update = true;
+    }
+}
+
+static size_t encode_integer(uint8_t *out, uint8_t first, int bits, size_t value)
+{
+    size_t max = ((size_t)1 << bits) - 1;
+    if (value < max)
+    {
+        out[0] = first | (uint8_t)value;
+        return 1;
+    }
+
+    out[0] = first | (uint8_t)max;
+    value -= max;
+    size_t n = 1;
+    while (value >= 0x80)
+    {
+        out[n++] = (uint8_t)(value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+static size_t encode_string(uint8_t *out, const char *data, size_t length)
+{
+    size_t n = encode_integer(out, 0, 7, length);
+    memcpy(out + n, data, length);
+    return n + length;
+}
+
+// one of the headers that go in the client's table
+static size_t encode_indexed_field(struct hpack_encoder_s *encoder, uint8_t *out, enum indexed_field field)
+{
+    if (encoder->size < INDEXED_FIELDS_SIZE)
+    {
+        size_t n = encode_integer(out, REP_WITHOUT_INDEXING, 4, indexed_fields[field].name_index);
+        return n + encode_string(out + n, indexed_fields[field].value, strlen(indexed_fields[field].value));
+    }
+
+    if (encoder->position[field] >= 0)
+    {
+        size_t index = STATIC_TABLE_COUNT + encoder->indexed - (size_t)encoder->position[field];
+        return encode_integer(out, REP_INDEXED, 7, index);
+    }
+
+    encoder->position[field] = (int)encoder->indexed++;
+    size_t n = encode_integer(out, REP_INCREMENTAL, 6, indexed_fields[field].name_index);
+    return n + encode_string(out + n, indexed_fields[field].value, strlen(indexed_fields[field].value));
+}
+
+bool hpack_encode_response(struct hpack_encoder_s *encoder, int status, size_t location_length,
+                           uint8_t *prefix, size_t *prefix_length,
+                           uint8_t *suffix, size_t *suffix_length)
+{
+    if (status < 100 || status > 999)
+    {
+        return false;
+    }
+
+    size_t n = 0;
+    if (encoder->size_update)
+    {
+        // emptying the table first means both sides agree on what is left
+        n += encode_integer(prefix + n, REP_SIZE_UPDATE, 5, 0);
+        n += encode_integer(prefix + n, REP_SIZE_UPDATE, 5, encoder->size);
+        encoder->size_update = false;
+        encoder->indexed = 0;
+        for (int i = 0; i < HPACK_INDEXED_FIELDS; i++)
+        {
+            encoder->position[i] = -1;
+        }
+    }
+
+    switch (status)
+    {
+    case 200:
+    case 204:
+    case 206:
+    case 304:
+    case 400:
+    case 404:
+    case 500:
+    {
+        static const int static_statuses[] = {200, 204, 206, 304, 400, 404, 500};
+        size_t index = STATIC_STATUS;
+        while (static_statuses[index - STATIC_STATUS] != status)
+        {
+            index++;
+        }
+        n += encode_integer(prefix + n, REP_INDEXED, 7, index);
+        break;
+    }
+    case 302:
+        n += encode_indexed_field(encoder, prefix + n, INDEXED_STATUS_302);
+        break;
+    default:
+    {
+        char digits[3] = {(char)('0' + status / 100), (char)('0' + status / 10 % 10), (char)('0' + status % 10)};
+        n += encode_integer(prefix + n, REP_WITHOUT_INDEXING, 4, STATIC_STATUS);
+        n += encode_string(prefix + n, digits, sizeof(digits));
+        break;
+    }
+    }
+
+    size_t m = 0;
+    if (status == 302)
+    {
+        // every location is different so it is never indexed
+        n += encode_integer(prefix + n, REP_WITHOUT_INDEXING, 4, STATIC_LOCATION);
+        n += encode_integer(prefix + n, 0, 7, location_length);
+        m += encode_indexed_field(encoder, suffix + m, INDEXED_CACHE_CONTROL);
+    }
+    m += encode_indexed_field(encoder, suffix + m, INDEXED_CONTENT_LENGTH);
+
+    *prefix_length = n;
+    *suffix_length = m;
+    return true;
+}
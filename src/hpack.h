@@ -0,0 +1,102 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "http.h"
+
+// HPACK header compression for HTTP/2 (RFC 7541).
+//
+// The decoder keeps the dynamic table the client builds up and turns
+// header blocks into the same slices the HTTP/1.1 parser produces. Names
+// and values are copied into space supplied by the caller so they stay
+// put while the table changes underneath them.
+//
+// The encoder only ever writes the few headers our responses carry. The
+// ones every redirect repeats are added to the client's dynamic table the
+// first time they are sent, after which a response costs a few bytes of
+// header plus the location.
+
+// the dynamic table size we allow the client to use. This is the
+// protocol default so it is never announced.
+#define HPACK_TABLE_SIZE 4096
+
+// what the spec adds to the size of every table entry
+#define HPACK_ENTRY_OVERHEAD 32
+
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+
+enum hpack_result
+{
+    HPACK_OK,
+    // the block is malformed. The connection has to be closed.
+    HPACK_ERROR,
+    // the headers do not fit the space given. The table is no longer in
+    // step with the client so the connection has to be closed as well.
+    HPACK_TOO_LARGE,
+};
+
+struct hpack_entry_s
+{
+    uint16_t offset;
+    uint16_t name_length;
+    uint16_t value_length;
+};
+
+// the decoder's dynamic table. Entries and their names and values are
+// kept in rings, so evicting the oldest entry moves nothing. A name and
+// value may wrap around the end of data.
+struct hpack_table_s
+{
+    struct hpack_entry_s entries[HPACK_MAX_ENTRIES];
+    // the oldest entry, and the number of entries
+    unsigned int first;
+    unsigned int count;
+    // where the oldest entry's bytes start, and the bytes in use
+    size_t data_start;
+    size_t data_length;
+    // the size as the spec counts it, and the most it may grow to
+    size_t size;
+    size_t max_size;
+    char data[HPACK_TABLE_SIZE];
+};
+
+// the response headers that go in the client's table
+#define HPACK_INDEXED_FIELDS 3
+
+// what the client's decoder holds of what we sent
+struct hpack_encoder_s
+{
+    // the table size we use, at most what the client allows
+    size_t size;
+    // the size changed and the client has to be told
+    bool size_update;
+    // how many response headers have been added to the table, and the
+    // order each was added in. -1 if it has not been.
+    unsigned int indexed;
+    int position[HPACK_INDEXED_FIELDS];
+};
+
+void hpack_table_init(struct hpack_table_s *table);
+
+// decode a complete header block into at most max_headers headers.
+// Any more are decoded to keep the table in step but are dropped.
+enum hpack_result hpack_decode(struct hpack_table_s *table, const uint8_t *block, size_t length,
+                               char *space, size_t space_size,
+                               http_header *headers, unsigned int max_headers, unsigned int *count);
+
+void hpack_encoder_init(struct hpack_encoder_s *encoder);
+
+// the client announced a new SETTINGS_HEADER_TABLE_SIZE
+void hpack_encoder_resize(struct hpack_encoder_s *encoder, size_t max_size);
+
+// the most hpack_encode_response writes before and after the location
+#define HPACK_MAX_RESPONSE_PREFIX 64
+#define HPACK_MAX_RESPONSE_SUFFIX 64
+
+// encode the headers of a response without a body. A redirect (302) has a
+// location, which is not copied: the block is prefix, the location and
+// suffix. Returns false if the block cannot be encoded.
+bool hpack_encode_response(struct hpack_encoder_s *encoder, int status, size_t location_length,
+                           uint8_t *prefix, size_t *prefix_length,
+                           uint8_t *suffix, size_t *suffix_length);
@@ -0,0 +1,295 @@
+#include "http.h"
+
+#include <string.h>
+#include <strings.h>
+
+// RFC 7230 tchar. strchr would also find the terminating NUL.
+static bool is_token_char(char c)
+{
+    return (c >= 'a' && c <= 'z') ||
+           (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') ||
+           (c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+// control characters, which have no place in a request line or
+// header, and could split a request or a log line if let through
+static bool is_control_char(char c)
+{
+    return (unsigned char)c < 0x20 || c == 0x7f;
+}
+
+static bool is_whitespace(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static http_slice trim(const char *start, const char *end)
+{
+    while (start < end && is_whitespace(*start))
+    {
+        start++;
+    }
+    while (end > start && is_whitespace(end[-1]))
+    {
+        end--;
+    }
+    return (http_slice){.data = start, .length = (size_t)(end - start)};
+}
+
+static bool parse_fail(http_parser *parser, int status)
+{
+    parser->state = HTTP_STATE_ERROR;
+    parser->error_status = status;
+    return false;
+}
+
+// METHOD SP request-target SP HTTP/1.x
+static bool parse_request_line(http_parser *parser, const char *line, const char *end)
+{
+    http_request *request = &parser->request;
+
+    const char *p = line;
+    while (p < end && is_token_char(*p))
+    {
+        p++;
+    }
+    if (p == line || p == end || *p != ' ')
+    {
+        return parse_fail(parser, 400);
+    }
+    request->method = (http_slice){.data = line, .length = (size_t)(p - line)};
+
+    const char *target = ++p;
+    while (p < end && *p != ' ' && !is_control_char(*p))
+    {
+        p++;
+    }
+    if (p == target || p == end || *p != ' ')
+    {
+        return parse_fail(parser, 400);
+    }
+    request->target = (http_slice){.data = target, .length = (size_t)(p - target)};
+
+    p++;
+    if (end - p != 8 || memcmp(p, "HTTP/1.", 7) != 0)
+    {
+        return parse_fail(parser, p < end && *p == 'H' ? 505 : 400);
+    }
+    if (p[7] == '1')
+    {
+        request->minor_version = 1;
+        request->keep_alive = true;
+    }
+    else if (p[7] == '0')
+    {
+        request->minor_version = 0;
+        request->keep_alive = false;
+    }
+    else
+    {
+        return parse_fail(parser, 505);
+    }
+
+    return true;
+}
+
+// name: value
+static bool parse_header_line(http_parser *parser, const char *line, const char *end)
+{
+    http_request *request = &parser->request;
+
+    const char *p = line;
+    while (p < end && is_token_char(*p))
+    {
+        p++;
+    }
+    // this also rejects obsolete line folding
+    if (p == line || p == end || *p != ':')
+    {
+        return parse_fail(parser, 400);
+    }
+    if (request->num_headers == HTTP_MAX_HEADERS)
+    {
+        return parse_fail(parser, 431);
+    }
+
+    // bare CR, NUL and other controls are not allowed in values. Tabs
+    // are whitespace (RFC 9112 2.2, RFC 9110 5.5).
+    for (const char *v = p + 1; v < end; v++)
+    {
+        if (is_control_char(*v) && *v != '\t')
+        {
+            return parse_fail(parser, 400);
+        }
+    }
+
+    http_header *header = &request->headers[request->num_headers++];
+    header->name = (http_slice){.data = line, .length = (size_t)(p - line)};
+    header->value = trim(p + 1, end);
+
+    // headers that change how the rest of the request is parsed
+    if (http_slice_iequals(header->name, "content-length"))
+    {
+        if (header->value.length == 0 || header->value.length > 9)
+        {
+            return parse_fail(parser, header->value.length ? 413 : 400);
+        }
+        size_t content_length = 0;
+        for (size_t i = 0; i < header->value.length; i++)
+        {
+            char c = header->value.data[i];
+            if (c < '0' || c > '9')
+            {
+                return parse_fail(parser, 400);
+            }
+            content_length = content_length * 10 + (size_t)(c - '0');
+        }
+        // repeats have to agree, or the request could be framed one way
+        // here and another way by a proxy in front (RFC 9112 6.3)
+        for (unsigned int i = 0; i + 1 < request->num_headers; i++)
+        {
+            if (http_slice_iequals(request->headers[i].name, "content-length") &&
+                content_length != request->content_length)
+            {
+                return parse_fail(parser, 400);
+            }
+        }
+        request->content_length = content_length;
+    }
+    else if (http_slice_iequals(header->name, "connection"))
+    {
+        if (http_slice_iequals(header->value, "close"))
+        {
+            request->keep_alive = false;
+        }
+        else if (http_slice_iequals(header->value, "keep-alive"))
+        {
+            request->keep_alive = true;
+        }
+    }
+    else if (http_slice_iequals(header->name, "transfer-encoding"))
+    {
+        // chunked request bodies are not supported
+        return parse_fail(parser, 501);
+    }
+
+    return true;
+}
+
+void http_parser_reset(http_parser *parser, size_t start)
+{
+    parser->state = HTTP_STATE_REQUEST_LINE;
+    parser->scan = start;
+    parser->line_start = start;
+    parser->error_status = 0;
+    parser->request.method = (http_slice){0};
+    parser->request.target = (http_slice){0};
+    parser->request.body = (http_slice){0};
+    parser->request.minor_version = 0;
+    parser->request.keep_alive = false;
+    parser->request.content_length = 0;
+    parser->request.end = start;
+    parser->request.num_headers = 0;
+}
+
+http_parse_result http_parse(http_parser *parser, const char *buffer, size_t length)
+{
+    while (parser->state != HTTP_STATE_DONE && parser->state != HTTP_STATE_ERROR)
+    {
+        if (parser->state == HTTP_STATE_BODY)
+        {
+            http_request *request = &parser->request;
+            if (length - parser->line_start < request->content_length)
+            {
+                return HTTP_PARSE_INCOMPLETE;
+            }
+            request->body = (http_slice){.data = buffer + parser->line_start, .length = request->content_length};
+            request->end = parser->line_start + request->content_length;
+            parser->state = HTTP_STATE_DONE;
+            break;
+        }
+
+        // find the end of the current line. Only the bytes
+        // that have not been looked at before are scanned.
+        const char *lf = (const char *)memchr(buffer + parser->scan, '\n', length - parser->scan);
+        if (!lf)
+        {
+            parser->scan = length;
+            if (length - parser->line_start > HTTP_MAX_LINE)
+            {
+                parse_fail(parser, parser->state == HTTP_STATE_REQUEST_LINE ? 414 : 431);
+                break;
+            }
+            return HTTP_PARSE_INCOMPLETE;
+        }
+
+        const char *line = buffer + parser->line_start;
+        const char *end = lf;
+        if (end > line && end[-1] == '\r')
+        {
+            end--;
+        }
+        parser->line_start = parser->scan = (size_t)(lf - buffer) + 1;
+
+        if (end - line > HTTP_MAX_LINE)
+        {
+            parse_fail(parser, parser->state == HTTP_STATE_REQUEST_LINE ? 414 : 431);
+        }
+        else if (parser->state == HTTP_STATE_REQUEST_LINE)
+        {
+            // ignore empty lines before the request line (RFC 7230 3.5)
+            if (end != line && parse_request_line(parser, line, end))
+            {
+                parser->state = HTTP_STATE_HEADERS;
+            }
+        }
+        else if (end == line)
+        {
+            // end of headers
+            if (parser->request.content_length)
+            {
+                parser->state = HTTP_STATE_BODY;
+            }
+            else
+            {
+                parser->request.end = parser->line_start;
+                parser->state = HTTP_STATE_DONE;
+            }
+        }
+        else
+        {
+            parse_header_line(parser, line, end);
+        }
+    }
+
+    return parser->state == HTTP_STATE_DONE ? HTTP_PARSE_COMPLETE : HTTP_PARSE_ERROR;
+}
+
+bool http_request_header(const http_request *request, const char *name, http_slice *value)
+{
+    for (unsigned int i = 0; i < request->num_headers; i++)
+    {
+        if (http_slice_iequals(request->headers[i].name, name))
+        {
+            if (value)
+            {
+                *value = request->headers[i].value;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+bool http_slice_equals(http_slice slice, const char *str)
+{
+    size_t len = strlen(str);
+    return slice.length == len && memcmp(slice.data, str, len) == 0;
+}
+
+bool http_slice_iequals(http_slice slice, const char *str)
+{
+    size_t len = strlen(str);
+    return slice.length == len && strncasecmp(slice.data, str, len) == 0;
+}
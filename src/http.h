@@ -0,0 +1,105 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// An incremental HTTP/1.1 request parser. The parser never copies or
+// allocates. Everything it returns is a slice into the buffer that
+// was passed to it so the buffer must stay put until the request has
+// been handled. The parser remembers how far it got so more data can
+// be appended to the buffer and parsing continues where it left off.
+
+// the maximum number of headers kept per request
+#define HTTP_MAX_HEADERS 24
+
+// the maximum length of the request line or any one header line
+#define HTTP_MAX_LINE 2048
+
+// a piece of the connection buffer
+struct http_slice_s
+{
+    const char *data;
+    size_t length;
+};
+typedef struct http_slice_s http_slice;
+
+struct http_header_s
+{
+    http_slice name;
+    http_slice value;
+};
+typedef struct http_header_s http_header;
+
+struct http_request_s
+{
+    http_slice method;
+    http_slice target;
+    http_slice body;
+
+    // 0 for HTTP/1.0, 1 for HTTP/1.1
+    int minor_version;
+
+    // whether the connection should stay open after this request
+    bool keep_alive;
+
+    // the value of the Content-Length header, if any
+    size_t content_length;
+
+    // the offset of the first byte after this request
+    size_t end;
+
+    unsigned int num_headers;
+    http_header headers[HTTP_MAX_HEADERS];
+};
+typedef struct http_request_s http_request;
+
+enum http_parse_state_e
+{
+    HTTP_STATE_REQUEST_LINE,
+    HTTP_STATE_HEADERS,
+    HTTP_STATE_BODY,
+    HTTP_STATE_DONE,
+    HTTP_STATE_ERROR
+};
+
+enum http_parse_result_e
+{
+    HTTP_PARSE_INCOMPLETE,
+    HTTP_PARSE_COMPLETE,
+    HTTP_PARSE_ERROR
+};
+typedef enum http_parse_result_e http_parse_result;
+
+struct http_parser_s
+{
+    enum http_parse_state_e state;
+
+    // where the search for the next line feed resumes
+    size_t scan;
+
+    // where the line currently being parsed starts
+    size_t line_start;
+
+    // the status code to respond with if parsing failed
+    int error_status;
+
+    http_request request;
+};
+typedef struct http_parser_s http_parser;
+
+// reset the parser to parse a request starting at offset start in the buffer
+void http_parser_reset(http_parser *parser, size_t start);
+
+// parse as much of the buffer as possible. length is the total number
+// of bytes in the buffer, including bytes that have already been parsed.
+// Once complete, parser->request holds the request.
+http_parse_result http_parse(http_parser *parser, const char *buffer, size_t length);
+
+// find a header by (case insensitive) name. Returns false if not found.
+bool http_request_header(const http_request *request, const char *name, http_slice *value);
+
+// compare a slice to a string, case sensitive
+bool http_slice_equals(http_slice slice, const char *str);
+
+// compare a slice to a string, case insensitive
+bool http_slice_iequals(http_slice slice, const char *str);
@@ -0,0 +1,869 @@
+#include "http2.h"
+#include "hpack.h"
+#include "connection.h"
+#include "handler.h"
+#include "response.h"
+#include "worker.h"
+#include "logging.h"
+
+#include <string.h>
+
+// what every client sends first
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LENGTH (sizeof(HTTP2_PREFACE) - 1)
+
+#define FRAME_HEADER_LENGTH 9
+
+// the largest frame either side may send until told otherwise
+#define DEFAULT_MAX_FRAME_SIZE 16384
+#define MAX_MAX_FRAME_SIZE 16777215
+#define MAX_WINDOW 0x7fffffff
+
+// announced in our SETTINGS. Only a stream whose body is arriving stays
+// open, but clients pipeline up to this many requests.
+#define HTTP2_MAX_STREAMS 100
+
+// the most decoded header bytes a request may have, which is also
+// what we announce as SETTINGS_MAX_HEADER_LIST_SIZE
+#define HTTP2_HEADER_SPACE 4096
+
+// room for the frames queued between flushes
+#define HTTP2_OUT_SIZE 4096
+
+enum frame_type
+{
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9,
+};
+
+#define FLAG_ACK 0x1
+#define FLAG_END_STREAM 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+enum http2_error
+{
+    ERROR_NO_ERROR = 0x0,
+    ERROR_PROTOCOL = 0x1,
+    ERROR_INTERNAL = 0x2,
+    ERROR_FLOW_CONTROL = 0x3,
+    ERROR_STREAM_CLOSED = 0x5,
+    ERROR_FRAME_SIZE = 0x6,
+    ERROR_REFUSED_STREAM = 0x7,
+    ERROR_COMPRESSION = 0x9,
+    ERROR_ENHANCE_YOUR_CALM = 0xb,
+};
+
+enum settings_id
+{
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5,
+    SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+};
+
+// our half of the connection preface
+static const uint8_t server_settings[] = {
+    0, 0, 12, FRAME_SETTINGS, 0, 0, 0, 0, 0,
+    0, SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, HTTP2_MAX_STREAMS,
+    0, SETTINGS_MAX_HEADER_LIST_SIZE, 0, 0, HTTP2_HEADER_SPACE >> 8, HTTP2_HEADER_SPACE & 0xff,
+};
+
+struct http2_s
+{
+    // the client preface has been received
+    bool preface;
+    // GOAWAY has been sent, nothing more is processed
+    bool goaway;
+
+    // the highest stream the client has opened, and the
+    // stream whose request is being handled
+    uint32_t last_stream;
+    uint32_t stream;
+
+    // a header block that continues in CONTINUATION frames
+    uint32_t block_stream;
+    bool block_end_stream;
+    size_t block_length;
+
+    // the rest of a DATA frame, or a frame that is ignored, which is
+    // consumed as it arrives. The stream is 0 if it is thrown away.
+    uint32_t payload_remaining;
+    uint32_t payload_padding;
+    uint32_t payload_stream;
+    bool payload_end_stream;
+
+    // DATA consumed since the last WINDOW_UPDATE
+    uint32_t window_credit;
+
+    // what the client lets us send. Nothing we send is flow
+    // controlled so the window is only checked for overflow.
+    int64_t send_window;
+    uint32_t max_frame_size;
+
+    struct hpack_table_s decoder;
+    struct hpack_encoder_s encoder;
+
+    // the request whose body is arriving
+    uint32_t pending_stream;
+    bool pending_too_large;
+    unsigned int pending_count;
+    http_header pending_headers[HTTP_MAX_HEADERS];
+    size_t body_length;
+    char body[CONNECTION_BUFFER_SIZE];
+
+    // decoded header names and values. While a request is
+    // pending one of them holds its headers.
+    unsigned int space;
+    char spaces[2][HTTP2_HEADER_SPACE];
+
+    // a header block gathered from several frames
+    uint8_t block[CONNECTION_BUFFER_SIZE];
+
+    // frames queued since the last flush
+    size_t out_length;
+    uint8_t out[HTTP2_OUT_SIZE];
+};
+
+static uint32_t read32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void write32(uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+static void frame_header(uint8_t *out, size_t length, uint8_t type, uint8_t flags, uint32_t stream)
+{
+    out[0] = (uint8_t)(length >> 16);
+    out[1] = (uint8_t)(length >> 8);
+    out[2] = (uint8_t)length;
+    out[3] = type;
+    out[4] = flags;
+    write32(out + 5, stream);
+}
+
+// space for frames. It is reused once everything in it has been flushed.
+static uint8_t *http2_reserve(struct connection_s *conn, size_t length)
+{
+    struct http2_s *h2 = conn->http2;
+    if (conn->iovcnt == 0)
+    {
+        h2->out_length = 0;
+    }
+    if (h2->out_length + length > HTTP2_OUT_SIZE)
+    {
+        if (!connection_flush(conn))
+        {
+            return NULL;
+        }
+        h2->out_length = 0;
+    }
+    return h2->out + h2->out_length;
+}
+
+static bool http2_frame(struct connection_s *conn, uint8_t type, uint8_t flags, uint32_t stream,
+                        const void *payload, size_t length)
+{
+    uint8_t *out = http2_reserve(conn, FRAME_HEADER_LENGTH + length);
+    if (!out)
+    {
+        return false;
+    }
+    frame_header(out, length, type, flags, stream);
+    if (length)
+    {
+        memcpy(out + FRAME_HEADER_LENGTH, payload, length);
+    }
+    conn->http2->out_length += FRAME_HEADER_LENGTH + length;
+    return connection_send(conn, out, FRAME_HEADER_LENGTH + length);
+}
+
+static bool http2_rst_stream(struct connection_s *conn, uint32_t stream, enum http2_error error)
+{
+    uint8_t payload[4];
+    write32(payload, error);
+    return http2_frame(conn, FRAME_RST_STREAM, 0, stream, payload, sizeof(payload));
+}
+
+// tell the client which requests were handled and close once it has been sent
+static bool http2_goaway(struct connection_s *conn, enum http2_error error)
+{
+    struct http2_s *h2 = conn->http2;
+    if (error != ERROR_NO_ERROR)
+    {
+        debugf("HTTP/2 connection error %d", (int)error);
+    }
+
+    uint8_t payload[8];
+    write32(payload, h2->last_stream);
+    write32(payload + 4, error);
+    h2->goaway = true;
+    conn->close_after_write = true;
+    return http2_frame(conn, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+bool http2_open(struct connection_s *conn)
+{
+    struct http2_s *h2 = (struct http2_s *)malloc(sizeof(struct http2_s));
+    if (!h2)
+    {
+        warn("Could not allocate memory for HTTP/2 connection");
+        return false;
+    }
+
+    h2->preface = false;
+    h2->goaway = false;
+    h2->last_stream = 0;
+    h2->stream = 0;
+    h2->block_stream = 0;
+    h2->block_end_stream = false;
+    h2->block_length = 0;
+    h2->payload_remaining = 0;
+    h2->payload_padding = 0;
+    h2->payload_stream = 0;
+    h2->payload_end_stream = false;
+    h2->window_credit = 0;
+    h2->send_window = 65535;
+    h2->max_frame_size = DEFAULT_MAX_FRAME_SIZE;
+    hpack_table_init(&h2->decoder);
+    hpack_encoder_init(&h2->encoder);
+    h2->pending_stream = 0;
+    h2->pending_too_large = false;
+    h2->pending_count = 0;
+    h2->body_length = 0;
+    h2->space = 0;
+    h2->out_length = 0;
+
+    conn->http2 = h2;
+    debug("HTTP/2 negotiated");
+    return connection_send(conn, server_settings, sizeof(server_settings));
+}
+
+void http2_close(struct connection_s *conn)
+{
+    if (conn->http2)
+    {
+        free(conn->http2);
+        conn->http2 = NULL;
+    }
+}
+
+bool http2_idle(const struct connection_s *conn)
+{
+    const struct http2_s *h2 = conn->http2;
+    return !h2->pending_stream && !h2->block_stream && !h2->payload_remaining;
+}
+
+// hand a complete request to the handler
+static bool http2_request(struct connection_s *conn, uint32_t stream, const http_header *headers,
+                          unsigned int count, const char *body, size_t body_length, bool too_large)
+{
+    struct http2_s *h2 = conn->http2;
+    http_request request;
+    memset(&request, 0, sizeof(request));
+    request.minor_version = 1;
+    request.keep_alive = true;
+    request.body = (http_slice){body, body_length};
+
+    bool malformed = false;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        const http_header *header = &headers[i];
+        if (header->name.length && header->name.data[0] == ':')
+        {
+            if (http_slice_equals(header->name, ":method"))
+            {
+                request.method = header->value;
+            }
+            else if (http_slice_equals(header->name, ":path"))
+            {
+                request.target = header->value;
+            }
+            else if (!http_slice_equals(header->name, ":scheme") &&
+                     !http_slice_equals(header->name, ":authority"))
+            {
+                malformed = true;
+            }
+        }
+        else if (request.num_headers < HTTP_MAX_HEADERS)
+        {
+            request.headers[request.num_headers++] = *header;
+            if (http_slice_equals(header->name, "content-length"))
+            {
+                size_t length = 0;
+                for (size_t j = 0; j < header->value.length; j++)
+                {
+                    char c = header->value.data[j];
+                    malformed = malformed || c < '0' || c > '9';
+                    length = length * 10 + (size_t)(c - '0');
+                }
+                request.content_length = length;
+            }
+        }
+    }
+
+    h2->stream = stream;
+    bool result;
+    if (malformed || !request.method.length || !request.target.length)
+    {
+        result = response_status(conn, 400, true);
+    }
+    else if (too_large)
+    {
+        result = response_status(conn, 413, true);
+    }
+    else
+    {
+        result = handler_request(conn, &request);
+    }
+    conn->stats.requests++;
+    return result;
+}
+
+// the body of the pending request is complete
+static bool http2_request_pending(struct connection_s *conn)
+{
+    struct http2_s *h2 = conn->http2;
+    uint32_t stream = h2->pending_stream;
+    h2->pending_stream = 0;
+    return http2_request(conn, stream, h2->pending_headers, h2->pending_count,
+                         h2->body, h2->body_length, h2->pending_too_large);
+}
+
+// a complete header block has arrived
+static bool http2_headers(struct connection_s *conn, uint32_t stream, bool end_stream,
+                          const uint8_t *block, size_t length)
+{
+    struct http2_s *h2 = conn->http2;
+    http_header headers[HTTP_MAX_HEADERS];
+    unsigned int count;
+    enum hpack_result result = hpack_decode(&h2->decoder, block, length,
+                                            h2->spaces[h2->space], HTTP2_HEADER_SPACE,
+                                            headers, HTTP_MAX_HEADERS, &count);
+    if (result != HPACK_OK)
+    {
+        // the decoder is out of step with the client now
+        return http2_goaway(conn, result == HPACK_TOO_LARGE ? ERROR_ENHANCE_YOUR_CALM : ERROR_COMPRESSION);
+    }
+
+    // trailers end the pending request
+    if (stream == h2->pending_stream)
+    {
+        return end_stream ? http2_request_pending(conn) : http2_goaway(conn, ERROR_PROTOCOL);
+    }
+
+    if (end_stream)
+    {
+        return http2_request(conn, stream, headers, count, NULL, 0, false);
+    }
+
+    // one request at a time may wait for its body
+    if (h2->pending_stream)
+    {
+        return http2_rst_stream(conn, stream, ERROR_REFUSED_STREAM);
+    }
+    h2->pending_stream = stream;
+    h2->pending_too_large = false;
+    h2->pending_count = count;
+    memcpy(h2->pending_headers, headers, count * sizeof(http_header));
+    h2->body_length = 0;
+    h2->space ^= 1;
+    return true;
+}
+
+// consume what has arrived of a DATA frame or a frame that is ignored
+static bool http2_payload(struct connection_s *conn, const uint8_t *data, size_t available, size_t *used)
+{
+    struct http2_s *h2 = conn->http2;
+    size_t length = available < h2->payload_remaining ? available : h2->payload_remaining;
+    size_t content_left = h2->payload_remaining - h2->payload_padding;
+    size_t content = length < content_left ? length : content_left;
+    h2->payload_remaining -= (uint32_t)length;
+    *used = length;
+
+    if (h2->payload_stream && h2->payload_stream == h2->pending_stream)
+    {
+        if (h2->body_length + content > sizeof(h2->body))
+        {
+            // answer now and stop the client sending the rest
+            uint32_t stream = h2->pending_stream;
+            h2->pending_too_large = true;
+            return http2_request_pending(conn) &&
+                   http2_rst_stream(conn, stream, ERROR_NO_ERROR);
+        }
+        memcpy(h2->body + h2->body_length, data, content);
+        h2->body_length += content;
+    }
+
+    if (h2->payload_remaining == 0)
+    {
+        h2->payload_padding = 0;
+        if (h2->payload_end_stream && h2->payload_stream == h2->pending_stream && h2->pending_stream)
+        {
+            return http2_request_pending(conn);
+        }
+    }
+    return true;
+}
+
+static bool http2_settings(struct connection_s *conn, uint8_t flags, const uint8_t *payload, size_t length)
+{
+    struct http2_s *h2 = conn->http2;
+    if (flags & FLAG_ACK)
+    {
+        return length == 0 ? true : http2_goaway(conn, ERROR_FRAME_SIZE);
+    }
+    if (length % 6)
+    {
+        return http2_goaway(conn, ERROR_FRAME_SIZE);
+    }
+
+    for (size_t i = 0; i < length; i += 6)
+    {
+        uint16_t id = (uint16_t)((payload[i] << 8) | payload[i + 1]);
+        uint32_t value = read32(payload + i + 2);
+        switch (id)
+        {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            hpack_encoder_resize(&h2->encoder, value);
+            break;
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1)
+            {
+                return http2_goaway(conn, ERROR_PROTOCOL);
+            }
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > MAX_WINDOW)
+            {
+                return http2_goaway(conn, ERROR_FLOW_CONTROL);
+            }
+            break;
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < DEFAULT_MAX_FRAME_SIZE || value > MAX_MAX_FRAME_SIZE)
+            {
+                return http2_goaway(conn, ERROR_PROTOCOL);
+            }
+            h2->max_frame_size = value;
+            break;
+        default:
+            break;
+        }
+    }
+    return http2_frame(conn, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+static bool http2_window_update(struct connection_s *conn, uint32_t stream, const uint8_t *payload)
+{
+    struct http2_s *h2 = conn->http2;
+    uint32_t increment = read32(payload) & MAX_WINDOW;
+    if (stream)
+    {
+        return increment ? true : http2_rst_stream(conn, stream, ERROR_PROTOCOL);
+    }
+    if (!increment)
+    {
+        return http2_goaway(conn, ERROR_PROTOCOL);
+    }
+    h2->send_window += increment;
+    return h2->send_window > MAX_WINDOW ? http2_goaway(conn, ERROR_FLOW_CONTROL) : true;
+}
+
+// the start of a HEADERS frame. The block is decoded once it is complete.
+static bool http2_headers_frame(struct connection_s *conn, uint8_t flags, uint32_t stream,
+                                const uint8_t *payload, size_t length)
+{
+    struct http2_s *h2 = conn->http2;
+    if (stream == 0 || !(stream & 1))
+    {
+        return http2_goaway(conn, ERROR_PROTOCOL);
+    }
+    if (stream > h2->last_stream)
+    {
+        h2->last_stream = stream;
+    }
+    else if (stream != h2->pending_stream)
+    {
+        return http2_goaway(conn, ERROR_STREAM_CLOSED);
+    }
+
+    size_t start = 0;
+    size_t padding = 0;
+    if (flags & FLAG_PADDED)
+    {
+        if (length == 0)
+        {
+            return http2_goaway(conn, ERROR_PROTOCOL);
+        }
+        padding = payload[0];
+        start = 1;
+    }
+    if (flags & FLAG_PRIORITY)
+    {
+        start += 5;
+    }
+    if (start + padding > length)
+    {
+        return http2_goaway(conn, ERROR_PROTOCOL);
+    }
+
+    const uint8_t *fragment = payload + start;
+    size_t fragment_length = length - start - padding;
+    bool end_stream = flags & FLAG_END_STREAM;
+    if (flags & FLAG_END_HEADERS)
+    {
+        return http2_headers(conn, stream, end_stream, fragment, fragment_length);
+    }
+
+    if (fragment_length > sizeof(h2->block))
+    {
+        return http2_goaway(conn, ERROR_ENHANCE_YOUR_CALM);
+    }
+    memcpy(h2->block, fragment, fragment_length);
+    h2->block_length = fragment_length;
+    h2->block_stream = stream;
+    h2->block_end_stream = end_stream;
+    return true;
+}
+
+static bool http2_continuation(struct connection_s *conn, uint8_t flags, uint32_t stream,
+                               const uint8_t *payload, size_t length)
+{
+    struct http2_s *h2 = conn->http2;
+    if (stream != h2->block_stream)
+    {
+        return http2_goaway(conn, ERROR_PROTOCOL);
+    }
+    if (h2->block_length + length > sizeof(h2->block))
+    {
+        return http2_goaway(conn, ERROR_ENHANCE_YOUR_CALM);
+    }
+    memcpy(h2->block + h2->block_length, payload, length);
+    h2->block_length += length;
+    if (!(flags & FLAG_END_HEADERS))
+    {
+        return true;
+    }
+
+    h2->block_stream = 0;
+    return http2_headers(conn, stream, h2->block_end_stream, h2->block, h2->block_length);
+}
+
+// a frame that has arrived in full
+static bool http2_frame_received(struct connection_s *conn, uint8_t type, uint8_t flags, uint32_t stream,
+                                 const uint8_t *payload, size_t length)
+{
+    struct http2_s *h2 = conn->http2;
+    switch (type)
+    {
+    case FRAME_HEADERS:
+        return http2_headers_frame(conn, flags, stream, payload, length);
+
+    case FRAME_CONTINUATION:
+        return http2_continuation(conn, flags, stream, payload, length);
+
+    case FRAME_PRIORITY:
+        if (stream == 0)
+        {
+            return http2_goaway(conn, ERROR_PROTOCOL);
+        }
+        return length == 5 ? true : http2_rst_stream(conn, stream, ERROR_FRAME_SIZE);
+
+    case FRAME_RST_STREAM:
+        if (stream == 0 || stream > h2->last_stream)
+        {
+            return http2_goaway(conn, ERROR_PROTOCOL);
+        }
+        if (length != 4)
+        {
+            return http2_goaway(conn, ERROR_FRAME_SIZE);
+        }
+        if (stream == h2->pending_stream)
+        {
+            h2->pending_stream = 0;
+        }
+        return true;
+
+    case FRAME_SETTINGS:
+        if (stream != 0)
+        {
+            return http2_goaway(conn, ERROR_PROTOCOL);
+        }
+        return http2_settings(conn, flags, payload, length);
+
+    case FRAME_PING:
+        if (stream != 0)
+        {
+            return http2_goaway(conn, ERROR_PROTOCOL);
+        }
+        if (length != 8)
+        {
+            return http2_goaway(conn, ERROR_FRAME_SIZE);
+        }
+        return (flags & FLAG_ACK) ? true : http2_frame(conn, FRAME_PING, FLAG_ACK, 0, payload, length);
+
+    case FRAME_GOAWAY:
+        if (stream != 0)
+        {
+            return http2_goaway(conn, ERROR_PROTOCOL);
+        }
+        // the client will not start anything new
+        conn->close_after_write = true;
+        return true;
+
+    case FRAME_WINDOW_UPDATE:
+        if (length != 4)
+        {
+            return http2_goaway(conn, ERROR_FRAME_SIZE);
+        }
+        return http2_window_update(conn, stream, payload);
+
+    default:
+        // clients do not push
+        return http2_goaway(conn, ERROR_PROTOCOL);
+    }
+}
+
+// the header of a DATA frame. Its payload is consumed as it arrives.
+static bool http2_data(struct connection_s *conn, uint8_t flags, uint32_t stream,
+                       const uint8_t *payload, size_t length)
+{
+    struct http2_s *h2 = conn->http2;
+    if (stream == 0 || stream > h2->last_stream)
+    {
+        return http2_goaway(conn, ERROR_PROTOCOL);
+    }
+
+    // all of it counts against the window, padding included
+    h2->window_credit += (uint32_t)length;
+
+    uint32_t padding = 0;
+    if (flags & FLAG_PADDED)
+    {
+        if (length == 0)
+        {
+            return http2_goaway(conn, ERROR_PROTOCOL);
+        }
+        padding = payload[0];
+        if (padding >= length)
+        {
+            return http2_goaway(conn, ERROR_PROTOCOL);
+        }
+        length--;
+    }
+    h2->payload_remaining = (uint32_t)length;
+    h2->payload_padding = padding;
+    h2->payload_stream = stream;
+    h2->payload_end_stream = flags & FLAG_END_STREAM;
+
+    // an empty frame can still end the stream
+    if (length == 0)
+    {
+        size_t used;
+        return http2_payload(conn, payload, 0, &used);
+    }
+    return true;
+}
+
+bool http2_process(struct connection_s *conn)
+{
+    struct http2_s *h2 = conn->http2;
+    const uint8_t *buffer = (const uint8_t *)conn->buffer;
+    size_t pos = 0;
+    bool result = true;
+
+    while (result && !h2->goaway && connection_can_process(conn))
+    {
+        size_t available = conn->length - pos;
+        if (!h2->preface)
+        {
+            size_t compare = available < HTTP2_PREFACE_LENGTH ? available : HTTP2_PREFACE_LENGTH;
+            if (memcmp(buffer + pos, HTTP2_PREFACE, compare) != 0)
+            {
+                result = http2_goaway(conn, ERROR_PROTOCOL);
+                break;
+            }
+            if (compare < HTTP2_PREFACE_LENGTH)
+            {
+                break;
+            }
+            pos += HTTP2_PREFACE_LENGTH;
+            h2->preface = true;
+            continue;
+        }
+
+        if (h2->payload_remaining)
+        {
+            if (available == 0)
+            {
+                break;
+            }
+            size_t used;
+            result = http2_payload(conn, buffer + pos, available, &used);
+            pos += used;
+            continue;
+        }
+
+        if (available < FRAME_HEADER_LENGTH)
+        {
+            break;
+        }
+        const uint8_t *header = buffer + pos;
+        size_t length = ((size_t)header[0] << 16) | ((size_t)header[1] << 8) | header[2];
+        uint8_t type = header[3];
+        uint8_t flags = header[4];
+        uint32_t stream = read32(header + 5) & MAX_WINDOW;
+
+        if (length > DEFAULT_MAX_FRAME_SIZE)
+        {
+            result = http2_goaway(conn, ERROR_FRAME_SIZE);
+            break;
+        }
+        if (h2->block_stream && type != FRAME_CONTINUATION)
+        {
+            result = http2_goaway(conn, ERROR_PROTOCOL);
+            break;
+        }
+
+        // DATA and unknown frames do not have to fit in the buffer
+        if (type == FRAME_DATA)
+        {
+            bool padded = (flags & FLAG_PADDED) && length > 0;
+            if (available < FRAME_HEADER_LENGTH + (padded ? 1 : 0))
+            {
+                break;
+            }
+            result = http2_data(conn, flags, stream, header + FRAME_HEADER_LENGTH, length);
+            pos += FRAME_HEADER_LENGTH + (padded ? 1 : 0);
+            continue;
+        }
+        if (type > FRAME_CONTINUATION)
+        {
+            h2->payload_remaining = (uint32_t)length;
+            h2->payload_padding = 0;
+            h2->payload_stream = 0;
+            h2->payload_end_stream = false;
+            pos += FRAME_HEADER_LENGTH;
+            continue;
+        }
+
+        if (FRAME_HEADER_LENGTH + length > CONNECTION_BUFFER_SIZE)
+        {
+            // only header blocks get this big, and they have to be
+            // decoded to keep the table in step
+            result = http2_goaway(conn, ERROR_ENHANCE_YOUR_CALM);
+            break;
+        }
+        if (available < FRAME_HEADER_LENGTH + length)
+        {
+            break;
+        }
+        result = http2_frame_received(conn, type, flags, stream, header + FRAME_HEADER_LENGTH, length);
+        pos += FRAME_HEADER_LENGTH + length;
+    }
+
+    // keep whatever is left of a frame for the next read
+    if (h2->goaway)
+    {
+        conn->length = 0;
+    }
+    else if (pos)
+    {
+        conn->length -= pos;
+        memmove(conn->buffer, conn->buffer + pos, conn->length);
+    }
+
+    // let the client send as much again as it has sent and we consumed
+    if (result && h2->window_credit && !h2->goaway)
+    {
+        uint8_t payload[4];
+        write32(payload, h2->window_credit);
+        h2->window_credit = 0;
+        result = http2_frame(conn, FRAME_WINDOW_UPDATE, 0, 0, payload, sizeof(payload));
+    }
+
+    // a draining worker answers what it has and sends the client elsewhere
+    if (result && conn->worker->draining && !h2->goaway)
+    {
+        result = http2_goaway(conn, ERROR_NO_ERROR);
+    }
+
+    return result;
+}
+
+bool http2_response_status(struct connection_s *conn, int status)
+{
+    struct http2_s *h2 = conn->http2;
+    uint8_t *out = http2_reserve(conn, FRAME_HEADER_LENGTH + HPACK_MAX_RESPONSE_PREFIX + HPACK_MAX_RESPONSE_SUFFIX);
+    if (!out)
+    {
+        return false;
+    }
+
+    uint8_t *prefix = out + FRAME_HEADER_LENGTH;
+    size_t prefix_length;
+    size_t suffix_length;
+    if (!hpack_encode_response(&h2->encoder, status, 0, prefix, &prefix_length,
+                               prefix + HPACK_MAX_RESPONSE_PREFIX, &suffix_length))
+    {
+        return false;
+    }
+    memmove(prefix + prefix_length, prefix + HPACK_MAX_RESPONSE_PREFIX, suffix_length);
+
+    size_t length = prefix_length + suffix_length;
+    frame_header(out, length, FRAME_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, h2->stream);
+    h2->out_length += FRAME_HEADER_LENGTH + length;
+    return connection_send(conn, out, FRAME_HEADER_LENGTH + length);
+}
+
+bool http2_response_redirect(struct connection_s *conn, const database_url *url)
+{
+    struct http2_s *h2 = conn->http2;
+    size_t url_length = database_url_length(url);
+    if (url_length + HPACK_MAX_RESPONSE_PREFIX + HPACK_MAX_RESPONSE_SUFFIX > h2->max_frame_size)
+    {
+        warn("Redirect does not fit in a frame");
+        return http2_response_status(conn, 500);
+    }
+
+    uint8_t *out = http2_reserve(conn, FRAME_HEADER_LENGTH + HPACK_MAX_RESPONSE_PREFIX + HPACK_MAX_RESPONSE_SUFFIX);
+    if (!out)
+    {
+        return false;
+    }
+
+    // the url goes out from where it is, between the two halves of the block
+    uint8_t *prefix = out + FRAME_HEADER_LENGTH;
+    uint8_t *suffix = prefix + HPACK_MAX_RESPONSE_PREFIX;
+    size_t prefix_length;
+    size_t suffix_length;
+    if (!hpack_encode_response(&h2->encoder, 302, url_length, prefix, &prefix_length, suffix, &suffix_length))
+    {
+        return false;
+    }
+
+    frame_header(out, prefix_length + url_length + suffix_length,
+                 FRAME_HEADERS, FLAG_END_STREAM | FLAG_END_HEADERS, h2->stream);
+    h2->out_length += FRAME_HEADER_LENGTH + HPACK_MAX_RESPONSE_PREFIX + suffix_length;
+    return connection_send(conn, out, FRAME_HEADER_LENGTH + prefix_length) &&
+           (url->prefix_length == 0 || connection_send(conn, url->prefix, url->prefix_length)) &&
+           connection_send(conn, url->suffix, url->suffix_length) &&
+           connection_send(conn, suffix, suffix_length);
+}
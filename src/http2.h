@@ -0,0 +1,40 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "database.h"
+
+struct connection_s;
+
+// HTTP/2 (RFC 9113) for connections that negotiate it with ALPN on the
+// secure port. Frames are parsed out of the connection's read buffer
+// like HTTP/1.1 requests are, and every complete request goes to the same
+// handler. Responses have no body, so nothing we send is flow controlled;
+// the client's DATA is credited back only as it is consumed, so a client
+// that stops reading its responses stops being able to send as well.
+//
+// Requests are answered as soon as they are complete, so the only stream
+// that stays open is one whose body is still arriving.
+
+// the ALPN protocol identifier
+#define HTTP2_ALPN "h2"
+
+// set a connection up for HTTP/2 and queue the server preface
+bool http2_open(struct connection_s *conn);
+
+// free the HTTP/2 state of a connection
+void http2_close(struct connection_s *conn);
+
+// handle all the complete frames in the connection buffer. Returns false
+// if the connection should be closed right away.
+bool http2_process(struct connection_s *conn);
+
+// whether the connection is between requests
+bool http2_idle(const struct connection_s *conn);
+
+// queue a response with no body on the stream being handled
+bool http2_response_status(struct connection_s *conn, int status);
+
+// queue a redirect on the stream being handled. The url is not copied.
+bool http2_response_redirect(struct connection_s *conn, const database_url *url);
@@ -0,0 +1,638 @@
+#include "jwt.h"
+#include "config.h"
+#include "logging.h"
+
+#include <string.h>
+
+#include <openssl/bio.h>
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/sha.h>
+
+// entries per set
+#define JWT_WAYS 2u
+
+// the most decoded bytes accepted for each part of a token
+#define JWT_MAX_HEADER 512
+#define JWT_MAX_PAYLOAD 2048
+#define JWT_MAX_SIGNATURE 1024
+
+// the issuer key and the one algorithm tokens signed with it may use
+static EVP_PKEY *issuer_key = NULL;
+static const char *issuer_algorithm = NULL;
+static const EVP_MD *issuer_digest = NULL;
+// for ECDSA, the length of each of r and s in a signature. 0 for RSA.
+static size_t issuer_coordinate_length = 0;
+
+bool jwt_init(void)
+{
+    const config_t *config = config_get();
+    if (!config->jwt_issuer || !config->jwt_issuer[0] ||
+        !config->jwt_issuer_key || !config->jwt_issuer_key[0] ||
+        !config->jwt_audience || !config->jwt_audience[0])
+    {
+        return false;
+    }
+
+    // the key is either PEM itself or the file it is in
+    BIO *bio = strstr(config->jwt_issuer_key, "-----BEGIN")
+                   ? BIO_new_mem_buf(config->jwt_issuer_key, -1)
+                   : BIO_new_file(config->jwt_issuer_key, "r");
+    EVP_PKEY *key = bio ? PEM_read_bio_PUBKEY(bio, NULL, NULL, NULL) : NULL;
+    BIO_free(bio);
+    if (!key)
+    {
+        error("Could not load the JWT issuer key");
+        log_ssl_errors();
+        return false;
+    }
+
+    int bits = EVP_PKEY_get_bits(key);
+    switch (EVP_PKEY_get_base_id(key))
+    {
+    case EVP_PKEY_EC:
+        issuer_coordinate_length = (size_t)(bits + 7) / 8;
+        if (bits == 256)
+        {
+            issuer_algorithm = "ES256";
+            issuer_digest = EVP_sha256();
+        }
+        else if (bits == 384)
+        {
+            issuer_algorithm = "ES384";
+            issuer_digest = EVP_sha384();
+        }
+        else if (bits == 521)
+        {
+            issuer_algorithm = "ES512";
+            issuer_digest = EVP_sha512();
+        }
+        break;
+    case EVP_PKEY_RSA:
+        issuer_coordinate_length = 0;
+        issuer_algorithm = "RS256";
+        issuer_digest = EVP_sha256();
+        break;
+    }
+    if (!issuer_algorithm)
+    {
+        errorf("The JWT issuer key (%d bits) is not an RSA or P-256, P-384 or P-521 key", bits);
+        EVP_PKEY_free(key);
+        return false;
+    }
+
+    issuer_key = key;
+    debugf("JWT tokens are verified with %s", issuer_algorithm);
+    return true;
+}
+
+bool jwt_enabled(void)
+{
+    return issuer_key != NULL;
+}
+
+void jwt_cleanup(void)
+{
+    EVP_PKEY_free(issuer_key);
+    issuer_key = NULL;
+    issuer_algorithm = NULL;
+}
+
+bool jwt_cache_open(struct jwt_cache_s *cache)
+{
+    const config_t *config = config_get();
+    *cache = (struct jwt_cache_s){0};
+    if (!config->jwt_cache)
+    {
+        return true;
+    }
+
+    // enough sets to hold every token, rounded up to a power of two
+    unsigned int bits = 0;
+    while (bits < 24 && (JWT_WAYS << bits) < config->jwt_cache)
+    {
+        bits++;
+    }
+    cache->bits = bits;
+
+    cache->entries = (struct jwt_entry_s *)calloc((size_t)JWT_WAYS << bits, sizeof(struct jwt_entry_s));
+    if (!cache->entries)
+    {
+        critical_error("Could not allocate JWT cache");
+        return false;
+    }
+    return true;
+}
+
+void jwt_cache_close(struct jwt_cache_s *cache)
+{
+    free(cache->entries);
+    cache->entries = NULL;
+}
+
+// the entries a digest may be kept in
+static struct jwt_entry_s *jwt_cache_set(struct jwt_cache_s *cache, const uint8_t *digest)
+{
+    uint32_t hash = ((uint32_t)digest[0] << 24) | ((uint32_t)digest[1] << 16) |
+                    ((uint32_t)digest[2] << 8) | digest[3];
+    uint32_t set = cache->bits ? hash >> (32 - cache->bits) : 0;
+    return &cache->entries[set * JWT_WAYS];
+}
+
+static int base64url_digit(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+    {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z')
+    {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0' + 52;
+    }
+    if (c == '-')
+    {
+        return 62;
+    }
+    if (c == '_')
+    {
+        return 63;
+    }
+    return -1;
+}
+
+// decode unpadded base64url. Returns false if the input is malformed
+// or decodes to more than capacity bytes.
+static bool base64url_decode(const char *in, size_t length, uint8_t *out, size_t capacity, size_t *decoded)
+{
+    if (length % 4 == 1 || length / 4 * 3 + (length % 4 ? length % 4 - 1 : 0) > capacity)
+    {
+        return false;
+    }
+
+    uint32_t bits = 0;
+    unsigned int count = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        int digit = base64url_digit(in[i]);
+        if (digit < 0)
+        {
+            return false;
+        }
+        bits = (bits << 6) | (uint32_t)digit;
+        count += 6;
+        if (count >= 8)
+        {
+            count -= 8;
+            out[n++] = (uint8_t)(bits >> count);
+        }
+    }
+    *decoded = n;
+    return true;
+}
+
+// a value in a JSON object. Strings are left escaped
+// and without their quotes.
+enum json_type
+{
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OTHER,
+};
+
+struct json_value_s
+{
+    enum json_type type;
+    const char *data;
+    size_t length;
+};
+
+static const char *json_space(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+    {
+        p++;
+    }
+    return p;
+}
+
+// the end of the value at p, or NULL if it is malformed
+static const char *json_skip(const char *p, const char *end)
+{
+    if (p >= end)
+    {
+        return NULL;
+    }
+    if (*p == '"')
+    {
+        for (p++; p < end; p++)
+        {
+            if (*p == '\\')
+            {
+                p++;
+            }
+            else if (*p == '"')
+            {
+                return p + 1;
+            }
+        }
+        return NULL;
+    }
+    if (*p == '{' || *p == '[')
+    {
+        int depth = 0;
+        while (p < end)
+        {
+            if (*p == '"')
+            {
+                p = json_skip(p, end);
+                if (!p)
+                {
+                    return NULL;
+                }
+                continue;
+            }
+            if (*p == '{' || *p == '[')
+            {
+                depth++;
+            }
+            else if (*p == '}' || *p == ']')
+            {
+                if (--depth == 0)
+                {
+                    return p + 1;
+                }
+            }
+            p++;
+        }
+        return NULL;
+    }
+
+    // a number, true, false or null
+    const char *start = p;
+    while (p < end && *p != ',' && *p != '}' && *p != ']' &&
+           *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+    {
+        p++;
+    }
+    return p > start ? p : NULL;
+}
+
+static void json_value(const char *start, const char *end, struct json_value_s *value)
+{
+    if (*start == '"')
+    {
+        value->type = JSON_STRING;
+        value->data = start + 1;
+        value->length = (size_t)(end - start) - 2;
+    }
+    else
+    {
+        value->type = *start == '[' ? JSON_ARRAY : JSON_OTHER;
+        value->data = start;
+        value->length = (size_t)(end - start);
+    }
+}
+
+// whether an escaped JSON string is the same as str
+static bool json_string_equals(const char *data, size_t length, const char *str)
+{
+    size_t i = 0;
+    for (; i < length; i++, str++)
+    {
+        char c = data[i];
+        if (c == '\\' && i + 1 < length)
+        {
+            c = data[++i];
+            switch (c)
+            {
+            case 'b':
+                c = '\b';
+                break;
+            case 'f':
+                c = '\f';
+                break;
+            case 'n':
+                c = '\n';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'u':
+                // only the ASCII range is compared
+                if (i + 4 >= length || strncmp(data + i + 1, "00", 2) != 0)
+                {
+                    return false;
+                }
+                {
+                    char hex[3] = {data[i + 3], data[i + 4], 0};
+                    char *hex_end;
+                    c = (char)strtoul(hex, &hex_end, 16);
+                    if (hex_end != hex + 2 || (unsigned char)c >= 0x80)
+                    {
+                        return false;
+                    }
+                }
+                i += 4;
+                break;
+            }
+        }
+        // a decoded \u0000 would match the terminator
+        if (*str == '\0' || *str != c)
+        {
+            return false;
+        }
+    }
+    return *str == '\0';
+}
+
+// find a member of the object in json. Returns false if it is not
+// there or the object is malformed.
+static bool json_member(const char *json, size_t length, const char *name, struct json_value_s *value)
+{
+    const char *end = json + length;
+    const char *p = json_space(json, end);
+    if (p >= end || *p != '{')
+    {
+        return false;
+    }
+    p = json_space(p + 1, end);
+    if (p < end && *p == '}')
+    {
+        return false;
+    }
+
+    while (p < end)
+    {
+        const char *key = p;
+        p = *p == '"' ? json_skip(p, end) : NULL;
+        if (!p)
+        {
+            return false;
+        }
+        struct json_value_s key_value;
+        json_value(key, p, &key_value);
+
+        p = json_space(p, end);
+        if (p >= end || *p != ':')
+        {
+            return false;
+        }
+        p = json_space(p + 1, end);
+        const char *start = p;
+        p = json_skip(p, end);
+        if (!p)
+        {
+            return false;
+        }
+        if (json_string_equals(key_value.data, key_value.length, name))
+        {
+            json_value(start, p, value);
+            return true;
+        }
+
+        p = json_space(p, end);
+        if (p >= end || *p != ',')
+        {
+            return false;
+        }
+        p = json_space(p + 1, end);
+    }
+    return false;
+}
+
+// a NumericDate, which may have a fraction. Returns false if it is not one.
+static bool json_date(const struct json_value_s *value, uint64_t *date)
+{
+    if (value->type != JSON_OTHER || value->length == 0 || value->data[0] < '0' || value->data[0] > '9')
+    {
+        return false;
+    }
+    uint64_t result = 0;
+    for (size_t i = 0; i < value->length && value->data[i] >= '0' && value->data[i] <= '9'; i++)
+    {
+        if (result > UINT64_MAX / 10 - 1)
+        {
+            return false;
+        }
+        result = result * 10 + (uint64_t)(value->data[i] - '0');
+    }
+    *date = result;
+    return true;
+}
+
+// whether aud is the audience, or an array that has it
+static bool jwt_audience_matches(const struct json_value_s *aud, const char *audience)
+{
+    if (aud->type == JSON_STRING)
+    {
+        return json_string_equals(aud->data, aud->length, audience);
+    }
+    if (aud->type != JSON_ARRAY)
+    {
+        return false;
+    }
+
+    const char *end = aud->data + aud->length - 1;
+    const char *p = json_space(aud->data + 1, end);
+    while (p < end)
+    {
+        const char *start = p;
+        p = json_skip(p, end);
+        if (!p)
+        {
+            return false;
+        }
+        struct json_value_s element;
+        json_value(start, p, &element);
+        if (element.type == JSON_STRING && json_string_equals(element.data, element.length, audience))
+        {
+            return true;
+        }
+        p = json_space(p, end);
+        if (p < end && *p == ',')
+        {
+            p = json_space(p + 1, end);
+        }
+        else
+        {
+            break;
+        }
+    }
+    return false;
+}
+
+// check the signature on the first length bytes of the token
+static bool jwt_signature_valid(const char *input, size_t length, const uint8_t *signature, size_t signature_length)
+{
+    // JWS carries ECDSA signatures as r and s back to back,
+    // where OpenSSL wants them DER encoded
+    uint8_t der[JWT_MAX_SIGNATURE];
+    if (issuer_coordinate_length)
+    {
+        if (signature_length != 2 * issuer_coordinate_length)
+        {
+            return false;
+        }
+        ECDSA_SIG *sig = ECDSA_SIG_new();
+        BIGNUM *r = BN_bin2bn(signature, (int)issuer_coordinate_length, NULL);
+        BIGNUM *s = BN_bin2bn(signature + issuer_coordinate_length, (int)issuer_coordinate_length, NULL);
+        if (!sig || !r || !s || !ECDSA_SIG_set0(sig, r, s))
+        {
+            BN_free(r);
+            BN_free(s);
+            ECDSA_SIG_free(sig);
+            return false;
+        }
+        unsigned char *p = der;
+        int der_length = i2d_ECDSA_SIG(sig, NULL) <= (int)sizeof(der) ? i2d_ECDSA_SIG(sig, &p) : -1;
+        ECDSA_SIG_free(sig);
+        if (der_length <= 0)
+        {
+            return false;
+        }
+        signature = der;
+        signature_length = (size_t)der_length;
+    }
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    bool valid = ctx &&
+                 EVP_DigestVerifyInit(ctx, NULL, issuer_digest, NULL, issuer_key) == 1 &&
+                 EVP_DigestVerify(ctx, signature, signature_length, (const unsigned char *)input, length) == 1;
+    EVP_MD_CTX_free(ctx);
+    ERR_clear_error();
+    return valid;
+}
+
+// verify a token from scratch. expires is set to its exp claim.
+static bool jwt_check(const char *token, size_t length, uint64_t now, uint64_t *expires)
+{
+    const config_t *config = config_get();
+
+    // header.payload.signature
+    const char *dot1 = memchr(token, '.', length);
+    const char *dot2 = dot1 ? memchr(dot1 + 1, '.', length - (size_t)(dot1 + 1 - token)) : NULL;
+    if (!dot2 || memchr(dot2 + 1, '.', length - (size_t)(dot2 + 1 - token)))
+    {
+        return false;
+    }
+
+    char header[JWT_MAX_HEADER];
+    char payload[JWT_MAX_PAYLOAD];
+    uint8_t signature[JWT_MAX_SIGNATURE];
+    size_t header_length, payload_length, signature_length;
+    if (!base64url_decode(token, (size_t)(dot1 - token), (uint8_t *)header, sizeof(header), &header_length) ||
+        !base64url_decode(dot1 + 1, (size_t)(dot2 - dot1 - 1), (uint8_t *)payload, sizeof(payload), &payload_length) ||
+        !base64url_decode(dot2 + 1, length - (size_t)(dot2 + 1 - token), signature, sizeof(signature), &signature_length))
+    {
+        return false;
+    }
+
+    // the algorithm has to be the key's, and nothing
+    // we do not understand may be marked critical
+    struct json_value_s value;
+    if (!json_member(header, header_length, "alg", &value) || value.type != JSON_STRING ||
+        !json_string_equals(value.data, value.length, issuer_algorithm) ||
+        json_member(header, header_length, "crit", &value))
+    {
+        debug("JWT with the wrong algorithm");
+        return false;
+    }
+
+    if (!json_member(payload, payload_length, "iss", &value) || value.type != JSON_STRING ||
+        !json_string_equals(value.data, value.length, config->jwt_issuer))
+    {
+        debug("JWT from another issuer");
+        return false;
+    }
+    if (!json_member(payload, payload_length, "aud", &value) ||
+        !jwt_audience_matches(&value, config->jwt_audience))
+    {
+        debug("JWT for another audience");
+        return false;
+    }
+    uint64_t exp, nbf;
+    if (!json_member(payload, payload_length, "exp", &value) || !json_date(&value, &exp) || exp <= now)
+    {
+        debug("JWT expired or without an expiry");
+        return false;
+    }
+    if (json_member(payload, payload_length, "nbf", &value) && (!json_date(&value, &nbf) || nbf > now))
+    {
+        debug("JWT not valid yet");
+        return false;
+    }
+
+    // the expensive part comes last
+    if (!jwt_signature_valid(token, (size_t)(dot2 - token), signature, signature_length))
+    {
+        debug("JWT with an invalid signature");
+        return false;
+    }
+
+    *expires = exp;
+    return true;
+}
+
+bool jwt_verify(struct jwt_cache_s *cache, const char *token, size_t length, uint64_t now)
+{
+    if (!issuer_key)
+    {
+        return false;
+    }
+    if (!cache->entries)
+    {
+        uint64_t expires;
+        return jwt_check(token, length, now, &expires);
+    }
+
+    uint8_t digest[JWT_DIGEST_LENGTH];
+    SHA256((const unsigned char *)token, length, digest);
+    struct jwt_entry_s *ways = jwt_cache_set(cache, digest);
+    cache->clock++;
+
+    for (unsigned int i = 0; i < JWT_WAYS; i++)
+    {
+        if (ways[i].expires && memcmp(ways[i].digest, digest, JWT_DIGEST_LENGTH) == 0)
+        {
+            if (ways[i].expires <= now)
+            {
+                ways[i].expires = 0;
+                return false;
+            }
+            ways[i].stamp = cache->clock;
+            return true;
+        }
+    }
+
+    uint64_t expires;
+    if (!jwt_check(token, length, now, &expires))
+    {
+        return false;
+    }
+
+    // replace the entry used least recently. Unused
+    // entries have a stamp of 0 so they look the oldest.
+    struct jwt_entry_s *entry = &ways[0];
+    for (unsigned int i = 1; i < JWT_WAYS; i++)
+    {
+        if (ways[i].stamp < entry->stamp)
+        {
+            entry = &ways[i];
+        }
+    }
+    memcpy(entry->digest, digest, JWT_DIGEST_LENGTH);
+    entry->expires = expires;
+    entry->stamp = cache->clock;
+    return true;
+}
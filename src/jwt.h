@@ -0,0 +1,58 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Verification of the bearer tokens that authorize changes to links. The
+// issuer's public key is parsed once at startup and shared by all the
+// workers. A token is accepted if its signature checks out with that key
+// (ES256, ES384, ES512 or RS256, whichever fits the key) and its iss, aud,
+// exp and nbf claims are in order.
+//
+// Clients reuse a token for hours, so each worker remembers the tokens it
+// has verified, keyed by their SHA-256, until they expire. Only the first
+// request with a token pays for the signature check; the rest cost a hash
+// and a lookup. The cache is two way set associative like the rate
+// limiter's, and a token that is not in its set replaces the entry that
+// was used least recently.
+
+// the length of a token digest
+#define JWT_DIGEST_LENGTH 32
+
+struct jwt_entry_s
+{
+    uint8_t digest[JWT_DIGEST_LENGTH];
+    // the token's exp claim. 0 if the entry is unused.
+    uint64_t expires;
+    // the order entries were last used in
+    uint64_t stamp;
+};
+
+struct jwt_cache_s
+{
+    // NULL if the cache is off
+    struct jwt_entry_s *entries;
+    // the number of sets is 1 << bits
+    unsigned int bits;
+    uint64_t clock;
+};
+
+// load the issuer key from configuration. Returns false if tokens
+// cannot be verified, in which case none are accepted.
+bool jwt_init(void);
+
+// whether jwt_init succeeded
+bool jwt_enabled(void);
+
+// free the issuer key
+void jwt_cleanup(void);
+
+// allocate a worker's cache of verified tokens as configured. The cache
+// stays off if LINKY_JWT_CACHE is 0.
+bool jwt_cache_open(struct jwt_cache_s *cache);
+
+void jwt_cache_close(struct jwt_cache_s *cache);
+
+// whether token (without the "Bearer " prefix) is valid at now, in
+// seconds since the epoch
+bool jwt_verify(struct jwt_cache_s *cache, const char *token, size_t length, uint64_t now);
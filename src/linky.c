@@ -4,6 +4,7 @@
 #include "listener.h"
 #include "database.h"
 #include "logging.h"
+#include "upgrade.h"
 
 int main()
 {
@@ -23,15 +24,27 @@ int main()
         result = !!cfg;
     }
 
+    // pick up where the previous process left off when upgrading
+    if (result && !upgrade_receive())
+    {
+        critical_error("Could not take over from the previous process");
+        result = false;
+    }
+
     if (result)
     {
-        db = database_open(cfg->database, true, cfg->setgid, cfg->setuid);
-        result = !!db;
+        int fd = upgrade_take_database();
+        db = fd != -1
+                 ? database_adopt(fd, cfg->database, cfg->database_log, cfg->setgid, cfg->setuid)
+                 : database_open(cfg->database, cfg->database_log, true, cfg->setgid, cfg->setuid);
+        result = db && database_checkpoint_every(db, cfg->checkpoint_interval) &&
+                 database_compress(db, cfg->compress_threshold) &&
+                 (!cfg->scrub || database_scrub(db));
     }
 
     if (result)
     {
-        if (!linky_listen())
+        if (!linky_listen(db))
         {
             critical_error("Could not listen");
             result = false;
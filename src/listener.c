@@ -1,10 +1,20 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "config.h"
 #include "logging.h"
+#include "connection.h"
+#include "listener.h"
+#include "worker.h"
+#include "event.h"
+#include "tls.h"
+#include "jwt.h"
+#include "upgrade.h"
 
-#include <sys/epoll.h>
 #include <sys/types.h> /* See NOTES */
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -12,64 +22,224 @@
 #include <sys/un.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
-#include <fcntl.h>
 #include <stdio.h>
 #include <errno.h>
 #include <signal.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+
+#ifndef SO_DETACH_REUSEPORT_BPF
+#define SO_DETACH_REUSEPORT_BPF 68
+#endif
+
+// upper bound on the size of the connection table
+#define MAX_CONNECTIONS (1 << 20)
+
+// read buffers are allocated this many at a time
+#define BUFFER_CHUNK_COUNT 64
+#define BUFFER_CHUNK_SIZE (CONNECTION_ALIGN + BUFFER_CHUNK_COUNT * CONNECTION_BUFFER_SIZE)
+
+// signals the main thread waits for while the workers run
+static void listener_signals(sigset_t *signals)
+{
+    sigemptyset(signals);
+    sigaddset(signals, SIGINT);
+    sigaddset(signals, SIGTERM);
+    sigaddset(signals, SIGHUP);
+    sigaddset(signals, SIGUSR2);
+}
+
+bool worker_running(const struct worker_s *worker)
+{
+    return !worker->draining || worker->live;
+}
 
-#define MAX_EVENTS 128
-#define MAX_BACKLOG 128
+// wake a worker up to drain
+static void worker_stop(struct worker_s *worker)
+{
+    uint64_t one = 1;
+    if (write(worker->wakefd, &one, sizeof(one)) == -1)
+    {
+        warnf("Could not stop worker %u", worker->id);
+        warnp();
+    }
+}
 
-static bool active = false;
+void worker_close_listen_sockets(struct worker_s *worker)
+{
+    if (worker->listen_socket_http != -1)
+    {
+        close(worker->listen_socket_http);
+        worker->listen_socket_http = -1;
+    }
+    if (worker->listen_socket_https != -1)
+    {
+        close(worker->listen_socket_https);
+        worker->listen_socket_https = -1;
+    }
+    if (worker->listen_socket_batch != -1)
+    {
+        close(worker->listen_socket_batch);
+        worker->listen_socket_batch = -1;
+    }
+}
 
-static void signal_hanlder(int signal)
+void worker_drain(struct worker_s *worker)
 {
-    // TODO: we need a dummy file handle
-    // to ping the epoll waiting instance
-    // and make it unblock to exit
-    exit(1);
-    // info("Termination signal received, exiting gracefully...");
-    // active = false;
+    uint64_t value;
+    if (read(worker->wakefd, &value, sizeof(value)) <= 0 || worker->draining)
+    {
+        return;
+    }
+
+    // connections still busy when the drain timeout
+    // runs out are closed regardless
+    debugf("worker %u draining", worker->id);
+    worker->draining = true;
+    unsigned int timeout = config_get()->drain_timeout;
+    if (timeout)
+    {
+        timer_arm(&worker->timers, &worker->drain_timer, (uint64_t)timeout * 1000);
+    }
 }
 
-static bool socket_read_all(int sfd)
+// take a read buffer off the free list, carving up a
+// new chunk of them if it is empty
+static char *worker_buffer_get(struct worker_s *worker)
 {
-    static uint8_t buffer[2048];
-    int amt = 0;
-    do
+    if (!worker->free_buffers)
     {
-        amt = read(sfd, buffer, sizeof(buffer) - 1);
-        if (amt > 0)
+        // the start of each chunk links it to the previous one
+        char *chunk = (char *)aligned_alloc(CONNECTION_ALIGN, BUFFER_CHUNK_SIZE);
+        if (!chunk)
         {
-            buffer[amt] = 0;
-            debugf("received: %s", buffer);
+            return NULL;
         }
-    } while (amt > 0);
+        *(void **)chunk = worker->buffer_chunks;
+        worker->buffer_chunks = chunk;
 
-    bool result;
-    switch (errno)
+        for (size_t i = BUFFER_CHUNK_COUNT; i > 0; i--)
+        {
+            struct connection_buffer_s *buffer =
+                (struct connection_buffer_s *)(chunk + CONNECTION_ALIGN + (i - 1) * CONNECTION_BUFFER_SIZE);
+            buffer->next = worker->free_buffers;
+            worker->free_buffers = buffer;
+        }
+    }
+
+    struct connection_buffer_s *buffer = worker->free_buffers;
+    worker->free_buffers = buffer->next;
+    return (char *)buffer;
+}
+
+static void worker_buffer_put(struct worker_s *worker, char *data)
+{
+    struct connection_buffer_s *buffer = (struct connection_buffer_s *)data;
+    buffer->next = worker->free_buffers;
+    worker->free_buffers = buffer;
+}
+
+struct connection_s *worker_connection_open(struct worker_s *worker, int fd, uint32_t address)
+{
+    if (fd < 0 || (size_t)fd >= worker->max_connections)
     {
-    case EAGAIN:
-        result = true;
-        break;
-    default:
-        warn("Socket write error");
-        warnp();
-        result = false;
+        warnf("Connection %d exceeds the maximum number of connections", fd);
+        return NULL;
     }
 
-    return result;
+    // a client over its limit is reset before anything is spent on it.
+    // Resetting leaves no TIME_WAIT behind on this side. Connections
+    // on the batch socket have no address and are not limited.
+    if (address && !ratelimit_take(&worker->ratelimit, address))
+    {
+        struct linger reset = {.l_onoff = 1, .l_linger = 0};
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, (socklen_t)sizeof(reset));
+        debug("connection refused by rate limit");
+        return NULL;
+    }
+
+    char *buffer = worker_buffer_get(worker);
+    if (!buffer)
+    {
+        warn("Could not allocate memory for connection");
+        return NULL;
+    }
+
+    struct connection_s *conn = &worker->connections[fd];
+    connection_init(conn, worker, fd, address, buffer);
+
+    conn->next = worker->live;
+    if (worker->live)
+    {
+        worker->live->prev = conn;
+    }
+    worker->live = conn;
+    return conn;
 }
 
-static bool socket_write_all(int sfd)
+void worker_connection_close(struct worker_s *worker, struct connection_s *conn)
 {
-    return true;
+    if (conn->prev)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        worker->live = conn->next;
+    }
+    if (conn->next)
+    {
+        conn->next->prev = conn->prev;
+    }
+
+    // closing the socket frees the record for
+    // whichever worker gets the fd next
+    worker_buffer_put(worker, conn->buffer);
+    connection_release(conn);
+}
+
+// the connection table has a record for every fd the process may
+// open. Pages are only backed once a record on them is used.
+static struct connection_s *connection_table_open(size_t *count)
+{
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == -1)
+    {
+        error("Could not get the file descriptor limit");
+        critical_errorp();
+        return NULL;
+    }
+    *count = nofile.rlim_cur < MAX_CONNECTIONS ? nofile.rlim_cur : MAX_CONNECTIONS;
+
+    void *table = mmap(NULL, *count * sizeof(struct connection_s), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED)
+    {
+        critical_error("Could not allocate connection table");
+        return NULL;
+    }
+    return (struct connection_s *)table;
 }
 
 static bool open_socket_listen(int port, int *psfd)
 {
+    const config_t *config = config_get();
+
+    // a socket handed over by the previous process is already listening
+    int sfd = upgrade_take_socket(port);
+    if (sfd != -1)
+    {
+        debugf("Took over listening on port %d", port);
+        *psfd = sfd;
+        return true;
+    }
+
     // create the socket
-    int sfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    sfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sfd == -1)
     {
         error("Could not create socket");
@@ -102,6 +272,54 @@ static bool open_socket_listen(int port, int *psfd)
         return false;
     }
 
+    // every worker binds its own socket to the same port and
+    // the kernel spreads incoming connections between them
+    if (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &opt, (socklen_t)sizeof(opt)) == -1)
+    {
+        errorf("Could not set SO_REUSEPORT on socket");
+        critical_errorp();
+        return false;
+    }
+
+    // accepted sockets inherit these so they are set once here
+    // rather than on every connection
+    if (setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &opt, (socklen_t)sizeof(opt)) == -1)
+    {
+        warn("Could not set TCP_NODELAY on socket");
+        warnp();
+    }
+    if (config->busy_poll)
+    {
+        int usec = (int)config->busy_poll;
+        if (setsockopt(sfd, SOL_SOCKET, SO_BUSY_POLL, &usec, (socklen_t)sizeof(usec)) == -1)
+        {
+            warn("Could not set SO_BUSY_POLL on socket");
+            warnp();
+        }
+    }
+
+    // only wake up for connections that have sent their request
+    if (config->defer_accept)
+    {
+        int secs = (int)config->defer_accept;
+        if (setsockopt(sfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, (socklen_t)sizeof(secs)) == -1)
+        {
+            warn("Could not set TCP_DEFER_ACCEPT on socket");
+            warnp();
+        }
+    }
+
+    // let returning clients send their request with the SYN
+    if (config->fastopen)
+    {
+        int qlen = (int)config->fastopen;
+        if (setsockopt(sfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, (socklen_t)sizeof(qlen)) == -1)
+        {
+            warn("Could not set TCP_FASTOPEN on socket");
+            warnp();
+        }
+    }
+
     // bind the socket to the address
     if (bind(sfd, (struct sockaddr *)&listen_address, sizeof(listen_address)) == -1)
     {
@@ -111,14 +329,14 @@ static bool open_socket_listen(int port, int *psfd)
     }
 
     // listen for connections
-    if (listen(sfd, MAX_BACKLOG) == -1)
+    if (listen(sfd, (int)config->listen_backlog) == -1)
     {
         errorf("Could not listen on 0.0.0.0:%d", port);
         critical_errorp();
         return false;
     }
 
-    infof("Listening on port %d", port);
+    debugf("Listening on port %d", port);
     if (psfd)
     {
         *psfd = sfd;
@@ -127,184 +345,454 @@ static bool open_socket_listen(int port, int *psfd)
     return true;
 }
 
-bool linky_listen()
+// listen on the Unix socket for the batch protocol. A socket file left
+// behind by a previous run is replaced.
+static bool open_socket_unix(const char *path, int *psfd)
 {
-    // make it catch signals
-    active = true;
-    signal(SIGINT, signal_hanlder);
-    signal(SIGHUP, signal_hanlder);
+    const config_t *config = config_get();
+
+    int sfd = upgrade_take_unix_socket(path);
+    if (sfd != -1)
+    {
+        debugf("Took over listening on %s", path);
+        *psfd = sfd;
+        return true;
+    }
 
-    // create epoll structure
-    int epollfd = epoll_create1(0);
-    if (epollfd == -1)
+    struct sockaddr_un listen_address = {
+        .sun_family = AF_UNIX,
+    };
+    if (strlen(path) >= sizeof(listen_address.sun_path))
+    {
+        critical_errorf("The socket path %s is too long", path);
+        return false;
+    }
+    strcpy(listen_address.sun_path, path);
+
+    sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sfd == -1)
     {
-        error("Could not create epoll structure");
+        error("Could not create socket");
         critical_errorp();
         return false;
     }
 
-    // get port config
-    const config_t *config = config_get();
-    int port_http = strtol(config->port, NULL, 10);
-    int port_https = strtol(config->secure_port, NULL, 10);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+
+    if (bind(sfd, (struct sockaddr *)&listen_address, sizeof(listen_address)) == -1)
+    {
+        errorf("Could not bind socket to %s", path);
+        critical_errorp();
+        close(sfd);
+        return false;
+    }
+
+    // the owner and its group may connect
+    if (chmod(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) == -1 ||
+        ((config->setuid || config->setgid) && chown(path, config->setuid, config->setgid) == -1))
+    {
+        warnf("Could not set the permissions of %s", path);
+        warnp();
+    }
+
+    if (listen(sfd, (int)config->listen_backlog) == -1)
+    {
+        errorf("Could not listen on %s", path);
+        critical_errorp();
+        close(sfd);
+        return false;
+    }
+
+    debugf("Listening on %s", path);
+    *psfd = sfd;
+    return true;
+}
+
+// pick the worker for a new connection from the client address, so that
+// every connection from a client lands on the worker holding its token
+// bucket. Sockets join the group in worker order, which is what the
+// index selects. Without rate limiting any program left attached by a
+// previous process is removed and the kernel spreads connections by
+// their ports as well.
+static void listener_steer(int listen_socket, unsigned int num_workers)
+{
+    if (listen_socket == -1 || num_workers < 2)
+    {
+        return;
+    }
+
+    if (!config_get()->rate_limit)
+    {
+        setsockopt(listen_socket, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF, NULL, 0);
+        return;
+    }
+
+    struct sock_filter code[] = {
+        // the IPv4 source address
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)SKF_NET_OFF + 12),
+        // spread neighbouring addresses
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1u),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num_workers),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog program = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, (socklen_t)sizeof(program)) == -1)
+    {
+        warn("Could not steer clients to workers. Rate limits apply per worker");
+        warnp();
+    }
+}
+
+static bool worker_open(struct worker_s *worker, int port_http, int port_https, int batch_socket)
+{
+    if (!timer_wheel_open(&worker->timers) || !ratelimit_open(&worker->ratelimit) ||
+        !cache_open(&worker->cache) || !jwt_cache_open(&worker->jwt))
+    {
+        return false;
+    }
+    worker->scratch = database_scratch_create();
+    if (!worker->scratch)
+    {
+        return false;
+    }
+    commit_open(&worker->commit);
+
+    worker->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->wakefd == -1)
+    {
+        error("Could not create eventfd");
+        critical_errorp();
+        return false;
+    }
 
     // open listen sockets
-    int listen_socket_http;
-    int listen_socket_https;
-    if (!open_socket_listen(port_http, &listen_socket_http))
+    if (!open_socket_listen(port_http, &worker->listen_socket_http))
     {
         return false;
     }
     if (port_https)
     {
-        if (!open_socket_listen(port_https, &listen_socket_https))
+        if (!open_socket_listen(port_https, &worker->listen_socket_https))
+        {
+            return false;
+        }
+    }
+    if (batch_socket != -1)
+    {
+        worker->listen_socket_batch = fcntl(batch_socket, F_DUPFD_CLOEXEC, 0);
+        if (worker->listen_socket_batch == -1)
         {
+            error("Could not duplicate the batch socket");
+            critical_errorp();
             return false;
         }
     }
 
-    // attach the listening sockets to epoll
-    struct epoll_event evt = {
-        .events = EPOLLIN,
-        .data = {
-            .fd = listen_socket_http,
-        }};
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listen_socket_http, &evt) == -1)
+    return true;
+}
+
+static void worker_close(struct worker_s *worker)
+{
+    // stop the event loop
+    if (worker->backend)
     {
-        error("Could not register listening socket with epoll");
-        critical_errorp();
+        worker->backend->close(worker);
+    }
+    // stop listening
+    worker_close_listen_sockets(worker);
+    // close all connections
+    while (worker->live)
+    {
+        worker_connection_close(worker, worker->live);
+    }
+    while (worker->buffer_chunks)
+    {
+        void *chunk = worker->buffer_chunks;
+        worker->buffer_chunks = *(void **)chunk;
+        free(chunk);
+    }
+    worker->free_buffers = NULL;
+    timer_wheel_close(&worker->timers);
+    ratelimit_close(&worker->ratelimit);
+    cache_close(&worker->cache);
+    jwt_cache_close(&worker->jwt);
+    database_scratch_free(worker->scratch);
+    worker->scratch = NULL;
+    if (worker->wakefd != -1)
+    {
+        close(worker->wakefd);
+        worker->wakefd = -1;
+    }
+}
+
+// start the backend on a worker, falling back to epoll if
+// the preferred backend is not supported
+static bool worker_open_backend(struct worker_s *worker, const struct event_backend_s **backend)
+{
+    if ((*backend)->open(worker))
+    {
+        worker->backend = *backend;
+        return true;
+    }
+
+    if (*backend != &event_backend_epoll)
+    {
+        warnf("Could not start the %s event backend. Falling back to epoll", (*backend)->name);
+        *backend = &event_backend_epoll;
+        return worker_open_backend(worker, backend);
+    }
+
+    return false;
+}
+
+static void *worker_run(void *arg)
+{
+    struct worker_s *worker = (struct worker_s *)arg;
+
+    // keep each worker on its own core if there are enough of them
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > 1)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->id % ncpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        {
+            warnf("Could not pin worker %u to cpu %ld", worker->id, worker->id % ncpu);
+        }
+    }
+
+    debugf("worker %u started", worker->id);
+
+    worker->result = worker->backend->run(worker);
+    if (!worker->result)
+    {
+        // take the others down with it
+        kill(getpid(), SIGTERM);
+    }
+    return NULL;
+}
+
+// hand the listen sockets and the database to a new process
+static bool listener_upgrade(struct worker_s *workers, unsigned int num_workers, database db)
+{
+    int *fds = (int *)calloc(num_workers * 2 + 2, sizeof(int));
+    if (!fds)
+    {
+        error("Could not allocate memory for upgrade");
         return false;
     }
-    if (port_https)
+
+    size_t count = 0;
+    for (unsigned int i = 0; i < num_workers; i++)
     {
-        evt.data.fd = listen_socket_https;
-        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listen_socket_https, &evt) == -1)
+        fds[count++] = workers[i].listen_socket_http;
+        if (workers[i].listen_socket_https != -1)
         {
-            error("Could not register listening socket with epoll");
-            critical_errorp();
-            return false;
+            fds[count++] = workers[i].listen_socket_https;
+        }
+    }
+    if (workers[0].listen_socket_batch != -1)
+    {
+        fds[count++] = workers[0].listen_socket_batch;
+    }
+    fds[count++] = database_fd(db);
+
+    // the new process starts from the file, so everything has to be in
+    // it, and this one must not change it any more
+    bool result = database_freeze(db, true);
+    if (result)
+    {
+        result = upgrade_start(fds, count);
+        if (!result)
+        {
+            database_freeze(db, false);
         }
     }
+    free(fds);
+    return result;
+}
+
+bool linky_listen(database db)
+{
+    // closed connections are noticed when writing fails
+    signal(SIGPIPE, SIG_IGN);
+
+    // get port config
+    const config_t *config = config_get();
+    int port_http = strtol(config->port, NULL, 10);
+    int port_https = strtol(config->secure_port, NULL, 10);
+    unsigned int num_workers = config->workers ? config->workers : 1;
+    const struct event_backend_s *backend = event_backend_find(config->event_backend);
+    if (!backend)
+    {
+        critical_errorf("Unknown event backend %s", config->event_backend);
+        return false;
+    }
+
+    // the secure port needs a certificate
+    if (port_https && !tls_init())
+    {
+        warnf("TLS could not be set up. Not listening on port %d", port_https);
+        port_https = 0;
+    }
+
+    // io_uring does not terminate TLS. Falling back to epoll for it
+    // would quietly change what is being run, so that is left to the
+    // configuration.
+    if (port_https && backend == &event_backend_uring)
+    {
+        critical_errorf("The io_uring event backend cannot serve HTTPS on port %d. "
+                        "Set LINKY_SECURE_PORT=0 or LINKY_EVENT_BACKEND=epoll",
+                        port_https);
+        return false;
+    }
+
+    // links can only be changed with a token from the issuer
+    if (!jwt_init())
+    {
+        info("No JWT issuer key. Links cannot be changed over HTTP");
+    }
+
+    size_t max_connections;
+    struct connection_s *connections = connection_table_open(&max_connections);
+    if (!connections)
+    {
+        return false;
+    }
 
-    // "poll" for events
-    struct epoll_event events[MAX_EVENTS];
-    while (active)
+    struct worker_s *workers = (struct worker_s *)calloc(num_workers, sizeof(struct worker_s));
+    if (!workers)
     {
-        int nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
-        debugf("got %d events", nfds);
+        critical_error("Could not allocate workers");
+        munmap(connections, max_connections * sizeof(struct connection_s));
+        return false;
+    }
 
-        for (int i = 0; active && i < nfds; i++)
+    // open sockets for all the workers up front so that
+    // any errors are reported before anything starts
+    bool result = true;
+    for (unsigned int i = 0; i < num_workers; i++)
+    {
+        workers[i].id = i;
+        workers[i].db = db;
+        workers[i].epollfd = -1;
+        workers[i].listen_socket_http = -1;
+        workers[i].listen_socket_https = -1;
+        workers[i].listen_socket_batch = -1;
+        workers[i].timers.fd = -1;
+        workers[i].wakefd = -1;
+        workers[i].connections = connections;
+        workers[i].max_connections = max_connections;
+    }
+    // every worker accepts on its own copy of the one batch socket
+    int batch_socket = -1;
+    if (config->batch_socket && config->batch_socket[0])
+    {
+        result = open_socket_unix(config->batch_socket, &batch_socket);
+    }
+    for (unsigned int i = 0; result && i < num_workers; i++)
+    {
+        result = worker_open(&workers[i], port_http, port_https, batch_socket) &&
+                 worker_open_backend(&workers[i], &backend);
+    }
+    if (batch_socket != -1)
+    {
+        close(batch_socket);
+    }
+
+    if (result)
+    {
+        listener_steer(workers[0].listen_socket_http, num_workers);
+        listener_steer(workers[0].listen_socket_https, num_workers);
+        infof("Listening on port %d with %u %s worker(s)", port_http, num_workers, backend->name);
+        if (port_https)
         {
-            struct epoll_event *evt = &events[i];
-            // check if this is an accept
-            if (evt->data.fd == listen_socket_http || evt->data.fd == listen_socket_https)
-            {
-                struct sockaddr_in client_addr;
-                size_t client_len = sizeof(client_addr);
-
-                int connection = accept(
-                    evt->data.fd,
-                    (struct sockaddr *)&client_addr,
-                    (socklen_t *)&client_len);
-                if (connection != -1)
-                {
-                    // set the socket as nonblocking
-                    int err = fcntl(connection,
-                                    F_SETFL,
-                                    fcntl(connection, F_GETFL, 0) | O_NONBLOCK);
-                    if (err == -1)
-                    {
-                        warn("Could not set socket as nonblocking");
-                        warnp();
-                    }
-
-                    if (err != -1)
-                    {
-                        int flag = 1;
-                        err = setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
-                        if (err == -1)
-                        {
-                            warn("Could not set TCP_NODELAY on socket");
-                            warnp();
-                        }
-                    }
-
-                    // poll for events for this socket
-                    struct epoll_event nevt = {
-                        .events = EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR | EPOLLRDHUP | EPOLLPRI | EPOLLET,
-                        .data = {
-                            .fd = connection}};
-                    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, connection, &nevt) != -1)
-                    {
-                        // TODO: log connection info
-                        debug("connection accepted");
-                    }
-                    else
-                    {
-                        warn("Could not register new socket with epoll");
-                        warnp();
-                    }
-                }
-                else
-                {
-                    warn("could not accept incoming connection");
-                    warnp();
-                }
-            }
-            else
+            infof("Listening on port %d with %u %s worker(s)", port_https, num_workers, backend->name);
+        }
+        if (workers[0].listen_socket_batch != -1)
+        {
+            infof("Serving the batch protocol on %s", config->batch_socket);
+        }
+    }
+
+    // the workers leave signals to this thread. Ignored signals are never
+    // delivered, so stopping and upgrading must not be inherited as ignored.
+    sigset_t signals;
+    listener_signals(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
+
+    // start the workers
+    unsigned int started = 0;
+    for (; result && started < num_workers; started++)
+    {
+        if (pthread_create(&workers[started].thread, NULL, worker_run, &workers[started]) != 0)
+        {
+            critical_errorf("Could not start worker %u", started);
+            result = false;
+            break;
+        }
+    }
+
+    // the previous process can stop now that this one is serving
+    if (result)
+    {
+        upgrade_done();
+    }
+
+    // wait for a signal to stop, or to hand over to a new process
+    while (result)
+    {
+        int sig;
+        if (sigwait(&signals, &sig) != 0)
+        {
+            continue;
+        }
+        if (sig == SIGUSR2)
+        {
+            if (listener_upgrade(workers, num_workers, db))
             {
-                // otherwise this is data or something to do
-                // with a client connection
-                if (evt->events & EPOLLIN)
-                {
-                    // data is ready to be read
-                    if (!socket_read_all(evt->data.fd))
-                    {
-                        close(evt->data.fd);
-                    }
-                }
-                if (evt->events & EPOLLOUT)
-                {
-                    // the socket is ready for sending now
-                    if (!socket_write_all(evt->data.fd))
-                    {
-                        close(evt->data.fd);
-                    }
-                }
-                if (evt->events & EPOLLRDHUP)
-                {
-                    // the socket is ready for sending now
-                    debug("Socket remote hangup");
-                    close(evt->data.fd);
-                }
-                if (evt->events & EPOLLHUP)
-                {
-                    // the socket is ready for sending now
-                    debug("Socket hangup");
-                    close(evt->data.fd);
-                }
-                if (evt->events & EPOLLERR)
-                {
-                    // the socket is ready for sending now
-                    debug("Socket error");
-                    close(evt->data.fd);
-                }
-                if (evt->events & EPOLLPRI)
-                {
-                    // the socket is ready for sending now
-                    debug("Socket exceptional condition");
-                    close(evt->data.fd);
-                }
+                break;
             }
         }
+        else
+        {
+            info("Stopping, finishing requests in progress");
+            break;
+        }
     }
 
-    // stop epolling
-    close(epollfd);
-    // stop listening
-    close(listen_socket_http);
-    close(listen_socket_https);
-    // TODO: close all connections
+    // let them finish what they are doing
+    for (unsigned int i = 0; i < started; i++)
+    {
+        worker_stop(&workers[i]);
+    }
+    for (unsigned int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        result = result && workers[i].result;
+    }
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
 
-    return true;
+    for (unsigned int i = 0; i < num_workers; i++)
+    {
+        worker_close(&workers[i]);
+    }
+    free(workers);
+    munmap(connections, max_connections * sizeof(struct connection_s));
+    tls_cleanup();
+    jwt_cleanup();
+
+    return result;
 }
\ No newline at end of file
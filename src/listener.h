@@ -1,6 +1,7 @@
 #pragma once
+#include <stdbool.h>
 
+#include "database.h"
 
-
-
-bool linky_listen();
\ No newline at end of file
+// serve links from the database until told to stop
+bool linky_listen(database db);
\ No newline at end of file
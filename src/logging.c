@@ -4,6 +4,8 @@
 
 #include "logging.h"
 
+#include <openssl/err.h>
+
 const char *cCriticalError = "\033[1;5;91m[ CRITICAL ]\033[0m ";
 const char *cError = "\033[0;31m[ ERROR ]\033[0m ";
 const char *cWarning = "\033[0;33m[ WARN ]\033[0m ";
@@ -19,3 +21,14 @@ void log_printf(const char *color, const char *format, ...)
     va_end(va);
     printf("\n");
 }
+
+void log_ssl_errors(void)
+{
+    unsigned long err;
+    while ((err = ERR_get_error()) != 0)
+    {
+        char message[256];
+        ERR_error_string_n(err, message, sizeof(message));
+        errorf("%s", message);
+    }
+}
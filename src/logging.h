@@ -4,14 +4,17 @@
 
 #include "config.h"
 
-const char *cCriticalError;
-const char *cError;
-const char *cWarning;
-const char *cInfo;
-const char *cDebug;
+extern const char *cCriticalError;
+extern const char *cError;
+extern const char *cWarning;
+extern const char *cInfo;
+extern const char *cDebug;
 
 void log_printf(const char *color, const char *format, ...);
 
+// log and clear the errors OpenSSL has queued on this thread
+void log_ssl_errors(void);
+
 static inline bool logging_debug_enabled()
 {
     const config_t *config = config_get();
@@ -0,0 +1,107 @@
+#include "ratelimit.h"
+#include "config.h"
+#include "logging.h"
+
+#include <string.h>
+#include <time.h>
+
+// entries per set
+#define RATELIMIT_WAYS 2u
+
+// a bucket holds at most this many tokens so
+// that thousandths of them fit in 32 bits
+#define RATELIMIT_MAX_BURST 4000000u
+
+// the coarse clock is read from the vDSO without a system call
+static uint32_t ratelimit_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint32_t)((uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000);
+}
+
+bool ratelimit_open(struct ratelimit_s *limit)
+{
+    const config_t *config = config_get();
+    *limit = (struct ratelimit_s){0};
+    if (!config->rate_limit)
+    {
+        return true;
+    }
+
+    unsigned int burst = config->rate_burst ? config->rate_burst : config->rate_limit;
+    if (burst > RATELIMIT_MAX_BURST)
+    {
+        burst = RATELIMIT_MAX_BURST;
+    }
+    limit->rate = config->rate_limit;
+    limit->burst = burst * RATELIMIT_SCALE;
+
+    // enough sets to hold every client, rounded up to a power of two
+    unsigned int bits = 0;
+    while (bits < 24 && (RATELIMIT_WAYS << bits) < config->rate_clients)
+    {
+        bits++;
+    }
+    limit->bits = bits;
+
+    size_t size = ((size_t)RATELIMIT_WAYS << bits) * sizeof(struct ratelimit_bucket_s);
+    limit->buckets = (struct ratelimit_bucket_s *)calloc(1, size);
+    if (!limit->buckets)
+    {
+        critical_error("Could not allocate rate limit table");
+        return false;
+    }
+    return true;
+}
+
+void ratelimit_close(struct ratelimit_s *limit)
+{
+    free(limit->buckets);
+    limit->buckets = NULL;
+}
+
+bool ratelimit_take(struct ratelimit_s *limit, uint32_t address)
+{
+    if (!limit->buckets)
+    {
+        return true;
+    }
+
+    uint32_t now = ratelimit_now();
+    uint32_t set = limit->bits ? (address * 0x9e3779b1u) >> (32 - limit->bits) : 0;
+    struct ratelimit_bucket_s *ways = &limit->buckets[set * RATELIMIT_WAYS];
+
+    // find the client, or the entry to give it. Unused
+    // entries have a stamp of 0 so they look the oldest.
+    struct ratelimit_bucket_s *bucket = &ways[0];
+    if (ways[0].address != address)
+    {
+        if (ways[1].address == address ||
+            (uint32_t)(now - ways[1].stamp) > (uint32_t)(now - ways[0].stamp))
+        {
+            bucket = &ways[1];
+        }
+        if (bucket->address != address)
+        {
+            bucket->address = address;
+            bucket->stamp = now;
+            bucket->tokens = limit->burst;
+        }
+    }
+
+    // top up for the time since the last refill
+    uint64_t tokens = bucket->tokens + (uint64_t)(uint32_t)(now - bucket->stamp) * limit->rate;
+    bucket->stamp = now;
+    if (tokens > limit->burst)
+    {
+        tokens = limit->burst;
+    }
+    if (tokens < RATELIMIT_SCALE)
+    {
+        bucket->tokens = (uint32_t)tokens;
+        return false;
+    }
+    bucket->tokens = (uint32_t)tokens - RATELIMIT_SCALE;
+    return true;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Per client rate limiting. Each worker keeps a fixed size table of token
+// buckets keyed by client address, so taking a token is a hash, a load and
+// a store with no locks or atomics. The listen sockets steer every
+// connection from an address to the same worker, which makes the worker's
+// bucket the only one for that client.
+//
+// The table is two way set associative. An address that is not in its set
+// replaces the entry that was used least recently, and starts with a full
+// bucket. A client that has been quiet long enough to refill loses nothing
+// by being evicted.
+
+// token counts are kept in thousandths so
+// that refills do not need a division
+#define RATELIMIT_SCALE 1000
+
+struct ratelimit_bucket_s
+{
+    // IPv4 address in network order. 0 if unused.
+    uint32_t address;
+    // milliseconds on the coarse monotonic clock of the last refill
+    uint32_t stamp;
+    // thousandths of a token
+    uint32_t tokens;
+};
+
+struct ratelimit_s
+{
+    // NULL if rate limiting is off
+    struct ratelimit_bucket_s *buckets;
+    // the number of sets is 1 << bits
+    unsigned int bits;
+    // thousandths of a token added per millisecond,
+    // which is the same as tokens per second
+    uint32_t rate;
+    // the most thousandths of a token a bucket holds
+    uint32_t burst;
+};
+
+// allocate the table as configured. Rate limiting stays off
+// if LINKY_RATE_LIMIT is 0.
+bool ratelimit_open(struct ratelimit_s *limit);
+
+void ratelimit_close(struct ratelimit_s *limit);
+
+static inline bool ratelimit_enabled(const struct ratelimit_s *limit)
+{
+    return limit->buckets != NULL;
+}
+
+// take a token from the client's bucket. Returns false if it is empty.
+// Always succeeds when rate limiting is off.
+bool ratelimit_take(struct ratelimit_s *limit, uint32_t address);
@@ -0,0 +1,130 @@
+#include "response.h"
+#include "http2.h"
+#include "logging.h"
+
+#include <string.h>
+
+// a string literal and its length
+#define FRAGMENT(str) {str, sizeof(str) - 1}
+
+#define STATUS_LINE(code, text) "HTTP/1.1 " #code " " text "\r\n"
+#define EMPTY_RESPONSE(code, text)                                        \
+    {                                                                     \
+        code,                                                             \
+            FRAGMENT(STATUS_LINE(code, text) "Content-Length: 0\r\n\r\n"), \
+            FRAGMENT(STATUS_LINE(code, text) "Content-Length: 0\r\n"       \
+                                             "Connection: close\r\n\r\n"), \
+    }
+
+struct fragment
+{
+    const char *data;
+    size_t length;
+};
+
+struct status_response
+{
+    int status;
+    struct fragment keep_alive;
+    struct fragment close;
+};
+
+// complete responses for every status we send without a body
+static const struct status_response status_responses[] = {
+    EMPTY_RESPONSE(200, "OK"),
+    EMPTY_RESPONSE(201, "Created"),
+    EMPTY_RESPONSE(400, "Bad Request"),
+    EMPTY_RESPONSE(401, "Unauthorized"),
+    EMPTY_RESPONSE(404, "Not Found"),
+    EMPTY_RESPONSE(405, "Method Not Allowed"),
+    EMPTY_RESPONSE(413, "Payload Too Large"),
+    EMPTY_RESPONSE(414, "URI Too Long"),
+    EMPTY_RESPONSE(429, "Too Many Requests"),
+    EMPTY_RESPONSE(431, "Request Header Fields Too Large"),
+    EMPTY_RESPONSE(500, "Internal Server Error"),
+    EMPTY_RESPONSE(501, "Not Implemented"),
+    EMPTY_RESPONSE(503, "Service Unavailable"),
+    EMPTY_RESPONSE(505, "HTTP Version Not Supported"),
+};
+
+// a redirect is sent as [prefix][url][suffix]
+static const struct fragment redirect_prefix = FRAGMENT(STATUS_LINE(302, "Found") "Location: ");
+static const struct fragment redirect_suffix_keep_alive = FRAGMENT("\r\n"
+                                                                   "Content-Length: 0\r\n"
+                                                                   "Cache-Control: private, max-age=90\r\n"
+                                                                   "\r\n");
+static const struct fragment redirect_suffix_close = FRAGMENT("\r\n"
+                                                              "Content-Length: 0\r\n"
+                                                              "Cache-Control: private, max-age=90\r\n"
+                                                              "Connection: close\r\n"
+                                                              "\r\n");
+
+#define NUM_STATUS_RESPONSES (sizeof(status_responses) / sizeof(status_responses[0]))
+
+static const struct status_response *find_status_response(int status)
+{
+    for (size_t i = 0; i < NUM_STATUS_RESPONSES; i++)
+    {
+        if (status_responses[i].status == status)
+        {
+            return &status_responses[i];
+        }
+    }
+    return NULL;
+}
+
+bool response_status(struct connection_s *conn, int status, bool keep_alive)
+{
+    if (conn->http2)
+    {
+        return http2_response_status(conn, status);
+    }
+
+    const struct status_response *response = find_status_response(status);
+    if (!response)
+    {
+        warnf("no response for status %d", status);
+        response = find_status_response(500);
+    }
+
+    const struct fragment *fragment = keep_alive ? &response->keep_alive : &response->close;
+    return connection_send(conn, fragment->data, fragment->length);
+}
+
+bool response_redirect(struct connection_s *conn, const database_url *url, bool keep_alive)
+{
+    if (conn->http2)
+    {
+        return http2_response_redirect(conn, url);
+    }
+
+    // the two pieces of the url go out from where they are stored
+    const struct fragment *suffix = keep_alive ? &redirect_suffix_keep_alive : &redirect_suffix_close;
+    return connection_send(conn, redirect_prefix.data, redirect_prefix.length) &&
+           (url->prefix_length == 0 || connection_send(conn, url->prefix, url->prefix_length)) &&
+           connection_send(conn, url->suffix, url->suffix_length) &&
+           connection_send(conn, suffix->data, suffix->length);
+}
+
+size_t response_format_redirect(char *out, size_t capacity, const database_url *url)
+{
+    const struct fragment *suffix = &redirect_suffix_keep_alive;
+    size_t total = redirect_prefix.length + database_url_length(url) + suffix->length;
+    if (total > capacity)
+    {
+        return 0;
+    }
+
+    char *p = out;
+    memcpy(p, redirect_prefix.data, redirect_prefix.length);
+    p += redirect_prefix.length;
+    if (url->prefix_length)
+    {
+        memcpy(p, url->prefix, url->prefix_length);
+        p += url->prefix_length;
+    }
+    memcpy(p, url->suffix, url->suffix_length);
+    p += url->suffix_length;
+    memcpy(p, suffix->data, suffix->length);
+    return total;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "connection.h"
+#include "database.h"
+
+// Responses are assembled from prebuilt fragments and handed to the
+// connection as pieces to be written. Nothing is formatted per request.
+// On HTTP/2 connections the same responses go out as HEADERS frames.
+
+// queue a response with no body for the given status code.
+// If keep_alive is false the response tells the client the
+// connection will be closed.
+bool response_status(struct connection_s *conn, int status, bool keep_alive);
+
+// queue a redirect to url. The pieces of the url are not copied so they
+// must stay valid until the response has been flushed.
+bool response_redirect(struct connection_s *conn, const database_url *url, bool keep_alive);
+
+// write the HTTP/1.1 keep-alive redirect to url into out as one piece.
+// Returns its length, or 0 if it does not fit in capacity.
+size_t response_format_redirect(char *out, size_t capacity, const database_url *url);
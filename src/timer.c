@@ -0,0 +1,205 @@
+#include "timer.h"
+#include "logging.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#define TIMER_LEVEL0_MASK (TIMER_LEVEL0_SLOTS - 1)
+#define TIMER_LEVEL_MASK (TIMER_LEVEL_SLOTS - 1)
+
+// the furthest ahead a timer can be armed, in ticks
+#define TIMER_MAX_TICKS ((1ull << (TIMER_LEVEL0_BITS + (TIMER_LEVELS - 1) * TIMER_LEVEL_BITS)) - 1)
+
+static uint64_t timer_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+// start or stop the timerfd ticking
+static void timer_wheel_run(struct timer_wheel_s *wheel, bool running)
+{
+    struct itimerspec spec = {0};
+    if (running)
+    {
+        spec.it_interval.tv_nsec = TIMER_TICK_MS * 1000000L;
+        spec.it_value = spec.it_interval;
+    }
+    if (timerfd_settime(wheel->fd, 0, &spec, NULL) == -1)
+    {
+        warn("Could not set timer");
+        warnp();
+        return;
+    }
+    wheel->running = running;
+}
+
+bool timer_wheel_open(struct timer_wheel_s *wheel)
+{
+    *wheel = (struct timer_wheel_s){0};
+    wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wheel->fd == -1)
+    {
+        error("Could not create timer");
+        critical_errorp();
+        return false;
+    }
+    wheel->tick = timer_now();
+    return true;
+}
+
+void timer_wheel_close(struct timer_wheel_s *wheel)
+{
+    if (wheel->fd != -1)
+    {
+        close(wheel->fd);
+        wheel->fd = -1;
+    }
+    wheel->running = false;
+}
+
+static void timer_link(struct timer_s **slot, struct timer_s *timer)
+{
+    timer->next = *slot;
+    if (timer->next)
+    {
+        timer->next->pprev = &timer->next;
+    }
+    *slot = timer;
+    timer->pprev = slot;
+}
+
+static void timer_unlink(struct timer_s *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next)
+    {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// put a timer in the slot for its tick on the finest level that reaches it
+static void timer_insert(struct timer_wheel_s *wheel, struct timer_s *timer)
+{
+    uint64_t delta = timer->expires - wheel->tick;
+    if (delta < TIMER_LEVEL0_SLOTS)
+    {
+        timer_link(&wheel->level0[timer->expires & TIMER_LEVEL0_MASK], timer);
+        return;
+    }
+
+    for (int i = 0; i < TIMER_LEVELS - 1; i++)
+    {
+        int shift = TIMER_LEVEL0_BITS + i * TIMER_LEVEL_BITS;
+        if (delta < (1ull << (shift + TIMER_LEVEL_BITS)) || i == TIMER_LEVELS - 2)
+        {
+            timer_link(&wheel->levels[i][(timer->expires >> shift) & TIMER_LEVEL_MASK], timer);
+            return;
+        }
+    }
+}
+
+// move the timers of a coarse slot down now that their time is close
+static void timer_cascade(struct timer_wheel_s *wheel, struct timer_s **slot)
+{
+    struct timer_s *pending = *slot;
+    *slot = NULL;
+    if (pending)
+    {
+        pending->pprev = &pending;
+    }
+    while (pending)
+    {
+        struct timer_s *timer = pending;
+        timer_unlink(timer);
+        timer_insert(wheel, timer);
+    }
+}
+
+void timer_wheel_advance(struct timer_wheel_s *wheel, timer_expire_fn expire, void *arg)
+{
+    uint64_t now = timer_now();
+    while (wheel->tick < now && wheel->count)
+    {
+        uint64_t tick = ++wheel->tick;
+
+        // coarser levels first so their timers can drop all the way down
+        for (int i = TIMER_LEVELS - 2; i >= 0; i--)
+        {
+            int shift = TIMER_LEVEL0_BITS + i * TIMER_LEVEL_BITS;
+            if ((tick & ((1ull << shift) - 1)) == 0)
+            {
+                timer_cascade(wheel, &wheel->levels[i][(tick >> shift) & TIMER_LEVEL_MASK]);
+            }
+        }
+
+        // expire the slot. The list hangs off a local head so that the
+        // callback can cancel any timer, including ones still pending.
+        struct timer_s **slot = &wheel->level0[tick & TIMER_LEVEL0_MASK];
+        struct timer_s *pending = *slot;
+        *slot = NULL;
+        if (pending)
+        {
+            pending->pprev = &pending;
+        }
+        while (pending)
+        {
+            struct timer_s *timer = pending;
+            timer_unlink(timer);
+            wheel->count--;
+            expire(timer, arg);
+        }
+    }
+
+    // nothing left to time so stop ticking
+    if (wheel->count == 0)
+    {
+        wheel->tick = now;
+        if (wheel->running)
+        {
+            timer_wheel_run(wheel, false);
+        }
+    }
+}
+
+void timer_arm(struct timer_wheel_s *wheel, struct timer_s *timer, uint64_t ms)
+{
+    timer_cancel(wheel, timer);
+
+    uint64_t now = timer_now();
+    uint64_t ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (wheel->count == 0)
+    {
+        // an empty wheel may not have ticked for a while
+        wheel->tick = now;
+    }
+    if (ticks == 0)
+    {
+        ticks = 1;
+    }
+    timer->expires = now + ticks;
+    if (timer->expires - wheel->tick > TIMER_MAX_TICKS)
+    {
+        timer->expires = wheel->tick + TIMER_MAX_TICKS;
+    }
+
+    timer_insert(wheel, timer);
+    wheel->count++;
+    if (!wheel->running)
+    {
+        timer_wheel_run(wheel, true);
+    }
+}
+
+void timer_cancel(struct timer_wheel_s *wheel, struct timer_s *timer)
+{
+    if (timer->pprev)
+    {
+        timer_unlink(timer);
+        wheel->count--;
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// A hierarchical timing wheel driven by a timerfd. Timers are linked
+// into the slot of the tick they expire on, so arming and cancelling
+// are O(1) and a tick only visits the timers that are due. Timers too
+// far out for the first level wait in a coarser one and are moved
+// down as their time comes closer.
+
+// the resolution of the wheel in milliseconds
+#define TIMER_TICK_MS 100
+
+// slots per level. The first level covers 25.6 seconds, the
+// second 27 minutes and the last 29 hours.
+#define TIMER_LEVEL0_BITS 8
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVELS 3
+
+#define TIMER_LEVEL0_SLOTS (1 << TIMER_LEVEL0_BITS)
+#define TIMER_LEVEL_SLOTS (1 << TIMER_LEVEL_BITS)
+
+// a timer embedded in whatever it times
+struct timer_s
+{
+    struct timer_s *next;
+    // the pointer that points to this timer. NULL if not armed.
+    struct timer_s **pprev;
+    // the tick the timer expires on
+    uint64_t expires;
+};
+
+struct timer_wheel_s
+{
+    // readable once per tick while timers are armed
+    int fd;
+    bool running;
+
+    // the last tick that was processed
+    uint64_t tick;
+    size_t count;
+
+    struct timer_s *level0[TIMER_LEVEL0_SLOTS];
+    struct timer_s *levels[TIMER_LEVELS - 1][TIMER_LEVEL_SLOTS];
+};
+
+// called for every timer that expires
+typedef void (*timer_expire_fn)(struct timer_s *timer, void *arg);
+
+// create the timerfd for a wheel
+bool timer_wheel_open(struct timer_wheel_s *wheel);
+
+// close the timerfd. Armed timers are forgotten.
+void timer_wheel_close(struct timer_wheel_s *wheel);
+
+// expire every timer that is due. The timerfd must have been read
+// by the caller.
+void timer_wheel_advance(struct timer_wheel_s *wheel, timer_expire_fn expire, void *arg);
+
+// (re)arm a timer to expire in the given number of milliseconds
+void timer_arm(struct timer_wheel_s *wheel, struct timer_s *timer, uint64_t ms);
+
+// disarm a timer if it is armed
+void timer_cancel(struct timer_wheel_s *wheel, struct timer_s *timer);
+
+// whether a timer is armed
+static inline bool timer_armed(const struct timer_s *timer)
+{
+    return timer->pprev != NULL;
+}
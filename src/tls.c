@@ -0,0 +1,242 @@
+#include "tls.h"
+#include "connection.h"
+#include "http2.h"
+#include "config.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+// the number of sessions kept in the server side session cache
+#define TLS_SESSION_CACHE_SIZE 20480
+
+// how long sessions and tickets can be resumed for, in seconds
+#define TLS_SESSION_TIMEOUT 7200
+
+static const unsigned char session_id_context[] = "linky";
+
+// the protocols offered with ALPN in order of preference, each
+// prefixed with its length
+static const unsigned char alpn_http2[] = "\x02" HTTP2_ALPN "\x08http/1.1";
+static const unsigned char alpn_http1[] = "\x08http/1.1";
+
+static SSL_CTX *tls_context = NULL;
+
+// pick HTTP/2 if the client offers it. Clients that offer neither
+// protocol carry on without ALPN and get HTTP/1.1.
+static int tls_select_protocol(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                               const unsigned char *in, unsigned int inlen, void *arg)
+{
+    (void)ssl;
+    (void)arg;
+    const unsigned char *protocols = config_get()->http2 ? alpn_http2 : alpn_http1;
+    unsigned int length = config_get()->http2 ? sizeof(alpn_http2) - 1 : sizeof(alpn_http1) - 1;
+    unsigned char *selected;
+    if (SSL_select_next_proto(&selected, outlen, protocols, length, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+    {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+bool tls_init(void)
+{
+    const config_t *config = config_get();
+    if (!config->certificate_chain_path || !config->certificate_chain_path[0] ||
+        !config->certificate_key_path || !config->certificate_key_path[0])
+    {
+        return false;
+    }
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+    {
+        error("Could not create TLS context");
+        log_ssl_errors();
+        return false;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    // hand the record layer to the kernel after the handshake if possible
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+    // writes may be partial and retried from a buffer that has moved.
+    // Idle connections give their buffers back.
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                              SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                              SSL_MODE_RELEASE_BUFFERS);
+
+    // cache sessions on the server and issue tickets so returning
+    // clients can skip the full handshake
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+    SSL_CTX_set_alpn_select_cb(ctx, tls_select_protocol, NULL);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, config->certificate_chain_path) != 1)
+    {
+        errorf("Could not load certificate chain %s", config->certificate_chain_path);
+        log_ssl_errors();
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, config->certificate_key_path, SSL_FILETYPE_PEM) != 1)
+    {
+        errorf("Could not load certificate key %s", config->certificate_key_path);
+        log_ssl_errors();
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    if (SSL_CTX_check_private_key(ctx) != 1)
+    {
+        error("The certificate key does not match the certificate");
+        log_ssl_errors();
+        SSL_CTX_free(ctx);
+        return false;
+    }
+
+    tls_context = ctx;
+    return true;
+}
+
+bool tls_enabled(void)
+{
+    return tls_context != NULL;
+}
+
+bool tls_accept(struct connection_s *conn)
+{
+    SSL *ssl = SSL_new(tls_context);
+    if (!ssl)
+    {
+        warn("Could not create TLS connection");
+        log_ssl_errors();
+        return false;
+    }
+
+    if (SSL_set_fd(ssl, conn->fd) != 1)
+    {
+        warn("Could not attach TLS to socket");
+        log_ssl_errors();
+        SSL_free(ssl);
+        return false;
+    }
+
+    SSL_set_accept_state(ssl);
+    conn->tls = ssl;
+    conn->tls_ready = false;
+    conn->ktls_send = false;
+    return true;
+}
+
+// map the result of an SSL call to read(2)/write(2) semantics
+static ssize_t tls_result(struct connection_s *conn, int ret)
+{
+    if (ret > 0)
+    {
+        return ret;
+    }
+
+    switch (SSL_get_error(conn->tls, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        // close_notify received
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        // errno is cleared before each call, so 0 here means the peer
+        // went away without a close_notify
+        ERR_clear_error();
+        if (errno == 0)
+        {
+            errno = ECONNRESET;
+        }
+        return -1;
+    default:
+        ERR_clear_error();
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+bool tls_handshake(struct connection_s *conn)
+{
+    errno = 0;
+    int ret = SSL_do_handshake(conn->tls);
+    if (ret == 1)
+    {
+        conn->tls_ready = true;
+
+        // once the kernel encrypts, responses can be written straight to the socket
+        conn->ktls_send = BIO_get_ktls_send(SSL_get_wbio(conn->tls)) > 0;
+        debugf("TLS handshake done (%s%s, kTLS send %s, receive %s)",
+               SSL_get_version(conn->tls),
+               SSL_session_reused(conn->tls) ? " resumed" : "",
+               conn->ktls_send ? "on" : "off",
+               BIO_get_ktls_recv(SSL_get_rbio(conn->tls)) > 0 ? "on" : "off");
+        return true;
+    }
+
+    if (tls_result(conn, ret) == -1 && errno == EAGAIN)
+    {
+        return true;
+    }
+
+    debug("TLS handshake failed");
+    return false;
+}
+
+bool tls_selected_http2(struct connection_s *conn)
+{
+    const unsigned char *protocol;
+    unsigned int length;
+    SSL_get0_alpn_selected(conn->tls, &protocol, &length);
+    return length == sizeof(HTTP2_ALPN) - 1 && memcmp(protocol, HTTP2_ALPN, length) == 0;
+}
+
+ssize_t tls_read(struct connection_s *conn, void *buffer, size_t length)
+{
+    errno = 0;
+    return tls_result(conn, SSL_read(conn->tls, buffer, (int)length));
+}
+
+ssize_t tls_write(struct connection_s *conn, const void *buffer, size_t length)
+{
+    errno = 0;
+    return tls_result(conn, SSL_write(conn->tls, buffer, (int)length));
+}
+
+void tls_close(struct connection_s *conn)
+{
+    if (conn->tls)
+    {
+        // only a clean connection gets a close_notify
+        if (conn->tls_ready && !(SSL_get_shutdown(conn->tls) & SSL_SENT_SHUTDOWN))
+        {
+            SSL_shutdown(conn->tls);
+        }
+        SSL_free(conn->tls);
+        ERR_clear_error();
+        conn->tls = NULL;
+    }
+    conn->tls_ready = false;
+    conn->ktls_send = false;
+}
+
+void tls_cleanup(void)
+{
+    if (tls_context)
+    {
+        SSL_CTX_free(tls_context);
+        tls_context = NULL;
+    }
+}
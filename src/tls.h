@@ -0,0 +1,40 @@
+#pragma once
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+struct connection_s;
+
+// TLS termination for connections accepted on the secure port. All the
+// workers share one context so sessions and tickets issued by one worker
+// are accepted by every other. After the handshake the record layer is
+// handed to the kernel (kTLS) if the kernel supports it.
+
+// load the certificate chain and key from configuration. Returns false
+// if TLS cannot be used.
+bool tls_init(void);
+
+// whether tls_init succeeded
+bool tls_enabled(void);
+
+// start TLS on a newly accepted connection
+bool tls_accept(struct connection_s *conn);
+
+// continue the handshake. Returns false if it failed. Once it completes
+// conn->tls_ready is set.
+bool tls_handshake(struct connection_s *conn);
+
+// whether the client chose HTTP/2 during the handshake
+bool tls_selected_http2(struct connection_s *conn);
+
+// read decrypted data. Behaves like read(2) on a nonblocking socket.
+ssize_t tls_read(struct connection_s *conn, void *buffer, size_t length);
+
+// write data to be encrypted. Behaves like write(2) on a nonblocking socket.
+ssize_t tls_write(struct connection_s *conn, const void *buffer, size_t length);
+
+// send close_notify if possible and free the TLS state of a connection
+void tls_close(struct connection_s *conn);
+
+// free the shared context
+void tls_cleanup(void);
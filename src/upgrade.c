@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include "upgrade.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+// fds sent per message. The kernel allows at most 253.
+#define UPGRADE_BATCH 64
+
+// the most fds that can be handed over
+#define UPGRADE_MAX_FDS 1024
+
+// how long a new process has to start serving
+#define UPGRADE_TIMEOUT_MS 30000
+
+// what the new process sends once it is serving
+#define UPGRADE_READY 'R'
+
+extern char **environ;
+
+// the channel back to the old process and what came over it
+static int channel = -1;
+static int received[UPGRADE_MAX_FDS];
+static size_t received_count = 0;
+
+static void close_received(void)
+{
+    for (size_t i = 0; i < received_count; i++)
+    {
+        if (received[i] != -1)
+        {
+            close(received[i]);
+            received[i] = -1;
+        }
+    }
+}
+
+bool upgrade_receive(void)
+{
+    const char *value = getenv(UPGRADE_ENV);
+    if (!value || !value[0])
+    {
+        return true;
+    }
+    channel = (int)strtol(value, NULL, 10);
+    unsetenv(UPGRADE_ENV);
+    fcntl(channel, F_SETFD, FD_CLOEXEC);
+
+    // every message carries the total number of fds
+    uint32_t total = 0;
+    do
+    {
+        char control[CMSG_SPACE(sizeof(int) * UPGRADE_BATCH)];
+        struct iovec iov = {
+            .iov_base = &total,
+            .iov_len = sizeof(total),
+        };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+
+        ssize_t amt;
+        do
+        {
+            amt = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+        } while (amt == -1 && errno == EINTR);
+        if (amt != sizeof(total) || total > UPGRADE_MAX_FDS)
+        {
+            error("Could not receive sockets from the previous process");
+            if (amt == -1)
+            {
+                errorp();
+            }
+            close_received();
+            return false;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            {
+                size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const int *fds = (const int *)CMSG_DATA(cmsg);
+                for (size_t i = 0; i < count; i++)
+                {
+                    if (received_count < UPGRADE_MAX_FDS)
+                    {
+                        received[received_count++] = fds[i];
+                    }
+                    else
+                    {
+                        close(fds[i]);
+                    }
+                }
+            }
+        }
+    } while (received_count < total);
+
+    infof("Took over %zu file(s) from the previous process", received_count);
+    return true;
+}
+
+int upgrade_take_socket(int port)
+{
+    for (size_t i = 0; i < received_count; i++)
+    {
+        struct sockaddr_in address;
+        socklen_t length = sizeof(address);
+        if (received[i] != -1 &&
+            getsockname(received[i], (struct sockaddr *)&address, &length) == 0 &&
+            address.sin_family == AF_INET &&
+            ntohs(address.sin_port) == port)
+        {
+            int fd = received[i];
+            received[i] = -1;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+int upgrade_take_unix_socket(const char *path)
+{
+    for (size_t i = 0; i < received_count; i++)
+    {
+        struct sockaddr_un address;
+        socklen_t length = sizeof(address);
+        if (received[i] != -1 &&
+            getsockname(received[i], (struct sockaddr *)&address, &length) == 0 &&
+            address.sun_family == AF_UNIX &&
+            length > offsetof(struct sockaddr_un, sun_path) &&
+            strncmp(address.sun_path, path, sizeof(address.sun_path)) == 0)
+        {
+            int fd = received[i];
+            received[i] = -1;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+int upgrade_take_database(void)
+{
+    for (size_t i = 0; i < received_count; i++)
+    {
+        struct stat st;
+        if (received[i] != -1 && fstat(received[i], &st) == 0 && S_ISREG(st.st_mode))
+        {
+            int fd = received[i];
+            received[i] = -1;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+void upgrade_done(void)
+{
+    if (channel == -1)
+    {
+        return;
+    }
+
+    // the old process stops accepting once it hears from us
+    char ready = UPGRADE_READY;
+    if (send(channel, &ready, sizeof(ready), MSG_NOSIGNAL) == -1)
+    {
+        warn("Could not tell the previous process to stop");
+        warnp();
+    }
+    close(channel);
+    channel = -1;
+
+    for (size_t i = 0; i < received_count; i++)
+    {
+        if (received[i] != -1)
+        {
+            warn("A socket from the previous process is not used");
+        }
+    }
+    close_received();
+    received_count = 0;
+}
+
+static bool send_fds(int sock, const int *fds, size_t count, uint32_t total)
+{
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_BATCH)];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {
+        .iov_base = &total,
+        .iov_len = sizeof(total),
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) != -1;
+}
+
+// the path of the binary to run. If it was replaced since
+// this process started the new one at the same path is used.
+static bool upgrade_path(char *path, size_t size)
+{
+    ssize_t length = readlink("/proc/self/exe", path, size - 1);
+    if (length <= 0)
+    {
+        return false;
+    }
+    path[length] = 0;
+
+    static const char deleted[] = " (deleted)";
+    size_t suffix = sizeof(deleted) - 1;
+    if ((size_t)length > suffix && strcmp(path + length - suffix, deleted) == 0)
+    {
+        path[length - suffix] = 0;
+    }
+    return true;
+}
+
+// the environment for the new process, with the channel fd added
+static char **upgrade_environment(char *variable)
+{
+    size_t count = 0;
+    while (environ[count])
+    {
+        count++;
+    }
+
+    char **envp = (char **)calloc(count + 2, sizeof(char *));
+    if (!envp)
+    {
+        return NULL;
+    }
+    size_t n = 0;
+    size_t prefix = strlen(UPGRADE_ENV);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (strncmp(environ[i], UPGRADE_ENV, prefix) != 0 || environ[i][prefix] != '=')
+        {
+            envp[n++] = environ[i];
+        }
+    }
+    envp[n++] = variable;
+    envp[n] = NULL;
+    return envp;
+}
+
+bool upgrade_start(const int *fds, size_t count)
+{
+    char path[PATH_MAX];
+    if (!upgrade_path(path, sizeof(path)))
+    {
+        error("Could not find the binary to upgrade to");
+        errorp();
+        return false;
+    }
+    if (count > UPGRADE_MAX_FDS)
+    {
+        error("Too many sockets to hand over");
+        return false;
+    }
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1)
+    {
+        error("Could not create upgrade channel");
+        errorp();
+        return false;
+    }
+
+    char variable[64];
+    snprintf(variable, sizeof(variable), "%s=%d", UPGRADE_ENV, pair[1]);
+    char **envp = upgrade_environment(variable);
+    char *argv[] = {program_invocation_name, NULL};
+    if (!envp)
+    {
+        error("Could not allocate upgrade environment");
+        close(pair[0]);
+        close(pair[1]);
+        return false;
+    }
+
+    infof("Upgrading to %s", path);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // only async signal safe calls until exec. The new process
+        // keeps its end of the channel and gets no blocked signals.
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        fcntl(pair[1], F_SETFD, 0);
+        execve(path, argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(pair[1]);
+    if (pid == -1)
+    {
+        error("Could not start the new process");
+        errorp();
+        close(pair[0]);
+        return false;
+    }
+
+    bool result = true;
+    for (size_t sent = 0; result && sent < count; sent += UPGRADE_BATCH)
+    {
+        size_t batch = count - sent < UPGRADE_BATCH ? count - sent : UPGRADE_BATCH;
+        result = send_fds(pair[0], fds + sent, batch, (uint32_t)count);
+    }
+    if (!result)
+    {
+        error("Could not hand sockets to the new process");
+        errorp();
+    }
+
+    // wait for the new process to start serving
+    if (result)
+    {
+        struct pollfd pfd = {
+            .fd = pair[0],
+            .events = POLLIN,
+        };
+        char ready = 0;
+        int ret;
+        do
+        {
+            ret = poll(&pfd, 1, UPGRADE_TIMEOUT_MS);
+        } while (ret == -1 && errno == EINTR);
+        result = ret == 1 && recv(pair[0], &ready, sizeof(ready), 0) == 1 && ready == UPGRADE_READY;
+        if (!result)
+        {
+            error("The new process did not start serving");
+        }
+    }
+    close(pair[0]);
+
+    if (!result)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+
+    infof("Handed over to process %d", (int)pid);
+    return true;
+}
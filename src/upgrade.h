@@ -0,0 +1,37 @@
+#pragma once
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Hot upgrades. The running process starts a new one (which may be a
+// new binary at the same path) and hands it the listen sockets and the
+// database fd over a Unix socket with SCM_RIGHTS. Both processes accept
+// on the same sockets until the new one reports that it is serving, then
+// the old one drains, so no connection is refused along the way.
+
+// the environment variable that tells a new process which fd
+// leads back to the process it is taking over from
+#define UPGRADE_ENV "LINKY_UPGRADE_FD"
+
+// in a process started for an upgrade, receive the handed over fds.
+// Does nothing if this is not an upgrade. Returns false if the fds
+// could not be received.
+bool upgrade_receive(void);
+
+// take a handed over listen socket bound to the port. Returns -1 if
+// there is none left.
+int upgrade_take_socket(int port);
+
+// take a handed over listen socket bound to the Unix socket path.
+// Returns -1 if there is none.
+int upgrade_take_unix_socket(const char *path);
+
+// take the handed over database fd. Returns -1 if there is none.
+int upgrade_take_database(void);
+
+// tell the old process that this one is serving, and close
+// whatever was handed over but not used
+void upgrade_done(void);
+
+// start a new process and hand it the fds. Returns true once the new
+// process is serving, after which this one should drain.
+bool upgrade_start(const int *fds, size_t count);
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include "wal.h"
+#include "logging.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/uio.h>
+
+#include <linux/magic.h>
+#include <zlib.h>
+
+// the largest record a log may hold, a page image
+#define WAL_MAX_DATA (2u << 20)
+
+static uint32_t wal_checksum(const struct wal_record *record, const void *data)
+{
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef *)record + sizeof(record->checksum), sizeof(*record) - sizeof(record->checksum));
+    if (record->length)
+    {
+        crc = crc32(crc, (const Bytef *)data, record->length);
+    }
+    return (uint32_t)crc;
+}
+
+bool wal_open(struct wal_s *wal, const char *database_file, const char *file)
+{
+    memset(wal, 0, sizeof(*wal));
+    wal->fd = -1;
+
+    if (file)
+    {
+        wal->file = strdup(file);
+    }
+    else
+    {
+        size_t length = strlen(database_file);
+        wal->file = (char *)malloc(length + 5);
+        if (wal->file)
+        {
+            memcpy(wal->file, database_file, length);
+            memcpy(wal->file + length, ".wal", 5);
+        }
+    }
+    if (!wal->file)
+    {
+        error("Could not allocate memory for the log");
+        return false;
+    }
+
+    wal->fd = open(wal->file, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    struct stat st;
+    struct statfs fs;
+    if (wal->fd == -1 || fstat(wal->fd, &st) == -1 || fstatfs(wal->fd, &fs) == -1)
+    {
+        errorf("Could not open the log %s", wal->file);
+        errorp();
+        wal_close(wal);
+        return false;
+    }
+    // which can only be written through a mapping
+    if (fs.f_type == HUGETLBFS_MAGIC)
+    {
+        errorf("The log %s cannot be on hugetlbfs. Set LINKY_DATABASE_LOG to a file elsewhere", wal->file);
+        if (st.st_size == 0)
+        {
+            unlink(wal->file);
+        }
+        wal_close(wal);
+        return false;
+    }
+    wal->size = (uint64_t)st.st_size;
+
+    // a log without a generation is one from before there were two
+    struct wal_record record;
+    if (pread(wal->fd, &record, sizeof(record), 0) == (ssize_t)sizeof(record) &&
+        record.type == WAL_START && record.length == 0 && record.checksum == wal_checksum(&record, NULL))
+    {
+        wal->generation = record.expires;
+    }
+    return true;
+}
+
+void wal_close(struct wal_s *wal)
+{
+    if (wal->fd != -1)
+    {
+        close(wal->fd);
+        wal->fd = -1;
+    }
+    free(wal->file);
+    wal->file = NULL;
+    free(wal->buffer);
+    wal->buffer = NULL;
+    wal->length = wal->capacity = 0;
+}
+
+bool wal_append(struct wal_s *wal, enum wal_type type, uint32_t key, uint64_t expires, const void *data, uint32_t length)
+{
+    size_t needed = wal->length + sizeof(struct wal_record) + length;
+    if (needed > wal->capacity)
+    {
+        size_t capacity = wal->capacity ? wal->capacity : 4096;
+        while (capacity < needed)
+        {
+            capacity *= 2;
+        }
+        uint8_t *buffer = (uint8_t *)realloc(wal->buffer, capacity);
+        if (!buffer)
+        {
+            error("Could not allocate memory for the log");
+            return false;
+        }
+        wal->buffer = buffer;
+        wal->capacity = capacity;
+    }
+
+    struct wal_record record = {
+        .type = (uint32_t)type,
+        .key = key,
+        .length = length,
+        .expires = expires,
+    };
+    record.checksum = wal_checksum(&record, data);
+    memcpy(wal->buffer + wal->length, &record, sizeof(record));
+    if (length)
+    {
+        memcpy(wal->buffer + wal->length + sizeof(record), data, length);
+    }
+    wal->length = needed;
+    return true;
+}
+
+// write everything in iov at the end of the log, or nothing
+static bool wal_writev(struct wal_s *wal, struct iovec *iov, int iovcnt)
+{
+    uint64_t start = wal->size;
+    while (iovcnt)
+    {
+        ssize_t amt = pwritev(wal->fd, iov, iovcnt, (off_t)wal->size);
+        if (amt == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (amt <= 0)
+        {
+            errorf("Could not write to the log %s", wal->file);
+            errorp();
+            // a torn record would hide the ones written after it
+            if (ftruncate(wal->fd, (off_t)start) == 0)
+            {
+                wal->size = start;
+            }
+            return false;
+        }
+        wal->size += (uint64_t)amt;
+        while (iovcnt && (size_t)amt >= iov->iov_len)
+        {
+            amt -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + amt;
+            iov->iov_len -= (size_t)amt;
+        }
+    }
+    return true;
+}
+
+bool wal_write(struct wal_s *wal)
+{
+    if (wal->length == 0)
+    {
+        return true;
+    }
+    struct iovec iov = {.iov_base = wal->buffer, .iov_len = wal->length};
+    if (!wal_writev(wal, &iov, 1))
+    {
+        return false;
+    }
+    wal->length = 0;
+    return true;
+}
+
+bool wal_write_page(struct wal_s *wal, uint32_t page, const void *data, uint32_t length)
+{
+    struct wal_record record = {
+        .type = WAL_PAGE,
+        .key = page,
+        .length = length,
+    };
+    record.checksum = wal_checksum(&record, data);
+    struct iovec iov[2] = {
+        {.iov_base = &record, .iov_len = sizeof(record)},
+        {.iov_base = (void *)data, .iov_len = length},
+    };
+    return wal_writev(wal, iov, 2);
+}
+
+bool wal_sync(struct wal_s *wal)
+{
+    if (fdatasync(wal->fd) == -1)
+    {
+        errorf("Could not sync the log %s", wal->file);
+        errorp();
+        return false;
+    }
+    return true;
+}
+
+bool wal_truncate(struct wal_s *wal)
+{
+    if (ftruncate(wal->fd, 0) == -1)
+    {
+        errorf("Could not truncate the log %s", wal->file);
+        errorp();
+        return false;
+    }
+    wal->size = 0;
+    wal->length = 0;
+    return true;
+}
+
+bool wal_start(struct wal_s *wal, uint64_t generation)
+{
+    if (!wal_append(wal, WAL_START, 0, generation, NULL, 0))
+    {
+        return false;
+    }
+    wal->generation = generation;
+    return true;
+}
+
+bool wal_replay(struct wal_s *wal, wal_replay_fn fn, void *state)
+{
+    uint8_t *data = (uint8_t *)malloc(WAL_MAX_DATA);
+    if (!data)
+    {
+        error("Could not allocate memory to replay the log");
+        return false;
+    }
+
+    uint64_t offset = 0;
+    bool result = true;
+    while (result && offset + sizeof(struct wal_record) <= wal->size)
+    {
+        struct wal_record record;
+        if (pread(wal->fd, &record, sizeof(record), (off_t)offset) != (ssize_t)sizeof(record) ||
+            record.length > WAL_MAX_DATA ||
+            offset + sizeof(record) + record.length > wal->size ||
+            pread(wal->fd, data, record.length, (off_t)(offset + sizeof(record))) != (ssize_t)record.length ||
+            record.checksum != wal_checksum(&record, data))
+        {
+            // the rest was never completely written
+            warnf("Ignoring the log %s from byte %llu on", wal->file, (unsigned long long)offset);
+            break;
+        }
+        result = fn(state, &record, data, offset);
+        offset += sizeof(record) + record.length;
+    }
+
+    free(data);
+    return result;
+}
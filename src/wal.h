@@ -0,0 +1,96 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The write-ahead log of the database. Changes are applied to a private
+// mapping of the database file, which the kernel never writes back, and
+// described here in a few bytes each. A sync only has to append to the
+// log. Every so often the database checkpoints: it copies the pages that
+// changed into the log, then over the file, and empties the log. Should
+// it stop halfway through writing the pages over the file, the copies in
+// the log put them right when it is opened again.
+//
+// There are two logs, so that changes can carry on while a checkpoint
+// writes. The checkpoint moves them to the other log, which is empty,
+// and copies the pages as they were then into the one it leaves. Each
+// log starts with its generation, which says which of the two came
+// first.
+//
+// Each record starts with a header and is followed by length bytes of
+// data. Records are written in one piece, and a record that does not
+// check out ends the log.
+
+enum wal_type
+{
+    // data is the url of key
+    WAL_SET = 1,
+    WAL_DELETE = 2,
+    // key expires at expires
+    WAL_EXPIRE = 3,
+    // data is the image of page key
+    WAL_PAGE = 4,
+    // the page images before this are complete
+    WAL_CHECKPOINT = 5,
+    // the first record of a log, expires is its generation
+    WAL_START = 6,
+};
+
+struct wal_record
+{
+    // crc32 of the rest of the header and the data
+    uint32_t checksum;
+    uint32_t type;
+    uint32_t key;
+    uint32_t length;
+    uint64_t expires;
+};
+
+_Static_assert(sizeof(struct wal_record) == 24, "log records must be packed");
+
+struct wal_s
+{
+    int fd;
+    // the path of the log, next to the database file
+    char *file;
+    // the bytes in the log file
+    uint64_t size;
+    // the generation from the first record, 0 if it has none
+    uint64_t generation;
+    // records waiting to be written
+    uint8_t *buffer;
+    size_t length;
+    size_t capacity;
+};
+
+// called for each record in the log, with the offset it starts at.
+// Returns false to stop.
+typedef bool (*wal_replay_fn)(void *state, const struct wal_record *record, const void *data, uint64_t offset);
+
+// open or create the log of the database file, at file or, if that is
+// NULL, next to it
+bool wal_open(struct wal_s *wal, const char *database_file, const char *file);
+
+void wal_close(struct wal_s *wal);
+
+// add a record to the ones waiting to be written
+bool wal_append(struct wal_s *wal, enum wal_type type, uint32_t key, uint64_t expires, const void *data, uint32_t length);
+
+// write the records that are waiting. Returns false and leaves the log
+// as it was if they could not all be written.
+bool wal_write(struct wal_s *wal);
+
+// write a page image straight to the log
+bool wal_write_page(struct wal_s *wal, uint32_t page, const void *data, uint32_t length);
+
+// make what was written durable
+bool wal_sync(struct wal_s *wal);
+
+// empty the log, and drop the records waiting to be written
+bool wal_truncate(struct wal_s *wal);
+
+// start an empty log as the one after a log of generation - 1
+bool wal_start(struct wal_s *wal, uint64_t generation);
+
+// call fn for every record that checks out, in order
+bool wal_replay(struct wal_s *wal, wal_replay_fn fn, void *state);
@@ -0,0 +1,99 @@
+#pragma once
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "database.h"
+#include "timer.h"
+#include "ratelimit.h"
+#include "cache.h"
+#include "jwt.h"
+#include "commit.h"
+
+struct connection_s;
+struct event_backend_s;
+
+// a read buffer that is not in use
+struct connection_buffer_s
+{
+    struct connection_buffer_s *next;
+};
+
+// each worker runs its own epoll loop on its own
+// SO_REUSEPORT listen sockets. The connection table is
+// shared, but a record is only ever touched by the
+// worker that accepted its socket.
+struct worker_s
+{
+    unsigned int id;
+    pthread_t thread;
+    int epollfd;
+    int listen_socket_http;
+    int listen_socket_https;
+    // the batch socket is shared, each worker has its own fd for it
+    int listen_socket_batch;
+    bool result;
+
+    // the event loop implementation this worker runs
+    const struct event_backend_s *backend;
+
+    // state private to the backend
+    void *backend_state;
+
+    // the database links are served from
+    database db;
+
+    // client connections indexed by fd
+    struct connection_s *connections;
+    size_t max_connections;
+
+    // the connections this worker has open
+    struct connection_s *live;
+
+    // connection timeouts
+    struct timer_wheel_s timers;
+
+    // token buckets for the clients this worker serves
+    struct ratelimit_s ratelimit;
+
+    // complete responses for the links requested most
+    struct cache_s cache;
+
+    // where compressed links are inflated
+    database_scratch scratch;
+
+    // the bearer tokens this worker has verified
+    struct jwt_cache_s jwt;
+
+    // connections waiting for their changes to be durable
+    struct commit_s commit;
+
+    // written to make the worker drain. While draining it stops
+    // accepting and runs until its connections have finished.
+    int wakefd;
+    bool draining;
+    struct timer_s drain_timer;
+
+    // read buffers that can be reused, and the
+    // chunks they were carved from
+    struct connection_buffer_s *free_buffers;
+    void *buffer_chunks;
+};
+
+// whether the worker should keep running
+bool worker_running(const struct worker_s *worker);
+
+// start draining once the wakefd is readable
+void worker_drain(struct worker_s *worker);
+
+// stop listening. New connections are refused, or go to the
+// process taking over which has its own copies of the sockets.
+void worker_close_listen_sockets(struct worker_s *worker);
+
+// add a connection for a newly accepted socket to the connection table.
+// Returns NULL if the connection is refused, in which case the caller
+// closes the socket.
+struct connection_s *worker_connection_open(struct worker_s *worker, int fd, uint32_t address);
+
+// remove a connection from the connection table and close it
+void worker_connection_close(struct worker_s *worker, struct connection_s *conn);
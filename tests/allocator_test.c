@@ -0,0 +1,370 @@
+// the allocator is internal to the database, so it is tested from inside
+#include "../src/database.c"
+#include "test.h"
+
+static char directory[] = "/tmp/linky-allocator-XXXXXX";
+static char file[sizeof(directory) + 16];
+
+static void remove_database(void)
+{
+    char path[sizeof(file) + 8];
+    unlink(file);
+    snprintf(path, sizeof(path), "%s.wal", file);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s.wal.2", file);
+    unlink(path);
+}
+
+static database open_database(void)
+{
+    database db = database_open(file, NULL, true, getgid(), getuid());
+    CHECK(db != NULL);
+    if (!db)
+    {
+        exit(test_result());
+    }
+    return db;
+}
+
+// the first run of count free extents, one extent at a time
+static int32_t find_run_slowly(const uint32_t *bitmap, uint32_t count)
+{
+    uint32_t run = 0;
+    for (uint32_t pos = 0; pos < MM_PAGE_EXTENTS; pos++)
+    {
+        run = bitmap[pos / 32] & (1u << (pos % 32)) ? 0 : run + 1;
+        if (run == count)
+        {
+            return (int32_t)(pos + 1 - count);
+        }
+    }
+    return -1;
+}
+
+static void check_find_run(const uint32_t *bitmap, uint32_t count)
+{
+    int32_t expected = find_run_slowly(bitmap, count);
+    int32_t found = mm_find_run(bitmap, count);
+    CHECK(found == expected);
+    if (found != expected)
+    {
+        fprintf(stderr, "  a run of %u found at %d, expected %d\n", count, found, expected);
+    }
+}
+
+static void check_find_runs(void)
+{
+    static uint32_t bitmap[MM_BITMAP_WORDS];
+    const uint32_t counts[] = {1, 2, 3, 7, 8, 9, 31, 32, 33, 64, 100, 257, 1000, MM_PAGE_EXTENTS};
+
+    // empty, full, and full but for one extent at either end
+    memset(bitmap, 0, sizeof(bitmap));
+    check_find_run(bitmap, 1);
+    check_find_run(bitmap, MM_PAGE_EXTENTS);
+    memset(bitmap, 0xff, sizeof(bitmap));
+    check_find_run(bitmap, 1);
+    bitmap[0] = ~1u;
+    check_find_run(bitmap, 1);
+    check_find_run(bitmap, 2);
+    bitmap[0] = UINT32_MAX;
+    bitmap[MM_BITMAP_WORDS - 1] = 0x7fffffff;
+    check_find_run(bitmap, 1);
+    check_find_run(bitmap, 2);
+
+    // runs that start and end anywhere within and across words
+    srand(1);
+    for (int round = 0; round < 200; round++)
+    {
+        memset(bitmap, 0xff, sizeof(bitmap));
+        for (int run = 0; run < 64; run++)
+        {
+            uint32_t start = (uint32_t)rand() % MM_PAGE_EXTENTS;
+            uint32_t length = (uint32_t)rand() % (round % 2 ? 80 : 1200) + 1;
+            if (start + length > MM_PAGE_EXTENTS)
+            {
+                length = MM_PAGE_EXTENTS - start;
+            }
+            mm_mark(bitmap, start, length, false);
+        }
+        for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+        {
+            check_find_run(bitmap, counts[i]);
+        }
+    }
+}
+
+// with every way of scanning bitmaps this machine has
+static void test_find_run(void)
+{
+    mm_scan_fn scans[] = {
+        mm_scan_scalar,
+#if defined(__x86_64__)
+        mm_scan_sse2,
+        __builtin_cpu_supports("avx2") ? mm_scan_avx2 : mm_scan_sse2,
+#endif
+    };
+    for (size_t i = 0; i < sizeof(scans) / sizeof(scans[0]); i++)
+    {
+        mm_scan = scans[i];
+        check_find_runs();
+    }
+    mm_cpu_init();
+}
+
+// a block comes back zeroed and does not overlap any other
+static void check_block(const uint8_t *block, size_t size, uint8_t fill)
+{
+    size_t zero = 0;
+    while (zero < size && block[zero] == 0)
+    {
+        zero++;
+    }
+    CHECK(zero == size);
+    memset((void *)block, fill, size);
+}
+
+// blocks of up to MM_SIZE_CLASSES extents are reused from their free list,
+// last freed first
+static void test_small(void)
+{
+    database db = open_database();
+
+    uint8_t *a = mm_allocate(db, 100);
+    uint8_t *b = mm_allocate(db, 100);
+    uint8_t *c = mm_allocate(db, MM_EXTENT_SIZE);
+    CHECK(a && b && c && a != b && b != c);
+    check_block(a, 100, 'a');
+    check_block(b, 100, 'b');
+    check_block(c, MM_EXTENT_SIZE, 'c');
+
+    mm_free(db, a, 100);
+    mm_free(db, b, 100);
+    CHECK(((struct mm_root_page *)db->data)->header.free_lists[1] == mm_extent_number(db, b));
+
+    // another size does not take them
+    uint8_t *d = mm_allocate(db, 3 * MM_EXTENT_SIZE);
+    CHECK(d != a && d != b);
+    check_block(d, 3 * MM_EXTENT_SIZE, 'd');
+
+    // any size that rounds to the same number of extents does
+    uint8_t *e = mm_allocate(db, 2 * MM_EXTENT_SIZE);
+    uint8_t *f = mm_allocate(db, MM_EXTENT_SIZE + 1);
+    CHECK(e == b);
+    CHECK(f == a);
+    check_block(e, 2 * MM_EXTENT_SIZE, 'e');
+    check_block(f, MM_EXTENT_SIZE + 1, 'f');
+    CHECK(((struct mm_root_page *)db->data)->header.free_lists[1] == 0);
+
+    // the lists are kept in the file
+    uint32_t extent = mm_extent_number(db, c);
+    mm_free(db, c, MM_EXTENT_SIZE);
+    CHECK(database_checkpoint(db));
+    database_close(db);
+
+    db = open_database();
+    CHECK(mm_extent_number(db, mm_allocate(db, 1)) == extent);
+    database_close(db);
+}
+
+// bigger blocks go back to the bitmap, and the first run that fits is
+// used again
+static void test_large(void)
+{
+    database db = open_database();
+    size_t size = (MM_SIZE_CLASSES + 1) * MM_EXTENT_SIZE;
+
+    uint8_t *a = mm_allocate(db, size);
+    uint8_t *b = mm_allocate(db, size);
+    uint8_t *c = mm_allocate(db, size);
+    CHECK(a && b && c);
+    CHECK(b == a + size && c == b + size);
+    check_block(a, size, 'a');
+    check_block(b, size, 'b');
+    check_block(c, size, 'c');
+
+    uint32_t page = mm_extent_number(db, b) / MM_PAGE_EXTENTS;
+    struct mm_index_record *record = mm_record(db, page);
+    uint32_t allocated = record->extents_allocated;
+
+    mm_free(db, b, size);
+    CHECK(record->extents_allocated == allocated - (MM_SIZE_CLASSES + 1));
+
+    // a bigger block does not fit in the hole, and one of the same size
+    // takes it
+    uint8_t *d = mm_allocate(db, size + MM_EXTENT_SIZE);
+    CHECK(d != b);
+    check_block(d, size + MM_EXTENT_SIZE, 'd');
+    uint8_t *e = mm_allocate(db, size);
+    CHECK(e == b);
+    check_block(e, size, 'e');
+    CHECK(record->extents_allocated == allocated + MM_SIZE_CLASSES + 2);
+
+    // a whole page, which has to come from a new one
+    uint8_t *whole = mm_allocate(db, sizeof(union mm_page));
+    CHECK(whole != NULL);
+    CHECK(mm_extent_number(db, whole) % MM_PAGE_EXTENTS == 0);
+    CHECK(mm_record(db, mm_extent_number(db, whole) / MM_PAGE_EXTENTS)->full);
+    CHECK(mm_allocate(db, sizeof(union mm_page) + 1) == NULL);
+    CHECK(mm_allocate(db, 0) == NULL);
+
+    mm_free(db, whole, sizeof(union mm_page));
+    CHECK(mm_allocate(db, sizeof(union mm_page)) == whole);
+    database_close(db);
+}
+
+// filling the file grows it, and everything handed out stays apart
+static void test_grow(void)
+{
+    database db = open_database();
+    uint32_t pages = db->pages;
+
+    size_t size = 300 * MM_EXTENT_SIZE;
+    size_t count = (size_t)(pages + 2) * MM_PAGE_EXTENTS / 300;
+    uint8_t **blocks = calloc(count, sizeof(*blocks));
+    for (size_t i = 0; i < count; i++)
+    {
+        blocks[i] = mm_allocate(db, size);
+        CHECK(blocks[i] != NULL);
+        if (!blocks[i])
+        {
+            break;
+        }
+        *(size_t *)blocks[i] = i;
+        *(size_t *)(blocks[i] + size - sizeof(size_t)) = i;
+    }
+    CHECK(db->pages > pages);
+
+    size_t intact = 0;
+    for (size_t i = 0; i < count && blocks[i]; i++)
+    {
+        intact += *(size_t *)blocks[i] == i && *(size_t *)(blocks[i] + size - sizeof(size_t)) == i;
+    }
+    CHECK(intact == count);
+
+    // freeing every other block leaves holes that are used before the
+    // file grows again
+    pages = db->pages;
+    for (size_t i = 0; i < count; i += 2)
+    {
+        mm_free(db, blocks[i], size);
+    }
+    for (size_t i = 0; i < count; i += 2)
+    {
+        blocks[i] = mm_allocate(db, size);
+    }
+    CHECK(db->pages == pages);
+
+    free(blocks);
+    database_close(db);
+}
+
+// whether a page is among the candidates for runs of count extents
+static bool candidate(database db, uint32_t page, uint32_t count)
+{
+    unsigned int c = mm_run_class(count);
+    return page / 64 >= db->first_candidate[c] && (db->candidates[c][page / 64] & (1ull << (page % 64)));
+}
+
+// pages too fragmented for a run are not searched for it again, while
+// every page that has room for a run is searched
+static void test_candidates(void)
+{
+    database db = open_database();
+
+    // pages full of blocks of 300 extents with a hole after every other
+    size_t size = 300 * MM_EXTENT_SIZE;
+    size_t count = (size_t)3 * MM_PAGE_EXTENTS / 300;
+    uint8_t **blocks = calloc(count, sizeof(*blocks));
+    size_t *sizes = calloc(count, sizeof(*sizes));
+    for (size_t i = 0; i < count; i++)
+    {
+        blocks[i] = mm_allocate(db, size);
+        sizes[i] = size;
+        CHECK(blocks[i] != NULL);
+    }
+    uint32_t last = mm_extent_number(db, blocks[count - 1]) / MM_PAGE_EXTENTS;
+    for (size_t i = 0; i < count; i += 2)
+    {
+        mm_free(db, blocks[i], size);
+        blocks[i] = NULL;
+    }
+    uint32_t fragmented = mm_extent_number(db, blocks[1]) / MM_PAGE_EXTENTS;
+    CHECK(candidate(db, fragmented, 1025));
+
+    // a run longer than any hole comes from after them, and the pages
+    // it did not fit in are left out for its class from then on
+    uint8_t *big = mm_allocate(db, 1025 * MM_EXTENT_SIZE);
+    CHECK(big != NULL);
+    CHECK(mm_extent_number(db, big) / MM_PAGE_EXTENTS >= last);
+    for (uint32_t page = fragmented; page < last; page++)
+    {
+        if (mm_record(db, page)->full)
+        {
+            continue;
+        }
+        CHECK(!candidate(db, page, 1025));
+        CHECK(!candidate(db, page, 2048));
+        CHECK(candidate(db, page, 300));
+    }
+
+    // freeing lets the page be searched again
+    mm_free(db, blocks[1], size);
+    blocks[1] = NULL;
+    CHECK(candidate(db, fragmented, 1025));
+
+    // whatever happened, a page that has room for a run is a candidate
+    srand(2);
+    for (size_t round = 0; round < 8 * count; round++)
+    {
+        size_t i = (size_t)rand() % count;
+        if (blocks[i])
+        {
+            mm_free(db, blocks[i], sizes[i]);
+            blocks[i] = NULL;
+        }
+        else
+        {
+            sizes[i] = ((size_t)rand() % 1200 + 1) * MM_EXTENT_SIZE;
+            blocks[i] = mm_allocate(db, sizes[i]);
+            CHECK(blocks[i] != NULL);
+        }
+    }
+    const uint32_t runs[] = {1, 9, 64, 65, 300, 513, 1025, 4096, MM_PAGE_EXTENTS};
+    for (uint32_t page = 0; page < db->pages; page++)
+    {
+        const struct mm_index_record *record = mm_record(db, page);
+        for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+        {
+            if (!record->full && mm_find_run(record->bitmap, runs[i]) >= 0)
+            {
+                CHECK(candidate(db, page, runs[i]));
+            }
+        }
+    }
+
+    free(sizes);
+    free(blocks);
+    database_close(db);
+}
+
+int main(void)
+{
+    if (!mkdtemp(directory))
+    {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    snprintf(file, sizeof(file), "%s/linky.db", directory);
+
+    RUN(test_find_run);
+    RUN(test_small);
+    remove_database();
+    RUN(test_large);
+    remove_database();
+    RUN(test_grow);
+    remove_database();
+    RUN(test_candidates);
+    remove_database();
+    rmdir(directory);
+    return test_result();
+}
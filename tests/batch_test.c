@@ -0,0 +1,400 @@
+#include "batch.h"
+#include "connection.h"
+#include "handler.h"
+#include "commit.h"
+#include "worker.h"
+#include "event.h"
+#include "test.h"
+
+#include <string.h>
+#include <unistd.h>
+
+// batch_process is driven on a connection of its own against a real
+// database. Whatever it sends is collected by a backend made up for the
+// test, which can also leave sends in flight for a while.
+
+static char directory[] = "/tmp/linky-batch-XXXXXX";
+static char file[sizeof(directory) + 16];
+
+bool connection_can_process(struct connection_s *conn)
+{
+    return !conn->close_after_write && batch_can_process(conn);
+}
+
+bool connection_send(struct connection_s *conn, const void *data, size_t length)
+{
+    CHECK(conn->iovcnt < CONNECTION_MAX_IOV);
+    conn->iov[conn->iovcnt].iov_base = (void *)data;
+    conn->iov[conn->iovcnt].iov_len = length;
+    conn->iovcnt++;
+    return true;
+}
+
+bool handler_valid_url(const char *url, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if ((unsigned char)url[i] < 0x21 || url[i] == 0x7f)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void commit_add(struct connection_s *conn) {}
+
+// what has been sent
+static uint8_t output[1 << 20];
+static size_t output_length;
+// whether sends stay in flight until complete_send
+static bool slow_sends;
+// flushes batch_process made itself because its output buffer was full
+static bool processing;
+static unsigned int rollovers;
+
+static void complete_send(struct connection_s *conn)
+{
+    for (int i = 0; i < conn->iovcnt; i++)
+    {
+        CHECK(output_length + conn->iov[i].iov_len <= sizeof(output));
+        memcpy(output + output_length, conn->iov[i].iov_base, conn->iov[i].iov_len);
+        output_length += conn->iov[i].iov_len;
+    }
+    conn->iovcnt = 0;
+    conn->send_inflight = false;
+}
+
+static bool flush(struct connection_s *conn)
+{
+    rollovers += processing;
+    if (slow_sends)
+    {
+        conn->send_inflight = conn->iovcnt != 0;
+    }
+    else
+    {
+        complete_send(conn);
+    }
+    return true;
+}
+
+static const struct event_backend_s backend = {.name = "test", .flush = flush};
+
+static struct worker_s worker;
+static struct connection_s conn;
+static char buffer[CONNECTION_BUFFER_SIZE];
+
+static void open_connection(void)
+{
+    memset(&conn, 0, sizeof(conn));
+    conn.worker = &worker;
+    conn.buffer = buffer;
+    CHECK(batch_open(&conn));
+    output_length = 0;
+    slow_sends = false;
+    rollovers = 0;
+}
+
+// feed a stream to the connection in reads of at most chunk bytes, the
+// way a backend would, carrying on after each send completes. Returns
+// false if the connection was closed.
+static bool feed(const uint8_t *stream, size_t length, size_t chunk)
+{
+    size_t pos = 0;
+    for (;;)
+    {
+        size_t room = CONNECTION_BUFFER_SIZE - conn.length;
+        size_t n = length - pos < chunk ? length - pos : chunk;
+        n = n < room ? n : room;
+        memcpy(conn.buffer + conn.length, stream + pos, n);
+        conn.length += n;
+        pos += n;
+
+        size_t sent = output_length;
+        size_t pending = conn.length;
+        processing = true;
+        bool result = batch_process(&conn);
+        processing = false;
+        if (!result)
+        {
+            return false;
+        }
+        flush(&conn);
+        complete_send(&conn);
+        if (pos == length && conn.length == pending && output_length == sent)
+        {
+            return true;
+        }
+    }
+}
+
+static void close_connection(void)
+{
+    batch_close(&conn);
+}
+
+// building requests
+static uint8_t stream[1 << 20];
+static size_t stream_length;
+
+static void put8(uint8_t value)
+{
+    stream[stream_length++] = value;
+}
+
+static void put16(uint16_t value)
+{
+    put8((uint8_t)value);
+    put8((uint8_t)(value >> 8));
+}
+
+static void put32(uint32_t value)
+{
+    put16((uint16_t)value);
+    put16((uint16_t)(value >> 16));
+}
+
+static void put64(uint64_t value)
+{
+    put32((uint32_t)value);
+    put32((uint32_t)(value >> 32));
+}
+
+static void put_header(uint8_t op, uint32_t count)
+{
+    put8(op);
+    put8(0);
+    put16(0);
+    put32(count);
+}
+
+static void put_set(uint32_t key, uint64_t expires, const char *url, size_t length)
+{
+    put32(key);
+    put64(expires);
+    put16((uint16_t)length);
+    memcpy(stream + stream_length, url, length);
+    stream_length += length;
+}
+
+// reading replies
+static size_t output_pos;
+
+static uint64_t get_bytes(unsigned int n)
+{
+    uint64_t value = 0;
+    for (unsigned int i = 0; i < n && output_pos < output_length; i++)
+    {
+        value |= (uint64_t)output[output_pos++] << (8 * i);
+    }
+    return value;
+}
+
+static void check_header(uint8_t op, uint32_t count)
+{
+    CHECK(get_bytes(1) == op);
+    CHECK(get_bytes(1) == 0);
+    CHECK(get_bytes(2) == 0);
+    CHECK(get_bytes(4) == count);
+}
+
+static void check_get(const char *url, size_t length, uint64_t expires)
+{
+    CHECK(get_bytes(2) == length);
+    CHECK(get_bytes(8) == expires);
+    CHECK(output_pos + length <= output_length && memcmp(output + output_pos, url, length) == 0);
+    output_pos += length;
+}
+
+// the same requests give the same replies however they are split up
+static void test_split(void)
+{
+    stream_length = 0;
+    put_header(BATCH_SET, 2);
+    put_set(1, 0, "https://example.com/one", 23);
+    put_set(2, 4000000000ull, "https://example.com/two", 23);
+    put_header(BATCH_GET, 3);
+    put32(1);
+    put32(2);
+    put32(3);
+    put_header(BATCH_DELETE, 2);
+    put32(1);
+    put32(3);
+    put_header(BATCH_GET, 1);
+    put32(1);
+
+    const size_t chunks[] = {1, 3, 7, 13, sizeof(stream)};
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+    {
+        open_connection();
+        CHECK(feed(stream, stream_length, chunks[i]));
+        CHECK(conn.length == 0);
+        CHECK(batch_idle(&conn));
+        CHECK(conn.stats.requests == 4);
+
+        output_pos = 0;
+        check_header(BATCH_SET, 2);
+        CHECK(get_bytes(1) == 0);
+        CHECK(get_bytes(1) == 0);
+        check_header(BATCH_GET, 3);
+        check_get("https://example.com/one", 23, 0);
+        check_get("https://example.com/two", 23, 4000000000ull);
+        check_get("", 0, 0);
+        check_header(BATCH_DELETE, 2);
+        CHECK(get_bytes(1) == 0);
+        CHECK(get_bytes(1) != 0);
+        check_header(BATCH_GET, 1);
+        check_get("", 0, 0);
+        CHECK(output_pos == output_length);
+        close_connection();
+    }
+}
+
+// a frame with no records is answered with its header
+static void test_empty_frame(void)
+{
+    stream_length = 0;
+    put_header(BATCH_GET, 0);
+    put_header(BATCH_DELETE, 0);
+    put_header(BATCH_GET, 1);
+    put32(12345);
+
+    open_connection();
+    CHECK(feed(stream, stream_length, 5));
+    CHECK(conn.stats.requests == 3);
+    output_pos = 0;
+    check_header(BATCH_GET, 0);
+    check_header(BATCH_DELETE, 0);
+    check_header(BATCH_GET, 1);
+    check_get("", 0, 0);
+    CHECK(output_pos == output_length);
+    close_connection();
+}
+
+// anything malformed closes the connection
+static void test_malformed(void)
+{
+    const uint8_t headers[][BATCH_FRAME_HEADER_LENGTH] = {
+        {0, 0, 0, 0, 1, 0, 0, 0},
+        {BATCH_DELETE + 1, 0, 0, 0, 1, 0, 0, 0},
+        {BATCH_GET, 1, 0, 0, 1, 0, 0, 0},
+        {BATCH_GET, 0, 0, 1, 1, 0, 0, 0},
+        {BATCH_GET, 0, 1, 0, 1, 0, 0, 0},
+    };
+    for (size_t i = 0; i < sizeof(headers) / sizeof(headers[0]); i++)
+    {
+        open_connection();
+        CHECK(!feed(headers[i], BATCH_FRAME_HEADER_LENGTH, BATCH_FRAME_HEADER_LENGTH));
+        close_connection();
+    }
+
+    // a url too long for a record, or none at all
+    static char url[BATCH_MAX_URL + 1];
+    memset(url, 'a', sizeof(url));
+    const size_t lengths[] = {0, BATCH_MAX_URL + 1, UINT16_MAX};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+    {
+        stream_length = 0;
+        put_header(BATCH_SET, 1);
+        put32(1);
+        put64(0);
+        put16((uint16_t)lengths[i]);
+        memcpy(stream + stream_length, url, lengths[i] < sizeof(url) ? lengths[i] : sizeof(url));
+        stream_length += lengths[i] < sizeof(url) ? lengths[i] : sizeof(url);
+        open_connection();
+        CHECK(!feed(stream, stream_length, 64));
+        close_connection();
+    }
+
+    // a url as long as allowed is fine, one that is not valid is refused
+    memcpy(url, "https://", 8);
+    stream_length = 0;
+    put_header(BATCH_SET, 2);
+    put_set(7, 0, url, BATCH_MAX_URL);
+    put_set(8, 0, "https://example.com/a b", 23);
+    open_connection();
+    CHECK(feed(stream, stream_length, 1000));
+    output_pos = 0;
+    check_header(BATCH_SET, 2);
+    CHECK(get_bytes(1) == 0);
+    CHECK(get_bytes(1) != 0);
+    close_connection();
+}
+
+// more results than the output buffer holds are all sent intact, whether
+// the buffer is reused right away or only once a send has finished
+static void test_rollover(void)
+{
+    static char url[2000];
+    memset(url, 'x', sizeof(url));
+    memcpy(url, "https://", 8);
+    const uint32_t count = 200;
+    for (uint32_t key = 0; key < count; key++)
+    {
+        snprintf(url + 8, 12, "%011u", key);
+        url[19] = '/';
+        CHECK(database_set(worker.db, 1000 + key, url, 0));
+    }
+
+    stream_length = 0;
+    put_header(BATCH_GET, count);
+    for (uint32_t key = 0; key < count; key++)
+    {
+        put32(1000 + key);
+    }
+
+    for (int slow = 0; slow < 2; slow++)
+    {
+        open_connection();
+        slow_sends = slow;
+        CHECK(feed(stream, stream_length, 4096));
+        output_pos = 0;
+        check_header(BATCH_GET, count);
+        for (uint32_t key = 0; key < count; key++)
+        {
+            snprintf(url + 8, 12, "%011u", key);
+            url[19] = '/';
+            check_get(url, sizeof(url), 0);
+        }
+        CHECK(output_pos == output_length);
+        CHECK(rollovers > 0);
+        close_connection();
+    }
+}
+
+int main(void)
+{
+    if (!mkdtemp(directory))
+    {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    snprintf(file, sizeof(file), "%s/linky.db", directory);
+    worker.db = database_open(file, NULL, true, getgid(), getuid());
+    worker.scratch = database_scratch_create();
+    worker.backend = &backend;
+    CHECK(worker.db && worker.scratch);
+    if (!worker.db || !worker.scratch)
+    {
+        return test_result();
+    }
+    database_reader_enter(worker.db, 0);
+
+    RUN(test_split);
+    RUN(test_empty_frame);
+    RUN(test_malformed);
+    RUN(test_rollover);
+
+    database_reader_leave(worker.db, 0);
+    database_scratch_free(worker.scratch);
+    database_close(worker.db);
+    char path[sizeof(file) + 8];
+    unlink(file);
+    snprintf(path, sizeof(path), "%s.wal", file);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s.wal.2", file);
+    unlink(path);
+    rmdir(directory);
+    return test_result();
+}
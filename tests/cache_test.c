@@ -0,0 +1,217 @@
+// the index is internal to the cache, so it is tested from inside
+#include "../src/cache.c"
+#include "test.h"
+
+#include <unistd.h>
+
+#define SLOTS 8
+#define NOW 1000000000ull
+
+static char directory[] = "/tmp/linky-cache-XXXXXX";
+static char file[sizeof(directory) + 16];
+
+static database db;
+
+static void open_cache(struct cache_s *cache)
+{
+    CHECK(cache_open(cache));
+    CHECK(cache->slots == SLOTS);
+    if (!cache_enabled(cache))
+    {
+        exit(test_result());
+    }
+}
+
+// cache a response for key that says which key it is for
+static void fill(struct cache_s *cache, uint32_t key, uint32_t version, uint64_t expires)
+{
+    char *slot = cache_reserve(cache);
+    CHECK(slot != NULL);
+    if (slot)
+    {
+        int length = snprintf(slot, CACHE_SLOT_SIZE, "response %u", key);
+        cache_commit(cache, slot, key, version, expires, (size_t)length);
+    }
+}
+
+static bool hit(struct cache_s *cache, uint32_t key, uint64_t now)
+{
+    size_t length;
+    const char *response = cache_get(cache, db, key, now, &length);
+    char expected[32];
+    int expected_length = snprintf(expected, sizeof(expected), "response %u", key);
+    CHECK(!response || (length == (size_t)expected_length && memcmp(response, expected, length) == 0));
+    return response != NULL;
+}
+
+// a response stops being served once its link is changed or expires
+static void test_invalidation(void)
+{
+    struct cache_s cache;
+    open_cache(&cache);
+
+    CHECK(database_set(db, 1, "https://example.com/one", 0));
+    fill(&cache, 1, database_version(db, 1), 0);
+    CHECK(hit(&cache, 1, NOW));
+    CHECK(database_set(db, 1, "https://example.com/uno", 0));
+    CHECK(!hit(&cache, 1, NOW));
+    CHECK(!hit(&cache, 1, NOW));
+
+    CHECK(database_set(db, 2, "https://example.com/two", 0));
+    fill(&cache, 2, database_version(db, 2), 0);
+    CHECK(hit(&cache, 2, NOW));
+    CHECK(database_expire(db, 2, NOW - 1));
+    CHECK(!hit(&cache, 2, NOW));
+
+    CHECK(database_set(db, 3, "https://example.com/three", NOW + 10));
+    fill(&cache, 3, database_version(db, 3), NOW + 10);
+    CHECK(hit(&cache, 3, NOW + 9));
+    CHECK(!hit(&cache, 3, NOW + 10));
+
+    // filling the cache again replaces the stale response
+    fill(&cache, 1, database_version(db, 1), 0);
+    CHECK(hit(&cache, 1, NOW));
+
+    cache_close(&cache);
+}
+
+// keys that all want the same index position, close enough to the
+// end that their probes wrap around
+static void colliding_keys(const struct cache_s *cache, uint32_t *keys, unsigned int count)
+{
+    uint32_t home = (1u << cache->index_bits) - 3;
+    unsigned int n = 0;
+    for (uint32_t key = 1; n < count; key++)
+    {
+        if (cache_home(cache, key) == home)
+        {
+            keys[n++] = key;
+        }
+    }
+}
+
+// taking an entry out of the middle of a probe sequence
+// leaves the entries after it findable
+static void test_unindex(void)
+{
+    struct cache_s cache;
+    open_cache(&cache);
+
+    uint32_t keys[SLOTS];
+    colliding_keys(&cache, keys, SLOTS);
+    for (unsigned int i = 0; i < SLOTS; i++)
+    {
+        fill(&cache, keys[i], database_version(db, keys[i]), i % 3 == 1 ? NOW : 0);
+    }
+    for (unsigned int i = 0; i < SLOTS; i++)
+    {
+        CHECK(hit(&cache, keys[i], NOW - 1));
+    }
+
+    // every third one has expired and goes
+    for (unsigned int i = 1; i < SLOTS; i += 3)
+    {
+        CHECK(!hit(&cache, keys[i], NOW));
+    }
+    for (unsigned int i = 0; i < SLOTS; i++)
+    {
+        CHECK(hit(&cache, keys[i], NOW - 1) == (i % 3 != 1));
+    }
+
+    // and the rest are found as the ones before them go
+    for (unsigned int i = 0; i < SLOTS; i++)
+    {
+        int64_t position = cache_find(&cache, keys[i]);
+        if (position >= 0)
+        {
+            cache_unindex(&cache, (uint32_t)position);
+        }
+        for (unsigned int j = i + 1; j < SLOTS; j++)
+        {
+            CHECK(hit(&cache, keys[j], NOW - 1) == (j % 3 != 1));
+        }
+    }
+    for (uint32_t position = 0; position < (1u << cache.index_bits); position++)
+    {
+        CHECK(cache.index[position] == 0);
+    }
+
+    cache_close(&cache);
+}
+
+// the hand passes over slots that are being sent from
+static void test_held(void)
+{
+    struct cache_s cache;
+    open_cache(&cache);
+
+    for (uint32_t key = 100; key < 100 + SLOTS; key++)
+    {
+        fill(&cache, key, database_version(db, key), 0);
+    }
+    size_t length;
+    const char *held = cache_get(&cache, db, 100, NOW, &length);
+    CHECK(held != NULL);
+    cache_hold(&cache, held);
+
+    // new responses take every slot but the one held
+    for (uint32_t key = 200; key < 200 + 3 * SLOTS; key++)
+    {
+        char *slot = cache_reserve(&cache);
+        CHECK(slot != NULL && slot != held);
+        if (slot)
+        {
+            cache_commit(&cache, slot, key, database_version(db, key), 0, 0);
+        }
+    }
+    CHECK(cache_get(&cache, db, 100, NOW, &length) == held);
+
+    // with every slot held there is no room
+    for (unsigned int i = 0; i < SLOTS; i++)
+    {
+        cache_hold(&cache, cache.responses + (size_t)i * CACHE_SLOT_SIZE);
+    }
+    CHECK(cache_reserve(&cache) == NULL);
+    cache_release(&cache, held);
+    CHECK(cache_reserve(&cache) == NULL);
+    cache_release(&cache, held);
+    CHECK(cache_reserve(&cache) == held);
+
+    cache_close(&cache);
+}
+
+int main(void)
+{
+    if (!mkdtemp(directory))
+    {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    snprintf(file, sizeof(file), "%s/linky.db", directory);
+    char size[16];
+    snprintf(size, sizeof(size), "%d", SLOTS * CACHE_SLOT_SIZE);
+    setenv("LINKY_CACHE_SIZE", size, 1);
+
+    db = database_open(file, NULL, true, getgid(), getuid());
+    CHECK(db != NULL);
+    if (!db)
+    {
+        return test_result();
+    }
+    database_reader_enter(db, 0);
+
+    RUN(test_invalidation);
+    RUN(test_unindex);
+    RUN(test_held);
+
+    database_reader_leave(db, 0);
+    database_close(db);
+    char path[sizeof(file) + 8];
+    unlink(file);
+    snprintf(path, sizeof(path), "%s.wal", file);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s.wal.2", file);
+    unlink(path);
+    rmdir(directory);
+    return test_result();
+}
@@ -0,0 +1,126 @@
+#include "connection.h"
+#include "handler.h"
+#include "response.h"
+#include "batch.h"
+#include "http2.h"
+#include "tls.h"
+#include "commit.h"
+#include "test.h"
+
+#include <string.h>
+
+// connection_process is driven on its own. What it hands requests and
+// errors to is replaced by stand-ins that write down what they got.
+
+static int requests;
+static size_t body_lengths[8];
+static int error_status;
+
+bool handler_request(struct connection_s *conn, const http_request *request)
+{
+    if (requests < (int)(sizeof(body_lengths) / sizeof(body_lengths[0])))
+    {
+        body_lengths[requests] = request->body.length;
+    }
+    requests++;
+    return true;
+}
+
+bool response_status(struct connection_s *conn, int status, bool keep_alive)
+{
+    error_status = status;
+    return true;
+}
+
+bool batch_process(struct connection_s *conn) { return false; }
+bool batch_can_process(const struct connection_s *conn) { return true; }
+bool batch_idle(const struct connection_s *conn) { return true; }
+void batch_close(struct connection_s *conn) {}
+bool http2_open(struct connection_s *conn) { return false; }
+bool http2_process(struct connection_s *conn) { return false; }
+bool http2_idle(const struct connection_s *conn) { return true; }
+void http2_close(struct connection_s *conn) {}
+bool tls_handshake(struct connection_s *conn) { return false; }
+bool tls_selected_http2(struct connection_s *conn) { return false; }
+ssize_t tls_read(struct connection_s *conn, void *buffer, size_t length) { return -1; }
+ssize_t tls_write(struct connection_s *conn, const void *buffer, size_t length) { return -1; }
+void tls_close(struct connection_s *conn) {}
+void commit_remove(struct connection_s *conn) {}
+
+static char buffer[CONNECTION_BUFFER_SIZE];
+
+static void open_connection(struct connection_s *conn)
+{
+    memset(conn, 0, sizeof(*conn));
+    connection_init(conn, NULL, -1, 0, buffer);
+    requests = 0;
+    error_status = 0;
+}
+
+// append data as if it was read from the socket
+static size_t receive(struct connection_s *conn, const char *data, size_t length)
+{
+    size_t room = CONNECTION_BUFFER_SIZE - conn->length;
+    length = length < room ? length : room;
+    memcpy(conn->buffer + conn->length, data, length);
+    conn->length += length;
+    return length;
+}
+
+static size_t append_request(char *stream, size_t length, const char *method, size_t padding, size_t body)
+{
+    length += (size_t)sprintf(stream + length, "%s / HTTP/1.1\r\nX-Padding: ", method);
+    memset(stream + length, 'p', padding);
+    length += padding;
+    length += (size_t)sprintf(stream + length, "\r\nContent-Length: %zu\r\n\r\n", body);
+    memset(stream + length, 'b', body);
+    return length + body;
+}
+
+// a body that fits is accepted wherever in the buffer its request starts
+static void test_pipelined_body(void)
+{
+    static char stream[3 * CONNECTION_BUFFER_SIZE];
+    size_t length = 0;
+    length = append_request(stream, length, "GET", 1500, 0);
+    length = append_request(stream, length, "GET", 1500, 0);
+    length = append_request(stream, length, "PUT", 0, 1900);
+    CHECK(length > CONNECTION_BUFFER_SIZE);
+
+    struct connection_s conn;
+    open_connection(&conn);
+    size_t sent = 0;
+    while (sent < length && !error_status)
+    {
+        sent += receive(&conn, stream + sent, length - sent);
+        CHECK(connection_process(&conn));
+    }
+    CHECK(error_status == 0);
+    CHECK(requests == 3);
+    CHECK(body_lengths[2] == 1900);
+}
+
+// a body that could never fit is refused before it is read
+static void test_body_too_large(void)
+{
+    static char stream[2 * CONNECTION_BUFFER_SIZE];
+    size_t length = 0;
+    length = append_request(stream, length, "GET", 1500, 0);
+    size_t put = length;
+    length = append_request(stream, length, "PUT", 0, CONNECTION_BUFFER_SIZE);
+
+    struct connection_s conn;
+    open_connection(&conn);
+    receive(&conn, stream, put + 100);
+    CHECK(connection_process(&conn));
+    CHECK(requests == 1);
+    CHECK(error_status == 413);
+    CHECK(conn.close_after_write);
+}
+
+int main(void)
+{
+    RUN(test_pipelined_body);
+    RUN(test_body_too_large);
+    return test_result();
+}
@@ -0,0 +1,166 @@
+// the page checksums are internal to the database, so they are tested
+// from inside
+#include "../src/database.c"
+#include "test.h"
+
+static const struct
+{
+    const char *name;
+    mm_crc_fn crc;
+} crcs[] = {
+    {"table", mm_crc32c_table},
+#if defined(__x86_64__)
+    {"sse4.2", mm_crc32c_sse42},
+#endif
+};
+
+#define CRCS (sizeof(crcs) / sizeof(crcs[0]))
+
+static bool crc_supported(size_t i)
+{
+#if defined(__x86_64__)
+    if (crcs[i].crc == mm_crc32c_sse42)
+    {
+        return __builtin_cpu_supports("sse4.2");
+    }
+#endif
+    return true;
+}
+
+static uint32_t crc32c(size_t i, const void *data, size_t length)
+{
+    return ~crcs[i].crc(~0u, (const uint8_t *)data, length);
+}
+
+// RFC 3720 B.4 and the usual check value
+static void test_known_answers(void)
+{
+    uint8_t zeros[32], ones[32], ascending[32], descending[32];
+    memset(zeros, 0, sizeof(zeros));
+    memset(ones, 0xff, sizeof(ones));
+    for (int i = 0; i < 32; i++)
+    {
+        ascending[i] = (uint8_t)i;
+        descending[i] = (uint8_t)(31 - i);
+    }
+
+    for (size_t i = 0; i < CRCS; i++)
+    {
+        if (!crc_supported(i))
+        {
+            printf("     no %s on this cpu\n", crcs[i].name);
+            continue;
+        }
+        CHECK(crc32c(i, "", 0) == 0);
+        CHECK(crc32c(i, "123456789", 9) == 0xe3069283);
+        CHECK(crc32c(i, zeros, sizeof(zeros)) == 0x8a9136aa);
+        CHECK(crc32c(i, ones, sizeof(ones)) == 0x62a8ab43);
+        CHECK(crc32c(i, ascending, sizeof(ascending)) == 0x46dd794e);
+        CHECK(crc32c(i, descending, sizeof(descending)) == 0x113fdb5c);
+    }
+
+    // 0 is kept for pages without one
+    CHECK(mm_checksum_final(~0u) == 1);
+    CHECK(mm_checksum_final(~0x1234u) == 0x1234);
+}
+
+// every implementation agrees with the table on any length, wherever
+// the data starts, and a checksum can be carried on piece by piece
+static void test_agree(void)
+{
+    static uint8_t data[sizeof(union mm_page)];
+    srand(1);
+    for (size_t i = 0; i < sizeof(data); i++)
+    {
+        data[i] = (uint8_t)rand();
+    }
+
+    for (size_t i = 0; i < CRCS; i++)
+    {
+        if (!crc_supported(i))
+        {
+            continue;
+        }
+        unsigned int agreed = 0, checked = 0;
+        for (size_t start = 0; start < 8; start++)
+        {
+            for (size_t length = 0; length < 200; length++, checked++)
+            {
+                agreed += crcs[i].crc(~0u, data + start, length) == mm_crc32c_table(~0u, data + start, length);
+            }
+        }
+        CHECK(agreed == checked);
+
+        uint32_t whole = crcs[i].crc(~0u, data, sizeof(data));
+        CHECK(whole == mm_crc32c_table(~0u, data, sizeof(data)));
+        for (size_t split = 1; split < sizeof(data); split = split * 3 + 1)
+        {
+            uint32_t crc = crcs[i].crc(~0u, data, split);
+            CHECK(crcs[i].crc(crc, data + split, sizeof(data) - split) == whole);
+        }
+    }
+}
+
+// a checkpoint writes the checksums the pages in the file have
+static void test_pages(void)
+{
+    char directory[] = "/tmp/linky-crc32c-XXXXXX";
+    if (!mkdtemp(directory))
+    {
+        CHECK(!"mkdtemp");
+        return;
+    }
+    char file[sizeof(directory) + 16], path[sizeof(file) + 8];
+    snprintf(file, sizeof(file), "%s/linky.db", directory);
+
+    database db = database_open(file, NULL, true, getgid(), getuid());
+    CHECK(db != NULL);
+    if (db)
+    {
+        for (uint32_t key = 1; key <= 10000; key++)
+        {
+            char url[64];
+            snprintf(url, sizeof(url), "https://example.com/%u", key);
+            CHECK(database_set(db, key, url, 0));
+        }
+        CHECK(database_checkpoint(db));
+
+        // pages that were never written have none
+        unsigned int good = 0, counted = 0;
+        for (uint32_t page = 0; page < db->pages; page++)
+        {
+            uint32_t checksum;
+            if (mm_record(db, page)->checksum)
+            {
+                good += mm_file_checksum(db, page, &checksum) && checksum == mm_record(db, page)->checksum;
+                counted++;
+            }
+        }
+        CHECK(counted >= 3 && good == counted);
+
+        // and one that changes in the file no longer matches
+        int fd = open(file, O_WRONLY);
+        CHECK(fd != -1 && pwrite(fd, "x", 1, (off_t)HUGE_PAGE_SIZE * 2 + 100) == 1);
+        close(fd);
+        uint32_t checksum;
+        CHECK(mm_record(db, 2)->checksum != 0);
+        CHECK(mm_file_checksum(db, 2, &checksum) && checksum != mm_record(db, 2)->checksum);
+        database_close(db);
+    }
+
+    unlink(file);
+    snprintf(path, sizeof(path), "%s.wal", file);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s.wal.2", file);
+    unlink(path);
+    rmdir(directory);
+}
+
+int main(void)
+{
+    mm_cpu_init();
+    RUN(test_known_answers);
+    RUN(test_agree);
+    RUN(test_pages);
+    return test_result();
+}
@@ -0,0 +1,236 @@
+// how values are stored is internal to the database, so it is tested
+// from inside
+#include "../src/database.c"
+#include "test.h"
+
+static char directory[] = "/tmp/linky-database-XXXXXX";
+static char file[sizeof(directory) + 16];
+
+static void remove_database(void)
+{
+    char path[sizeof(file) + 8];
+    unlink(file);
+    snprintf(path, sizeof(path), "%s.wal", file);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s.wal.2", file);
+    unlink(path);
+}
+
+static database open_database(void)
+{
+    database db = database_open(file, NULL, true, getgid(), getuid());
+    CHECK(db != NULL);
+    if (!db)
+    {
+        exit(test_result());
+    }
+    database_reader_enter(db, 0);
+    return db;
+}
+
+static void close_database(database db)
+{
+    database_reader_leave(db, 0);
+    database_close(db);
+}
+
+// the flags of the stored value of key
+static uint32_t stored_flags(database db, uint32_t key)
+{
+    struct database_value *stored;
+    if (!hashtable_get(db->table, key, (void **)&stored, false))
+    {
+        return UINT32_MAX;
+    }
+    return stored->length & DATABASE_LENGTH_FLAGS;
+}
+
+// whether key reads back as url
+static bool reads_back(database db, database_scratch scratch, uint32_t key, const char *url)
+{
+    database_url value;
+    uint64_t expires;
+    if (!database_get(db, key, scratch, &value, &expires))
+    {
+        return false;
+    }
+    size_t length = strlen(url);
+    return database_url_length(&value) == length &&
+           memcmp(value.prefix ? value.prefix : "", url, value.prefix_length) == 0 &&
+           memcmp(value.suffix, url + value.prefix_length, value.suffix_length) == 0;
+}
+
+#define PREFIXED 100
+
+static void prefixed_url(uint32_t key, char *url, size_t size)
+{
+    // a few hosts, each with many links
+    snprintf(url, size, "https://host%u.example.com/some/path/%u?q=%u", key % 4, key, key * 7);
+}
+
+static unsigned int check_prefixed(database db, database_scratch scratch)
+{
+    unsigned int intact = 0;
+    char url[128];
+    for (uint32_t key = 0; key < PREFIXED; key++)
+    {
+        prefixed_url(key, url, sizeof(url));
+        intact += reads_back(db, scratch, key, url);
+    }
+    intact += reads_back(db, scratch, PREFIXED, "https://a.io/x");
+    return intact;
+}
+
+// urls that share a prefix store it once, and read back whole
+static void test_prefixes(void)
+{
+    database db = open_database();
+    database_scratch scratch = database_scratch_create();
+    char url[128];
+    for (uint32_t key = 0; key < PREFIXED; key++)
+    {
+        prefixed_url(key, url, sizeof(url));
+        CHECK(database_set(db, key, url, 0));
+    }
+    // too short a prefix to be worth it
+    CHECK(database_set(db, PREFIXED, "https://a.io/x", 0));
+
+    const struct mm_header *header = &((struct mm_root_page *)db->data)->header;
+    CHECK(header->prefix_count == 4);
+    // the first of each host is seen before its prefix is interned
+    CHECK(stored_flags(db, 0) == 0);
+    CHECK(stored_flags(db, 3) == 0);
+    CHECK(stored_flags(db, 4) == DATABASE_INTERNED);
+    CHECK(stored_flags(db, PREFIXED - 1) == DATABASE_INTERNED);
+    CHECK(stored_flags(db, PREFIXED) == 0);
+    CHECK(check_prefixed(db, scratch) == PREFIXED + 1);
+
+    // a value set again may lose or change its prefix
+    CHECK(database_set(db, 4, "https://a.io/y", 0));
+    CHECK(stored_flags(db, 4) == 0);
+    CHECK(reads_back(db, scratch, 4, "https://a.io/y"));
+    prefixed_url(4, url, sizeof(url));
+    CHECK(database_set(db, 4, url, 0));
+    CHECK(stored_flags(db, 4) == DATABASE_INTERNED);
+    close_database(db);
+
+    // from the log, and from the file after a checkpoint
+    db = open_database();
+    CHECK(((struct mm_root_page *)db->data)->header.prefix_count == 4);
+    CHECK(check_prefixed(db, scratch) == PREFIXED + 1);
+    CHECK(database_checkpoint(db));
+    close_database(db);
+    db = open_database();
+    CHECK(check_prefixed(db, scratch) == PREFIXED + 1);
+
+    // new values find the prefixes that are there
+    CHECK(database_set(db, 1000, "https://host1.example.com/some/path/new", 0));
+    CHECK(stored_flags(db, 1000) == DATABASE_INTERNED);
+    CHECK(reads_back(db, scratch, 1000, "https://host1.example.com/some/path/new"));
+    CHECK(((struct mm_root_page *)db->data)->header.prefix_count == 4);
+
+    database_scratch_free(scratch);
+    close_database(db);
+}
+
+#define THRESHOLD 256
+#define LONG_URLS 1500
+
+// long urls with the same tracking parameters and values that vary
+static void long_url(uint32_t key, char *url, size_t size)
+{
+    uint32_t x = key * 2654435761u + 12345;
+    snprintf(url, size,
+             "https://shop.example.com/products/%u/item-%u?utm_source=newsletter&utm_medium=email"
+             "&utm_campaign=spring_sale_%u&utm_content=banner_top&utm_term=running+shoes"
+             "&ref=homepage_carousel&session=%08x%08x&click_id=%08x&variant=%u"
+             "&redirect=https%%3A%%2F%%2Fshop.example.com%%2Fcheckout%%2Fcart%%3Fsource%%3Demail"
+             "&tracking_id=%08x-%04x-%04x&locale=en_US&currency=USD",
+             key % 7, key, 2020 + key % 7, x, x ^ 0x5bd1e995u, x * 31, key % 5, x * 17, key & 0xffff, x >> 16);
+}
+
+static unsigned int check_long(database db, database_scratch scratch, uint32_t from, uint32_t to)
+{
+    unsigned int intact = 0;
+    char url[1024];
+    for (uint32_t key = from; key < to; key++)
+    {
+        long_url(key, url, sizeof(url));
+        intact += reads_back(db, scratch, 10000 + key, url);
+    }
+    return intact;
+}
+
+// long urls are compressed once there is a dictionary, and read back whole
+static void test_compression(void)
+{
+    database db = open_database();
+    database_scratch scratch = database_scratch_create();
+    CHECK(database_compress(db, THRESHOLD));
+
+    char url[1024];
+    long_url(0, url, sizeof(url));
+    CHECK(strlen(url) > THRESHOLD);
+    for (uint32_t key = 0; key < LONG_URLS; key++)
+    {
+        long_url(key, url, sizeof(url));
+        CHECK(database_set(db, 10000 + key, url, 0));
+    }
+    CHECK(database_set(db, 20000, "https://shop.example.com/products/short", 0));
+
+    uint32_t dictionary_length;
+    CHECK(database_dictionary(db, &dictionary_length) != NULL);
+    CHECK(stored_flags(db, 10000) == 0);
+    CHECK(stored_flags(db, 10000 + LONG_URLS - 1) == (DATABASE_INTERNED | DATABASE_COMPRESSED));
+    CHECK(stored_flags(db, 20000) == 0);
+    unsigned int compressed = 0;
+    for (uint32_t key = 0; key < LONG_URLS; key++)
+    {
+        compressed += (stored_flags(db, 10000 + key) & DATABASE_COMPRESSED) != 0;
+    }
+    CHECK(compressed > LONG_URLS / 3);
+    CHECK(check_long(db, scratch, 0, LONG_URLS) == LONG_URLS);
+    CHECK(reads_back(db, scratch, 20000, "https://shop.example.com/products/short"));
+
+    // without scratch to inflate into there is nothing to read
+    database_url value;
+    uint64_t expires;
+    CHECK(!database_get(db, 10000 + LONG_URLS - 1, NULL, &value, &expires));
+    close_database(db);
+
+    // the dictionary is in the file, so compressed values read back
+    // without compression being on
+    db = open_database();
+    CHECK(check_long(db, scratch, 0, LONG_URLS) == LONG_URLS);
+    CHECK(database_checkpoint(db));
+    close_database(db);
+    db = open_database();
+    CHECK(check_long(db, scratch, 0, LONG_URLS) == LONG_URLS);
+
+    // and turning it on again uses the same dictionary
+    CHECK(database_compress(db, THRESHOLD));
+    long_url(LONG_URLS, url, sizeof(url));
+    CHECK(database_set(db, 10000 + LONG_URLS, url, 0));
+    CHECK(stored_flags(db, 10000 + LONG_URLS) & DATABASE_COMPRESSED);
+    CHECK(check_long(db, scratch, 0, LONG_URLS + 1) == LONG_URLS + 1);
+
+    database_scratch_free(scratch);
+    close_database(db);
+}
+
+int main(void)
+{
+    if (!mkdtemp(directory))
+    {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    snprintf(file, sizeof(file), "%s/linky.db", directory);
+
+    RUN(test_prefixes);
+    remove_database();
+    RUN(test_compression);
+    remove_database();
+    rmdir(directory);
+    return test_result();
+}
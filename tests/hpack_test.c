@@ -0,0 +1,291 @@
+#include "hpack.h"
+#include "test.h"
+
+#include <string.h>
+
+#define MAX_HEADERS 16
+
+struct example_s
+{
+    // the header block as printed in the RFC
+    const char *hex;
+    const char *headers[MAX_HEADERS][2];
+    // the dynamic table size after the block
+    size_t size;
+};
+
+static size_t from_hex(const char *hex, uint8_t *out)
+{
+    size_t n = 0;
+    for (const char *p = hex; *p; p++)
+    {
+        if (*p == ' ')
+        {
+            continue;
+        }
+        unsigned int value;
+        sscanf(p, "%2x", &value);
+        out[n++] = (uint8_t)value;
+        p++;
+    }
+    return n;
+}
+
+static void check_header(http_header header, const char *name, const char *value)
+{
+    CHECK(http_slice_equals(header.name, name));
+    CHECK(http_slice_equals(header.value, value));
+    if (!http_slice_equals(header.name, name) || !http_slice_equals(header.value, value))
+    {
+        fprintf(stderr, "  got %.*s: %.*s, expected %s: %s\n", (int)header.name.length, header.name.data,
+                (int)header.value.length, header.value.data, name, value);
+    }
+}
+
+// decode the blocks of one of the RFC's examples in turn with one table,
+// as they would be on a connection
+static void check_examples(struct hpack_table_s *table, const struct example_s *examples, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        uint8_t block[256];
+        size_t length = from_hex(examples[i].hex, block);
+
+        char space[1024];
+        http_header headers[MAX_HEADERS];
+        unsigned int decoded;
+        CHECK(hpack_decode(table, block, length, space, sizeof(space), headers, MAX_HEADERS, &decoded) == HPACK_OK);
+
+        unsigned int expected = 0;
+        while (expected < MAX_HEADERS && examples[i].headers[expected][0])
+        {
+            expected++;
+        }
+        CHECK(decoded == expected);
+        for (unsigned int h = 0; h < decoded && h < expected; h++)
+        {
+            check_header(headers[h], examples[i].headers[h][0], examples[i].headers[h][1]);
+        }
+        CHECK(table->size == examples[i].size);
+    }
+}
+
+// RFC 7541 C.3
+static void test_requests(void)
+{
+    const struct example_s examples[] = {
+        {"8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+         {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}},
+         57},
+        {"8286 84be 5808 6e6f 2d63 6163 6865",
+         {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"},
+          {"cache-control", "no-cache"}},
+         110},
+        {"8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+         {{":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"}, {":authority", "www.example.com"},
+          {"custom-key", "custom-value"}},
+         164},
+    };
+    struct hpack_table_s table;
+    hpack_table_init(&table);
+    check_examples(&table, examples, sizeof(examples) / sizeof(examples[0]));
+}
+
+// RFC 7541 C.4
+static void test_requests_huffman(void)
+{
+    const struct example_s examples[] = {
+        {"8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+         {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}},
+         57},
+        {"8286 84be 5886 a8eb 1064 9cbf",
+         {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"},
+          {"cache-control", "no-cache"}},
+         110},
+        {"8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+         {{":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"}, {":authority", "www.example.com"},
+          {"custom-key", "custom-value"}},
+         164},
+    };
+    struct hpack_table_s table;
+    hpack_table_init(&table);
+    check_examples(&table, examples, sizeof(examples) / sizeof(examples[0]));
+}
+
+// RFC 7541 C.5, which evicts entries. The examples use a table of 256
+// bytes, which the client would have announced in its settings; here it
+// is set with a size update (3fe1 01) at the start of the first block.
+static void test_responses(void)
+{
+    const struct example_s examples[] = {
+        {"3fe101 4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a "
+         "3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+         {{":status", "302"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+          {"location", "https://www.example.com"}},
+         222},
+        {"4803 3330 37c1 c0bf",
+         {{":status", "307"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+          {"location", "https://www.example.com"}},
+         222},
+        {"88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a "
+         "6970 7738 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d "
+         "6178 2d61 6765 3d33 3630 303b 2076 6572 7369 6f6e 3d31",
+         {{":status", "200"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+          {"location", "https://www.example.com"}, {"content-encoding", "gzip"},
+          {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}},
+         215},
+    };
+    struct hpack_table_s table;
+    hpack_table_init(&table);
+    check_examples(&table, examples, sizeof(examples) / sizeof(examples[0]));
+}
+
+// RFC 7541 C.6
+static void test_responses_huffman(void)
+{
+    const struct example_s examples[] = {
+        {"3fe101 4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e "
+         "919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3",
+         {{":status", "302"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+          {"location", "https://www.example.com"}},
+         222},
+        {"4883 640e ffc1 c0bf",
+         {{":status", "307"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+          {"location", "https://www.example.com"}},
+         222},
+        {"88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d "
+         "d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 "
+         "3d50 07",
+         {{":status", "200"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+          {"location", "https://www.example.com"}, {"content-encoding", "gzip"},
+          {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}},
+         215},
+    };
+    struct hpack_table_s table;
+    hpack_table_init(&table);
+    check_examples(&table, examples, sizeof(examples) / sizeof(examples[0]));
+}
+
+static void test_bad_blocks(void)
+{
+    const char *blocks[] = {
+        // index 0, and past the end of both tables
+        "80",
+        "be",
+        // a string longer than the block
+        "4005 6162",
+        // Huffman padding that is not all ones, and EOS
+        "4081 00 00",
+        "4084 ffff ffff 00",
+        // a size update above what we allow
+        "3fe2 1f",
+        // an integer that never ends
+        "ff ffff ffff ffff ffff ffff ffff",
+    };
+    for (size_t i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++)
+    {
+        uint8_t block[64];
+        size_t length = from_hex(blocks[i], block);
+
+        struct hpack_table_s table;
+        hpack_table_init(&table);
+        char space[256];
+        http_header headers[MAX_HEADERS];
+        unsigned int count;
+        CHECK(hpack_decode(&table, block, length, space, sizeof(space), headers, MAX_HEADERS, &count) == HPACK_ERROR);
+    }
+
+    // the headers do not fit the space
+    uint8_t block[64];
+    size_t length = from_hex("4188 f1e3 c2e5 f23a 6ba0 ab90 f4ff", block);
+    struct hpack_table_s table;
+    hpack_table_init(&table);
+    char space[8];
+    http_header headers[MAX_HEADERS];
+    unsigned int count;
+    CHECK(hpack_decode(&table, block, length, space, sizeof(space), headers, MAX_HEADERS, &count) == HPACK_TOO_LARGE);
+}
+
+// decode a response the encoder wrote for a redirect to location
+static void check_response(struct hpack_encoder_s *encoder, struct hpack_table_s *table, int status,
+                           const char *location)
+{
+    uint8_t block[HPACK_MAX_RESPONSE_PREFIX + 256 + HPACK_MAX_RESPONSE_SUFFIX];
+    size_t prefix_length, suffix_length;
+    size_t location_length = location ? strlen(location) : 0;
+    CHECK(hpack_encode_response(encoder, status, location_length, block, &prefix_length,
+                                block + HPACK_MAX_RESPONSE_PREFIX + 256, &suffix_length));
+    memcpy(block + prefix_length, location, location_length);
+    memmove(block + prefix_length + location_length, block + HPACK_MAX_RESPONSE_PREFIX + 256, suffix_length);
+
+    char space[1024];
+    http_header headers[MAX_HEADERS];
+    unsigned int count;
+    CHECK(hpack_decode(table, block, prefix_length + location_length + suffix_length, space, sizeof(space),
+                       headers, MAX_HEADERS, &count) == HPACK_OK);
+
+    char digits[4];
+    snprintf(digits, sizeof(digits), "%d", status);
+    if (status == 302)
+    {
+        CHECK(count == 4);
+        if (count == 4)
+        {
+            check_header(headers[0], ":status", digits);
+            check_header(headers[1], "location", location);
+            check_header(headers[2], "cache-control", "private, max-age=90");
+            check_header(headers[3], "content-length", "0");
+        }
+    }
+    else
+    {
+        CHECK(count == 2);
+        if (count == 2)
+        {
+            check_header(headers[0], ":status", digits);
+            check_header(headers[1], "content-length", "0");
+        }
+    }
+}
+
+// what the encoder writes decodes to what it meant, as the client's
+// table grows and shrinks
+static void test_encoder(void)
+{
+    struct hpack_encoder_s encoder;
+    struct hpack_table_s table;
+    hpack_encoder_init(&encoder);
+    hpack_table_init(&table);
+
+    check_response(&encoder, &table, 302, "https://example.com/a");
+    size_t size = table.size;
+    CHECK(size > 0);
+    check_response(&encoder, &table, 302, "https://example.com/b");
+    CHECK(table.size == size);
+    check_response(&encoder, &table, 404, NULL);
+    check_response(&encoder, &table, 429, NULL);
+    CHECK(table.size == size);
+
+    // a table too small for all of them
+    hpack_encoder_resize(&encoder, 64);
+    check_response(&encoder, &table, 302, "https://example.com/c");
+    CHECK(table.max_size == 64);
+    CHECK(table.size == 0);
+
+    hpack_encoder_resize(&encoder, 1 << 20);
+    check_response(&encoder, &table, 302, "https://example.com/d");
+    CHECK(table.max_size == HPACK_TABLE_SIZE);
+    CHECK(table.size == size);
+    check_response(&encoder, &table, 302, "https://example.com/e");
+}
+
+int main(void)
+{
+    RUN(test_requests);
+    RUN(test_requests_huffman);
+    RUN(test_responses);
+    RUN(test_responses_huffman);
+    RUN(test_bad_blocks);
+    RUN(test_encoder);
+    return test_result();
+}
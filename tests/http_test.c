@@ -0,0 +1,226 @@
+#include "http.h"
+#include "test.h"
+
+#include <string.h>
+
+static http_parse_result parse(http_parser *parser, const char *buffer)
+{
+    http_parser_reset(parser, 0);
+    return http_parse(parser, buffer, strlen(buffer));
+}
+
+static void test_request(void)
+{
+    const char *buffer = "GET /abc?x=1 HTTP/1.1\r\n"
+                         "Host: example.com\r\n"
+                         "X-Padded: \t val\tue \t\r\n"
+                         "\r\n";
+    http_parser parser;
+    CHECK(parse(&parser, buffer) == HTTP_PARSE_COMPLETE);
+
+    http_request *request = &parser.request;
+    CHECK(http_slice_equals(request->method, "GET"));
+    CHECK(http_slice_equals(request->target, "/abc?x=1"));
+    CHECK(request->minor_version == 1);
+    CHECK(request->keep_alive);
+    CHECK(request->num_headers == 2);
+    CHECK(request->body.length == 0);
+    CHECK(request->end == strlen(buffer));
+
+    http_slice value;
+    CHECK(http_request_header(request, "host", &value) && http_slice_equals(value, "example.com"));
+    CHECK(http_request_header(request, "X-PADDED", &value) && http_slice_equals(value, "val\tue"));
+    CHECK(!http_request_header(request, "Content-Length", &value));
+}
+
+static void test_connection(void)
+{
+    http_parser parser;
+    CHECK(parse(&parser, "\r\n\r\nGET / HTTP/1.0\r\n\r\n") == HTTP_PARSE_COMPLETE);
+    CHECK(parser.request.minor_version == 0);
+    CHECK(!parser.request.keep_alive);
+
+    CHECK(parse(&parser, "GET / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n") == HTTP_PARSE_COMPLETE);
+    CHECK(parser.request.keep_alive);
+
+    CHECK(parse(&parser, "GET / HTTP/1.1\nConnection: close\n\n") == HTTP_PARSE_COMPLETE);
+    CHECK(!parser.request.keep_alive);
+}
+
+// a Content-Length that is repeated with the same value is the same as one
+static void test_repeated_length(void)
+{
+    http_parser parser;
+    CHECK(parse(&parser, "PUT / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\nhello") ==
+          HTTP_PARSE_COMPLETE);
+    CHECK(parser.request.content_length == 5);
+    CHECK(http_slice_equals(parser.request.body, "hello"));
+}
+
+// requests follow each other in the buffer, and each is parsed from
+// where the one before ended
+static void test_pipelined(void)
+{
+    const char *buffer = "GET /one HTTP/1.1\r\nHost: a\r\n\r\n"
+                         "PUT /two HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello"
+                         "DELETE /three HTTP/1.1\r\n\r\n"
+                         "GET /fo";
+    size_t length = strlen(buffer);
+    const char *targets[] = {"/one", "/two", "/three"};
+
+    http_parser parser;
+    http_parser_reset(&parser, 0);
+    for (int i = 0; i < 3; i++)
+    {
+        CHECK(http_parse(&parser, buffer, length) == HTTP_PARSE_COMPLETE);
+        CHECK(http_slice_equals(parser.request.target, targets[i]));
+        http_parser_reset(&parser, parser.request.end);
+    }
+    CHECK(http_slice_equals(parser.request.body, ""));
+    CHECK(http_parse(&parser, buffer, length) == HTTP_PARSE_INCOMPLETE);
+
+    // the body of the second request is where it was
+    http_parser_reset(&parser, 0);
+    CHECK(http_parse(&parser, buffer, length) == HTTP_PARSE_COMPLETE);
+    http_parser_reset(&parser, parser.request.end);
+    CHECK(http_parse(&parser, buffer, length) == HTTP_PARSE_COMPLETE);
+    CHECK(http_slice_equals(parser.request.method, "PUT"));
+    CHECK(parser.request.content_length == 5);
+    CHECK(http_slice_equals(parser.request.body, "hello"));
+}
+
+// a request that arrives a byte at a time parses the same as one that
+// arrives whole
+static void test_split(void)
+{
+    const char *buffer = "PUT /split HTTP/1.1\r\n"
+                         "Host: example.com\r\n"
+                         "Content-Length: 11\r\n"
+                         "\r\n"
+                         "hello world";
+    size_t length = strlen(buffer);
+
+    http_parser parser;
+    http_parser_reset(&parser, 0);
+    for (size_t i = 1; i < length; i++)
+    {
+        if (http_parse(&parser, buffer, i) != HTTP_PARSE_INCOMPLETE)
+        {
+            CHECK(!"complete before the end");
+            return;
+        }
+    }
+    CHECK(http_parse(&parser, buffer, length) == HTTP_PARSE_COMPLETE);
+    CHECK(http_slice_equals(parser.request.target, "/split"));
+    CHECK(parser.request.num_headers == 2);
+    CHECK(http_slice_equals(parser.request.body, "hello world"));
+    CHECK(parser.request.end == length);
+
+    // split between the carriage return and the line feed
+    const char *crlf = "GET / HTTP/1.1\r\n\r\n";
+    http_parser_reset(&parser, 0);
+    CHECK(http_parse(&parser, crlf, 15) == HTTP_PARSE_INCOMPLETE);
+    CHECK(http_parse(&parser, crlf, 17) == HTTP_PARSE_INCOMPLETE);
+    CHECK(http_parse(&parser, crlf, 18) == HTTP_PARSE_COMPLETE);
+    CHECK(http_slice_equals(parser.request.target, "/"));
+}
+
+static void check_error(const char *buffer, size_t length, int status)
+{
+    http_parser parser;
+    http_parser_reset(&parser, 0);
+    http_parse_result result = http_parse(&parser, buffer, length);
+    CHECK(result == HTTP_PARSE_ERROR);
+    CHECK(parser.error_status == status);
+    if (result != HTTP_PARSE_ERROR || parser.error_status != status)
+    {
+        fprintf(stderr, "  for %.*s\n", (int)strcspn(buffer, "\r\n"), buffer);
+    }
+}
+
+static void test_bad_input(void)
+{
+    const struct
+    {
+        const char *request;
+        int status;
+    } cases[] = {
+        {"GET\r\n\r\n", 400},
+        {"GET /\r\n\r\n", 400},
+        {"G(T / HTTP/1.1\r\n\r\n", 400},
+        {" GET / HTTP/1.1\r\n\r\n", 400},
+        {"GET  HTTP/1.1\r\n\r\n", 400},
+        {"GET / HTTP/1.10\r\n\r\n", 505},
+        {"GET / HTTP/2.0\r\n\r\n", 505},
+        {"GET / HTTP/1.2\r\n\r\n", 505},
+        {"GET / FTP/1.1\r\n\r\n", 400},
+        {"GET / HTTP/1.1\r\nHost example.com\r\n\r\n", 400},
+        {"GET / HTTP/1.1\r\nHost : example.com\r\n\r\n", 400},
+        {"GET / HTTP/1.1\r\n: example.com\r\n\r\n", 400},
+        {"GET / HTTP/1.1\r\nHost: a\r\n folded\r\n\r\n", 400},
+        {"PUT / HTTP/1.1\r\nContent-Length: 12a\r\n\r\n", 400},
+        {"PUT / HTTP/1.1\r\nContent-Length:\r\n\r\n", 400},
+        {"PUT / HTTP/1.1\r\nContent-Length: 1234567890\r\n\r\n", 413},
+        {"PUT / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n", 501},
+        {"PUT / HTTP/1.1\r\nContent-Length: 5\r\nHost: a\r\ncontent-length: 6\r\n\r\nhello!", 400},
+        {"PUT / HTTP/1.1\r\nContent-Length: 0\r\nContent-Length: 5\r\n\r\nhello", 400},
+        {"GET /a\rb HTTP/1.1\r\n\r\n", 400},
+        {"GET /a\tb HTTP/1.1\r\n\r\n", 400},
+        {"GET /a\x7f HTTP/1.1\r\n\r\n", 400},
+        {"GET / HTTP/1.1\r\nX: a\rb\r\n\r\n", 400},
+        {"GET / HTTP/1.1\r\nX: a\r\r\n\r\n", 400},
+        {"GET / HTTP/1.1\r\nX: a\x1b[2Jb\r\n\r\n", 400},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        check_error(cases[i].request, strlen(cases[i].request), cases[i].status);
+    }
+
+    // NUL is not a token character, even though strchr finds it
+    const char method[] = "G\0T / HTTP/1.1\r\n\r\n";
+    check_error(method, sizeof(method) - 1, 400);
+    const char name[] = "GET / HTTP/1.1\r\nHo\0st: a\r\n\r\n";
+    check_error(name, sizeof(name) - 1, 400);
+    const char target[] = "GET /\0 HTTP/1.1\r\n\r\n";
+    check_error(target, sizeof(target) - 1, 400);
+    const char value[] = "GET / HTTP/1.1\r\nHost: a\0b\r\n\r\n";
+    check_error(value, sizeof(value) - 1, 400);
+}
+
+static void test_limits(void)
+{
+    static char buffer[HTTP_MAX_LINE * 2 + 64];
+
+    // a request line that never ends
+    memset(buffer, 'a', sizeof(buffer));
+    memcpy(buffer, "GET /", 5);
+    check_error(buffer, HTTP_MAX_LINE + 1, 414);
+
+    // a header line that is too long, complete or not
+    size_t start = (size_t)sprintf(buffer, "GET / HTTP/1.1\r\nX: ");
+    memset(buffer + start, 'a', HTTP_MAX_LINE);
+    check_error(buffer, start + HTTP_MAX_LINE, 431);
+    memcpy(buffer + start + HTTP_MAX_LINE, "\r\n\r\n", 4);
+    check_error(buffer, start + HTTP_MAX_LINE + 4, 431);
+
+    // one header too many
+    size_t length = (size_t)sprintf(buffer, "GET / HTTP/1.1\r\n");
+    for (int i = 0; i <= HTTP_MAX_HEADERS; i++)
+    {
+        length += (size_t)sprintf(buffer + length, "X-%d: %d\r\n", i, i);
+    }
+    length += (size_t)sprintf(buffer + length, "\r\n");
+    check_error(buffer, length, 431);
+}
+
+int main(void)
+{
+    RUN(test_request);
+    RUN(test_connection);
+    RUN(test_repeated_length);
+    RUN(test_pipelined);
+    RUN(test_split);
+    RUN(test_bad_input);
+    RUN(test_limits);
+    return test_result();
+}
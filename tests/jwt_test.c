@@ -0,0 +1,253 @@
+#include "jwt.h"
+#include "config.h"
+#include "test.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+// tokens are made and signed here with keys made up for the test. The
+// issuer key is read from a file, which is rewritten to switch keys.
+
+#define ISSUER "https://issuer.example"
+#define AUDIENCE "linky"
+#define NOW 1000000000ull
+
+static char key_file[] = "/tmp/linky-jwt-XXXXXX";
+
+static EVP_PKEY *signing_key;
+static bool signing_ecdsa;
+
+static bool use_key(EVP_PKEY *key, bool ecdsa)
+{
+    FILE *f = fopen(key_file, "w");
+    bool written = f && PEM_write_PUBKEY(f, key) == 1;
+    if (f)
+    {
+        fclose(f);
+    }
+    signing_key = key;
+    signing_ecdsa = ecdsa;
+    jwt_cleanup();
+    return written && jwt_init();
+}
+
+static size_t base64url_encode(const uint8_t *in, size_t length, char *out)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    size_t n = 0;
+    uint32_t bits = 0;
+    unsigned int count = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        bits = (bits << 8) | in[i];
+        count += 8;
+        while (count >= 6)
+        {
+            count -= 6;
+            out[n++] = digits[(bits >> count) & 63];
+        }
+    }
+    if (count)
+    {
+        out[n++] = digits[(bits << (6 - count)) & 63];
+    }
+    out[n] = '\0';
+    return n;
+}
+
+// a token with the header and payload given, signed with the current key
+static const char *make_token(const char *header, const char *payload)
+{
+    static char token[4096];
+    size_t length = base64url_encode((const uint8_t *)header, strlen(header), token);
+    token[length++] = '.';
+    length += base64url_encode((const uint8_t *)payload, strlen(payload), token + length);
+
+    uint8_t signature[1024];
+    size_t signature_length = sizeof(signature);
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    CHECK(EVP_DigestSignInit(ctx, NULL, EVP_sha256(), NULL, signing_key) == 1);
+    CHECK(EVP_DigestSign(ctx, signature, &signature_length, (const uint8_t *)token, length) == 1);
+    EVP_MD_CTX_free(ctx);
+
+    // JWS wants ECDSA signatures as r and s back to back
+    if (signing_ecdsa)
+    {
+        const uint8_t *der = signature;
+        ECDSA_SIG *sig = d2i_ECDSA_SIG(NULL, &der, (long)signature_length);
+        CHECK(sig != NULL);
+        BN_bn2binpad(ECDSA_SIG_get0_r(sig), signature, 32);
+        BN_bn2binpad(ECDSA_SIG_get0_s(sig), signature + 32, 32);
+        ECDSA_SIG_free(sig);
+        signature_length = 64;
+    }
+
+    token[length++] = '.';
+    base64url_encode(signature, signature_length, token + length);
+    return token;
+}
+
+static const char *make_claims(const char *extra)
+{
+    static char payload[1024];
+    snprintf(payload, sizeof(payload), "{\"iss\":\"" ISSUER "\",\"aud\":\"" AUDIENCE "\",\"exp\":%llu%s}",
+             NOW + 60, extra);
+    return payload;
+}
+
+static bool verify(const char *token)
+{
+    struct jwt_cache_s cache = {0};
+    return jwt_verify(&cache, token, strlen(token), NOW);
+}
+
+static void test_es256(void)
+{
+    EVP_PKEY *key = EVP_PKEY_Q_keygen(NULL, NULL, "EC", "P-256");
+    CHECK(key && use_key(key, true));
+
+    const char *header = "{\"alg\":\"ES256\",\"typ\":\"JWT\"}";
+    CHECK(verify(make_token(header, make_claims(""))));
+    CHECK(verify(make_token(header, make_claims(",\"nbf\":1000000000"))));
+    CHECK(!verify(make_token("{\"alg\":\"RS256\"}", make_claims(""))));
+    CHECK(!verify(make_token("{\"alg\":\"none\"}", make_claims(""))));
+
+    // an r or s that is not the size of the curve
+    const char *token = make_token(header, make_claims(""));
+    char shortened[4096];
+    size_t length = strlen(token) - 4;
+    memcpy(shortened, token, length);
+    shortened[length] = '\0';
+    CHECK(!verify(shortened));
+
+    jwt_cleanup();
+    EVP_PKEY_free(key);
+}
+
+static void test_rs256(void)
+{
+    EVP_PKEY *key = EVP_PKEY_Q_keygen(NULL, NULL, "RSA", (size_t)2048);
+    CHECK(key && use_key(key, false));
+
+    const char *header = "{\"alg\":\"RS256\"}";
+    CHECK(verify(make_token(header, make_claims(""))));
+    // an audience may be one of several
+    char payload[256];
+    snprintf(payload, sizeof(payload), "{\"iss\":\"" ISSUER "\",\"aud\":[\"other\",\"" AUDIENCE "\"],\"exp\":%llu}",
+             NOW + 60);
+    CHECK(verify(make_token(header, payload)));
+
+    jwt_cleanup();
+    EVP_PKEY_free(key);
+}
+
+static void test_rejected(void)
+{
+    EVP_PKEY *key = EVP_PKEY_Q_keygen(NULL, NULL, "EC", "P-256");
+    CHECK(key && use_key(key, true));
+
+    const char *header = "{\"alg\":\"ES256\"}";
+    char payload[512];
+
+    snprintf(payload, sizeof(payload), "{\"iss\":\"" ISSUER "\",\"aud\":\"" AUDIENCE "\",\"exp\":%llu}", NOW);
+    CHECK(!verify(make_token(header, payload)));
+    snprintf(payload, sizeof(payload), "{\"iss\":\"" ISSUER "\",\"aud\":\"" AUDIENCE "\"}");
+    CHECK(!verify(make_token(header, payload)));
+    CHECK(!verify(make_token(header, make_claims(",\"nbf\":1000000001"))));
+    CHECK(!verify(make_token("{\"alg\":\"ES256\",\"crit\":[\"exp\"]}", make_claims(""))));
+    CHECK(!verify(make_token("{\"typ\":\"JWT\"}", make_claims(""))));
+
+    snprintf(payload, sizeof(payload), "{\"iss\":\"https://other.example\",\"aud\":\"" AUDIENCE "\",\"exp\":%llu}",
+             NOW + 60);
+    CHECK(!verify(make_token(header, payload)));
+    snprintf(payload, sizeof(payload), "{\"iss\":\"" ISSUER "\",\"aud\":\"other\",\"exp\":%llu}", NOW + 60);
+    CHECK(!verify(make_token(header, payload)));
+    snprintf(payload, sizeof(payload), "{\"iss\":\"" ISSUER "\",\"aud\":[\"other\"],\"exp\":%llu}", NOW + 60);
+    CHECK(!verify(make_token(header, payload)));
+
+    // an escaped NUL does not end the comparison early
+    snprintf(payload, sizeof(payload), "{\"iss\":\"" ISSUER "\\u0000x\",\"aud\":\"" AUDIENCE "\",\"exp\":%llu}",
+             NOW + 60);
+    CHECK(!verify(make_token(header, payload)));
+    snprintf(payload, sizeof(payload), "{\"iss\":\"" ISSUER "\",\"aud\":\"" AUDIENCE "\\u0000\",\"exp\":%llu}",
+             NOW + 60);
+    CHECK(!verify(make_token(header, payload)));
+    // while other escapes are understood
+    snprintf(payload, sizeof(payload), "{\"iss\":\"https:\\/\\/issuer.example\",\"aud\":\"\\u006cinky\",\"exp\":%llu}",
+             NOW + 60);
+    CHECK(verify(make_token(header, payload)));
+
+    // a signature over something else
+    char token[4096];
+    strcpy(token, make_token(header, make_claims("")));
+    char *signature = strrchr(token, '.') + 1;
+    signature[10] = signature[10] == 'A' ? 'B' : 'A';
+    CHECK(!verify(token));
+    // a payload that is not the one signed
+    strcpy(token, make_token(header, make_claims("")));
+    char other[4096];
+    strcpy(other, make_token(header, make_claims(",\"sub\":\"someone\"")));
+    strcpy(strrchr(other, '.'), strrchr(token, '.'));
+    CHECK(!verify(other));
+
+    CHECK(!verify("not a token"));
+    CHECK(!verify("a.b"));
+    CHECK(!verify("a.b.c.d"));
+
+    jwt_cleanup();
+    EVP_PKEY_free(key);
+}
+
+// the cache takes the place of the checks, but not of the expiry
+static void test_cache(void)
+{
+    EVP_PKEY *key = EVP_PKEY_Q_keygen(NULL, NULL, "EC", "P-256");
+    CHECK(key && use_key(key, true));
+
+    struct jwt_cache_s cache;
+    CHECK(jwt_cache_open(&cache));
+    CHECK(cache.entries != NULL);
+
+    char token[4096];
+    strcpy(token, make_token("{\"alg\":\"ES256\"}", make_claims("")));
+    size_t length = strlen(token);
+    CHECK(jwt_verify(&cache, token, length, NOW));
+    CHECK(jwt_verify(&cache, token, length, NOW + 59));
+    CHECK(!jwt_verify(&cache, token, length, NOW + 60));
+    CHECK(!jwt_verify(&cache, token, length, NOW + 61));
+    // and what was not accepted is not remembered
+    token[length - 2] = token[length - 2] == 'A' ? 'B' : 'A';
+    CHECK(!jwt_verify(&cache, token, length, NOW));
+    CHECK(!jwt_verify(&cache, token, length, NOW));
+
+    jwt_cache_close(&cache);
+    jwt_cleanup();
+    EVP_PKEY_free(key);
+}
+
+int main(void)
+{
+    int fd = mkstemp(key_file);
+    if (fd == -1)
+    {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    setenv("LINKY_JWT_ISSUER", ISSUER, 1);
+    setenv("LINKY_JWT_AUDIENCE", AUDIENCE, 1);
+    setenv("LINKY_JWT_ISSUER_KEY", key_file, 1);
+
+    RUN(test_es256);
+    RUN(test_rs256);
+    RUN(test_rejected);
+    RUN(test_cache);
+
+    unlink(key_file);
+    return test_result();
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+
+// Each test program runs a few test functions, which check what they
+// expect with CHECK. A failed check is reported and the test carries on,
+// and the program fails if any check did.
+
+static int test_failures;
+
+#define CHECK(condition)                                                                  \
+    do                                                                                    \
+    {                                                                                     \
+        if (!(condition))                                                                 \
+        {                                                                                 \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            test_failures++;                                                              \
+        }                                                                                 \
+    } while (0)
+
+#define RUN(test)                                                              \
+    do                                                                         \
+    {                                                                          \
+        int failures = test_failures;                                          \
+        test();                                                                \
+        printf("%s %s\n", failures == test_failures ? "ok  " : "FAIL", #test); \
+    } while (0)
+
+static inline int test_result(void)
+{
+    return test_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,175 @@
+// the wheel reads the clock itself, so it is tested from inside with a
+// clock that only moves when the test says so
+#define clock_gettime test_clock_gettime
+#include "../src/timer.c"
+#include "test.h"
+
+#include <time.h>
+
+#define TICK_NS (TIMER_TICK_MS * 1000000ull)
+
+static uint64_t clock_ns;
+
+int test_clock_gettime(clockid_t clock, struct timespec *now)
+{
+    now->tv_sec = (time_t)(clock_ns / 1000000000ull);
+    now->tv_nsec = (long)(clock_ns % 1000000000ull);
+    return 0;
+}
+
+struct test_timer_s
+{
+    struct timer_s timer;
+    // the tick it expired on. 0 while it has not.
+    uint64_t expired;
+};
+
+static void expire(struct timer_s *timer, void *arg)
+{
+    ((struct test_timer_s *)timer)->expired = clock_ns / TICK_NS;
+}
+
+// move the clock to a tick and let the wheel catch up
+static void advance_to(struct timer_wheel_s *wheel, uint64_t tick)
+{
+    clock_ns = tick * TICK_NS;
+    timer_wheel_advance(wheel, expire, NULL);
+}
+
+static void open_wheel(struct timer_wheel_s *wheel, uint64_t tick)
+{
+    clock_ns = tick * TICK_NS + TICK_NS / 2;
+    CHECK(timer_wheel_open(wheel));
+}
+
+// a timer expires on the tick it was armed for, not before, whether it
+// waited on the first level or was cascaded down from a coarser one
+static void check_expiry(uint64_t start, uint64_t ticks)
+{
+    struct timer_wheel_s wheel;
+    open_wheel(&wheel, start);
+    struct test_timer_s t = {0};
+    timer_arm(&wheel, &t.timer, ticks * TIMER_TICK_MS);
+
+    advance_to(&wheel, start + ticks - 1);
+    CHECK(t.expired == 0);
+    CHECK(timer_armed(&t.timer));
+    advance_to(&wheel, start + ticks);
+    CHECK(t.expired == start + ticks);
+    CHECK(!timer_armed(&t.timer));
+    CHECK(wheel.count == 0);
+    if (t.expired != start + ticks)
+    {
+        fprintf(stderr, "  armed at %llu for %llu ticks, expired on %llu\n",
+                (unsigned long long)start, (unsigned long long)ticks, (unsigned long long)t.expired);
+    }
+    timer_wheel_close(&wheel);
+}
+
+static void test_expiry(void)
+{
+    const uint64_t level1 = TIMER_LEVEL0_SLOTS;
+    const uint64_t level2 = level1 << TIMER_LEVEL_BITS;
+    const uint64_t ticks[] = {1, 2, 100, level1 - 1, level1, level1 + 1, 2 * level1, 3 * level1 - 1,
+                              level2 - 1, level2, level2 + 1, 5 * level2 + 17, TIMER_MAX_TICKS};
+    // started on a boundary of every level, and in between
+    const uint64_t starts[] = {level2 << TIMER_LEVEL_BITS, (level2 << TIMER_LEVEL_BITS) - 1,
+                               1000003, level2 * 7 + level1 - 1};
+    for (size_t s = 0; s < sizeof(starts) / sizeof(starts[0]); s++)
+    {
+        for (size_t i = 0; i < sizeof(ticks) / sizeof(ticks[0]); i++)
+        {
+            check_expiry(starts[s], ticks[i]);
+        }
+    }
+}
+
+// timers further out than the wheel reaches wait as long as it can
+static void test_clamped(void)
+{
+    struct timer_wheel_s wheel;
+    open_wheel(&wheel, 5000);
+    struct test_timer_s t = {0};
+    timer_arm(&wheel, &t.timer, (TIMER_MAX_TICKS + 1000) * TIMER_TICK_MS);
+    advance_to(&wheel, 5000 + TIMER_MAX_TICKS - 1);
+    CHECK(t.expired == 0);
+    advance_to(&wheel, 5000 + TIMER_MAX_TICKS);
+    CHECK(t.expired == 5000 + TIMER_MAX_TICKS);
+    timer_wheel_close(&wheel);
+}
+
+// a timer can be cancelled or armed again after it has been cascaded
+static void test_cancel_after_cascade(void)
+{
+    const uint64_t start = 100 * TIMER_LEVEL0_SLOTS;
+    const uint64_t ticks = 3 * TIMER_LEVEL0_SLOTS + 10;
+    struct timer_wheel_s wheel;
+    open_wheel(&wheel, start);
+    struct test_timer_s cancelled = {0}, rearmed = {0}, kept = {0};
+    timer_arm(&wheel, &cancelled.timer, ticks * TIMER_TICK_MS);
+    timer_arm(&wheel, &rearmed.timer, ticks * TIMER_TICK_MS);
+    timer_arm(&wheel, &kept.timer, ticks * TIMER_TICK_MS);
+    struct timer_s **slot = &wheel.level0[(start + ticks) & TIMER_LEVEL0_MASK];
+    CHECK(*slot == NULL);
+
+    // past the level boundary the timers are on the first level, in
+    // reverse. The one cancelled is at the head of the slot.
+    advance_to(&wheel, start + 3 * TIMER_LEVEL0_SLOTS);
+    CHECK(*slot == &cancelled.timer);
+    CHECK(cancelled.expired == 0 && rearmed.expired == 0 && kept.expired == 0);
+    CHECK(wheel.count == 3);
+    timer_cancel(&wheel, &cancelled.timer);
+    CHECK(!timer_armed(&cancelled.timer));
+    CHECK(wheel.count == 2);
+    timer_arm(&wheel, &rearmed.timer, 20 * TIMER_TICK_MS);
+    CHECK(wheel.count == 2);
+
+    advance_to(&wheel, start + ticks);
+    CHECK(cancelled.expired == 0);
+    CHECK(rearmed.expired == 0);
+    CHECK(kept.expired == start + ticks);
+    CHECK(wheel.count == 1);
+    advance_to(&wheel, start + 3 * TIMER_LEVEL0_SLOTS + 20);
+    CHECK(rearmed.expired == start + 3 * TIMER_LEVEL0_SLOTS + 20);
+    CHECK(wheel.count == 0);
+    timer_wheel_close(&wheel);
+}
+
+static struct test_timer_s *victim;
+static struct timer_wheel_s *victim_wheel;
+
+static void expire_and_cancel(struct timer_s *timer, void *arg)
+{
+    expire(timer, arg);
+    timer_cancel(victim_wheel, &victim->timer);
+}
+
+// expiring one timer may cancel another that is due on the same tick
+static void test_cancel_while_expiring(void)
+{
+    struct timer_wheel_s wheel;
+    open_wheel(&wheel, 1000);
+    struct test_timer_s a = {0}, b = {0};
+    timer_arm(&wheel, &a.timer, 500);
+    timer_arm(&wheel, &b.timer, 500);
+
+    // the timer armed last is expired first
+    victim = &a;
+    victim_wheel = &wheel;
+    clock_ns = 1005 * TICK_NS;
+    timer_wheel_advance(&wheel, expire_and_cancel, NULL);
+    CHECK(b.expired == 1005);
+    CHECK(a.expired == 0);
+    CHECK(!timer_armed(&a.timer));
+    CHECK(wheel.count == 0);
+    timer_wheel_close(&wheel);
+}
+
+int main(void)
+{
+    RUN(test_expiry);
+    RUN(test_clamped);
+    RUN(test_cancel_after_cascade);
+    RUN(test_cancel_while_expiring);
+    return test_result();
+}
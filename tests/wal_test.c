@@ -0,0 +1,307 @@
+#include "database.h"
+#include "wal.h"
+#include "test.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static char directory[] = "/tmp/linky-wal-XXXXXX";
+static char file[sizeof(directory) + 16];
+static char log_file[sizeof(file) + 8];
+static char second_log_file[sizeof(log_file) + 2];
+
+#define RECORDS 50
+
+// what a replay saw
+struct replayed_s
+{
+    unsigned int count;
+    struct wal_record records[RECORDS * 2];
+    uint64_t offsets[RECORDS * 2];
+    char data[RECORDS * 2][64];
+};
+
+static bool collect(void *state, const struct wal_record *record, const void *data, uint64_t offset)
+{
+    struct replayed_s *replayed = (struct replayed_s *)state;
+    if (replayed->count == RECORDS * 2)
+    {
+        return false;
+    }
+    replayed->records[replayed->count] = *record;
+    replayed->offsets[replayed->count] = offset;
+    memcpy(replayed->data[replayed->count], data, record->length < 64 ? record->length : 64);
+    replayed->count++;
+    return true;
+}
+
+static void replay(struct replayed_s *replayed)
+{
+    struct wal_s wal;
+    memset(replayed, 0, sizeof(*replayed));
+    CHECK(wal_open(&wal, file, NULL));
+    CHECK(wal_replay(&wal, collect, replayed));
+    wal_close(&wal);
+}
+
+static void url_of(uint32_t key, char *url)
+{
+    sprintf(url, "https://example.com/%u/%.*s", key, (int)(key % 20), "aaaaaaaaaaaaaaaaaaaaa");
+}
+
+// write RECORDS records of all kinds, returning where each one ends
+static void write_records(uint64_t *ends)
+{
+    struct wal_s wal;
+    CHECK(wal_open(&wal, file, NULL));
+    CHECK(wal.size == 0 && wal.generation == 0);
+    CHECK(wal_start(&wal, 7));
+    for (uint32_t key = 1; key < RECORDS; key++)
+    {
+        char url[64];
+        url_of(key, url);
+        if (key % 5 == 0)
+        {
+            CHECK(wal_append(&wal, WAL_DELETE, key, 0, NULL, 0));
+        }
+        else
+        {
+            CHECK(wal_append(&wal, key % 3 ? WAL_SET : WAL_EXPIRE, key, 1000 + key, url, (uint32_t)strlen(url)));
+        }
+        // some are written on their own and some together
+        if (key % 4 == 0)
+        {
+            CHECK(wal_write(&wal));
+        }
+    }
+    CHECK(wal_write(&wal));
+    CHECK(wal_sync(&wal));
+    wal_close(&wal);
+
+    struct replayed_s replayed;
+    replay(&replayed);
+    CHECK(replayed.count == RECORDS);
+    for (unsigned int i = 0; i < replayed.count; i++)
+    {
+        ends[i] = replayed.offsets[i] + sizeof(struct wal_record) + replayed.records[i].length;
+    }
+}
+
+static void test_round_trip(void)
+{
+    uint64_t ends[RECORDS];
+    write_records(ends);
+
+    struct wal_s wal;
+    CHECK(wal_open(&wal, file, NULL));
+    CHECK(wal.generation == 7);
+    CHECK(wal.size == ends[RECORDS - 1]);
+    wal_close(&wal);
+
+    struct replayed_s replayed;
+    replay(&replayed);
+    CHECK(replayed.records[0].type == WAL_START && replayed.records[0].expires == 7);
+    CHECK(replayed.offsets[0] == 0);
+    for (uint32_t key = 1; key < RECORDS; key++)
+    {
+        const struct wal_record *record = &replayed.records[key];
+        CHECK(record->key == key);
+        CHECK(replayed.offsets[key] == ends[key - 1]);
+        if (key % 5 == 0)
+        {
+            CHECK(record->type == WAL_DELETE && record->length == 0);
+            continue;
+        }
+        char url[64];
+        url_of(key, url);
+        CHECK(record->type == (key % 3 ? WAL_SET : WAL_EXPIRE));
+        CHECK(record->expires == 1000 + key);
+        CHECK(record->length == strlen(url) && memcmp(replayed.data[key], url, record->length) == 0);
+    }
+
+    // emptying it drops what was written and what was waiting
+    CHECK(wal_open(&wal, file, NULL));
+    CHECK(wal_append(&wal, WAL_DELETE, 1, 0, NULL, 0));
+    CHECK(wal_truncate(&wal));
+    CHECK(wal_write(&wal));
+    CHECK(wal.size == 0);
+    wal_close(&wal);
+    replay(&replayed);
+    CHECK(replayed.count == 0);
+    unlink(log_file);
+}
+
+// a log cut short anywhere replays the records that were complete
+static void test_torn(void)
+{
+    uint64_t ends[RECORDS];
+    write_records(ends);
+
+    unsigned int checked = 0;
+    for (uint64_t length = ends[RECORDS - 1]; length > 0; length -= 7)
+    {
+        CHECK(truncate(log_file, (off_t)length) == 0);
+        unsigned int complete = 0;
+        while (complete < RECORDS && ends[complete] <= length)
+        {
+            complete++;
+        }
+
+        struct replayed_s replayed;
+        replay(&replayed);
+        CHECK(replayed.count == complete);
+        checked += replayed.count == complete;
+        if (length < 7)
+        {
+            break;
+        }
+    }
+    CHECK(checked > RECORDS);
+    unlink(log_file);
+
+    // a record that does not check out ends the log, even with
+    // complete ones after it
+    write_records(ends);
+    int fd = open(log_file, O_WRONLY);
+    CHECK(fd != -1);
+    CHECK(pwrite(fd, "x", 1, (off_t)ends[20] - 1) == 1);
+    close(fd);
+    struct replayed_s replayed;
+    replay(&replayed);
+    CHECK(replayed.count == 20);
+    unlink(log_file);
+}
+
+static bool get(database db, uint32_t key, char *url)
+{
+    database_scratch scratch = database_scratch_create();
+    database_reader_enter(db, 0);
+    database_url value;
+    uint64_t expires;
+    bool found = database_get(db, key, scratch, &value, &expires);
+    if (found)
+    {
+        sprintf(url, "%.*s%.*s", (int)value.prefix_length, value.prefix, (int)value.suffix_length, value.suffix);
+    }
+    database_reader_leave(db, 0);
+    database_scratch_free(scratch);
+    return found;
+}
+
+// set keys from..to, syncing at the end, in a process that then dies
+// without closing the database. Returns the log it wrote last, which is
+// the longer one when the checkpoints have emptied the other.
+static const char *crash(uint32_t from, uint32_t to, bool checkpoint)
+{
+    // or the child prints what is buffered again
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        database db = database_open(file, NULL, true, getgid(), getuid());
+        if (!db)
+        {
+            _exit(1);
+        }
+        for (uint32_t key = from; key <= to; key++)
+        {
+            char url[64];
+            url_of(key, url);
+            if (!database_set(db, key, url, 0) || (key % 100 == 0 && !database_sync(db)))
+            {
+                _exit(1);
+            }
+            if (checkpoint && key == (from + to) / 2 && !database_checkpoint(db))
+            {
+                _exit(1);
+            }
+        }
+        _exit(database_sync(db) ? 0 : 1);
+    }
+
+    int status;
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    struct stat st, second;
+    CHECK(stat(log_file, &st) == 0 && stat(second_log_file, &second) == 0);
+    return st.st_size >= second.st_size ? log_file : second_log_file;
+}
+
+// keys from..to have their url, and to + 1 has none
+static void check_keys(database db, uint32_t from, uint32_t to)
+{
+    unsigned int found = 0;
+    for (uint32_t key = from; key <= to; key++)
+    {
+        char url[64], expected[64];
+        url_of(key, expected);
+        found += get(db, key, url) && strcmp(url, expected) == 0;
+    }
+    CHECK(found == to - from + 1);
+    char url[64];
+    CHECK(!get(db, to + 1, url));
+}
+
+// what a database synced before it died is there when it is opened again
+static void test_database(void)
+{
+    crash(1, 1000, false);
+    database db = database_open(file, NULL, true, getgid(), getuid());
+    CHECK(db != NULL);
+    if (!db)
+    {
+        return;
+    }
+    check_keys(db, 1, 1000);
+    database_close(db);
+
+    // after a checkpoint, the changes from before it are in the file and
+    // the rest are in the other log
+    crash(1001, 3000, true);
+    db = database_open(file, NULL, true, getgid(), getuid());
+    CHECK(db != NULL);
+    if (!db)
+    {
+        return;
+    }
+    check_keys(db, 1, 3000);
+    database_close(db);
+
+    // the last change was torn as it was written
+    const char *log = crash(3001, 3100, false);
+    struct stat st;
+    CHECK(stat(log, &st) == 0 && truncate(log, st.st_size - 1) == 0);
+    db = database_open(file, NULL, true, getgid(), getuid());
+    CHECK(db != NULL);
+    if (!db)
+    {
+        return;
+    }
+    check_keys(db, 1, 3099);
+    database_close(db);
+}
+
+int main(void)
+{
+    if (!mkdtemp(directory))
+    {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    snprintf(file, sizeof(file), "%s/linky.db", directory);
+    snprintf(log_file, sizeof(log_file), "%s.wal", file);
+    snprintf(second_log_file, sizeof(second_log_file), "%s.2", log_file);
+
+    RUN(test_round_trip);
+    RUN(test_torn);
+    RUN(test_database);
+
+    unlink(second_log_file);
+    unlink(log_file);
+    unlink(file);
+    rmdir(directory);
+    return test_result();
+}